@@ -16,61 +16,231 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno
+
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
 #include <openssl/sha.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "../utils/hash.h"
 #include "../utils/xdelta3.h"
 #include "../mfapi/file.h"
 #include "../mfapi/apicalls.h"
+#include "../mfapi/linkcache.h"
 #include "../mfapi/patch.h"
 #include "../mfapi/mfconn.h"
 #include "../utils/http.h"
 #include "../utils/strings.h"
+#include "../utils/extents.h"
+#include "overlay.h"
+#include "filecache.h"
+
+/*
+ * assumed until the first download was measured
+ */
+#define FILECACHE_DEFAULT_RATE (1024.0 * 1024.0)
+#define FILECACHE_DEFAULT_LATENCY 0.5
+
+/*
+ * if at least this share of a modified file was written, the whole file is
+ * uploaded instead of a patch
+ */
+#define FILECACHE_FULL_UPLOAD_PERCENT 50
+
+// how many bytes of the written ranges are compared at once
+#define FILECACHE_COMPARE_BUFSIZE 32768
+
+enum filecache_patch_state {
+    FILECACHE_PATCH_PENDING,
+    FILECACHE_PATCH_READY,
+    FILECACHE_PATCH_FAILED
+};
+
+struct filecache_prefetch;
+
+struct filecache_patch_fetch {
+    struct filecache_prefetch *prefetch;
+    int             index;
+};
+
+struct filecache_prefetch {
+    mfconn         *conn;
+    const char     *filecache_path;
+    const char     *quickkey;
+    mfpatch       **patches;
+    enum filecache_patch_state *state;
+    struct filecache_patch_fetch *fetches;
+    // the download link of every patch, NULL if it could not be retrieved
+    char          **links;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int             next_link;
+    int             next_patch;
+    int             in_flight;
+    bool            stop;
+};
 
 static int      filecache_update_file(const char *filecache_path,
                                       mfconn * conn, const char *quickkey,
                                       uint64_t local_revision,
-                                      uint64_t remote_revision);
+                                      uint64_t remote_revision,
+                                      uint64_t fsize,
+                                      const unsigned char *fhash);
 static int      filecache_download_file(const char *filecache_path,
                                         const char *quickkey,
                                         uint64_t remote_revision,
                                         mfconn * conn);
-static int      filecache_download_patch(mfconn * conn, const char *quickkey,
-                                         uint64_t source_revision,
-                                         uint64_t target_revision,
-                                         const char *phash,
-                                         const char *filecache_path);
+static int      filecache_download_verified(const char *filecache_path,
+                                            const char *quickkey,
+                                            uint64_t remote_revision,
+                                            uint64_t fsize,
+                                            const unsigned char *fhash,
+                                            mfconn * conn);
+static bool     filecache_patching_is_cheaper(const char *quickkey,
+                                              mfpatch ** patches,
+                                              uint64_t fsize);
+static char    *filecache_patch_link(mfconn * conn, const char *quickkey,
+                                     uint64_t source_revision,
+                                     uint64_t target_revision,
+                                     const char *phash);
 static int      filecache_patch_file(const char *filecache_path,
                                      const char *quickkey,
-                                     uint64_t source_revision,
-                                     uint64_t target_revision);
+                                     FILE * sourcefile_fh,
+                                     FILE * targetfile_fh, mfpatch * patch,
+                                     unsigned char *target_hash);
+static char    *filecache_patch_path(const char *filecache_path,
+                                     const char *quickkey, mfpatch * patch);
+static FILE    *filecache_scratch_file(const char *filecache_path);
+static char    *filecache_blob_path(const char *filecache_path,
+                                    const unsigned char *hash);
+static int      filecache_link_blob(const char *filecache_path,
+                                    const char *quickkey, uint64_t revision,
+                                    uint64_t fsize,
+                                    const unsigned char *fhash);
+static void    *filecache_prefetch_worker(void *user_ptr);
+static void    *filecache_link_worker(void *user_ptr);
+static int      filecache_resolve_links(struct filecache_prefetch *prefetch,
+                                        mfconn * conn);
+static void     filecache_prefetch_done(mfhttp * http, int result,
+                                        void *user_ptr);
+static void     filecache_prefetch_set(struct filecache_prefetch *prefetch,
+                                       int i,
+                                       enum filecache_patch_state state);
+static int      filecache_open_cached(const char *filecache_path,
+                                      const char *quickkey,
+                                      uint64_t revision, mode_t mode,
+                                      overlay ** ovl);
+static bool     filecache_extents_unchanged(FILE * source_fh,
+                                            FILE * target_fh,
+                                            extents * dirty);
+static int      filecache_upload_full(const char *quickkey,
+                                      const char *file_name,
+                                      FILE * target_fh,
+                                      const char *target_hex,
+                                      uint64_t target_size, mfconn * conn,
+                                      char **upload_key);
+
+/*
+ * compare the written byte ranges of the target with the source
+ *
+ * returns true if both files have the same size and the content of all
+ * dirty ranges is identical, which means that the files are identical
+ */
+static bool filecache_extents_unchanged(FILE * source_fh, FILE * target_fh,
+                                        extents * dirty)
+{
+    struct stat     source_info;
+    struct stat     target_info;
+    unsigned char   source_buf[FILECACHE_COMPARE_BUFSIZE];
+    unsigned char   target_buf[FILECACHE_COMPARE_BUFSIZE];
+    uint64_t        offset;
+    uint64_t        length;
+    size_t          chunk;
+    size_t          i;
+
+    if (fstat(fileno(source_fh), &source_info) != 0
+        || fstat(fileno(target_fh), &target_info) != 0) {
+        fprintf(stderr, "fstat failed\n");
+        return false;
+    }
+
+    if (source_info.st_size != target_info.st_size)
+        return false;
+
+    for (i = 0; i < extents_count(dirty); i++) {
+        extents_get(dirty, i, &offset, &length);
+        while (length > 0) {
+            chunk = FILECACHE_COMPARE_BUFSIZE;
+            if (length < chunk)
+                chunk = length;
+            if (pread(fileno(source_fh), source_buf, chunk, offset)
+                != (ssize_t) chunk
+                || pread(fileno(target_fh), target_buf, chunk, offset)
+                != (ssize_t) chunk) {
+                return false;
+            }
+            if (memcmp(source_buf, target_buf, chunk) != 0)
+                return false;
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+
+    return true;
+}
 
+/*
+ * source_hash and target_hash may be NULL in which case the hash of the
+ * respective file is computed from its content
+ *
+ * dirty are the byte ranges of the target that were written to or NULL if
+ * they are unknown. If they cover most of the file, a patch would be about
+ * as large as the file, so the diff is skipped and the file is uploaded
+ * as a whole under the name file_name.
+ *
+ * returns 0 after the new content was sent and stores its hash in
+ * uploaded_hash, 1 if the content did not change and -1 on error
+ *
+ * the server still has to process what was sent, so upload_key receives the
+ * key to poll for its completion. It stays NULL if the server already had
+ * the content and nothing had to be sent.
+ */
 int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
-                           const char *filecache_path, mfconn * conn)
+                           const char *file_name,
+                           const unsigned char *source_hash,
+                           const unsigned char *target_hash, extents * dirty,
+                           const char *filecache_path, mfconn * conn,
+                           unsigned char *uploaded_hash, char **upload_key)
 {
     FILE           *source_fh;
     FILE           *target_fh;
     FILE           *patchfile_fh;
-    unsigned char   hash[SHA256_DIGEST_LENGTH];
-    char           *source_hash;
-    char           *target_hash;
+    unsigned char   source_bhash[SHA256_DIGEST_LENGTH];
+    unsigned char   target_bhash[SHA256_DIGEST_LENGTH];
+    char           *source_hex;
+    char           *target_hex;
     uint64_t        target_size;
+    struct stat     file_info;
     char           *cachefile;
     char           *newfile;
     char           *patch_file;
     int             retval;
-    char           *upload_key;
 
-    cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
+    *upload_key = NULL;
+
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
                               local_revision);
 
     source_fh = fopen(cachefile, "r");
@@ -81,8 +251,8 @@ int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
     }
     free(cachefile);
 
-    newfile = strdup_printf("%s/%s_%d_new", filecache_path, quickkey,
-                            local_revision);
+    newfile = strdup_printf("%s/%s_%" PRIu64 "_new", filecache_path,
+                            quickkey, local_revision);
 
     target_fh = fopen(newfile, "r");
     if (target_fh == NULL) {
@@ -93,142 +263,175 @@ int filecache_upload_patch(const char *quickkey, uint64_t local_revision,
     }
     free(newfile);
 
-    retval = calc_sha256(source_fh, hash, NULL);
-
-    if (retval != 0) {
-        fprintf(stderr, "failed to calculate hash\n");
+    // if only the same content was written back, neither hashing nor
+    // diffing is necessary
+    if (dirty != NULL
+        && filecache_extents_unchanged(source_fh, target_fh, dirty)) {
         fclose(source_fh);
         fclose(target_fh);
-        return -1;
+        return 1;
     }
 
-    source_hash = binary2hex(hash, SHA256_DIGEST_LENGTH);
+    if (source_hash == NULL) {
+        retval = calc_sha256(source_fh, source_bhash, NULL);
+
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            fclose(source_fh);
+            fclose(target_fh);
+            return -1;
+        }
+        rewind(source_fh);
+    } else {
+        memcpy(source_bhash, source_hash, SHA256_DIGEST_LENGTH);
+    }
 
-    retval = calc_sha256(target_fh, hash, &target_size);
+    if (target_hash == NULL) {
+        retval = calc_sha256(target_fh, target_bhash, &target_size);
 
-    if (retval != 0) {
-        fprintf(stderr, "failed to calculate hash\n");
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            fclose(source_fh);
+            fclose(target_fh);
+            return -1;
+        }
+        rewind(target_fh);
+    } else {
+        memcpy(target_bhash, target_hash, SHA256_DIGEST_LENGTH);
+
+        if (fstat(fileno(target_fh), &file_info) != 0) {
+            fprintf(stderr, "fstat failed\n");
+            fclose(source_fh);
+            fclose(target_fh);
+            return -1;
+        }
+        target_size = file_info.st_size;
+    }
+
+    if (memcmp(source_bhash, target_bhash, SHA256_DIGEST_LENGTH) == 0) {
+        // no changes were done
         fclose(source_fh);
         fclose(target_fh);
-        return -1;
+        return 1;
     }
 
-    target_hash = binary2hex(hash, SHA256_DIGEST_LENGTH);
+    memcpy(uploaded_hash, target_bhash, SHA256_DIGEST_LENGTH);
 
-    if (strcmp(source_hash, target_hash) == 0) {
-        // no changes were done
-        free(source_hash);
-        free(target_hash);
+    if (dirty != NULL && target_size > 0
+        && extents_total(dirty) * 100
+        >= target_size * FILECACHE_FULL_UPLOAD_PERCENT) {
+        fclose(source_fh);
+        target_hex = binary2hex(target_bhash, SHA256_DIGEST_LENGTH);
+        retval = filecache_upload_full(quickkey, file_name, target_fh,
+                                       target_hex, target_size, conn,
+                                       upload_key);
+        fclose(target_fh);
+        free(target_hex);
+        if (retval != 0) {
+            fprintf(stderr, "filecache_upload_full failed\n");
+            return -1;
+        }
         return 0;
     }
 
-    patch_file = strdup_printf("%s/%s_patch_%d_new", filecache_path, quickkey,
-                               local_revision);
+    patch_file = strdup_printf("%s/%s_patch_%" PRIu64 "_new",
+                               filecache_path, quickkey, local_revision);
 
     patchfile_fh = fopen(patch_file, "w");
     if (patchfile_fh == NULL) {
         fprintf(stderr, "cannot open %s\n", patch_file);
+        free(patch_file);
         fclose(source_fh);
         fclose(target_fh);
         return -1;
     }
 
-    rewind(source_fh);
-    rewind(target_fh);
     retval = xdelta3_diff(source_fh, target_fh, patchfile_fh);
     fclose(source_fh);
     fclose(target_fh);
     fclose(patchfile_fh);
 
-    upload_key = NULL;
-    retval = mfconn_api_upload_patch(conn, quickkey, source_hash, target_hash,
-                                     target_size, patch_file, &upload_key);
+    source_hex = binary2hex(source_bhash, SHA256_DIGEST_LENGTH);
+    target_hex = binary2hex(target_bhash, SHA256_DIGEST_LENGTH);
+
+    retval = mfconn_api_upload_patch(conn, quickkey, source_hex, target_hex,
+                                     target_size, patch_file, upload_key);
+    free(source_hex);
+    free(target_hex);
+    free(patch_file);
 
-    if (retval != 0 || upload_key == NULL) {
+    if (retval != 0 || *upload_key == NULL) {
         fprintf(stderr, "mfconn_api_upload_patch failed\n");
+        free(*upload_key);
+        *upload_key = NULL;
         return -1;
     }
-    // poll for completion
-    retval = mfconn_upload_poll_for_completion(conn, upload_key);
-    free(upload_key);
 
-    if (retval != 0) {
-        fprintf(stderr, "mfconn_upload_poll_for_completion failed\n");
+    return 0;
+}
+
+/*
+ * replaces the content of the file with target_fh
+ *
+ * if the server already knows content with the same hash, upload/instant
+ * makes it the new revision without sending any data and upload_key stays
+ * NULL. Otherwise the file is sent and upload_key has to be polled.
+ */
+static int filecache_upload_full(const char *quickkey, const char *file_name,
+                                 FILE * target_fh, const char *target_hex,
+                                 uint64_t target_size, mfconn * conn,
+                                 char **upload_key)
+{
+    int             retval;
+
+    *upload_key = NULL;
+
+    retval = mfconn_api_upload_instant(conn, quickkey, NULL, target_hex,
+                                       target_size, NULL);
+    if (retval == 0)
+        return 0;
+
+    fprintf(stderr, "content of %s is new, uploading all of it\n",
+            quickkey);
+
+    retval = mfconn_api_upload_simple(conn, NULL, quickkey, target_fh,
+                                      file_name, upload_key);
+    if (retval != 0 || *upload_key == NULL) {
+        fprintf(stderr, "mfconn_api_upload_simple failed\n");
+        free(*upload_key);
+        *upload_key = NULL;
         return -1;
     }
 
     return 0;
 }
 
+/*
+ * opens the cached revision of a file, retrieving it first if necessary
+ *
+ * if the file is opened read-only, a file descriptor of the cached revision
+ * is returned. Otherwise, modifications go to <key>_<rev>_new through an
+ * overlay which is stored in ovl and 0 is returned.
+ */
 int filecache_open_file(const char *quickkey, uint64_t local_revision,
                         uint64_t remote_revision, uint64_t fsize,
                         const unsigned char *fhash,
                         const char *filecache_path, mfconn * conn, mode_t mode,
-                        bool update)
+                        bool update, overlay ** ovl)
 {
     char           *cachefile;
-    char           *newfile;
     int             fd;
     int             retval;
-    const int       BUFSIZE = 4096;
-    char            buf[BUFSIZE];
-    size_t          size;
-    int             source;
-    int             dest;
-
-    if (update) {
-        cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                                  remote_revision);
-    } else {
-        cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                                  local_revision);
-    }
+
     /* check if the requested file is already in the cache */
-    if ((mode & O_ACCMODE) == O_RDONLY) {
-        // if file is opened in readonly mode, we try to open it directly
-        fd = open(cachefile, mode);
-        free(cachefile);
-        if (fd > 0) {
-            /* file existed - return handle */
-            return fd;
-        }
-        // if the file cannot be opened, then it has to be retrieved
-    } else {
-        // if file is opened writable then a temporary file has to be opened
-        // instead to upload a patch if necessary
-        if (update) {
-            newfile = strdup_printf("%s/%s_%d_new", filecache_path, quickkey,
-                                    remote_revision);
-        } else {
-            newfile = strdup_printf("%s/%s_%d_new", filecache_path, quickkey,
-                                    local_revision);
-        }
-        fd = open(newfile, mode);
-        if (fd > 0) {
-            /* file existed - return handle */
-            free(newfile);
-            free(cachefile);
-            return fd;
-        }
-        // the temporary file wasn't available, so we copy it from the
-        // original
-        source = open(cachefile, O_RDONLY);
-        free(cachefile);
-        if (fd > 0) {
-            dest = open(newfile, O_WRONLY | O_CREAT, 0644);
-            while ((size = read(source, buf, BUFSIZE)) > 0) {
-                write(dest, buf, size);
-            }
-            close(source);
-            close(dest);
-            fd = open(newfile, mode);
-            free(newfile);
-            return fd;
-        }
-        free(newfile);
-        // if the source file cannot be opened for copying, then it has to be
-        // retrieved
+    fd = filecache_open_cached(filecache_path, quickkey,
+                               update ? remote_revision : local_revision,
+                               mode, ovl);
+    if (fd >= 0) {
+        /* file existed - return handle */
+        return fd;
     }
+    // if the file cannot be opened, then it has to be retrieved
 
     // if no updating is requested and we end up here, then something failed
     // but since we must not update, this is a failure
@@ -237,21 +440,33 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
         return -1;
     }
 
+    /* the same content may already be cached for another file or another
+     * revision, in which case it is shared instead of fetched */
+    retval = filecache_link_blob(filecache_path, quickkey, remote_revision,
+                                 fsize, fhash);
+    if (retval == 0) {
+        fprintf(stderr, "content of %s is already in the cache\n", quickkey);
+        return filecache_open_cached(filecache_path, quickkey,
+                                     remote_revision, mode, ovl);
+    }
+
     /* if the file with remote revision didn't exist, then check whether an
      * old revision exists and in that case update that.
      *
      * Otherwise, download the file anew */
 
     cachefile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, local_revision);
+        strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                      local_revision);
     fd = open(cachefile, O_RDONLY);
     free(cachefile);
     if (fd > 0) {
         close(fd);
         /* file exists, so we have to update it with one or more patches from
-         * the remote */
+         * the remote. The result is verified while it is written. */
         retval = filecache_update_file(filecache_path, conn, quickkey,
-                                       local_revision, remote_revision);
+                                       local_revision, remote_revision,
+                                       fsize, fhash);
         if (retval != 0) {
             fprintf(stderr, "update_file failed\n");
             return -1;
@@ -259,111 +474,226 @@ int filecache_open_file(const char *quickkey, uint64_t local_revision,
 
     } else {
         /* download the file */
-        retval = filecache_download_file(filecache_path, quickkey,
-                                         remote_revision, conn);
-        if (retval != 0) {
-            fprintf(stderr, "filecache_download_file failed\n");
+        retval = filecache_download_verified(filecache_path, quickkey,
+                                             remote_revision, fsize, fhash,
+                                             conn);
+        if (retval != 0)
             return -1;
-        }
     }
 
-    /* check whether the patched or newly downloaded file matches the hash we
-     * have stored */
-    cachefile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, remote_revision);
-    retval = file_check_integrity(cachefile, fsize, fhash);
-    if (retval != 0) {
-        fprintf(stderr, "checking integrity failed\n");
-        free(cachefile);
-        return -1;
-    }
+    /* a failure only means that later copies of the content cannot share
+     * the storage with this one */
+    filecache_store_blob(filecache_path, quickkey, remote_revision, fhash);
+
+    /* return the file handle */
+    return filecache_open_cached(filecache_path, quickkey, remote_revision,
+                                 mode, ovl);
+}
+
+/*
+ * read-only opens return a file descriptor of the cached revision while
+ * writable opens store an overlay in ovl and return 0
+ */
+static int filecache_open_cached(const char *filecache_path,
+                                 const char *quickkey, uint64_t revision,
+                                 mode_t mode, overlay ** ovl)
+{
+    char           *cachefile;
+    char           *newfile;
+    int             fd;
+
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                              revision);
 
     if ((mode & O_ACCMODE) == O_RDONLY) {
-        // if file is opened in readonly mode, we open it directly
         fd = open(cachefile, mode);
-    } else {
-        // if file is opened writable then a temporary file has to be opened
-        // instead to upload a patch if necessary
-        newfile = strdup_printf("%s/%s_%d_new", filecache_path, quickkey,
-                                remote_revision);
-        source = open(cachefile, O_RDONLY);
-        dest = open(newfile, O_WRONLY | O_CREAT, 0644);
-        while ((size = read(source, buf, BUFSIZE)) > 0) {
-            write(dest, buf, size);
-        }
-        close(source);
-        close(dest);
-        fd = open(newfile, mode);
-        free(newfile);
+        free(cachefile);
+        return fd;
     }
-
+    // if file is opened writable then the changes go to a separate file
+    // to upload a patch if necessary
+    newfile = strdup_printf("%s/%s_%" PRIu64 "_new", filecache_path,
+                            quickkey, revision);
+    *ovl = overlay_open(cachefile, newfile, mode);
     free(cachefile);
+    free(newfile);
 
-    /* return the file handle */
-    return fd;
+    if (*ovl == NULL)
+        return -1;
+
+    return 0;
 }
 
+/*
+ * the direct link usually comes from the link cache. If the server refuses
+ * a cached link, it is dropped and the download is tried once more with a
+ * fresh one.
+ */
 static int filecache_download_file(const char *filecache_path,
                                    const char *quickkey,
                                    uint64_t remote_revision, mfconn * conn)
 {
-    const char     *url;
-    mffile         *file;
+    char           *url;
     mfhttp         *http;
     char           *cachefile;
     int             retval;
+    int             attempt;
 
-    cachefile = strdup_printf("%s/%s_%d", filecache_path, quickkey,
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
                               remote_revision);
 
-    file = file_alloc();
-    retval = mfconn_api_file_get_links(conn, file,
-                                       (char *)quickkey,
-                                       MFCONN_FILE_LINK_TYPE_DIRECT_DOWNLOAD);
+    retval = -1;
+    for (attempt = 0; attempt < 2; attempt++) {
+        url = mfapi_linkcache_get(conn, quickkey, remote_revision);
+        if (url == NULL) {
+            fprintf(stderr, "cannot get a link to %s\n", quickkey);
+            free(cachefile);
+            return -1;
+        }
+
+        http = http_create();
+        retval = http_get_file(http, url, cachefile);
+        http_destroy(http);
+        free(url);
+
+        if (retval != HTTP_FORBIDDEN)
+            break;
+        mfapi_linkcache_invalidate(quickkey);
+    }
 
     if (retval != 0) {
-        fprintf(stderr, "mfconn_api_file_get_links failed\n");
+        fprintf(stderr, "download failed\n");
+        // the link may have gone stale in another way
+        mfapi_linkcache_invalidate(quickkey);
         free(cachefile);
-        file_free(file);
         return -1;
     }
 
-    url = file_get_direct_link(file);
+    free(cachefile);
 
-    if (url == NULL) {
-        fprintf(stderr, "file_get_direct_link failed\n");
-        free(cachefile);
-        file_free(file);
-        return -1;
-    }
+    return 0;
+}
 
-    http = http_create();
-    retval = http_get_file(http, url, cachefile);
-    http_destroy(http);
+/*
+ * downloads the remote revision and checks it against the hash and size we
+ * have stored
+ */
+static int filecache_download_verified(const char *filecache_path,
+                                       const char *quickkey,
+                                       uint64_t remote_revision,
+                                       uint64_t fsize,
+                                       const unsigned char *fhash,
+                                       mfconn * conn)
+{
+    char           *cachefile;
+    int             retval;
 
+    retval = filecache_download_file(filecache_path, quickkey,
+                                     remote_revision, conn);
     if (retval != 0) {
-        fprintf(stderr, "download failed\n");
-        free(cachefile);
-        file_free(file);
+        fprintf(stderr, "filecache_download_file failed\n");
         return -1;
     }
 
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                              remote_revision);
+    retval = file_check_integrity(cachefile, fsize, fhash);
     free(cachefile);
-    file_free(file);
+    if (retval != 0) {
+        fprintf(stderr, "checking integrity failed\n");
+        // the server might have answered with an error page, so the next
+        // attempt must not use the same link
+        mfapi_linkcache_invalidate(quickkey);
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * estimates whether fetching the patches of a chain is faster than
+ * downloading the remote revision of fsize bytes anew
+ *
+ * every patch costs a device/get_patch call and a download, as many of
+ * them as are fetched at the same time share one latency. A full download
+ * costs a file/get_links call and the download. The rate and latency are
+ * the ones measured for earlier downloads. If the server did not tell the
+ * size of every patch, the chain is used.
+ */
+static bool filecache_patching_is_cheaper(const char *quickkey,
+                                          mfpatch ** patches, uint64_t fsize)
+{
+    double          rate;
+    double          latency;
+    double          patch_cost;
+    double          download_cost;
+    uint64_t        patch_bytes;
+    int             num_rounds;
+    int             i;
+
+    patch_bytes = 0;
+    for (i = 0; patches[i] != NULL; i++) {
+        if (patch_get_size(patches[i]) == 0) {
+            fprintf(stderr, "updating %s with %d patches of unknown size\n",
+                    quickkey, i + 1);
+            return true;
+        }
+        patch_bytes += patch_get_size(patches[i]);
+    }
+
+    http_get_download_estimate(&rate, &latency);
+    if (rate == 0)
+        rate = FILECACHE_DEFAULT_RATE;
+    if (latency == 0)
+        latency = FILECACHE_DEFAULT_LATENCY;
+
+    num_rounds = (i + FILECACHE_PATCH_PREFETCH - 1) / FILECACHE_PATCH_PREFETCH;
+    patch_cost = 2 * num_rounds * latency + patch_bytes / rate;
+    download_cost = 2 * latency + fsize / rate;
+
+    fprintf(stderr, "updating %s: %d patches of %" PRIu64 " bytes take "
+            "%.2fs, downloading %" PRIu64 " bytes takes %.2fs, %s\n",
+            quickkey, i, patch_bytes, patch_cost, fsize, download_cost,
+            patch_cost <= download_cost ? "patching" : "downloading");
+
+    return patch_cost <= download_cost;
+}
+
+/*
+ * bring the cached local revision up to the remote revision by applying the
+ * chain of patches returned by device/get_updates
+ *
+ * only the final revision is written to the cache. Intermediate revisions
+ * live in unlinked scratch files which are dropped as soon as the next step
+ * has consumed them. The hashes of the patches and of every patched revision
+ * are computed while the data passes through xdelta3, so nothing has to be
+ * read a second time to be verified.
+ *
+ * up to FILECACHE_PATCH_PREFETCH patches are fetched at the same time while
+ * the ones that already arrived are applied in order.
+ */
 static int filecache_update_file(const char *filecache_path, mfconn * conn,
                                  const char *quickkey,
                                  uint64_t local_revision,
-                                 uint64_t remote_revision)
+                                 uint64_t remote_revision, uint64_t fsize,
+                                 const unsigned char *fhash)
 {
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
     unsigned char   hash2[SHA256_DIGEST_LENGTH];
     int             retval;
     int             i;
+    int             j;
     uint64_t        last_target_revision;
     char           *cachefile;
+    char           *targetfile;
+    char           *patchfile;
+    FILE           *sourcefile_fh;
+    FILE           *targetfile_fh;
+    struct filecache_prefetch prefetch;
+    enum filecache_patch_state state;
+    pthread_t       thread;
+    bool            thread_started;
+    int             num_patches;
 
     mfpatch       **patches = NULL;
 
@@ -378,112 +708,217 @@ static int filecache_update_file(const char *filecache_path, mfconn * conn,
     // if no patches are returned, then the full file has to be downloaded
     if (patches[0] == NULL) {
         free(patches);
-
-        retval = filecache_download_file(filecache_path, quickkey,
-                                         remote_revision, conn);
-        if (retval != 0) {
-            fprintf(stderr, "filecache_download_file failed\n");
-            return -1;
-        }
-
-        return 0;
+        return filecache_download_verified(filecache_path, quickkey,
+                                           remote_revision, fsize, fhash,
+                                           conn);
     }
 
+    /* verify that the patches form a chain from the local to the remote
+     * revision before anything is downloaded */
     last_target_revision = local_revision;
-    // else, go through all patches and download and apply them
     for (i = 0; patches[i] != NULL; i++) {
-        /* verify that the source revision is equal to the last target
-         * revision */
         if (patch_get_source_revision(patches[i]) != last_target_revision) {
             fprintf(stderr, "the source revision is unequal the last "
                     "target revision\n");
             break;
         }
+        if (i > 0 && strcmp(patch_get_source_hash(patches[i]),
+                            patch_get_target_hash(patches[i - 1])) != 0) {
+            fprintf(stderr, "the source hash is unequal the last "
+                    "target hash\n");
+            break;
+        }
         last_target_revision = patch_get_target_revision(patches[i]);
+    }
+    /* verify that the last target revision is equal to the requested remote
+     * revision */
+    if (patches[i] == NULL && last_target_revision != remote_revision) {
+        fprintf(stderr, "last_target_revision is not equal to the requested "
+                "remote revision\n");
+    }
+    if (patches[i] != NULL || last_target_revision != remote_revision) {
+        for (i = 0; patches[i] != NULL; i++)
+            free(patches[i]);
+        free(patches);
+        return -1;
+    }
+    num_patches = i;
 
-        retval =
-            filecache_download_patch(conn, quickkey,
-                                     patch_get_source_revision(patches[i]),
-                                     patch_get_target_revision(patches[i]),
-                                     patch_get_hash(patches[i]),
-                                     filecache_path);
-        if (retval != 0) {
-            fprintf(stderr, "filecache_download_patch failed\n");
+    if (!filecache_patching_is_cheaper(quickkey, patches, fsize)) {
+        for (i = 0; patches[i] != NULL; i++)
+            free(patches[i]);
+        free(patches);
+        return filecache_download_verified(filecache_path, quickkey,
+                                           remote_revision, fsize, fhash,
+                                           conn);
+    }
+
+    cachefile =
+        strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                      local_revision);
+    sourcefile_fh = fopen(cachefile, "r");
+    if (sourcefile_fh == NULL) {
+        fprintf(stderr, "cannot open %s\n", cachefile);
+        free(cachefile);
+        for (i = 0; patches[i] != NULL; i++)
+            free(patches[i]);
+        free(patches);
+        return -1;
+    }
+    free(cachefile);
+
+    prefetch.conn = conn;
+    prefetch.filecache_path = filecache_path;
+    prefetch.quickkey = quickkey;
+    prefetch.patches = patches;
+    prefetch.state = (enum filecache_patch_state *)
+        calloc(num_patches, sizeof(enum filecache_patch_state));
+    prefetch.fetches = (struct filecache_patch_fetch *)
+        calloc(num_patches, sizeof(struct filecache_patch_fetch));
+    prefetch.links = (char **)calloc(num_patches, sizeof(char *));
+    for (i = 0; i < num_patches; i++) {
+        prefetch.fetches[i].prefetch = &prefetch;
+        prefetch.fetches[i].index = i;
+    }
+    pthread_mutex_init(&(prefetch.mutex), NULL);
+    pthread_cond_init(&(prefetch.cond), NULL);
+    prefetch.next_link = 0;
+    prefetch.next_patch = 0;
+    prefetch.in_flight = 0;
+    prefetch.stop = false;
+
+    thread_started = pthread_create(&thread, NULL, filecache_prefetch_worker,
+                                    &prefetch) == 0;
+    if (!thread_started) {
+        fprintf(stderr, "cannot start patch fetching thread\n");
+        prefetch.stop = true;
+        for (i = 0; i < num_patches; i++)
+            prefetch.state[i] = FILECACHE_PATCH_FAILED;
+    }
+
+    targetfile =
+        strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                      remote_revision);
+    targetfile_fh = NULL;
+
+    // go through all patches and apply them as soon as they arrived
+    for (i = 0; patches[i] != NULL; i++) {
+        pthread_mutex_lock(&(prefetch.mutex));
+        while (prefetch.state[i] == FILECACHE_PATCH_PENDING)
+            pthread_cond_wait(&(prefetch.cond), &(prefetch.mutex));
+        state = prefetch.state[i];
+        pthread_mutex_unlock(&(prefetch.mutex));
+
+        if (state != FILECACHE_PATCH_READY) {
+            fprintf(stderr, "fetching the patch failed\n");
             break;
         }
 
-        /* verify that the file to patch has the right hash */
-        cachefile =
-            strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                          patch_get_source_revision(patches[i]));
-        hex2binary(patch_get_source_hash(patches[i]), hash2);
-        retval = file_check_integrity_hash(cachefile, hash2);
-        free(cachefile);
-        if (retval != 0) {
-            fprintf(stderr, "the source file has the wrong hash\n");
+        /* only the last revision of the chain is kept */
+        if (patches[i + 1] == NULL)
+            targetfile_fh = fopen(targetfile, "w");
+        else
+            targetfile_fh = filecache_scratch_file(filecache_path);
+        if (targetfile_fh == NULL) {
+            fprintf(stderr, "cannot open target of patch\n");
             break;
         }
 
-        /* now apply the patch in patchfile to the file in cachefile */
+        /* now apply the patch to the last revision */
         retval = filecache_patch_file(filecache_path, quickkey,
-                                      patch_get_source_revision(patches[i]),
-                                      patch_get_target_revision(patches[i]));
+                                      sourcefile_fh, targetfile_fh,
+                                      patches[i], hash);
         if (retval != 0) {
             fprintf(stderr, "filecache_patch_file failed\n");
             break;
         }
 
-        /* verify that the patched file has the right hash */
-        cachefile =
-            strdup_printf("%s/%s_%d", filecache_path, quickkey,
-                          patch_get_target_revision(patches[i]));
+        /* verify that the patched revision has the right hash */
         hex2binary(patch_get_target_hash(patches[i]), hash2);
-        retval = file_check_integrity_hash(cachefile, hash2);
-        free(cachefile);
-        if (retval != 0) {
+        if (memcmp(hash, hash2, SHA256_DIGEST_LENGTH) != 0) {
             fprintf(stderr, "the target file has the wrong hash\n");
             break;
         }
 
-        free(patches[i]);
+        /* the source is not needed anymore and if it was a scratch file,
+         * closing it releases its space */
+        fclose(sourcefile_fh);
+        sourcefile_fh = targetfile_fh;
+        targetfile_fh = NULL;
+    }
+
+    /* no further patches are fetched once the chain is aborted */
+    pthread_mutex_lock(&(prefetch.mutex));
+    prefetch.stop = true;
+    pthread_mutex_unlock(&(prefetch.mutex));
+    if (thread_started)
+        pthread_join(thread, NULL);
+    pthread_cond_destroy(&(prefetch.cond));
+    pthread_mutex_destroy(&(prefetch.mutex));
+    free(prefetch.state);
+    free(prefetch.fetches);
+    for (j = 0; j < num_patches; j++)
+        free(prefetch.links[j]);
+    free(prefetch.links);
+
+    /* applied patches are already gone, remove the ones that were fetched
+     * in vain */
+    for (j = i; patches[j] != NULL; j++) {
+        patchfile = filecache_patch_path(filecache_path, quickkey,
+                                         patches[j]);
+        unlink(patchfile);
+        free(patchfile);
     }
 
     /* check if the terminating NULL was reached or if processing was aborted
      * before that */
     if (patches[i] != NULL) {
-        for (; patches[i] != NULL; i++)
-            free(patches[i]);
+        for (j = 0; patches[j] != NULL; j++)
+            free(patches[j]);
         free(patches);
+        fclose(sourcefile_fh);
+        if (targetfile_fh != NULL) {
+            fclose(targetfile_fh);
+            unlink(targetfile);
+        }
+        free(targetfile);
         return -1;
     }
 
+    for (j = 0; patches[j] != NULL; j++)
+        free(patches[j]);
     free(patches);
+    fclose(sourcefile_fh);
 
-    /* verify that the last target revision is equal to the requested remote
-     * revision */
-    if (last_target_revision != remote_revision) {
-        fprintf(stderr, "last_target_revision is not equal to the requested "
-                "remote revision\n");
+    /* the hash of the final revision was verified while it was written, the
+     * size and the hash we have stored remain to be checked */
+    if (memcmp(hash, fhash, SHA256_DIGEST_LENGTH) != 0
+        || file_check_integrity_size(targetfile, fsize) != 0) {
+        fprintf(stderr, "the patched file does not match the stored hash "
+                "or size\n");
+        unlink(targetfile);
+        free(targetfile);
         return -1;
     }
 
+    free(targetfile);
+
     return 0;
 }
 
-static int filecache_download_patch(mfconn * conn, const char *quickkey,
-                                    uint64_t source_revision,
-                                    uint64_t target_revision,
-                                    const char *phash,
-                                    const char *filecache_path)
+/*
+ * asks device/get_patch for the link to a patch of the chain and checks that
+ * it is the patch that device/get_updates announced
+ */
+static char *filecache_patch_link(mfconn * conn, const char *quickkey,
+                                  uint64_t source_revision,
+                                  uint64_t target_revision, const char *phash)
 {
     mfpatch        *patch;
     const char     *url;
-    mfhttp         *http;
+    char           *link;
     int             retval;
-    char           *patchfile;
-    unsigned char   hash2[SHA256_DIGEST_LENGTH];
 
-    /* first retrieve the patch url */
     patch = patch_alloc();
     retval = mfconn_api_device_get_patch(conn, patch, quickkey,
                                          source_revision, target_revision);
@@ -491,7 +926,7 @@ static int filecache_download_patch(mfconn * conn, const char *quickkey,
     if (retval != 0) {
         fprintf(stderr, "mfconn_api_device_get_patch failed\n");
         patch_free(patch);
-        return -1;
+        return NULL;
     }
 
     /* verify if the retrieved patch hash is the expected patch hash */
@@ -499,110 +934,501 @@ static int filecache_download_patch(mfconn * conn, const char *quickkey,
         fprintf(stderr, "the expected patch hash is not equal the hash "
                 "returned by device/get_patch\n");
         patch_free(patch);
-        return -1;
+        return NULL;
     }
 
-    /* then download the patch */
     url = patch_get_link(patch);
 
     if (url == NULL || url[0] == '\0') {
         fprintf(stderr, "patch_get_link failed\n");
         patch_free(patch);
-        return -1;
+        return NULL;
     }
 
-    patchfile =
-        strdup_printf("%s/%s_patch_%d_%d", filecache_path, quickkey,
-                      source_revision, target_revision);
+    /* the integrity of the patch is verified while it is applied */
+    link = strdup(url);
+    patch_free(patch);
 
-    http = http_create();
-    retval = http_get_file(http, url, patchfile);
-    http_destroy(http);
+    return link;
+}
 
-    if (retval != 0) {
-        fprintf(stderr, "download failed\n");
+/*
+ * apply the downloaded patch to the revision in sourcefile_fh and write the
+ * result to targetfile_fh
+ *
+ * the patch file is removed afterwards. The patch is verified against its
+ * expected hash and the sha256 of the result is stored in target_hash.
+ */
+static int filecache_patch_file(const char *filecache_path,
+                                const char *quickkey, FILE * sourcefile_fh,
+                                FILE * targetfile_fh, mfpatch * patch,
+                                unsigned char *target_hash)
+{
+    char           *patchfile;
+    FILE           *patchfile_fh;
+    unsigned char   patch_hash[SHA256_DIGEST_LENGTH];
+    unsigned char   hash2[SHA256_DIGEST_LENGTH];
+    int             retval;
+
+    patchfile = filecache_patch_path(filecache_path, quickkey, patch);
+    patchfile_fh = fopen(patchfile, "r");
+    if (patchfile_fh == NULL) {
+        fprintf(stderr, "cannot open %s\n", patchfile);
         free(patchfile);
-        patch_free(patch);
         return -1;
     }
 
-    /* verify the integrity of the patch */
-    hex2binary(patch_get_hash(patch), hash2);
-    retval = file_check_integrity_hash(patchfile, hash2);
+    retval = xdelta3_patch_hash(sourcefile_fh, patchfile_fh, targetfile_fh,
+                                patch_hash, target_hash);
+    fclose(patchfile_fh);
+    unlink(patchfile);
+    free(patchfile);
 
     if (retval != 0) {
-        fprintf(stderr, "file_check_integrity_hash failed for patch\n");
-        patch_free(patch);
+        fprintf(stderr, "unable to patch\n");
         return -1;
     }
 
-    patch_free(patch);
+    if (fflush(targetfile_fh) != 0) {
+        fprintf(stderr, "unable to write patched file\n");
+        return -1;
+    }
+
+    /* verify the integrity of the patch */
+    hex2binary(patch_get_hash(patch), hash2);
+    if (memcmp(patch_hash, hash2, SHA256_DIGEST_LENGTH) != 0) {
+        fprintf(stderr, "the patch has the wrong hash\n");
+        return -1;
+    }
 
     return 0;
 }
 
-static int filecache_patch_file(const char *filecache_path,
-                                const char *quickkey,
-                                uint64_t source_revision,
-                                uint64_t target_revision)
+/*
+ * where a patch of the chain is stored between its download and being
+ * applied
+ */
+static char *filecache_patch_path(const char *filecache_path,
+                                  const char *quickkey, mfpatch * patch)
 {
-    char           *patchfile;
-    char           *sourcefile;
-    char           *targetfile;
-    FILE           *sourcefile_fh;
-    FILE           *patchfile_fh;
-    FILE           *targetfile_fh;
+    return strdup_printf("%s/%s_patch_%" PRIu64 "_%" PRIu64, filecache_path,
+                         quickkey, patch_get_source_revision(patch),
+                         patch_get_target_revision(patch));
+}
+
+/*
+ * create a file that holds an intermediate revision
+ *
+ * it is created next to the cached files and unlinked right away, so that
+ * it disappears once it is closed
+ */
+static FILE *filecache_scratch_file(const char *filecache_path)
+{
+    char           *path;
+    FILE           *fh;
+    int             fd;
+
+    path = strdup_printf("%s/scratch_XXXXXX", filecache_path);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        fprintf(stderr, "cannot create scratch file in %s\n",
+                filecache_path);
+        free(path);
+        return NULL;
+    }
+    unlink(path);
+    free(path);
+
+    fh = fdopen(fd, "w+");
+    if (fh == NULL) {
+        fprintf(stderr, "fdopen failed\n");
+        close(fd);
+        return NULL;
+    }
+
+    return fh;
+}
+
+static char *filecache_blob_path(const char *filecache_path,
+                                 const unsigned char *hash)
+{
+    char           *hex;
+    char           *path;
+
+    hex = binary2hex(hash, SHA256_DIGEST_LENGTH);
+    path = strdup_printf("%s/" FILECACHE_BLOBS "/%s", filecache_path, hex);
+    free(hex);
+
+    return path;
+}
+
+/*
+ * let the revision of quickkey refer to the blob with the content fhash if
+ * that content is cached already
+ *
+ * only the size is checked. Blobs are never written to and are checked
+ * like every other cached file when the cache is cleaned up.
+ */
+static int filecache_link_blob(const char *filecache_path,
+                               const char *quickkey, uint64_t revision,
+                               uint64_t fsize, const unsigned char *fhash)
+{
+    struct stat     file_info;
+    char           *blobfile;
+    char           *cachefile;
     int             retval;
 
-    sourcefile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, source_revision);
-    sourcefile_fh = fopen(sourcefile, "r");
-    if (sourcefile_fh == NULL) {
-        fprintf(stderr, "cannot open %s\n", sourcefile);
-        free(sourcefile);
+    blobfile = filecache_blob_path(filecache_path, fhash);
+    retval = stat(blobfile, &file_info);
+    if (retval != 0 || (uint64_t) file_info.st_size != fsize) {
+        free(blobfile);
         return -1;
     }
 
-    free(sourcefile);
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                              revision);
+    retval = link(blobfile, cachefile);
+    if (retval != 0) {
+        fprintf(stderr, "cannot link %s to %s\n", cachefile, blobfile);
+    }
+    free(blobfile);
+    free(cachefile);
 
-    patchfile =
-        strdup_printf("%s/%s_patch_%d_%d", filecache_path, quickkey,
-                      source_revision, target_revision);
-    patchfile_fh = fopen(patchfile, "r");
-    if (patchfile_fh == NULL) {
-        fprintf(stderr, "cannot open %s\n", patchfile);
-        free(patchfile);
-        fclose(sourcefile_fh);
+    return retval == 0 ? 0 : -1;
+}
+
+/*
+ * make the cached revision of quickkey share its storage with all other
+ * cached files of the same content
+ *
+ * if the content was not cached yet, the revision becomes its blob.
+ * Otherwise the revision is replaced by a link to the existing blob. The
+ * number of links of a blob counts the cached files that refer to it.
+ */
+int filecache_store_blob(const char *filecache_path, const char *quickkey,
+                         uint64_t revision, const unsigned char *hash)
+{
+    struct stat     cache_info;
+    struct stat     blob_info;
+    char           *blobdir;
+    char           *blobfile;
+    char           *cachefile;
+    char           *tmpfile;
+    int             retval;
+
+    blobdir = strdup_printf("%s/" FILECACHE_BLOBS, filecache_path);
+    if (mkdir(blobdir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cannot create %s\n", blobdir);
+        free(blobdir);
         return -1;
     }
+    free(blobdir);
 
-    free(patchfile);
+    blobfile = filecache_blob_path(filecache_path, hash);
+    cachefile = strdup_printf("%s/%s_%" PRIu64, filecache_path, quickkey,
+                              revision);
 
-    targetfile =
-        strdup_printf("%s/%s_%d", filecache_path, quickkey, target_revision);
-    targetfile_fh = fopen(targetfile, "w");
-    if (targetfile_fh == NULL) {
-        fprintf(stderr, "cannot open %s\n", targetfile);
-        fclose(sourcefile_fh);
-        fclose(patchfile_fh);
-        free(targetfile);
+    if (link(cachefile, blobfile) == 0) {
+        free(blobfile);
+        free(cachefile);
+        return 0;
+    }
+
+    if (errno != EEXIST || stat(cachefile, &cache_info) != 0
+        || stat(blobfile, &blob_info) != 0) {
+        fprintf(stderr, "cannot link %s to %s\n", blobfile, cachefile);
+        free(blobfile);
+        free(cachefile);
         return -1;
     }
 
-    free(targetfile);
+    /* rename() does nothing if both names refer to the same file */
+    if (cache_info.st_ino == blob_info.st_ino
+        && cache_info.st_dev == blob_info.st_dev) {
+        free(blobfile);
+        free(cachefile);
+        return 0;
+    }
 
-    retval = xdelta3_patch(sourcefile_fh, patchfile_fh, targetfile_fh);
+    /* the link is made under another name first so that the cached revision
+     * is never missing */
+    tmpfile = strdup_printf("%s_blob", cachefile);
+    unlink(tmpfile);
+    retval = link(blobfile, tmpfile);
+    if (retval == 0) {
+        retval = rename(tmpfile, cachefile);
+        if (retval != 0)
+            unlink(tmpfile);
+    }
     if (retval != 0) {
-        fprintf(stderr, "unable to patch\n");
-        fclose(sourcefile_fh);
-        fclose(patchfile_fh);
-        fclose(targetfile_fh);
-        return -1;
+        fprintf(stderr, "cannot replace %s by a link to %s\n", cachefile,
+                blobfile);
     }
+    free(tmpfile);
+    free(blobfile);
+    free(cachefile);
 
-    fclose(sourcefile_fh);
-    fclose(patchfile_fh);
-    fclose(targetfile_fh);
+    return retval == 0 ? 0 : -1;
+}
 
-    return 0;
+/*
+ * removes the blob with the content hash if no cached file refers to it
+ * anymore and returns whether it was removed
+ */
+bool filecache_release_blob(const char *filecache_path,
+                            const unsigned char *hash)
+{
+    struct stat     file_info;
+    char           *blobfile;
+    int             retval;
+
+    blobfile = filecache_blob_path(filecache_path, hash);
+    retval = stat(blobfile, &file_info);
+    if (retval != 0 || file_info.st_nlink > 1) {
+        free(blobfile);
+        return false;
+    }
+
+    retval = unlink(blobfile);
+    free(blobfile);
+
+    return retval == 0;
+}
+
+/*
+ * removes all blobs that no cached file refers to anymore and returns the
+ * summed size of the remaining ones
+ */
+uint64_t filecache_sweep_blobs(const char *filecache_path)
+{
+    struct dirent  *ent;
+    struct stat     file_info;
+    char           *blobdir;
+    char           *blobfile;
+    DIR            *dir;
+    uint64_t        sum_size;
+
+    blobdir = strdup_printf("%s/" FILECACHE_BLOBS, filecache_path);
+    dir = opendir(blobdir);
+    if (dir == NULL) {
+        free(blobdir);
+        return 0;
+    }
+
+    sum_size = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        blobfile = strdup_printf("%s/%s", blobdir, ent->d_name);
+        if (stat(blobfile, &file_info) != 0 || !S_ISREG(file_info.st_mode)) {
+            free(blobfile);
+            continue;
+        }
+        if (file_info.st_nlink == 1) {
+            fprintf(stderr, "delete unreferenced blob: %s\n", ent->d_name);
+            if (unlink(blobfile) != 0) {
+                fprintf(stderr, "unlink failed\n");
+            }
+        } else {
+            sum_size += file_info.st_size;
+        }
+        free(blobfile);
+    }
+    closedir(dir);
+    free(blobdir);
+
+    return sum_size;
+}
+
+/*
+ * fetches the patches of a chain in order until there are none left or the
+ * chain was aborted
+ *
+ * the links of all patches are requested before the first download starts,
+ * so that no signed call blocks the downloads that are in flight. Up to
+ * FILECACHE_PATCH_PREFETCH of them are requested at the same time, one with
+ * the session of the caller, which does not need it until the chain is
+ * done, and the others with sessions from the pool. The downloads run in
+ * the multi engine, so up to FILECACHE_PATCH_PREFETCH of them are in flight
+ * at the same time without a thread for each of them. Earlier patches have
+ * the higher priority because they are applied first.
+ */
+static void *filecache_prefetch_worker(void *user_ptr)
+{
+    struct filecache_prefetch *prefetch;
+    pthread_t       helpers[FILECACHE_PATCH_PREFETCH - 1];
+    mfhttp_multi   *multi;
+    char           *url;
+    char           *patchfile;
+    mfpatch        *patch;
+    bool            stop;
+    bool            start;
+    bool            idle;
+    int             num_helpers;
+    int             retval;
+    int             i;
+
+    prefetch = (struct filecache_prefetch *)user_ptr;
+
+    multi = http_multi_create(FILECACHE_PATCH_PREFETCH);
+    if (multi == NULL)
+        fprintf(stderr, "cannot create engine for patch fetching\n");
+
+    num_helpers = 0;
+    for (i = 1; multi != NULL && i < FILECACHE_PATCH_PREFETCH
+         && prefetch->patches[i] != NULL; i++) {
+        if (pthread_create(&(helpers[num_helpers]), NULL,
+                           filecache_link_worker, prefetch) == 0)
+            num_helpers++;
+    }
+    if (multi != NULL)
+        filecache_resolve_links(prefetch, prefetch->conn);
+    for (i = 0; i < num_helpers; i++)
+        pthread_join(helpers[i], NULL);
+
+    while (multi != NULL) {
+        pthread_mutex_lock(&(prefetch->mutex));
+        i = prefetch->next_patch;
+        stop = prefetch->stop;
+        start = !stop && prefetch->patches[i] != NULL
+            && prefetch->in_flight < FILECACHE_PATCH_PREFETCH;
+        if (start) {
+            prefetch->next_patch++;
+            prefetch->in_flight++;
+        }
+        idle = prefetch->in_flight == 0;
+        pthread_mutex_unlock(&(prefetch->mutex));
+
+        if (stop)
+            break;
+
+        if (start) {
+            patch = prefetch->patches[i];
+            url = prefetch->links[i];
+            retval = -1;
+            if (url != NULL) {
+                patchfile = filecache_patch_path(prefetch->filecache_path,
+                                                 prefetch->quickkey, patch);
+                retval = http_multi_get_file(multi, url, patchfile, -i,
+                                             filecache_prefetch_done,
+                                             &(prefetch->fetches[i]));
+                free(patchfile);
+            }
+            if (retval != 0)
+                filecache_prefetch_set(prefetch, i, FILECACHE_PATCH_FAILED);
+            continue;
+        }
+
+        if (idle)
+            break;
+
+        if (http_multi_perform(multi, 100) < 0)
+            break;
+    }
+
+    // downloads that are still running are aborted
+    if (multi != NULL)
+        http_multi_destroy(multi);
+
+    // whatever did not arrive will not arrive anymore
+    pthread_mutex_lock(&(prefetch->mutex));
+    for (i = 0; prefetch->patches[i] != NULL; i++) {
+        if (prefetch->state[i] == FILECACHE_PATCH_PENDING)
+            prefetch->state[i] = FILECACHE_PATCH_FAILED;
+    }
+    pthread_cond_broadcast(&(prefetch->cond));
+    pthread_mutex_unlock(&(prefetch->mutex));
+
+    return NULL;
+}
+
+static void *filecache_link_worker(void *user_ptr)
+{
+    struct filecache_prefetch *prefetch;
+    mfconn         *session;
+
+    prefetch = (struct filecache_prefetch *)user_ptr;
+
+    session = mfconn_acquire(prefetch->conn);
+    if (session == NULL)
+        return NULL;
+
+    // a session whose call failed may have lost track of its key chain
+    if (filecache_resolve_links(prefetch, session) != 0) {
+        mfconn_destroy(session);
+    } else {
+        mfconn_release(session);
+    }
+
+    return NULL;
+}
+
+/*
+ * requests the links of the patches that nobody else requested yet until
+ * there are none left or the chain was aborted
+ *
+ * returns -1 if any of the links could not be retrieved and 0 otherwise
+ */
+static int filecache_resolve_links(struct filecache_prefetch *prefetch,
+                                   mfconn * conn)
+{
+    mfpatch        *patch;
+    char           *link;
+    int             retval;
+    int             i;
+
+    retval = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&(prefetch->mutex));
+        i = prefetch->next_link;
+        patch = prefetch->stop ? NULL : prefetch->patches[i];
+        if (patch != NULL)
+            prefetch->next_link++;
+        pthread_mutex_unlock(&(prefetch->mutex));
+
+        if (patch == NULL)
+            break;
+
+        link = filecache_patch_link(conn, prefetch->quickkey,
+                                    patch_get_source_revision(patch),
+                                    patch_get_target_revision(patch),
+                                    patch_get_hash(patch));
+        if (link == NULL)
+            retval = -1;
+
+        pthread_mutex_lock(&(prefetch->mutex));
+        prefetch->links[i] = link;
+        pthread_mutex_unlock(&(prefetch->mutex));
+    }
+
+    return retval;
+}
+
+static void filecache_prefetch_done(mfhttp * http, int result,
+                                    void *user_ptr)
+{
+    struct filecache_patch_fetch *fetch;
+
+    (void)http;
+
+    fetch = (struct filecache_patch_fetch *)user_ptr;
+    if (result != 0)
+        fprintf(stderr, "download of patch %d failed\n", fetch->index);
+    filecache_prefetch_set(fetch->prefetch, fetch->index,
+                           result == 0 ? FILECACHE_PATCH_READY :
+                           FILECACHE_PATCH_FAILED);
+}
+
+static void filecache_prefetch_set(struct filecache_prefetch *prefetch,
+                                   int i, enum filecache_patch_state state)
+{
+    pthread_mutex_lock(&(prefetch->mutex));
+    prefetch->state[i] = state;
+    prefetch->in_flight--;
+    // later patches cannot be applied anyway
+    if (state == FILECACHE_PATCH_FAILED)
+        prefetch->stop = true;
+    pthread_cond_broadcast(&(prefetch->cond));
+    pthread_mutex_unlock(&(prefetch->mutex));
 }
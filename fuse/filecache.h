@@ -19,15 +19,45 @@
 #ifndef __FUSE_FILECACHE_H__
 #define __FUSE_FILECACHE_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../mfapi/mfconn.h"
+#include "../utils/extents.h"
+#include "overlay.h"
+
+// how many patches of a chain are fetched at the same time
+#define FILECACHE_PATCH_PREFETCH 4
+
+// cached files with the same content are links to one file in this
+// directory of the file cache which is named after the sha256 of the content
+#define FILECACHE_BLOBS "blobs"
+
 int             filecache_open_file(const char *quickkey,
                                     uint64_t local_revision,
                                     uint64_t remote_revision, uint64_t fsize,
                                     const unsigned char *fhash,
                                     const char *filecache, mfconn * conn,
-                                    mode_t mode, bool update);
+                                    mode_t mode, bool update, overlay ** ovl);
 
 int             filecache_upload_patch(const char *quickkey,
                                        uint64_t local_revision,
-                                       const char *filecache, mfconn * conn);
+                                       const char *file_name,
+                                       const unsigned char *source_hash,
+                                       const unsigned char *target_hash,
+                                       extents * dirty, const char *filecache,
+                                       mfconn * conn,
+                                       unsigned char *uploaded_hash,
+                                       char **upload_key);
+
+int             filecache_store_blob(const char *filecache,
+                                     const char *quickkey, uint64_t revision,
+                                     const unsigned char *hash);
+
+bool            filecache_release_blob(const char *filecache,
+                                       const unsigned char *hash);
+
+uint64_t        filecache_sweep_blobs(const char *filecache);
 
 #endif
@@ -42,6 +42,7 @@
 
 #include "hashtbl.h"
 #include "filecache.h"
+#include "overlay.h"
 #include "../mfapi/mfconn.h"
 #include "../mfapi/file.h"
 #include "../mfapi/folder.h"
@@ -56,6 +57,12 @@
  */
 #define NUM_BUCKETS 46656
 
+/*
+ * a second hashtable finds files by their content. It uses the first twelve
+ * bits of the SHA256 and is only kept in memory.
+ */
+#define NUM_HASH_BUCKETS 4096
+
 struct h_entry {
     /*
      * keys are either 13 (folders) or 15 (files) long since the structure
@@ -129,6 +136,8 @@ struct folder_tree {
     char           *filecache;
     uint64_t        bucket_lens[NUM_BUCKETS];
     struct h_entry **buckets[NUM_BUCKETS];
+    uint64_t        hash_bucket_lens[NUM_HASH_BUCKETS];
+    struct h_entry **hash_buckets[NUM_HASH_BUCKETS];
     struct h_entry  root;
 };
 
@@ -148,6 +157,10 @@ static struct h_entry *folder_tree_add_folder(folder_tree * tree,
                                               mffolder * folder,
                                               struct h_entry *new_parent);
 static void     folder_tree_remove(folder_tree * tree, const char *key);
+static int      folder_tree_hash_index_add(folder_tree * tree,
+                                           struct h_entry *entry);
+static void     folder_tree_hash_index_remove(folder_tree * tree,
+                                              struct h_entry *entry);
 static bool     folder_tree_is_parent_of(struct h_entry *parent,
                                          struct h_entry *child);
 static bool     is_valid_cache_filename(const char *name, char key[],
@@ -164,6 +177,19 @@ static int      folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
                                              const char *key);
 static int      folder_tree_update_folder_info(folder_tree * tree,
                                                mfconn * conn, const char *key);
+static int      folder_tree_apply_file_info(folder_tree * tree, mfconn * conn,
+                                            const char *key, mffile * file);
+static int      folder_tree_apply_folder_info(folder_tree * tree,
+                                              mfconn * conn, const char *key,
+                                              mffolder * folder);
+static void     folder_tree_update_file_infos(folder_tree * tree,
+                                              mfconn * conn,
+                                              const char **keys,
+                                              int num_keys);
+static void     folder_tree_update_folder_infos(folder_tree * tree,
+                                                mfconn * conn,
+                                                const char **keys,
+                                                int num_keys);
 
 /* persistant storage file layout:
  *
@@ -408,6 +434,12 @@ folder_tree    *folder_tree_load(FILE * stream, const char *filecache)
         }
         tree->buckets[bucket_id][tree->bucket_lens[bucket_id] - 1] =
             ordered_entries[i];
+
+        /* files are also found by their content */
+        if (ordered_entries[i]->atime != 0
+            && folder_tree_hash_index_add(tree, ordered_entries[i]) != 0) {
+            return NULL;
+        }
     }
 
     free(ordered_entries);
@@ -442,6 +474,11 @@ static void folder_tree_free_entries(folder_tree * tree)
         tree->buckets[i] = NULL;
         tree->bucket_lens[i] = 0;
     }
+    for (i = 0; i < NUM_HASH_BUCKETS; i++) {
+        free(tree->hash_buckets[i]);
+        tree->hash_buckets[i] = NULL;
+        tree->hash_bucket_lens[i] = 0;
+    }
     free(tree->root.children);
     tree->root.children = NULL;
     tree->root.num_children = 0;
@@ -727,33 +764,53 @@ int folder_tree_readdir(folder_tree * tree, mfconn * conn, const char *path,
     return 0;
 }
 
-int folder_tree_tmp_open(folder_tree * tree)
+/*
+ * looks up the file at path and returns what a patch of its cached revision
+ * has to be based on: its key, the local revision and the hash of that
+ * revision if it is known (otherwise source_hash is set to NULL)
+ */
+int folder_tree_path_get_patch_source(folder_tree * tree, mfconn * conn,
+                                      const char *path, const char **key,
+                                      uint64_t * revision,
+                                      const unsigned char **source_hash)
 {
-    char           *tmpfilename;
-    int             fd;
-
-    tmpfilename = strdup_printf("%s/tmp_XXXXXX", tree->filecache);
+    struct h_entry *entry;
 
-    fd = mkstemp(tmpfilename);
+    entry = folder_tree_lookup_path(tree, conn, path);
+    /* either file not found or found entry is not a file */
+    if (entry == NULL || entry->atime == 0) {
+        return -ENOENT;
+    }
 
-    // this will cause the file to be removed immediately after it is closed
-    unlink(tmpfilename);
+    *key = entry->key;
+    *revision = entry->local_revision;
 
-    if (fd < 0) {
-        fprintf(stderr, "mkstemp failed\n");
-        return -1;
+    /* the stored hash belongs to the remote revision and the cached copy of
+     * that revision was checked against it when it was retrieved, so it only
+     * has to be computed again if the local revision is an older one */
+    if (entry->local_revision == entry->remote_revision) {
+        *source_hash = entry->hash;
+    } else {
+        *source_hash = NULL;
     }
 
-    free(tmpfilename);
-
-    return fd;
+    return 0;
 }
 
-int folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
-                             const char *path)
+/*
+ * makes localfile the cached copy of the remote revision of path, if the
+ * remote content has the given hash
+ *
+ * this is for content that was just uploaded from localfile and thus does
+ * not have to be downloaded again. Older cached revisions are left for the
+ * cache cleanup because open overlays might still be based on them.
+ */
+int folder_tree_adopt_file(folder_tree * tree, mfconn * conn,
+                           const char *path, const char *localfile,
+                           const unsigned char *hash)
 {
     struct h_entry *entry;
-    int             retval;
+    char           *cachefile;
 
     entry = folder_tree_lookup_path(tree, conn, path);
     /* either file not found or found entry is not a file */
@@ -761,19 +818,40 @@ int folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
         return -ENOENT;
     }
 
-    retval = filecache_upload_patch(entry->key, entry->local_revision,
-                                    tree->filecache, conn);
+    if (memcmp(entry->hash, hash, SHA256_DIGEST_LENGTH) != 0) {
+        fprintf(stderr, "remote content of %s differs from the upload\n",
+                path);
+        return -1;
+    }
 
-    if (retval != 0) {
-        fprintf(stderr, "filecache_upload_patch failed\n");
+    if (entry->local_revision == entry->remote_revision) {
+        /* the current revision is already cached */
+        return 0;
+    }
+
+    cachefile = strdup_printf("%s/%s_%" PRIu64, tree->filecache, entry->key,
+                              entry->remote_revision);
+    if (rename(localfile, cachefile) != 0) {
+        fprintf(stderr, "cannot move %s to %s\n", localfile, cachefile);
+        free(cachefile);
         return -1;
     }
+    free(cachefile);
+
+    filecache_store_blob(tree->filecache, entry->key, entry->remote_revision,
+                         hash);
+
+    entry->local_revision = entry->remote_revision;
+    entry->atime = time(NULL);
 
     return 0;
 }
 
+/*
+ * see filecache_open_file() for the meaning of the return value and ovl
+ */
 int folder_tree_open_file(folder_tree * tree, mfconn * conn, const char *path,
-                          mode_t mode, bool update)
+                          mode_t mode, bool update, overlay ** ovl)
 {
     struct h_entry *entry;
     int             retval;
@@ -790,7 +868,7 @@ int folder_tree_open_file(folder_tree * tree, mfconn * conn, const char *path,
     retval = filecache_open_file(entry->key, entry->local_revision,
                                  entry->remote_revision, entry->fsize,
                                  entry->hash, tree->filecache, conn, mode,
-                                 update);
+                                 update, ovl);
     if (retval == -1) {
         fprintf(stderr, "filecache_open_file failed\n");
         return -1;
@@ -989,6 +1067,8 @@ static struct h_entry *folder_tree_add_file(folder_tree * tree, mffile * file,
     old_entry = folder_tree_lookup_key(tree, key);
     if (old_entry != NULL) {
         old_revision = old_entry->local_revision;
+        /* the content might change, so the entry is indexed anew */
+        folder_tree_hash_index_remove(tree, old_entry);
     }
 
     new_entry = folder_tree_allocate_entry(tree, key, new_parent);
@@ -1012,6 +1092,11 @@ static struct h_entry *folder_tree_add_file(folder_tree * tree, mffile * file,
     if (new_entry->atime == 0)
         new_entry->atime = 1;
 
+    if (folder_tree_hash_index_add(tree, new_entry) != 0) {
+        fprintf(stderr, "folder_tree_hash_index_add failed\n");
+        return NULL;
+    }
+
     return new_entry;
 }
 
@@ -1079,6 +1164,41 @@ static struct h_entry *folder_tree_add_folder(folder_tree * tree,
     return new_entry;
 }
 
+struct folder_tree_rebuild {
+    folder_tree    *tree;
+    struct h_entry *parent;
+};
+
+/*
+ * adds one entry of the remote content of a folder as its child
+ *
+ * called by mfconn_api_folder_get_content_stream() from any of its threads
+ * but only one at a time, while the thread that rebuilds the folder waits
+ */
+static int folder_tree_rebuild_add(mffolder * folder, mffile * file,
+                                   void *user_ptr)
+{
+    struct folder_tree_rebuild *rebuild;
+
+    rebuild = (struct folder_tree_rebuild *)user_ptr;
+
+    if (folder != NULL) {
+        if (folder_get_key(folder) == NULL) {
+            fprintf(stderr, "folder_get_key returned NULL\n");
+        } else {
+            folder_tree_add_folder(rebuild->tree, folder, rebuild->parent);
+        }
+    } else {
+        if (file_get_key(file) == NULL) {
+            fprintf(stderr, "file_get_key returned NULL\n");
+        } else {
+            folder_tree_add_file(rebuild->tree, file, rebuild->parent);
+        }
+    }
+
+    return 0;
+}
+
 /*
  * given a h_entry struct of a folder, this function gets the remote content
  * of that folder and fills its children
@@ -1086,11 +1206,9 @@ static struct h_entry *folder_tree_add_folder(folder_tree * tree,
 static int folder_tree_rebuild_helper(folder_tree * tree, mfconn * conn,
                                       struct h_entry *curr_entry)
 {
+    struct folder_tree_rebuild rebuild;
+    int             content_mask;
     int             retval;
-    mffolder      **folder_result;
-    mffile        **file_result;
-    int             i;
-    const char     *key;
 
     /*
      * free the old children array of this folder to make sure that any
@@ -1109,62 +1227,19 @@ static int folder_tree_rebuild_helper(folder_tree * tree, mfconn * conn,
     curr_entry->children = NULL;
     curr_entry->num_children = 0;
 
-    /* first folders */
-    folder_result = NULL;
-    retval =
-        mfconn_api_folder_get_content(conn, 0, curr_entry->key, &folder_result,
-                                      NULL);
-    if (retval != 0) {
-        fprintf(stderr, "folder/get_content failed\n");
-        if (folder_result != NULL) {
-            for (i = 0; folder_result[i] != NULL; i++) {
-                free(folder_result[i]);
-            }
-            free(folder_result);
-        }
-        return -1;
-    }
-
-    for (i = 0; folder_result[i] != NULL; i++) {
-        key = folder_get_key(folder_result[i]);
-        if (key == NULL) {
-            fprintf(stderr, "folder_get_key returned NULL\n");
-            folder_free(folder_result[i]);
-            continue;
-        }
-        folder_tree_add_folder(tree, folder_result[i], curr_entry);
-        folder_free(folder_result[i]);
-    }
-    free(folder_result);
-
-    /* then files */
-    file_result = NULL;
-    retval =
-        mfconn_api_folder_get_content(conn, 1, curr_entry->key, NULL,
-                                      &file_result);
+    /* folders and files arrive together and in no particular order */
+    rebuild.tree = tree;
+    rebuild.parent = curr_entry;
+    content_mask = MFCONN_FOLDER_CONTENT_FOLDERS | MFCONN_FOLDER_CONTENT_FILES;
+    retval = mfconn_api_folder_get_content_stream(conn, curr_entry->key,
+                                                  content_mask,
+                                                  folder_tree_rebuild_add,
+                                                  &rebuild);
     if (retval != 0) {
         fprintf(stderr, "folder/get_content failed\n");
-        if (file_result != NULL) {
-            for (i = 0; file_result[i] != NULL; i++) {
-                file_free(file_result[i]);
-            }
-            free(file_result);
-        }
         return -1;
     }
 
-    for (i = 0; file_result[i] != NULL; i++) {
-        key = file_get_key(file_result[i]);
-        if (key == NULL) {
-            fprintf(stderr, "file_get_key returned NULL\n");
-            file_free(file_result[i]);
-            continue;
-        }
-        folder_tree_add_file(tree, file_result[i], curr_entry);
-        file_free(file_result[i]);
-    }
-    free(file_result);
-
     /* since the children have been updated, no update is needed anymore */
     curr_entry->local_revision = curr_entry->remote_revision;
 
@@ -1257,12 +1332,94 @@ static void folder_tree_remove(folder_tree * tree, const char *key)
         }
     }
 
+    /* files are also referenced by the content index */
+    if (entry->atime != 0)
+        folder_tree_hash_index_remove(tree, entry);
+
     /* remove its possible children */
     free(entry->children);
     /* remove entry */
     free(entry);
 }
 
+static int folder_tree_hash_bucket(const unsigned char *hash)
+{
+    return (hash[0] << 4) | (hash[1] >> 4);
+}
+
+static int folder_tree_hash_index_add(folder_tree * tree,
+                                      struct h_entry *entry)
+{
+    int             bucket_id;
+
+    bucket_id = folder_tree_hash_bucket(entry->hash);
+    tree->hash_bucket_lens[bucket_id]++;
+    tree->hash_buckets[bucket_id] =
+        (struct h_entry **)realloc(tree->hash_buckets[bucket_id],
+                                   tree->hash_bucket_lens[bucket_id] *
+                                   sizeof(struct h_entry *));
+    if (tree->hash_buckets[bucket_id] == NULL) {
+        fprintf(stderr, "realloc failed\n");
+        return -1;
+    }
+    tree->hash_buckets[bucket_id][tree->hash_bucket_lens[bucket_id] - 1] =
+        entry;
+
+    return 0;
+}
+
+/* When trying to remove an entry that is not indexed, nothing happens */
+static void folder_tree_hash_index_remove(folder_tree * tree,
+                                          struct h_entry *entry)
+{
+    int             bucket_id;
+    uint64_t        i;
+
+    bucket_id = folder_tree_hash_bucket(entry->hash);
+    for (i = 0; i < tree->hash_bucket_lens[bucket_id]; i++) {
+        if (tree->hash_buckets[bucket_id][i] == entry)
+            break;
+    }
+    if (i == tree->hash_bucket_lens[bucket_id])
+        return;
+
+    /* the order inside a bucket does not matter */
+    tree->hash_bucket_lens[bucket_id]--;
+    tree->hash_buckets[bucket_id][i] =
+        tree->hash_buckets[bucket_id][tree->hash_bucket_lens[bucket_id]];
+    if (tree->hash_bucket_lens[bucket_id] == 0) {
+        free(tree->hash_buckets[bucket_id]);
+        tree->hash_buckets[bucket_id] = NULL;
+    }
+}
+
+/*
+ * returns the key of a file in the account with the given content or NULL
+ * if there is none
+ *
+ * content that is already in the account can be uploaded with upload/instant
+ * without asking upload/check first
+ */
+const char     *folder_tree_lookup_hash(folder_tree * tree,
+                                        const unsigned char *hash,
+                                        uint64_t size)
+{
+    int             bucket_id;
+    uint64_t        i;
+    struct h_entry *entry;
+
+    bucket_id = folder_tree_hash_bucket(hash);
+    for (i = 0; i < tree->hash_bucket_lens[bucket_id]; i++) {
+        entry = tree->hash_buckets[bucket_id][i];
+        if (entry->fsize == size
+            && memcmp(entry->hash, hash, SHA256_DIGEST_LENGTH) == 0) {
+            return entry->key;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * check if a h_entry struct is the parent of another
  *
@@ -1300,8 +1457,6 @@ static int folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
 {
     mffile         *file;
     int             retval;
-    struct h_entry *parent;
-    struct h_entry *new_entry;
 
     file = file_alloc();
 
@@ -1316,6 +1471,22 @@ static int folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
         return 0;
     }
 
+    retval = folder_tree_apply_file_info(tree, conn, key, file);
+
+    file_free(file);
+
+    return retval;
+}
+
+/*
+ * store the fields of a file that were retrieved from the remote
+ */
+static int folder_tree_apply_file_info(folder_tree * tree, mfconn * conn,
+                                       const char *key, mffile * file)
+{
+    struct h_entry *parent;
+    struct h_entry *new_entry;
+
     parent = folder_tree_lookup_key(tree, file_get_parent(file));
     if (parent == NULL) {
         fprintf(stderr, "the parent of %s does not exist yet - retrieve it\n",
@@ -1330,15 +1501,52 @@ static int folder_tree_update_file_info(folder_tree * tree, mfconn * conn,
 
     if (new_entry == NULL) {
         fprintf(stderr, "folder_tree_add_file failed\n");
-        file_free(file);
         return -1;
     }
 
-    file_free(file);
-
     return 0;
 }
 
+/*
+ * update the fields of several files with as few api calls as possible
+ *
+ * files that the batch did not return are asked for one by one, so that a
+ * file is only removed if file/get_info fails for it alone
+ */
+static void folder_tree_update_file_infos(folder_tree * tree, mfconn * conn,
+                                          const char **keys, int num_keys)
+{
+    mffile        **files;
+    int             retval;
+    int             i;
+
+    if (num_keys == 0)
+        return;
+
+    files = NULL;
+    if (num_keys > 1)
+        files = (mffile **) calloc(num_keys, sizeof(mffile *));
+
+    if (files != NULL) {
+        retval = mfconn_api_file_get_info_batch(conn, keys, num_keys, files);
+        if (retval != 0) {
+            fprintf(stderr, "file/get_info for %d files failed\n",
+                    num_keys);
+        }
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        if (files != NULL && files[i] != NULL) {
+            folder_tree_apply_file_info(tree, conn, keys[i], files[i]);
+            file_free(files[i]);
+        } else {
+            folder_tree_update_file_info(tree, conn, keys[i]);
+        }
+    }
+
+    free(files);
+}
+
 /*
  * update the fields of a folder through a call to folder/get_info
  *
@@ -1356,8 +1564,6 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
 {
     mffolder       *folder;
     int             retval;
-    struct h_entry *parent;
-    struct h_entry *new_entry;
 
     if (key != NULL && strcmp(key, "trash") == 0) {
         fprintf(stderr, "cannot get folder info of trash\n");
@@ -1377,6 +1583,22 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
         return 0;
     }
 
+    retval = folder_tree_apply_folder_info(tree, conn, key, folder);
+
+    folder_free(folder);
+
+    return retval;
+}
+
+/*
+ * store the fields of a folder that were retrieved from the remote
+ */
+static int folder_tree_apply_folder_info(folder_tree * tree, mfconn * conn,
+                                         const char *key, mffolder * folder)
+{
+    struct h_entry *parent;
+    struct h_entry *new_entry;
+
     /*
      * folder_tree_update_folder_info might have been called during an
      * device/get_changes call in which case, the parent of that folder might
@@ -1397,15 +1619,83 @@ static int folder_tree_update_folder_info(folder_tree * tree, mfconn * conn,
 
     if (new_entry == NULL) {
         fprintf(stderr, "folder_tree_add_folder failed\n");
-        folder_free(folder);
         return -1;
     }
 
-    folder_free(folder);
-
     return 0;
 }
 
+/*
+ * the folder counterpart of folder_tree_update_file_infos()
+ */
+static void folder_tree_update_folder_infos(folder_tree * tree,
+                                            mfconn * conn, const char **keys,
+                                            int num_keys)
+{
+    mffolder      **folders;
+    int             retval;
+    int             i;
+
+    if (num_keys == 0)
+        return;
+
+    folders = NULL;
+    if (num_keys > 1)
+        folders = (mffolder **) calloc(num_keys, sizeof(mffolder *));
+
+    if (folders != NULL) {
+        retval = mfconn_api_folder_get_info_batch(conn, keys, num_keys,
+                                                  folders);
+        if (retval != 0) {
+            fprintf(stderr, "folder/get_info for %d folders failed\n",
+                    num_keys);
+        }
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        if (folders != NULL && folders[i] != NULL) {
+            folder_tree_apply_folder_info(tree, conn, keys[i], folders[i]);
+            folder_free(folders[i]);
+        } else {
+            folder_tree_update_folder_info(tree, conn, keys[i]);
+        }
+    }
+
+    free(folders);
+}
+
+/*
+ * add key to the keys whose information is to be retrieved unless it is
+ * already among them
+ */
+static void folder_tree_collect_key(const char **keys, int *num_keys,
+                                    const char *key)
+{
+    int             i;
+
+    for (i = 0; i < *num_keys; i++) {
+        if (strcmp(keys[i], key) == 0)
+            return;
+    }
+    keys[*num_keys] = key;
+    (*num_keys)++;
+}
+
+static void folder_tree_forget_key(const char **keys, int *num_keys,
+                                   const char *key)
+{
+    int             i;
+
+    for (i = 0; i < *num_keys; i++) {
+        if (strcmp(keys[i], key) == 0) {
+            memmove(keys + i, keys + i + 1,
+                    (*num_keys - i - 1) * sizeof(char *));
+            (*num_keys)--;
+            return;
+        }
+    }
+}
+
 /*
  * ask the remote if there are changes after the locally stored revision
  *
@@ -1424,6 +1714,10 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
     struct h_entry *tmp_entry;
     const char     *key;
     uint64_t        revision;
+    const char    **folder_keys;
+    const char    **file_keys;
+    int             num_folder_keys;
+    int             num_file_keys;
 
     if (!expect_changes) {
         retval = mfconn_api_device_get_status(conn, &revision_remote);
@@ -1452,6 +1746,12 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
     /*
      * changes have to be applied in the right order but the result of
      * mfconn_api_device_get_changes is already sorted by revision
+     *
+     * the information of updated files and folders is retrieved in batches
+     * after all changes were seen. Since that information is the current
+     * one, only the last change of every key matters: a removal drops
+     * earlier updates of the key and an update after a removal brings the
+     * key back.
      */
 
     changes = NULL;
@@ -1462,12 +1762,27 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
         return;
     }
 
+    for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) ;
+    folder_keys = (const char **)malloc(sizeof(char *) * (i + 1));
+    file_keys = (const char **)malloc(sizeof(char *) * (i + 1));
+    if (folder_keys == NULL || file_keys == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        free(folder_keys);
+        free(file_keys);
+        free(changes);
+        return;
+    }
+    num_folder_keys = 0;
+    num_file_keys = 0;
+
     for (i = 0; changes[i].change != MFCONN_DEVICE_CHANGE_END; i++) {
         key = changes[i].key;
         revision = changes[i].revision;
         switch (changes[i].change) {
             case MFCONN_DEVICE_CHANGE_DELETED_FOLDER:
             case MFCONN_DEVICE_CHANGE_DELETED_FILE:
+                folder_tree_forget_key(folder_keys, &num_folder_keys, key);
+                folder_tree_forget_key(file_keys, &num_file_keys, key);
                 folder_tree_remove(tree, changes[i].key);
                 break;
             case MFCONN_DEVICE_CHANGE_UPDATED_FOLDER:
@@ -1492,7 +1807,7 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
                  * new remote revision is higher than the local revision and
                  * will also fetch the content if this is the case
                  * */
-                folder_tree_update_folder_info(tree, conn, changes[i].key);
+                folder_tree_collect_key(folder_keys, &num_folder_keys, key);
                 break;
             case MFCONN_DEVICE_CHANGE_UPDATED_FILE:
                 /* ignore files updated in trash */
@@ -1506,13 +1821,19 @@ void folder_tree_update(folder_tree * tree, mfconn * conn, bool expect_changes)
                     break;
                 }
                 /* if a file changed, update its info */
-                folder_tree_update_file_info(tree, conn, key);
+                folder_tree_collect_key(file_keys, &num_file_keys, key);
                 break;
             case MFCONN_DEVICE_CHANGE_END:
                 break;
         }
     }
 
+    /* folders first so that the parents of the files exist */
+    folder_tree_update_folder_infos(tree, conn, folder_keys, num_folder_keys);
+    folder_tree_update_file_infos(tree, conn, file_keys, num_file_keys);
+    free(folder_keys);
+    free(file_keys);
+
     /*
      * we have to manually check the root because it never shows up in the
      * results from device_get_changes
@@ -1805,6 +2126,10 @@ static bool is_valid_cache_filename(const char *name, char key[],
  *      - if no, delete
  *  - once all files in the cache have been processed this way, check if
  *    the sum of their sizes is greater than X and delete the oldest
+ *
+ * files with the same content are links to a shared blob (see
+ * filecache_store_blob()) whose size only counts once. Blobs are removed
+ * together with the last file that refers to them.
  */
 void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
 {
@@ -1821,6 +2146,8 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
     size_t          i;
     uint64_t        sum_size;
     struct h_entry **cachefiles;
+    struct stat     file_info;
+    uint64_t        blobs_size;
 
     // from the readdir_r man page
     name_max = pathconf(tree->filecache, _PC_NAME_MAX);
@@ -1852,7 +2179,8 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
             break;
         }
         if (strcmp(entryp->d_name, ".") == 0 ||
-            strcmp(entryp->d_name, "..") == 0)
+            strcmp(entryp->d_name, "..") == 0 ||
+            strcmp(entryp->d_name, FILECACHE_BLOBS) == 0)
             continue;
 
         if (!is_valid_cache_filename(entryp->d_name, key, &revision)) {
@@ -1934,15 +2262,25 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
     free(entryp);
     closedir(dirp);
 
+    // files that were deleted above may have been the last to refer to a
+    // blob
+    blobs_size = filecache_sweep_blobs(tree->filecache);
+
     // return if there are no files in the cache
     if (num_cachefiles == 0)
         return;
 
     // now calculate the sum of valid files in the cache and check whether it
-    // is larger than allowed
-    sum_size = 0;
+    // is larger than allowed. Files that share a blob are counted with it.
+    sum_size = blobs_size;
     for (i = 0; i < num_cachefiles; i++) {
-        sum_size += cachefiles[i]->fsize;
+        filepath = strdup_printf("%s/%s_%" PRIu64, tree->filecache,
+                                 cachefiles[i]->key,
+                                 cachefiles[i]->remote_revision);
+        if (stat(filepath, &file_info) != 0 || file_info.st_nlink == 1) {
+            sum_size += cachefiles[i]->fsize;
+        }
+        free(filepath);
     }
 
     // if the summed size is below the allowed, return
@@ -1960,13 +2298,19 @@ void folder_tree_cleanup_filecache(folder_tree * tree, uint64_t allowed_size)
                 entry->key, entry->remote_revision);
         filepath = strdup_printf("%s/%s_%" PRIu64, tree->filecache, entry->key,
                                  entry->remote_revision);
+        if (stat(filepath, &file_info) != 0)
+            file_info.st_nlink = 1;
         retval = unlink(filepath);
         if (retval != 0) {
             fprintf(stderr, "unlink failed\n");
         }
         entry->local_revision = 0;
         free(filepath);
-        sum_size -= entry->fsize;
+        // space is only freed once no other file refers to the content
+        if (file_info.st_nlink == 1
+            || filecache_release_blob(tree->filecache, entry->hash)) {
+            sum_size -= entry->fsize;
+        }
     }
 
     free(cachefiles);
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 
 #include "../mfapi/mfconn.h"
+#include "overlay.h"
 
 typedef struct folder_tree folder_tree;
 
@@ -77,11 +78,22 @@ bool            folder_tree_path_is_file(folder_tree * tree, mfconn * conn,
 
 int             folder_tree_open_file(folder_tree * tree, mfconn * conn,
                                       const char *path, mode_t mode,
-                                      bool update);
+                                      bool update, overlay ** ovl);
 
-int             folder_tree_tmp_open(folder_tree * tree);
-
-int             folder_tree_upload_patch(folder_tree * tree, mfconn * conn,
-                                         const char *path);
+int             folder_tree_path_get_patch_source(folder_tree * tree,
+                                                  mfconn * conn,
+                                                  const char *path,
+                                                  const char **key,
+                                                  uint64_t * revision,
+                                                  const unsigned char
+                                                  **source_hash);
+
+const char     *folder_tree_lookup_hash(folder_tree * tree,
+                                        const unsigned char *hash,
+                                        uint64_t size);
+
+int             folder_tree_adopt_file(folder_tree * tree, mfconn * conn,
+                                       const char *path, const char *localfile,
+                                       const unsigned char *hash);
 
 #endif
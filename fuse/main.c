@@ -38,10 +38,14 @@
 #include <pthread.h>
 
 #include "../mfapi/mfconn.h"
+#include "../mfapi/request.h"
 #include "hashtbl.h"
 #include "operations.h"
+#include "uploadqueue.h"
+#include "../utils/http.h"
 #include "../utils/strings.h"
 #include "../utils/stringv.h"
+#include "../utils/xdelta3.h"
 
 enum {
     KEY_HELP,
@@ -55,6 +59,13 @@ struct mediafirefs_user_options {
     char           *server;
     int             app_id;
     char           *api_key;
+    int             upload_workers;
+    int             dirty_limit;
+    int             upload_delay;
+    int             upload_units;
+    int             upload_limit;
+    int             api_rate;
+    char           *patch_compression;
 };
 
 static struct fuse_operations mediafirefs_oper = {
@@ -85,7 +96,7 @@ static struct fuse_operations mediafirefs_oper = {
     .readdir = mediafirefs_readdir,
     .releasedir = mediafirefs_releasedir,
     .fsyncdir = mediafirefs_fsyncdir,
-//  .init = mediafirefs_init,
+    .init = mediafirefs_init,
     .destroy = mediafirefs_destroy,
     .access = mediafirefs_access,
     .create = mediafirefs_create,
@@ -108,6 +119,24 @@ static void usage(const char *progname)
             "    --server domain        server domain\n"
             "    -i, --app-id id        App ID\n"
             "    -k, --api-key key      API Key\n"
+            "    --upload-workers num   number of parallel uploads\n"
+            "                           (default: 2)\n"
+            "    --dirty-limit MiB      block writes while more data is\n"
+            "                           waiting to be uploaded\n"
+            "                           (default: 1024, 0 means no limit)\n"
+            "    --upload-delay sec     wait for further modifications\n"
+            "                           before uploading a file\n"
+            "                           (default: 5)\n"
+            "    --upload-units num     number of parts of a single file\n"
+            "                           that are uploaded in parallel\n"
+            "                           (default: 4)\n"
+            "    --upload-limit KiB/s   bandwidth shared by all uploads\n"
+            "                           (default: 0 which means no limit)\n"
+            "    --api-rate num         api calls per second at most\n"
+            "                           (default: 0 which means no limit)\n"
+            "    --patch-compression c  secondary compression of uploaded\n"
+            "                           patches: none, djw, fgk or lzma\n"
+            "                           (default: none)\n"
             "\n"
             "Notice that long options are separated from their arguments by\n"
             "a space and not an equal sign.\n" "\n", progname);
@@ -258,6 +287,20 @@ static void parse_arguments(int *argc, char ***argv,
         {"-k %s", offsetof(struct mediafirefs_user_options, api_key), 0},
         {"--api-key %s", offsetof(struct mediafirefs_user_options, api_key),
          0},
+        {"--upload-workers %d",
+         offsetof(struct mediafirefs_user_options, upload_workers), 0},
+        {"--dirty-limit %d",
+         offsetof(struct mediafirefs_user_options, dirty_limit), 0},
+        {"--upload-delay %d",
+         offsetof(struct mediafirefs_user_options, upload_delay), 0},
+        {"--upload-units %d",
+         offsetof(struct mediafirefs_user_options, upload_units), 0},
+        {"--upload-limit %d",
+         offsetof(struct mediafirefs_user_options, upload_limit), 0},
+        {"--api-rate %d",
+         offsetof(struct mediafirefs_user_options, api_rate), 0},
+        {"--patch-compression %s",
+         offsetof(struct mediafirefs_user_options, patch_compression), 0},
         FUSE_OPT_END
     };
 
@@ -279,9 +322,31 @@ static void parse_arguments(int *argc, char ***argv,
     *argv = args_snd.argv;
 }
 
+static int set_patch_compression(const char *name)
+{
+    enum xdelta3_secondary secondary;
+
+    if (strcmp(name, "none") == 0) {
+        secondary = XDELTA3_SECONDARY_NONE;
+    } else if (strcmp(name, "djw") == 0) {
+        secondary = XDELTA3_SECONDARY_DJW;
+    } else if (strcmp(name, "fgk") == 0) {
+        secondary = XDELTA3_SECONDARY_FGK;
+    } else if (strcmp(name, "lzma") == 0) {
+        secondary = XDELTA3_SECONDARY_LZMA;
+    } else {
+        fprintf(stderr, "unknown patch compression %s\n", name);
+        return -1;
+    }
+
+    return xdelta3_set_secondary(secondary);
+}
+
 static void connect_mf(struct mediafirefs_user_options *options,
                        mfconn ** conn)
 {
+    char           *session_file;
+
     if (options->app_id == -1) {
         options->app_id = 42709;
     }
@@ -290,9 +355,13 @@ static void connect_mf(struct mediafirefs_user_options *options,
         options->server = "www.mediafire.com";
     }
 
-    *conn = mfconn_create(options->server, options->username,
+    // the session of the last mount is continued if it is still valid
+    session_file = mfconn_session_file(options->server, options->username,
+                                       options->app_id);
+    *conn = mfconn_resume(options->server, options->username,
                           options->password, options->app_id,
-                          options->api_key, 3);
+                          options->api_key, 3, session_file);
+    free(session_file);
 
     if (*conn == NULL) {
         fprintf(stderr, "Cannot establish connection\n");
@@ -392,7 +461,7 @@ static void setup_conf_dir(char **configfile)
 }
 
 static void setup_cache_dir(const char *ekey, char **dircache,
-                            char **filecache)
+                            char **filecache, char **uploaddir)
 {
     const char     *homedir;
     const char     *cachedir;
@@ -447,6 +516,13 @@ static void setup_cache_dir(const char *ekey, char **dircache,
         exit(1);
     }
 
+    *uploaddir = strdup_printf("%s/uploads", usercachedir);
+    if (mkdir(*uploaddir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        fprintf(stderr, "cannot create %s\n", *uploaddir);
+        exit(1);
+    }
+
     free((void *)cachedir);
     free((void *)usercachedir);
 }
@@ -458,7 +534,8 @@ int main(int argc, char *argv[])
     struct mediafirefs_context_private *ctx;
 
     struct mediafirefs_user_options options = {
-        NULL, NULL, NULL, NULL, -1, NULL
+        NULL, NULL, NULL, NULL, -1, NULL, 2, 1024, 5,
+        MFCONN_UPLOAD_PARALLEL_UNITS, 0, 0, "none"
     };
 
     ctx = calloc(1, sizeof(struct mediafirefs_context_private));
@@ -476,20 +553,42 @@ int main(int argc, char *argv[])
         options.password = string_line_from_stdin(true);
     }
 
+    // the limit already applies to the login
+    if (options.api_rate > 0)
+        mfapi_request_set_rate_limit(options.api_rate);
+
     connect_mf(&options, &(ctx->conn));
 
     setup_cache_dir(mfconn_get_ekey(ctx->conn), &(ctx->dircache),
-                    &(ctx->filecache));
+                    &(ctx->filecache), &(ctx->uploaddir));
 
     open_hashtbl(ctx->dircache, ctx->filecache, ctx->conn, &(ctx->tree));
 
+    pthread_mutex_init(&(ctx->mutex), NULL);
+
+    if (options.upload_limit > 0)
+        http_set_upload_limit((uint64_t) options.upload_limit * 1024);
+
+    if (set_patch_compression(options.patch_compression) != 0)
+        exit(1);
+
+    // the workers are only started in mediafirefs_init
+    ctx->uploads = uploadqueue_create(ctx->uploaddir, ctx->filecache,
+                                      ctx->tree, ctx->conn, &(ctx->mutex),
+                                      options.upload_workers,
+                                      (uint64_t) options.dirty_limit
+                                      * 1024 * 1024, options.upload_delay,
+                                      options.upload_units);
+    if (ctx->uploads == NULL) {
+        fprintf(stderr, "cannot create upload queue\n");
+        exit(1);
+    }
+
     ctx->sv_writefiles = stringv_alloc();
     ctx->sv_readonlyfiles = stringv_alloc();
     ctx->last_status_check = 0;
     ctx->interval_status_check = 60;    // TODO: make this configurable
 
-    pthread_mutex_init(&(ctx->mutex), NULL);
-
     ret = fuse_main(argc, argv, &mediafirefs_oper, ctx);
 
     for (i = 0; i < argc; i++) {
@@ -500,6 +599,7 @@ int main(int argc, char *argv[])
     free(ctx->configfile);
     free(ctx->dircache);
     free(ctx->filecache);
+    free(ctx->uploaddir);
     stringv_free(ctx->sv_writefiles);
     stringv_free(ctx->sv_readonlyfiles);
     pthread_mutex_destroy(&(ctx->mutex));
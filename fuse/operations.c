@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <fuse/fuse_common.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdbool.h>
 #include <time.h>
@@ -45,7 +46,11 @@
 #include "../mfapi/apicalls.h"
 #include "../utils/stringv.h"
 #include "../utils/hash.h"
+#include "../utils/extents.h"
+#include "../utils/http.h"
 #include "hashtbl.h"
+#include "overlay.h"
+#include "uploadqueue.h"
 #include "operations.h"
 
 /* what you can safely assume about requests to your filesystem
@@ -105,8 +110,90 @@ struct mediafirefs_openfile {
     bool            is_readonly;
     // whether or not to do a new file upload when closing
     bool            is_local;
+    // sha256 of the data written so far, only valid as long as all writes
+    // were sequential and started at offset zero
+    SHA256_CTX      hash_ctx;
+    uint64_t        hash_offset;
+    bool            hash_valid;
+    // writable files that also exist remotely are accessed through an
+    // overlay on top of the cached revision which also tracks the written
+    // byte ranges
+    overlay        *ovl;
+    // whether an upload has to be queued when closing even if nothing was
+    // written through this handle because the file was truncated or its
+    // previous upload was taken back from the queue
+    bool            must_upload;
+    // whether the written byte ranges of the overlay are incomplete
+    bool            dirty_unknown;
+    // when the previous upload that was taken back was first queued
+    time_t          queued_since;
+    // for files that only exist locally: the file in the upload queue
+    // directory the content is written to
+    char           *tmpfile;
+    // the number of bytes this handle added to the modifications: the growth
+    // of the written ranges of the overlay or of the local file
+    uint64_t        written;
 };
 
+/*
+ * if the file content was written sequentially from the start, the hash
+ * collected during the write calls covers the whole file and doesn't have to
+ * be computed again
+ *
+ * returns true and stores the hash and file size if this is the case and
+ * false otherwise
+ */
+static bool mediafirefs_openfile_get_hash(struct mediafirefs_openfile
+                                          *openfile, unsigned char *hash,
+                                          uint64_t * size)
+{
+    struct stat     file_info;
+
+    if (!openfile->hash_valid)
+        return false;
+
+    if (fstat(openfile->fd, &file_info) != 0) {
+        fprintf(stderr, "fstat failed\n");
+        return false;
+    }
+
+    if ((uint64_t) file_info.st_size != openfile->hash_offset)
+        return false;
+
+    SHA256_Final(hash, &(openfile->hash_ctx));
+    openfile->hash_valid = false;
+
+    if (size != NULL)
+        *size = openfile->hash_offset;
+
+    return true;
+}
+
+/*
+ * queues the upload of the complete <key>_<rev>_new file of path
+ */
+static int mediafirefs_queue_patch(struct mediafirefs_context_private *ctx,
+                                   const char *path,
+                                   const unsigned char *hash,
+                                   extents * dirty, time_t since)
+{
+    const char     *quickkey;
+    const unsigned char *source_hash;
+    uint64_t        revision;
+    int             retval;
+
+    retval = folder_tree_path_get_patch_source(ctx->tree, ctx->conn, path,
+                                               &quickkey, &revision,
+                                               &source_hash);
+    if (retval != 0) {
+        fprintf(stderr, "folder_tree_path_get_patch_source failed\n");
+        return -1;
+    }
+
+    return uploadqueue_add_patch(ctx->uploads, path, quickkey, revision,
+                                 source_hash, hash, dirty, since);
+}
+
 int mediafirefs_getattr(const char *path, struct stat *stbuf)
 {
     /*
@@ -130,6 +217,11 @@ int mediafirefs_getattr(const char *path, struct stat *stbuf)
 
     retval = folder_tree_getattr(ctx->tree, ctx->conn, path, stbuf);
 
+    // pending uploads are not reflected by the directory tree yet
+    if (uploadqueue_getattr(ctx->uploads, path, stbuf, retval == 0)) {
+        retval = 0;
+    }
+
     if (retval != 0 && stringv_mem(ctx->sv_writefiles, path)) {
         stbuf->st_uid = geteuid();
         stbuf->st_gid = getegid();
@@ -159,6 +251,9 @@ int mediafirefs_readdir(const char *path, void *buf, fuse_fill_dir_t filldir,
 
     pthread_mutex_lock(&(ctx->mutex));
     retval = folder_tree_readdir(ctx->tree, ctx->conn, path, buf, filldir);
+    if (retval == 0) {
+        uploadqueue_readdir(ctx->uploads, path, buf, filldir);
+    }
     pthread_mutex_unlock(&(ctx->mutex));
 
     return retval;
@@ -168,9 +263,13 @@ void mediafirefs_destroy(void *user_ptr)
 {
     FILE           *fd;
     struct mediafirefs_context_private *ctx;
+    struct http_stats stats;
 
     ctx = (struct mediafirefs_context_private *)user_ptr;
 
+    // let running uploads finish, all others are resumed on the next mount
+    uploadqueue_destroy(ctx->uploads);
+
     pthread_mutex_lock(&(ctx->mutex));
 
     fprintf(stderr, "storing hashtable\n");
@@ -191,6 +290,13 @@ void mediafirefs_destroy(void *user_ptr)
 
     mfconn_destroy(ctx->conn);
 
+    http_get_stats(&stats);
+    fprintf(stderr, "%" PRIu64 " requests over %" PRIu64 " connections, %"
+            PRIu64 " of %" PRIu64 " handles reused\n", stats.requests,
+            stats.connections, stats.handles_reused,
+            stats.handles_reused + stats.handles_created);
+    http_cleanup();
+
     pthread_mutex_unlock(&(ctx->mutex));
 }
 
@@ -306,6 +412,7 @@ int mediafirefs_unlink(const char *path)
 {
     const char     *key;
     int             retval;
+    int             is_queued;
     struct mediafirefs_context_private *ctx;
 
     ctx = fuse_get_context()->private_data;
@@ -320,7 +427,19 @@ int mediafirefs_unlink(const char *path)
      * because getattr was called before and already made sure
      */
 
+    // pending uploads of the file are not needed anymore
+    is_queued = uploadqueue_cancel(ctx->uploads, path);
+    if (is_queued < 0) {
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -EIO;
+    }
+
     key = folder_tree_path_get_key(ctx->tree, ctx->conn, path);
+    if (key == NULL && is_queued) {
+        // the file never made it to the remote
+        pthread_mutex_unlock(&(ctx->mutex));
+        return 0;
+    }
     if (key == NULL) {
         fprintf(stderr, "key is NULL\n");
         pthread_mutex_unlock(&(ctx->mutex));
@@ -366,7 +485,11 @@ int mediafirefs_unlink(const char *path)
 int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
 {
     int             fd;
+    int             retval;
     bool            is_open;
+    bool            is_reclaimed;
+    overlay        *ovl;
+    struct uploadqueue_reclaimed reclaimed;
     struct mediafirefs_openfile *openfile;
     struct mediafirefs_context_private *ctx;
 
@@ -383,6 +506,61 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
         return -EACCES;
     }
 
+    if ((file_info->flags & O_ACCMODE) == O_RDONLY) {
+        /* the content of pending uploads is only available through the
+         * cache once they are finished */
+        retval = uploadqueue_wait(ctx->uploads, path);
+    } else {
+        /* a pending upload that did not start yet is taken back, so that
+         * it can be merged with the modifications about to be made */
+        retval = uploadqueue_reclaim(ctx->uploads, path, &reclaimed);
+    }
+    if (retval < 0) {
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -EIO;
+    }
+    is_reclaimed = (file_info->flags & O_ACCMODE) != O_RDONLY && retval == 1;
+
+    if (is_reclaimed && reclaimed.is_new) {
+        /* the file still only exists locally */
+        fd = open(reclaimed.tmpfile, O_RDWR | (file_info->flags & O_TRUNC));
+        if (fd < 0) {
+            fprintf(stderr, "cannot open %s\n", reclaimed.tmpfile);
+            if (uploadqueue_add_new(ctx->uploads, path, reclaimed.folderkey,
+                                    reclaimed.tmpfile, NULL,
+                                    reclaimed.since) != 0) {
+                fprintf(stderr, "pending upload of %s was lost\n", path);
+            }
+            free(reclaimed.tmpfile);
+            free(reclaimed.folderkey);
+            pthread_mutex_unlock(&(ctx->mutex));
+            return -EIO;
+        }
+        free(reclaimed.folderkey);
+
+        openfile = malloc(sizeof(struct mediafirefs_openfile));
+        openfile->fd = fd;
+        openfile->ovl = NULL;
+        openfile->tmpfile = reclaimed.tmpfile;
+        openfile->written = 0;
+        openfile->is_local = true;
+        openfile->is_readonly = false;
+        openfile->path = strdup(path);
+        SHA256_Init(&(openfile->hash_ctx));
+        openfile->hash_offset = 0;
+        openfile->hash_valid = (file_info->flags & O_TRUNC) != 0;
+        openfile->must_upload = true;
+        openfile->dirty_unknown = false;
+        openfile->queued_since = reclaimed.since;
+
+        stringv_add(ctx->sv_writefiles, path);
+        file_info->fh = (uintptr_t) openfile;
+
+        pthread_mutex_unlock(&(ctx->mutex));
+
+        return 0;
+    }
+
     is_open = false;
     // check if the file was already opened
     // check read-only files first
@@ -398,18 +576,41 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
         is_open = true;
     }
 
+    // a reclaimed patch refers to the revision it was made against, so the
+    // file must not be updated to a newer one
+    ovl = NULL;
     fd = folder_tree_open_file(ctx->tree, ctx->conn, path, file_info->flags,
-                               !is_open);
+                               !is_open && !is_reclaimed, &ovl);
     if (fd < 0) {
         fprintf(stderr, "folder_tree_file_open unsuccessful\n");
+        if (is_reclaimed) {
+            if (mediafirefs_queue_patch(ctx, path, NULL, reclaimed.dirty,
+                                        reclaimed.since) != 0) {
+                fprintf(stderr, "pending upload of %s was lost\n", path);
+            }
+            if (reclaimed.dirty != NULL)
+                extents_free(reclaimed.dirty);
+        }
         pthread_mutex_unlock(&(ctx->mutex));
         return fd;
     }
+    if (ovl != NULL) {
+        fd = overlay_get_fd(ovl);
+    }
 
     openfile = malloc(sizeof(struct mediafirefs_openfile));
     openfile->fd = fd;
+    openfile->ovl = ovl;
+    openfile->tmpfile = NULL;
+    openfile->written = 0;
     openfile->is_local = false;
     openfile->path = strdup(path);
+    SHA256_Init(&(openfile->hash_ctx));
+    openfile->hash_offset = 0;
+    openfile->hash_valid = (file_info->flags & O_ACCMODE) != O_RDONLY;
+    openfile->must_upload = false;
+    openfile->dirty_unknown = false;
+    openfile->queued_since = 0;
 
     if ((file_info->flags & O_ACCMODE) == O_RDONLY) {
         openfile->is_readonly = true;
@@ -417,6 +618,25 @@ int mediafirefs_open(const char *path, struct fuse_file_info *file_info)
         stringv_add(ctx->sv_readonlyfiles, path);
     } else {
         openfile->is_readonly = false;
+        openfile->must_upload = (file_info->flags & O_TRUNC) != 0;
+        openfile->dirty_unknown = (file_info->flags & O_TRUNC) != 0;
+        if (ovl != NULL && overlay_dirty_unknown(ovl) && !is_reclaimed) {
+            // a modified copy was left behind without an upload job that
+            // knows its changes, so compare it as a whole
+            openfile->must_upload = true;
+            openfile->dirty_unknown = true;
+        }
+        if (is_reclaimed) {
+            // the ranges written before are part of the upload as well
+            openfile->must_upload = true;
+            openfile->queued_since = reclaimed.since;
+            if (reclaimed.dirty == NULL) {
+                openfile->dirty_unknown = true;
+            } else {
+                extents_merge(overlay_get_dirty(ovl), reclaimed.dirty);
+                extents_free(reclaimed.dirty);
+            }
+        }
         // add to writefiles
         stringv_add(ctx->sv_writefiles, path);
     }
@@ -439,6 +659,7 @@ int mediafirefs_create(const char *path, mode_t mode,
     (void)mode;
 
     int             fd;
+    char           *tmpfile;
     struct mediafirefs_openfile *openfile;
     struct mediafirefs_context_private *ctx;
 
@@ -446,9 +667,9 @@ int mediafirefs_create(const char *path, mode_t mode,
 
     pthread_mutex_lock(&(ctx->mutex));
 
-    fd = folder_tree_tmp_open(ctx->tree);
+    fd = uploadqueue_tmp_open(ctx->uploads, &tmpfile);
     if (fd < 0) {
-        fprintf(stderr, "folder_tree_tmp_open failed\n");
+        fprintf(stderr, "uploadqueue_tmp_open failed\n");
         pthread_mutex_unlock(&(ctx->mutex));
         return -EACCES;
     }
@@ -458,6 +679,15 @@ int mediafirefs_create(const char *path, mode_t mode,
     openfile->is_local = true;
     openfile->is_readonly = false;
     openfile->path = strdup(path);
+    SHA256_Init(&(openfile->hash_ctx));
+    openfile->hash_offset = 0;
+    openfile->hash_valid = true;
+    openfile->ovl = NULL;
+    openfile->must_upload = true;
+    openfile->dirty_unknown = false;
+    openfile->queued_since = 0;
+    openfile->tmpfile = tmpfile;
+    openfile->written = 0;
     file_info->fh = (uintptr_t) openfile;
 
     // add to writefiles
@@ -474,13 +704,18 @@ int mediafirefs_read(const char *path, char *buf, size_t size, off_t offset,
     (void)path;
     ssize_t         retval;
     struct mediafirefs_context_private *ctx;
+    struct mediafirefs_openfile *openfile;
 
     ctx = fuse_get_context()->private_data;
     pthread_mutex_lock(&(ctx->mutex));
 
-    retval =
-        pread(((struct mediafirefs_openfile *)(uintptr_t) file_info->fh)->fd,
-              buf, size, offset);
+    openfile = (struct mediafirefs_openfile *)(uintptr_t) file_info->fh;
+
+    if (openfile->ovl != NULL) {
+        retval = overlay_read(openfile->ovl, buf, size, offset);
+    } else {
+        retval = pread(openfile->fd, buf, size, offset);
+    }
 
     pthread_mutex_unlock(&(ctx->mutex));
 
@@ -492,14 +727,53 @@ int mediafirefs_write(const char *path, const char *buf, size_t size,
 {
     (void)path;
     ssize_t         retval;
+    uint64_t        growth;
+    uint64_t        before;
+    uint64_t        end;
+    extents        *dirty;
     struct mediafirefs_context_private *ctx;
+    struct mediafirefs_openfile *openfile;
 
     ctx = fuse_get_context()->private_data;
     pthread_mutex_lock(&(ctx->mutex));
 
-    retval =
-        pwrite(((struct mediafirefs_openfile *)(uintptr_t) file_info->fh)->fd,
-               buf, size, offset);
+    openfile = (struct mediafirefs_openfile *)(uintptr_t) file_info->fh;
+
+    // rewriting what was already modified does not add anything to upload
+    end = offset + size;
+    if (openfile->ovl != NULL) {
+        dirty = overlay_get_dirty(openfile->ovl);
+        growth = extents_uncovered(dirty, offset, size);
+    } else {
+        dirty = NULL;
+        growth = end > openfile->written ? end - openfile->written : 0;
+    }
+
+    // this blocks if too much data is waiting to be uploaded
+    uploadqueue_dirty_wait(ctx->uploads, growth);
+
+    if (openfile->ovl != NULL) {
+        before = extents_total(dirty);
+        retval = overlay_write(openfile->ovl, buf, size, offset);
+        growth = extents_total(dirty) - before;
+    } else {
+        retval = pwrite(openfile->fd, buf, size, offset);
+        end = offset + (retval > 0 ? retval : 0);
+        growth = end > openfile->written ? end - openfile->written : 0;
+    }
+    uploadqueue_dirty_add(ctx->uploads, growth);
+    openfile->written += growth;
+
+    // keep the hash up to date as long as the file is written sequentially,
+    // otherwise it has to be calculated from the file content on release
+    if (retval > 0 && openfile->hash_valid) {
+        if ((uint64_t) offset == openfile->hash_offset) {
+            SHA256_Update(&(openfile->hash_ctx), buf, retval);
+            openfile->hash_offset += retval;
+        } else {
+            openfile->hash_valid = false;
+        }
+    }
 
     pthread_mutex_unlock(&(ctx->mutex));
 
@@ -513,25 +787,23 @@ int mediafirefs_write(const char *path, const char *buf, size_t size,
  * before this function returns. Thus, the uploading should be done once flush
  * is called but this becomes tricky because mediafire doesn't like files of
  * zero length and flush() is often called right after creation.
+ *
+ * the upload itself is left to the upload queue, so that other operations
+ * do not have to wait for it to finish
  */
 int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
 {
     (void)path;
 
-    FILE           *fh;
-    char           *file_name;
     char           *dir_name;
     const char     *folder_key;
-    char           *upload_key;
-    char           *temp1;
-    char           *temp2;
+    char           *temp;
     int             retval;
     struct mediafirefs_context_private *ctx;
     struct mediafirefs_openfile *openfile;
-    struct mfconn_upload_check_result check_result;
     unsigned char   bhash[SHA256_DIGEST_LENGTH];
-    char           *hash;
-    uint64_t        size;
+    bool            have_hash;
+    extents        *dirty;
 
     ctx = fuse_get_context()->private_data;
 
@@ -566,122 +838,89 @@ int mediafirefs_release(const char *path, struct fuse_file_info *file_info)
                 openfile->path);
         exit(1);
     }
+    // what was written is now accounted for by the queued upload
+    uploadqueue_dirty_sub(ctx->uploads, openfile->written);
+
     // if the file only exists locally, an initial upload has to be done
     if (openfile->is_local) {
-        // pass a copy because dirname and basename may modify their argument
-        temp1 = strdup(openfile->path);
-        file_name = basename(temp1);
-        temp2 = strdup(openfile->path);
-        dir_name = dirname(temp2);
-
-        fh = fdopen(openfile->fd, "r");
-        rewind(fh);
+        // pass a copy because dirname may modify its argument
+        temp = strdup(openfile->path);
+        dir_name = dirname(temp);
 
         folder_key = folder_tree_path_get_key(ctx->tree, ctx->conn, dir_name);
 
-        retval = calc_sha256(fh, bhash, &size);
-        rewind(fh);
+        // the hash is only passed on if it could be computed while writing,
+        // otherwise the upload worker computes it
+        have_hash = mediafirefs_openfile_get_hash(openfile, bhash, NULL);
 
-        if (retval != 0) {
-            fprintf(stderr, "failed to calculate hash\n");
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            pthread_mutex_unlock(&(ctx->mutex));
-            return -EACCES;
-        }
-
-        hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
-
-        retval = mfconn_api_upload_check(ctx->conn, file_name, hash, size,
-                                         folder_key, &check_result);
+        close(openfile->fd);
 
+        if (folder_key == NULL) {
+            fprintf(stderr, "parent directory of %s vanished\n",
+                    openfile->path);
+            retval = -1;
+        } else {
+            retval = uploadqueue_add_new(ctx->uploads, openfile->path,
+                                         folder_key, openfile->tmpfile,
+                                         have_hash ? bhash : NULL,
+                                         openfile->queued_since);
+        }
         if (retval != 0) {
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-            fprintf(stderr, "mfconn_api_upload_check failed\n");
-            pthread_mutex_unlock(&(ctx->mutex));
-            return -EACCES;
+            fprintf(stderr, "uploadqueue_add_new failed\n");
+            unlink(openfile->tmpfile);
         }
 
-        if (check_result.hash_exists) {
-            // hash exists, so use upload/instant
-
-            retval = mfconn_api_upload_instant(ctx->conn, NULL,
-                                               file_name, hash, size,
-                                               folder_key);
-
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-
-            if (retval != 0) {
-                fprintf(stderr, "mfconn_api_upload_instant failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -EACCES;
-            }
-        } else {
-            // hash does not exist, so do full upload
-            upload_key = NULL;
-            retval = mfconn_api_upload_simple(ctx->conn, folder_key,
-                                              fh, file_name, &upload_key);
+        free(temp);
+        free(openfile->tmpfile);
+        free(openfile->path);
+        free(openfile);
+        pthread_mutex_unlock(&(ctx->mutex));
 
-            fclose(fh);
-            free(temp1);
-            free(temp2);
-            free(openfile->path);
-            free(openfile);
-            free(hash);
-
-            if (retval != 0 || upload_key == NULL) {
-                fprintf(stderr, "mfconn_api_upload_simple failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -EACCES;
-            }
-            // poll for completion
-            retval = mfconn_upload_poll_for_completion(ctx->conn, upload_key);
-            free(upload_key);
-
-            if (retval != 0) {
-                fprintf(stderr, "mfconn_upload_poll_for_completion failed\n");
-                pthread_mutex_unlock(&(ctx->mutex));
-                return -1;
-            }
-        }
+        if (retval != 0)
+            return -EACCES;
 
-        folder_tree_update(ctx->tree, ctx->conn, true);
-        pthread_mutex_unlock(&(ctx->mutex));
         return 0;
     }
     // the file was not opened readonly and also existed on the remote
     // thus, we have to check whether any changes were made and if yes, upload
     // a patch
 
-    close(openfile->fd);
+    dirty = overlay_get_dirty(openfile->ovl);
 
-    retval = folder_tree_upload_patch(ctx->tree, ctx->conn, openfile->path);
-    free(openfile->path);
-    free(openfile);
-
-    if (retval != 0) {
-        fprintf(stderr, "folder_tree_upload_patch failed\n");
+    // if nothing was written, there is nothing to compare or upload
+    if (extents_is_empty(dirty) && !openfile->must_upload) {
+        overlay_close(openfile->ovl);
+        free(openfile->path);
+        free(openfile);
         pthread_mutex_unlock(&(ctx->mutex));
-        return -EACCES;
+        return 0;
     }
+    // the patch is computed from the complete file
+    retval = overlay_materialize(openfile->ovl);
+    if (retval != 0) {
+        fprintf(stderr, "overlay_materialize failed\n");
+    } else {
+        have_hash = mediafirefs_openfile_get_hash(openfile, bhash, NULL);
 
-    folder_tree_update(ctx->tree, ctx->conn, true);
+        retval = mediafirefs_queue_patch(ctx, openfile->path,
+                                         have_hash ? bhash : NULL,
+                                         openfile->dirty_unknown ?
+                                         NULL : dirty,
+                                         openfile->queued_since);
+        if (retval != 0) {
+            fprintf(stderr, "uploadqueue_add_patch failed\n");
+        }
+    }
+
+    overlay_close(openfile->ovl);
+    free(openfile->path);
+    free(openfile);
 
     pthread_mutex_unlock(&(ctx->mutex));
 
+    if (retval != 0)
+        return -EACCES;
+
     return 0;
 }
 
@@ -756,6 +995,29 @@ int mediafirefs_rename(const char *oldpath, const char *newpath)
 
     pthread_mutex_lock(&(ctx->mutex));
 
+    // a new file that was not uploaded yet only has to be moved in the queue
+    if (folder_tree_path_get_key(ctx->tree, ctx->conn, oldpath) == NULL
+        && folder_tree_path_get_key(ctx->tree, ctx->conn, newpath) == NULL) {
+        temp2 = strdup(newpath);
+        newdir = dirname(temp2);
+        folderkey = folder_tree_path_get_key(ctx->tree, ctx->conn, newdir);
+        if (folderkey != NULL
+            && uploadqueue_rename(ctx->uploads, oldpath, newpath,
+                                  folderkey)) {
+            free(temp2);
+            pthread_mutex_unlock(&(ctx->mutex));
+            return 0;
+        }
+        free(temp2);
+    }
+    // pending uploads have to be finished before they can be moved or
+    // overwritten
+    if (uploadqueue_wait(ctx->uploads, oldpath) != 0
+        || uploadqueue_wait(ctx->uploads, newpath) != 0) {
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -EIO;
+    }
+
     is_file = folder_tree_path_is_file(ctx->tree, ctx->conn, oldpath);
 
     key = folder_tree_path_get_key(ctx->tree, ctx->conn, oldpath);
@@ -1136,12 +1398,26 @@ int mediafirefs_fsyncdir(const char *path, int datasync,
 }
 
 /*
-void* mediafirefs_init(struct fuse_conn_info *conn)
+ * this is called after fuse has forked into the background, so threads have
+ * to be started here and not earlier
+ */
+void           *mediafirefs_init(struct fuse_conn_info *conn)
 {
     (void)conn;
-    fprintf(stderr, "init is a no-op");
+    struct mediafirefs_context_private *ctx;
+
+    ctx = fuse_get_context()->private_data;
+
+    if (uploadqueue_start(ctx->uploads) != 0) {
+        fprintf(stderr, "cannot start upload workers\n");
+    }
+
+    if (mfconn_start_renewal(ctx->conn) != 0) {
+        fprintf(stderr, "session token is only renewed when it expires\n");
+    }
+
+    return ctx;
 }
-*/
 
 int mediafirefs_access(const char *path, int mode)
 {
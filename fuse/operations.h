@@ -27,6 +27,7 @@
 
 #include "../mfapi/mfconn.h"
 #include "hashtbl.h"
+#include "uploadqueue.h"
 #include "../utils/stringv.h"
 
 struct fuse_conn_info;
@@ -37,12 +38,14 @@ struct statvfs;
 struct mediafirefs_context_private {
     mfconn         *conn;
     folder_tree    *tree;
+    uploadqueue    *uploads;
     time_t          last_status_check;
     time_t          interval_status_check;
     pthread_mutex_t mutex;
     char           *configfile;
     char           *dircache;
     char           *filecache;
+    char           *uploaddir;
     /* stores:
      *  - all currently open temporary files which are to be uploaded when
      *    they are closed.
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pread and pwrite
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "../utils/extents.h"
+#include "../utils/strings.h"
+#include "overlay.h"
+
+// how many bytes are copied from the base at once
+#define OVERLAY_COPY_BUFSIZE 65536
+
+struct overlay {
+    // the file receiving the writes
+    int             fd;
+    // the cached revision to read unmodified ranges from or -1 if fd
+    // already holds the complete content
+    int             base_fd;
+    uint64_t        base_size;
+    // the partial file as long as base_fd is set and its final location
+    char           *ovlfile;
+    char           *newfile;
+    // the ranges written through this overlay
+    extents        *dirty;
+    // whether fd was left behind by an earlier session, so that dirty does
+    // not cover everything that differs from the base
+    bool            dirty_unknown;
+};
+
+/*
+ * the overlay takes over fd, which is closed if the allocation fails
+ */
+static overlay *overlay_alloc(int fd)
+{
+    overlay        *ovl;
+
+    ovl = (overlay *) calloc(1, sizeof(overlay));
+    if (ovl == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    ovl->fd = fd;
+    ovl->base_fd = -1;
+    ovl->base_size = 0;
+    ovl->ovlfile = NULL;
+    ovl->newfile = NULL;
+    ovl->dirty = extents_alloc();
+    if (ovl->dirty == NULL) {
+        if (fd >= 0)
+            close(fd);
+        free(ovl);
+        return NULL;
+    }
+    ovl->dirty_unknown = false;
+    return ovl;
+}
+
+/*
+ * opens newfile for writing, using basefile as the initial content if
+ * newfile doesn't exist yet
+ *
+ * if newfile exists from an earlier session, it is used as it is. Otherwise
+ * a reflink of basefile is attempted and if the filesystem doesn't support
+ * that, a sparse overlay file is created next to newfile. Copying any data is
+ * thus deferred until overlay_materialize() is called.
+ *
+ * returns NULL if neither newfile nor basefile exist
+ */
+overlay        *overlay_open(const char *basefile, const char *newfile,
+                             int flags)
+{
+    int             fd;
+    int             base_fd;
+    struct stat     file_info;
+    overlay        *ovl;
+
+    // the overlay has to be able to read back what was written
+    flags = (flags & ~(O_ACCMODE | O_CREAT | O_EXCL)) | O_RDWR;
+
+    fd = open(newfile, flags);
+    if (fd >= 0) {
+        ovl = overlay_alloc(fd);
+        // the ranges written back then are not known anymore
+        if (ovl != NULL)
+            ovl->dirty_unknown = true;
+        return ovl;
+    }
+
+    base_fd = open(basefile, O_RDONLY);
+    if (base_fd < 0) {
+        return NULL;
+    }
+    // if the content is discarded anyways, the base is not needed
+    if (flags & O_TRUNC) {
+        close(base_fd);
+        fd = open(newfile, flags | O_CREAT, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "cannot open %s\n", newfile);
+            return NULL;
+        }
+        return overlay_alloc(fd);
+    }
+#ifdef FICLONE
+    // on filesystems supporting it, a reflink gives a complete copy without
+    // copying any data
+    fd = open(newfile, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        if (ioctl(fd, FICLONE, base_fd) == 0) {
+            close(base_fd);
+            close(fd);
+            fd = open(newfile, flags);
+            if (fd < 0) {
+                fprintf(stderr, "cannot open %s\n", newfile);
+                return NULL;
+            }
+            return overlay_alloc(fd);
+        }
+        close(fd);
+        unlink(newfile);
+    }
+#endif
+
+    if (fstat(base_fd, &file_info) != 0) {
+        fprintf(stderr, "fstat failed\n");
+        close(base_fd);
+        return NULL;
+    }
+
+    ovl = overlay_alloc(-1);
+    if (ovl == NULL) {
+        close(base_fd);
+        return NULL;
+    }
+    ovl->base_fd = base_fd;
+    ovl->base_size = file_info.st_size;
+    ovl->newfile = strdup_printf("%s", newfile);
+    ovl->ovlfile = strdup_printf("%s_ovl", newfile);
+
+    // the overlay has the size of the base but does not occupy any space
+    // until it is written to
+    ovl->fd = open(ovl->ovlfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ovl->fd < 0 || ftruncate(ovl->fd, ovl->base_size) != 0) {
+        fprintf(stderr, "cannot create %s\n", ovl->ovlfile);
+        overlay_close(ovl);
+        return NULL;
+    }
+
+    return ovl;
+}
+
+int overlay_get_fd(overlay * ovl)
+{
+    return ovl->fd;
+}
+
+extents        *overlay_get_dirty(overlay * ovl)
+{
+    return ovl->dirty;
+}
+
+/*
+ * returns true if the file was modified before this overlay was opened, so
+ * that the dirty ranges do not describe all modifications
+ */
+bool overlay_dirty_unknown(overlay * ovl)
+{
+    return ovl->dirty_unknown;
+}
+
+ssize_t overlay_read(overlay * ovl, char *buf, size_t size, off_t offset)
+{
+    size_t          done;
+    size_t          len;
+    uint64_t        pos;
+    uint64_t        boundary;
+    bool            is_dirty;
+    ssize_t         retval;
+
+    if (ovl->base_fd == -1) {
+        return pread(ovl->fd, buf, size, offset);
+    }
+
+    done = 0;
+    while (done < size) {
+        pos = offset + done;
+        is_dirty = extents_find(ovl->dirty, pos, &boundary);
+
+        len = size - done;
+        if (boundary - pos < len)
+            len = boundary - pos;
+
+        // written ranges and ranges beyond the end of the base are read from
+        // the overlay
+        if (is_dirty || pos >= ovl->base_size) {
+            retval = pread(ovl->fd, buf + done, len, pos);
+        } else {
+            if (ovl->base_size - pos < len)
+                len = ovl->base_size - pos;
+            retval = pread(ovl->base_fd, buf + done, len, pos);
+        }
+
+        if (retval < 0)
+            return retval;
+        if (retval == 0)
+            break;
+        done += retval;
+    }
+
+    return done;
+}
+
+ssize_t overlay_write(overlay * ovl, const char *buf, size_t size,
+                      off_t offset)
+{
+    ssize_t         retval;
+
+    retval = pwrite(ovl->fd, buf, size, offset);
+
+    if (retval > 0) {
+        extents_add(ovl->dirty, offset, retval);
+    }
+
+    return retval;
+}
+
+/*
+ * copy all ranges that were not written from the base and move the result to
+ * its final location
+ */
+int overlay_materialize(overlay * ovl)
+{
+    char            buf[OVERLAY_COPY_BUFSIZE];
+    uint64_t        pos;
+    uint64_t        boundary;
+    size_t          len;
+    ssize_t         retval;
+
+    if (ovl->base_fd == -1)
+        return 0;
+
+    pos = 0;
+    while (pos < ovl->base_size) {
+        if (extents_find(ovl->dirty, pos, &boundary)) {
+            pos = boundary;
+            continue;
+        }
+
+        len = OVERLAY_COPY_BUFSIZE;
+        if (boundary - pos < len)
+            len = boundary - pos;
+        if (ovl->base_size - pos < len)
+            len = ovl->base_size - pos;
+
+        retval = pread(ovl->base_fd, buf, len, pos);
+        if (retval <= 0) {
+            fprintf(stderr, "cannot read from base\n");
+            return -1;
+        }
+        if (pwrite(ovl->fd, buf, retval, pos) != retval) {
+            fprintf(stderr, "cannot write to %s\n", ovl->ovlfile);
+            return -1;
+        }
+        pos += retval;
+    }
+
+    if (rename(ovl->ovlfile, ovl->newfile) != 0) {
+        fprintf(stderr, "cannot rename %s\n", ovl->ovlfile);
+        return -1;
+    }
+
+    close(ovl->base_fd);
+    ovl->base_fd = -1;
+
+    return 0;
+}
+
+/*
+ * an overlay that was not materialized is discarded
+ */
+void overlay_close(overlay * ovl)
+{
+    if (ovl->fd >= 0)
+        close(ovl->fd);
+    if (ovl->base_fd != -1) {
+        close(ovl->base_fd);
+        unlink(ovl->ovlfile);
+    }
+    free(ovl->ovlfile);
+    free(ovl->newfile);
+    extents_free(ovl->dirty);
+    free(ovl);
+}
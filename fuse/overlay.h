@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __FUSE_OVERLAY_H__
+#define __FUSE_OVERLAY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../utils/extents.h"
+
+/*
+ * a writable view onto an immutable cached file revision
+ *
+ * writes go to a sparse file and only the written ranges are recorded, all
+ * other ranges are read from the cached revision. Only when the complete
+ * content is needed (to compute a patch), the remaining ranges are copied
+ * and the result is moved into place.
+ */
+typedef struct overlay overlay;
+
+overlay        *overlay_open(const char *basefile, const char *newfile,
+                             int flags);
+
+int             overlay_get_fd(overlay * ovl);
+
+extents        *overlay_get_dirty(overlay * ovl);
+
+bool            overlay_dirty_unknown(overlay * ovl);
+
+ssize_t         overlay_read(overlay * ovl, char *buf, size_t size,
+                             off_t offset);
+
+ssize_t         overlay_write(overlay * ovl, const char *buf, size_t size,
+                              off_t offset);
+
+int             overlay_materialize(overlay * ovl);
+
+void            overlay_close(overlay * ovl);
+
+#endif
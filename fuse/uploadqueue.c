@@ -0,0 +1,1412 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup, getline and mkstemp
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
+#define FUSE_USE_VERSION 30
+
+#include <fuse/fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/sha.h>
+
+#include "../mfapi/mfconn.h"
+#include "../mfapi/apicalls.h"
+#include "../mfapi/uploadtracker.h"
+#include "../utils/hash.h"
+#include "../utils/strings.h"
+#include "../utils/extents.h"
+#include "filecache.h"
+#include "hashtbl.h"
+#include "uploadqueue.h"
+
+enum upload_job_type {
+    UPLOAD_JOB_NEW,
+    UPLOAD_JOB_PATCH,
+};
+
+struct upload_job {
+    uint64_t        id;
+    enum upload_job_type type;
+    // the location inside the filesystem
+    char           *path;
+    // for new files: the key of the folder to upload into
+    char           *folderkey;
+    // for modified files: the file and the cached revision the patch is based
+    // on
+    char           *quickkey;
+    uint64_t        revision;
+    bool            has_source_hash;
+    unsigned char   source_hash[SHA256_DIGEST_LENGTH];
+    // the hash of the content to upload if it is already known
+    bool            has_hash;
+    unsigned char   hash[SHA256_DIGEST_LENGTH];
+    uint64_t        size;
+    // the ranges written since the cached revision or NULL if unknown (this
+    // is not stored on disk)
+    extents        *dirty;
+    unsigned int    attempts;
+    time_t          not_before;
+    // when the first of the uploads that were merged into this one was
+    // queued
+    time_t          since;
+    bool            in_progress;
+    struct upload_job *next;
+};
+
+struct uploadqueue {
+    char           *queuedir;
+    char           *filecache;
+    folder_tree    *tree;
+    // only used for updating the tree after an upload finished
+    mfconn         *conn;
+    // the mutex of the filesystem context
+    pthread_mutex_t *mutex;
+    // signalled whenever a job was added or finished
+    pthread_cond_t  cond;
+    // ordered by id
+    struct upload_job *jobs;
+    uint64_t        next_id;
+    // the size of all queued uploads plus what was written to files which
+    // are still open
+    uint64_t        queued_bytes;
+    uint64_t        open_bytes;
+    uint64_t        max_dirty_bytes;
+    // how long to wait for further modifications before uploading
+    time_t          delay;
+    // how many units of a single resumable upload are sent at once
+    int             parallel_units;
+    int             num_workers;
+    pthread_t      *workers;
+    // waits for the server to process what the workers sent, so that they
+    // can go on with the next job in the meantime
+    uploadtracker  *tracker;
+    bool            stop;
+};
+
+// an upload whose completion is waited for by the tracker
+struct upload_tracked {
+    uploadqueue    *queue;
+    struct upload_job *job;
+};
+
+// the maximum time between two attempts of a failing upload
+#define UPLOADQUEUE_MAX_BACKOFF 3600
+
+// a file that keeps being modified is uploaded at the latest after this many
+// times the delay
+#define UPLOADQUEUE_MAX_DEFERRAL 10
+
+static struct upload_job *uploadqueue_job_load(uploadqueue * queue,
+                                               const char *filename);
+static int      uploadqueue_job_store(uploadqueue * queue,
+                                      struct upload_job *job);
+static void     uploadqueue_job_free(struct upload_job *job);
+static char    *uploadqueue_job_datafile(uploadqueue * queue,
+                                         struct upload_job *job);
+static void     uploadqueue_insert(uploadqueue * queue,
+                                   struct upload_job *job);
+static void     uploadqueue_remove(uploadqueue * queue,
+                                   struct upload_job *job);
+static void     uploadqueue_discard(uploadqueue * queue,
+                                    struct upload_job *job);
+static struct upload_job *uploadqueue_find(uploadqueue * queue,
+                                           const char *path);
+static struct upload_job *uploadqueue_find_in_progress(uploadqueue * queue,
+                                                       const char *path);
+static int      uploadqueue_wait_in_progress(uploadqueue * queue,
+                                             const char *path);
+static struct upload_job *uploadqueue_next(uploadqueue * queue, time_t now,
+                                           time_t * wakeup);
+static int      uploadqueue_process_new(uploadqueue * queue, mfconn * conn,
+                                        struct upload_job *job,
+                                        char **upload_key);
+static int      uploadqueue_process_patch(uploadqueue * queue,
+                                          mfconn * conn,
+                                          struct upload_job *job,
+                                          char **upload_key);
+static void     uploadqueue_finish(uploadqueue * queue,
+                                   struct upload_job *job, int retval);
+static void     uploadqueue_upload_done(const char *upload_key, int result,
+                                        void *user_ptr);
+static void     uploadqueue_adopt(uploadqueue * queue,
+                                  struct upload_job *job);
+static time_t   uploadqueue_backoff(unsigned int attempts);
+static time_t   uploadqueue_due(uploadqueue * queue, time_t since);
+static void    *uploadqueue_worker(void *user_ptr);
+
+/*
+ * loads all jobs that were left in the queue directory but does not start
+ * processing them yet
+ */
+uploadqueue    *uploadqueue_create(const char *queuedir,
+                                   const char *filecache, folder_tree * tree,
+                                   mfconn * conn, pthread_mutex_t * mutex,
+                                   int num_workers, uint64_t max_dirty_bytes,
+                                   time_t delay, int parallel_units)
+{
+    uploadqueue    *queue;
+    struct upload_job *job;
+    DIR            *dir;
+    struct dirent  *ent;
+    char           *filename;
+    size_t          len;
+
+    dir = opendir(queuedir);
+    if (dir == NULL) {
+        fprintf(stderr, "cannot open %s\n", queuedir);
+        return NULL;
+    }
+
+    queue = (uploadqueue *) calloc(1, sizeof(uploadqueue));
+    queue->queuedir = strdup(queuedir);
+    queue->filecache = strdup(filecache);
+    queue->tree = tree;
+    queue->conn = conn;
+    queue->mutex = mutex;
+    pthread_cond_init(&(queue->cond), NULL);
+    queue->jobs = NULL;
+    queue->next_id = 1;
+    queue->queued_bytes = 0;
+    queue->open_bytes = 0;
+    queue->max_dirty_bytes = max_dirty_bytes;
+    queue->delay = delay < 0 ? 0 : delay;
+    queue->parallel_units = parallel_units < 1 ? 1 : parallel_units;
+    queue->num_workers = num_workers < 1 ? 1 : num_workers;
+    queue->workers = NULL;
+    queue->tracker = NULL;
+    queue->stop = false;
+
+    while ((ent = readdir(dir)) != NULL) {
+        len = strlen(ent->d_name);
+        filename = strdup_printf("%s/%s", queuedir, ent->d_name);
+        if (strncmp(ent->d_name, "tmp_", 4) == 0) {
+            // files that were still being written when the filesystem went
+            // away and job files that were not completely written
+            unlink(filename);
+        } else if (len > 4 && strcmp(ent->d_name + len - 4, ".job") == 0) {
+            job = uploadqueue_job_load(queue, filename);
+            if (job != NULL) {
+                fprintf(stderr, "resuming upload of %s\n", job->path);
+                uploadqueue_insert(queue, job);
+                queue->queued_bytes += job->size;
+                if (job->id >= queue->next_id)
+                    queue->next_id = job->id + 1;
+            } else {
+                fprintf(stderr, "dropping invalid job %s\n", filename);
+                unlink(filename);
+            }
+        }
+        free(filename);
+    }
+    closedir(dir);
+
+    return queue;
+}
+
+int uploadqueue_start(uploadqueue * queue)
+{
+    int             i;
+
+    // the workers hand their uploads over to the tracker
+    queue->tracker = uploadtracker_create(queue->conn);
+    if (queue->tracker == NULL) {
+        fprintf(stderr, "cannot start upload tracker\n");
+        return -1;
+    }
+
+    queue->workers = (pthread_t *) calloc(queue->num_workers,
+                                          sizeof(pthread_t));
+    for (i = 0; i < queue->num_workers; i++) {
+        if (pthread_create(&(queue->workers[i]), NULL, uploadqueue_worker,
+                           queue) != 0) {
+            fprintf(stderr, "cannot start upload worker\n");
+            queue->num_workers = i;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * uploads that are in progress are finished, all others stay in the queue
+ * directory for the next time
+ */
+void uploadqueue_destroy(uploadqueue * queue)
+{
+    struct upload_job *job;
+    int             i;
+
+    pthread_mutex_lock(queue->mutex);
+    queue->stop = true;
+    pthread_cond_broadcast(&(queue->cond));
+    pthread_mutex_unlock(queue->mutex);
+
+    if (queue->workers != NULL) {
+        for (i = 0; i < queue->num_workers; i++) {
+            pthread_join(queue->workers[i], NULL);
+        }
+        free(queue->workers);
+    }
+
+    // the uploads that were sent already are waited for
+    if (queue->tracker != NULL)
+        uploadtracker_destroy(queue->tracker);
+
+    while (queue->jobs != NULL) {
+        job = queue->jobs;
+        queue->jobs = job->next;
+        uploadqueue_job_free(job);
+    }
+
+    pthread_cond_destroy(&(queue->cond));
+    free(queue->queuedir);
+    free(queue->filecache);
+    free(queue);
+}
+
+/*
+ * newly created files are written directly into the queue directory so that
+ * they don't have to be copied when they are enqueued
+ */
+int uploadqueue_tmp_open(uploadqueue * queue, char **tmpfile)
+{
+    int             fd;
+
+    *tmpfile = strdup_printf("%s/tmp_XXXXXX", queue->queuedir);
+
+    fd = mkstemp(*tmpfile);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp failed\n");
+        free(*tmpfile);
+        *tmpfile = NULL;
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * takes ownership of tmpfile which must have been created by
+ * uploadqueue_tmp_open() or returned by uploadqueue_reclaim()
+ *
+ * since is the time the content was first queued if it was reclaimed and
+ * zero otherwise
+ *
+ * returns 0 on success and -1 on error in which case tmpfile still exists
+ */
+int uploadqueue_add_new(uploadqueue * queue, const char *path,
+                        const char *folderkey, const char *tmpfile,
+                        const unsigned char *hash, time_t since)
+{
+    struct upload_job *job;
+    struct stat     file_info;
+    char           *datafile;
+
+    if (stat(tmpfile, &file_info) != 0) {
+        fprintf(stderr, "cannot stat %s\n", tmpfile);
+        return -1;
+    }
+
+    job = (struct upload_job *)calloc(1, sizeof(struct upload_job));
+    job->id = queue->next_id++;
+    job->type = UPLOAD_JOB_NEW;
+    job->path = strdup(path);
+    job->folderkey = strdup(folderkey);
+    job->quickkey = NULL;
+    job->has_hash = hash != NULL;
+    if (hash != NULL)
+        memcpy(job->hash, hash, SHA256_DIGEST_LENGTH);
+    job->size = file_info.st_size;
+    job->dirty = NULL;
+    job->since = since == 0 ? time(NULL) : since;
+    job->not_before = uploadqueue_due(queue, job->since);
+
+    datafile = uploadqueue_job_datafile(queue, job);
+    if (rename(tmpfile, datafile) != 0) {
+        fprintf(stderr, "cannot move %s to %s\n", tmpfile, datafile);
+        free(datafile);
+        uploadqueue_job_free(job);
+        return -1;
+    }
+
+    // a job that would not survive a restart is not queued at all and the
+    // content is given back to the caller
+    if (uploadqueue_job_store(queue, job) != 0) {
+        fprintf(stderr, "cannot store upload job\n");
+        if (rename(datafile, tmpfile) != 0)
+            fprintf(stderr, "cannot move %s to %s\n", datafile, tmpfile);
+        free(datafile);
+        uploadqueue_job_free(job);
+        return -1;
+    }
+    free(datafile);
+
+    uploadqueue_insert(queue, job);
+    queue->queued_bytes += job->size;
+    pthread_cond_broadcast(&(queue->cond));
+
+    return 0;
+}
+
+/*
+ * the content to upload is the <quickkey>_<revision>_new file in the file
+ * cache which must be complete
+ *
+ * source_hash, target_hash and dirty may be NULL if they are not known. dirty
+ * is copied.
+ *
+ * since is the time the content was first queued if it was reclaimed and
+ * zero otherwise
+ *
+ * returns 0 on success and -1 on error
+ */
+int uploadqueue_add_patch(uploadqueue * queue, const char *path,
+                          const char *quickkey, uint64_t revision,
+                          const unsigned char *source_hash,
+                          const unsigned char *target_hash, extents * dirty,
+                          time_t since)
+{
+    struct upload_job *job;
+    struct stat     file_info;
+    char           *datafile;
+
+    job = (struct upload_job *)calloc(1, sizeof(struct upload_job));
+    job->id = queue->next_id++;
+    job->type = UPLOAD_JOB_PATCH;
+    job->path = strdup(path);
+    job->folderkey = NULL;
+    job->quickkey = strdup(quickkey);
+    job->revision = revision;
+    job->has_source_hash = source_hash != NULL;
+    if (source_hash != NULL)
+        memcpy(job->source_hash, source_hash, SHA256_DIGEST_LENGTH);
+    job->has_hash = target_hash != NULL;
+    if (target_hash != NULL)
+        memcpy(job->hash, target_hash, SHA256_DIGEST_LENGTH);
+    // without a copy of the ranges, the whole file is compared
+    job->dirty = NULL;
+    if (dirty != NULL) {
+        job->dirty = extents_alloc();
+        if (job->dirty != NULL && extents_merge(job->dirty, dirty) != 0) {
+            extents_free(job->dirty);
+            job->dirty = NULL;
+        }
+    }
+    job->since = since == 0 ? time(NULL) : since;
+    job->not_before = uploadqueue_due(queue, job->since);
+
+    datafile = uploadqueue_job_datafile(queue, job);
+    if (stat(datafile, &file_info) != 0) {
+        fprintf(stderr, "cannot stat %s\n", datafile);
+        free(datafile);
+        uploadqueue_job_free(job);
+        return -1;
+    }
+    free(datafile);
+    job->size = file_info.st_size;
+
+    // the content stays in the file cache where the next open finds it
+    if (uploadqueue_job_store(queue, job) != 0) {
+        fprintf(stderr, "cannot store upload job\n");
+        uploadqueue_job_free(job);
+        return -1;
+    }
+
+    uploadqueue_insert(queue, job);
+    queue->queued_bytes += job->size;
+    pthread_cond_broadcast(&(queue->cond));
+
+    return 0;
+}
+
+/*
+ * files that are waiting to be uploaded for the first time do not exist in
+ * the directory tree yet, so their attributes are taken from the queue
+ *
+ * for modified files (which must exist in the tree as indicated by in_tree),
+ * the size of the queued content is used instead of the size the remote
+ * still reports
+ *
+ * returns true if stbuf was filled or changed
+ */
+bool uploadqueue_getattr(uploadqueue * queue, const char *path,
+                         struct stat *stbuf, bool in_tree)
+{
+    struct upload_job *job;
+
+    job = uploadqueue_find(queue, path);
+    if (job == NULL)
+        return false;
+
+    if (job->type == UPLOAD_JOB_PATCH && !in_tree)
+        return false;
+
+    if (job->type == UPLOAD_JOB_NEW) {
+        stbuf->st_uid = geteuid();
+        stbuf->st_gid = getegid();
+        stbuf->st_ctime = 0;
+        stbuf->st_mtime = 0;
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_atime = 0;
+        stbuf->st_blksize = 4096;
+    }
+    stbuf->st_size = job->size;
+    stbuf->st_blocks = job->size / 4096 + 1;
+
+    return true;
+}
+
+/*
+ * adds the names of new files in the directory path that are not uploaded
+ * yet
+ */
+void uploadqueue_readdir(uploadqueue * queue, const char *path, void *buf,
+                         fuse_fill_dir_t filldir)
+{
+    struct upload_job *job;
+    struct upload_job *other;
+    char           *temp1;
+    char           *temp2;
+    char           *dir_name;
+
+    for (job = queue->jobs; job != NULL; job = job->next) {
+        if (job->type != UPLOAD_JOB_NEW)
+            continue;
+        // only list every path once
+        for (other = job->next; other != NULL; other = other->next) {
+            if (strcmp(other->path, job->path) == 0)
+                break;
+        }
+        if (other != NULL)
+            continue;
+        // pass a copy because dirname and basename may modify their argument
+        temp1 = strdup(job->path);
+        dir_name = dirname(temp1);
+        if (strcmp(dir_name, path) == 0) {
+            temp2 = strdup(job->path);
+            filldir(buf, basename(temp2), NULL, 0);
+            free(temp2);
+        }
+        free(temp1);
+    }
+}
+
+/*
+ * blocks until all pending uploads of path are finished
+ *
+ * this is necessary before any operation that needs to see the uploaded
+ * content in the directory tree like opening, moving or removing the file
+ *
+ * returns -1 if an upload failed while waiting for it and 0 otherwise
+ */
+int uploadqueue_wait(uploadqueue * queue, const char *path)
+{
+    struct upload_job *job;
+    uint64_t        id;
+    unsigned int    attempts;
+
+    while ((job = uploadqueue_find(queue, path)) != NULL) {
+        if (queue->stop || queue->workers == NULL)
+            return -1;
+        id = job->id;
+        attempts = job->attempts;
+        // somebody is waiting, so don't delay this one any longer
+        job->not_before = 0;
+        pthread_cond_broadcast(&(queue->cond));
+        pthread_cond_wait(&(queue->cond), queue->mutex);
+        // check whether the same job is still there but failed in the
+        // meantime
+        job = uploadqueue_find(queue, path);
+        if (job != NULL && job->id == id && job->attempts > attempts) {
+            fprintf(stderr, "upload of %s failed\n", path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * takes a queued upload of path back because the file is opened for writing
+ * again, so that the new modifications can be merged into a single upload
+ *
+ * if a job for path is already being uploaded, this waits for it to finish
+ * instead
+ *
+ * for new files, the content is moved to reclaimed->tmpfile and the folder
+ * key is copied to reclaimed->folderkey. For modified files, the
+ * <key>_<rev>_new file stays where it is and reclaimed->dirty holds the
+ * ranges written so far (or NULL if they are unknown). The content has to be
+ * handed back to uploadqueue_add_new() or uploadqueue_add_patch() together
+ * with reclaimed->since.
+ *
+ * returns 1 if a job was reclaimed, 0 if there was none and -1 on error
+ */
+int uploadqueue_reclaim(uploadqueue * queue, const char *path,
+                        struct uploadqueue_reclaimed *reclaimed)
+{
+    struct upload_job *job;
+    char           *datafile;
+
+    if (uploadqueue_wait_in_progress(queue, path) != 0)
+        return -1;
+
+    job = uploadqueue_find(queue, path);
+    if (job == NULL)
+        return 0;
+
+    reclaimed->since = job->since;
+    if (job->type == UPLOAD_JOB_NEW) {
+        reclaimed->is_new = true;
+        reclaimed->folderkey = strdup(job->folderkey);
+        reclaimed->dirty = NULL;
+        reclaimed->tmpfile = strdup_printf("%s/tmp_%" PRIu64 ".data",
+                                           queue->queuedir, job->id);
+        datafile = uploadqueue_job_datafile(queue, job);
+        if (rename(datafile, reclaimed->tmpfile) != 0) {
+            fprintf(stderr, "cannot move %s to %s\n", datafile,
+                    reclaimed->tmpfile);
+            free(datafile);
+            free(reclaimed->tmpfile);
+            free(reclaimed->folderkey);
+            return -1;
+        }
+        free(datafile);
+    } else {
+        reclaimed->is_new = false;
+        reclaimed->tmpfile = NULL;
+        reclaimed->folderkey = NULL;
+        reclaimed->dirty = job->dirty;
+        job->dirty = NULL;
+    }
+
+    uploadqueue_remove(queue, job);
+
+    return 1;
+}
+
+/*
+ * a new file that was not uploaded yet is simply moved inside the queue
+ *
+ * returns true if this was the case and false if the caller has to wait for
+ * the uploads of both paths and rename the remote file
+ */
+bool uploadqueue_rename(uploadqueue * queue, const char *oldpath,
+                        const char *newpath, const char *newfolderkey)
+{
+    struct upload_job *job;
+    struct upload_job *other;
+    struct upload_job *next;
+    char           *oldjobpath;
+    char           *oldfolderkey;
+
+    job = uploadqueue_find(queue, oldpath);
+    if (job == NULL || job->in_progress || job->type != UPLOAD_JOB_NEW)
+        return false;
+    if (uploadqueue_find_in_progress(queue, oldpath) != NULL
+        || uploadqueue_find_in_progress(queue, newpath) != NULL)
+        return false;
+
+    for (other = queue->jobs; other != NULL; other = other->next) {
+        if (strcmp(other->path, newpath) == 0
+            && other->type != UPLOAD_JOB_NEW)
+            return false;
+    }
+
+    oldjobpath = job->path;
+    oldfolderkey = job->folderkey;
+    job->path = strdup(newpath);
+    job->folderkey = strdup(newfolderkey);
+
+    // if the job cannot be stored, it stays at the old path
+    if (uploadqueue_job_store(queue, job) != 0) {
+        fprintf(stderr, "cannot store upload job\n");
+        free(job->path);
+        free(job->folderkey);
+        job->path = oldjobpath;
+        job->folderkey = oldfolderkey;
+        return false;
+    }
+    free(oldjobpath);
+    free(oldfolderkey);
+
+    // queued new files at the destination are overwritten
+    for (other = queue->jobs; other != NULL; other = next) {
+        next = other->next;
+        if (other != job && strcmp(other->path, newpath) == 0)
+            uploadqueue_remove(queue, other);
+    }
+
+    return true;
+}
+
+/*
+ * drops all queued uploads of path because the file is removed (uploads in
+ * progress are waited for)
+ *
+ * returns 1 if the file only existed in the queue, 0 if it has to be removed
+ * remotely as well and -1 on error
+ */
+int uploadqueue_cancel(uploadqueue * queue, const char *path)
+{
+    struct upload_job *job;
+    int             retval;
+
+    if (uploadqueue_wait_in_progress(queue, path) != 0)
+        return -1;
+
+    retval = 0;
+    while ((job = uploadqueue_find(queue, path)) != NULL) {
+        if (job->type == UPLOAD_JOB_NEW)
+            retval = 1;
+        uploadqueue_discard(queue, job);
+    }
+    pthread_cond_broadcast(&(queue->cond));
+
+    return retval;
+}
+
+/*
+ * called before up to bytes are added to the modifications of an open file
+ *
+ * if the amount of data that is not yet uploaded would exceed the
+ * configured maximum, this blocks until enough of the queue has been
+ * processed
+ */
+void uploadqueue_dirty_wait(uploadqueue * queue, uint64_t bytes)
+{
+    if (queue->max_dirty_bytes == 0)
+        return;
+
+    // only wait as long as there is something that can be processed
+    while (!queue->stop && queue->workers != NULL
+           && queue->queued_bytes > 0
+           && queue->queued_bytes + queue->open_bytes + bytes
+           > queue->max_dirty_bytes) {
+        pthread_cond_wait(&(queue->cond), queue->mutex);
+    }
+}
+
+/*
+ * accounts for bytes that were added to the modifications of an open file
+ */
+void uploadqueue_dirty_add(uploadqueue * queue, uint64_t bytes)
+{
+    queue->open_bytes += bytes;
+}
+
+void uploadqueue_dirty_sub(uploadqueue * queue, uint64_t bytes)
+{
+    if (bytes > queue->open_bytes)
+        bytes = queue->open_bytes;
+    queue->open_bytes -= bytes;
+}
+
+static char    *uploadqueue_job_datafile(uploadqueue * queue,
+                                         struct upload_job *job)
+{
+    if (job->type == UPLOAD_JOB_NEW) {
+        return strdup_printf("%s/%" PRIu64 ".data", queue->queuedir, job->id);
+    } else {
+        return strdup_printf("%s/%s_%" PRIu64 "_new", queue->filecache,
+                             job->quickkey, job->revision);
+    }
+}
+
+static void uploadqueue_job_free(struct upload_job *job)
+{
+    free(job->path);
+    free(job->folderkey);
+    free(job->quickkey);
+    if (job->dirty != NULL)
+        extents_free(job->dirty);
+    free(job);
+}
+
+/*
+ * jobs are stored as one "name value" pair per line. The file is written to a
+ * temporary file first so that a crash never leaves a partial job behind.
+ */
+static int uploadqueue_job_store(uploadqueue * queue, struct upload_job *job)
+{
+    FILE           *fp;
+    char           *tmpfile;
+    char           *jobfile;
+    char           *hex;
+    int             retval;
+
+    tmpfile = strdup_printf("%s/tmp_%" PRIu64 ".job", queue->queuedir,
+                            job->id);
+    fp = fopen(tmpfile, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open %s\n", tmpfile);
+        free(tmpfile);
+        return -1;
+    }
+
+    fprintf(fp, "id %" PRIu64 "\n", job->id);
+    fprintf(fp, "type %s\n", job->type == UPLOAD_JOB_NEW ? "new" : "patch");
+    if (job->folderkey != NULL)
+        fprintf(fp, "folderkey %s\n", job->folderkey);
+    if (job->quickkey != NULL)
+        fprintf(fp, "quickkey %s\n", job->quickkey);
+    fprintf(fp, "revision %" PRIu64 "\n", job->revision);
+    if (job->has_source_hash) {
+        hex = binary2hex(job->source_hash, SHA256_DIGEST_LENGTH);
+        fprintf(fp, "source_hash %s\n", hex);
+        free(hex);
+    }
+    if (job->has_hash) {
+        hex = binary2hex(job->hash, SHA256_DIGEST_LENGTH);
+        fprintf(fp, "hash %s\n", hex);
+        free(hex);
+    }
+    fprintf(fp, "size %" PRIu64 "\n", job->size);
+    fprintf(fp, "attempts %u\n", job->attempts);
+    fprintf(fp, "not_before %" PRId64 "\n", (int64_t) job->not_before);
+    fprintf(fp, "since %" PRId64 "\n", (int64_t) job->since);
+    // the path goes last because it extends until the end of the line
+    fprintf(fp, "path %s\n", job->path);
+
+    retval = 0;
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        retval = -1;
+    if (fclose(fp) != 0)
+        retval = -1;
+
+    jobfile = strdup_printf("%s/%" PRIu64 ".job", queue->queuedir, job->id);
+    if (retval == 0 && rename(tmpfile, jobfile) != 0)
+        retval = -1;
+    if (retval != 0)
+        unlink(tmpfile);
+
+    free(tmpfile);
+    free(jobfile);
+
+    return retval;
+}
+
+static struct upload_job *uploadqueue_job_load(uploadqueue * queue,
+                                               const char *filename)
+{
+    FILE           *fp;
+    struct upload_job *job;
+    char           *line;
+    size_t          len;
+    char           *value;
+    char           *datafile;
+    bool            has_type;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot open %s\n", filename);
+        return NULL;
+    }
+
+    job = (struct upload_job *)calloc(1, sizeof(struct upload_job));
+    has_type = false;
+
+    line = NULL;
+    len = 0;
+    while (getline(&line, &len, fp) != -1) {
+        if (line[strlen(line) - 1] == '\n')
+            line[strlen(line) - 1] = '\0';
+        value = strchr(line, ' ');
+        if (value == NULL)
+            continue;
+        *value = '\0';
+        value++;
+
+        if (strcmp(line, "id") == 0) {
+            job->id = strtoull(value, NULL, 10);
+        } else if (strcmp(line, "type") == 0) {
+            has_type = true;
+            if (strcmp(value, "new") == 0) {
+                job->type = UPLOAD_JOB_NEW;
+            } else if (strcmp(value, "patch") == 0) {
+                job->type = UPLOAD_JOB_PATCH;
+            } else {
+                has_type = false;
+            }
+        } else if (strcmp(line, "folderkey") == 0) {
+            free(job->folderkey);
+            job->folderkey = strdup(value);
+        } else if (strcmp(line, "quickkey") == 0) {
+            free(job->quickkey);
+            job->quickkey = strdup(value);
+        } else if (strcmp(line, "revision") == 0) {
+            job->revision = strtoull(value, NULL, 10);
+        } else if (strcmp(line, "source_hash") == 0
+                   && strlen(value) == 2 * SHA256_DIGEST_LENGTH) {
+            hex2binary(value, job->source_hash);
+            job->has_source_hash = true;
+        } else if (strcmp(line, "hash") == 0
+                   && strlen(value) == 2 * SHA256_DIGEST_LENGTH) {
+            hex2binary(value, job->hash);
+            job->has_hash = true;
+        } else if (strcmp(line, "size") == 0) {
+            job->size = strtoull(value, NULL, 10);
+        } else if (strcmp(line, "attempts") == 0) {
+            job->attempts = strtoul(value, NULL, 10);
+        } else if (strcmp(line, "not_before") == 0) {
+            job->not_before = strtoll(value, NULL, 10);
+        } else if (strcmp(line, "since") == 0) {
+            job->since = strtoll(value, NULL, 10);
+        } else if (strcmp(line, "path") == 0) {
+            free(job->path);
+            job->path = strdup(value);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (job->id == 0 || !has_type || job->path == NULL
+        || (job->type == UPLOAD_JOB_NEW && job->folderkey == NULL)
+        || (job->type == UPLOAD_JOB_PATCH && job->quickkey == NULL)) {
+        uploadqueue_job_free(job);
+        return NULL;
+    }
+
+    // without its content, the job is useless
+    datafile = uploadqueue_job_datafile(queue, job);
+    if (access(datafile, R_OK) != 0) {
+        fprintf(stderr, "%s is missing\n", datafile);
+        free(datafile);
+        uploadqueue_job_free(job);
+        return NULL;
+    }
+    free(datafile);
+
+    return job;
+}
+
+static void uploadqueue_insert(uploadqueue * queue, struct upload_job *job)
+{
+    struct upload_job **pos;
+
+    for (pos = &(queue->jobs); *pos != NULL && (*pos)->id < job->id;
+         pos = &((*pos)->next)) ;
+
+    job->next = *pos;
+    *pos = job;
+}
+
+/*
+ * removes a finished job from the queue and deletes its files
+ *
+ * the modified copy of a patch job is part of the file cache and stays
+ * where it is, so that it can be opened again
+ */
+static void uploadqueue_remove(uploadqueue * queue, struct upload_job *job)
+{
+    struct upload_job **pos;
+    char           *filename;
+
+    for (pos = &(queue->jobs); *pos != NULL && *pos != job;
+         pos = &((*pos)->next)) ;
+
+    if (*pos == NULL) {
+        fprintf(stderr, "job not found\n");
+        return;
+    }
+    *pos = job->next;
+
+    filename = strdup_printf("%s/%" PRIu64 ".job", queue->queuedir, job->id);
+    unlink(filename);
+    free(filename);
+
+    if (job->type == UPLOAD_JOB_NEW) {
+        filename = uploadqueue_job_datafile(queue, job);
+        unlink(filename);
+        free(filename);
+    }
+
+    if (job->size > queue->queued_bytes) {
+        queue->queued_bytes = 0;
+    } else {
+        queue->queued_bytes -= job->size;
+    }
+
+    uploadqueue_job_free(job);
+}
+
+/*
+ * removes a job whose content is not needed anymore, which for a patch job
+ * also deletes the modified copy in the file cache
+ */
+static void uploadqueue_discard(uploadqueue * queue, struct upload_job *job)
+{
+    char           *datafile;
+
+    if (job->type == UPLOAD_JOB_PATCH) {
+        datafile = uploadqueue_job_datafile(queue, job);
+        unlink(datafile);
+        free(datafile);
+    }
+
+    uploadqueue_remove(queue, job);
+}
+
+/*
+ * returns the most recent job for path
+ */
+static struct upload_job *uploadqueue_find(uploadqueue * queue,
+                                           const char *path)
+{
+    struct upload_job *job;
+    struct upload_job *found;
+
+    found = NULL;
+    for (job = queue->jobs; job != NULL; job = job->next) {
+        if (strcmp(job->path, path) == 0)
+            found = job;
+    }
+
+    return found;
+}
+
+static struct upload_job *uploadqueue_find_in_progress(uploadqueue * queue,
+                                                       const char *path)
+{
+    struct upload_job *job;
+
+    for (job = queue->jobs; job != NULL; job = job->next) {
+        if (job->in_progress && strcmp(job->path, path) == 0)
+            return job;
+    }
+
+    return NULL;
+}
+
+/*
+ * unlike uploadqueue_wait() this leaves the jobs of path alone that are not
+ * being uploaded yet
+ */
+static int uploadqueue_wait_in_progress(uploadqueue * queue, const char *path)
+{
+    while (uploadqueue_find_in_progress(queue, path) != NULL) {
+        if (queue->stop || queue->workers == NULL)
+            return -1;
+        pthread_cond_wait(&(queue->cond), queue->mutex);
+    }
+
+    return 0;
+}
+
+/*
+ * returns the oldest job that is due and that does not concern a file that
+ * another worker is currently uploading
+ *
+ * if there is none, wakeup is set to the time when the next job is due or to
+ * zero if there is no job waiting
+ */
+static struct upload_job *uploadqueue_next(uploadqueue * queue, time_t now,
+                                           time_t * wakeup)
+{
+    struct upload_job *job;
+    struct upload_job *other;
+    bool            blocked;
+
+    *wakeup = 0;
+    for (job = queue->jobs; job != NULL; job = job->next) {
+        if (job->in_progress)
+            continue;
+
+        // uploads of the same file must happen in order
+        blocked = false;
+        for (other = queue->jobs; other != job; other = other->next) {
+            if (strcmp(other->path, job->path) == 0
+                || (other->quickkey != NULL && job->quickkey != NULL
+                    && strcmp(other->quickkey, job->quickkey) == 0)) {
+                blocked = true;
+                break;
+            }
+        }
+        if (blocked)
+            continue;
+
+        if (job->not_before <= now)
+            return job;
+
+        if (*wakeup == 0 || job->not_before < *wakeup)
+            *wakeup = job->not_before;
+    }
+
+    return NULL;
+}
+
+/*
+ * upload_key receives the key to poll for the completion of the upload. It
+ * stays NULL if the upload is already complete.
+ */
+static int uploadqueue_process_new(uploadqueue * queue, mfconn * conn,
+                                   struct upload_job *job, char **upload_key)
+{
+    FILE           *fh;
+    char           *datafile;
+    char           *temp;
+    char           *file_name;
+    char           *hash;
+    unsigned char   bhash[SHA256_DIGEST_LENGTH];
+    uint64_t        size;
+    int             retval;
+    bool            in_account;
+    struct mfconn_upload_check_result check_result;
+
+    *upload_key = NULL;
+
+    datafile = uploadqueue_job_datafile(queue, job);
+    fh = fopen(datafile, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "cannot open %s\n", datafile);
+        free(datafile);
+        return -1;
+    }
+    free(datafile);
+
+    if (job->has_hash) {
+        memcpy(bhash, job->hash, SHA256_DIGEST_LENGTH);
+        size = job->size;
+    } else {
+        retval = calc_sha256(fh, bhash, &size);
+        rewind(fh);
+        if (retval != 0) {
+            fprintf(stderr, "failed to calculate hash\n");
+            fclose(fh);
+            return -1;
+        }
+        // the hash is needed again to keep the file once it is uploaded
+        memcpy(job->hash, bhash, SHA256_DIGEST_LENGTH);
+        job->has_hash = true;
+    }
+
+    hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
+
+    // pass a copy because basename may modify its argument
+    temp = strdup(job->path);
+    file_name = basename(temp);
+
+    // content that is already in the account does not have to be checked
+    // with the server, the tree knows it
+    pthread_mutex_lock(queue->mutex);
+    in_account = folder_tree_lookup_hash(queue->tree, bhash, size) != NULL;
+    pthread_mutex_unlock(queue->mutex);
+    if (in_account) {
+        retval = mfconn_api_upload_instant(conn, NULL, file_name, hash, size,
+                                           job->folderkey);
+        if (retval == 0) {
+            fclose(fh);
+            free(temp);
+            free(hash);
+            return 0;
+        }
+        // the tree might be outdated, so do it the long way
+        fprintf(stderr, "upload/instant of known content failed\n");
+    }
+
+    // ask for a resumable upload so that the units which already arrived in
+    // an earlier attempt don't have to be sent again
+    retval = mfconn_api_upload_check(conn, file_name, hash, size,
+                                     job->folderkey, true, &check_result);
+    if (retval != 0) {
+        fprintf(stderr, "mfconn_api_upload_check failed\n");
+        mfapi_upload_resumable_clear(&(check_result.resumable));
+        fclose(fh);
+        free(temp);
+        free(hash);
+        return -1;
+    }
+
+    if (check_result.hash_exists) {
+        // hash exists, so use upload/instant
+        retval = mfconn_api_upload_instant(conn, NULL, file_name, hash, size,
+                                           job->folderkey);
+        mfapi_upload_resumable_clear(&(check_result.resumable));
+        fclose(fh);
+        free(temp);
+        free(hash);
+
+        if (retval != 0) {
+            fprintf(stderr, "mfconn_api_upload_instant failed\n");
+            return -1;
+        }
+        return 0;
+    }
+    // hash does not exist, so do full upload
+    if (size > 0 && check_result.resumable.number_of_units > 0) {
+        retval = mfconn_upload_resumable(conn, job->folderkey, fh, file_name,
+                                         size, hash, &(check_result.resumable),
+                                         queue->parallel_units, upload_key);
+    } else {
+        retval = mfconn_api_upload_simple(conn, job->folderkey, NULL, fh,
+                                          file_name, upload_key);
+    }
+    mfapi_upload_resumable_clear(&(check_result.resumable));
+    fclose(fh);
+    free(temp);
+    free(hash);
+
+    if (retval != 0 || *upload_key == NULL) {
+        fprintf(stderr, "upload of %s failed\n", job->path);
+        free(*upload_key);
+        *upload_key = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int uploadqueue_process_patch(uploadqueue * queue, mfconn * conn,
+                                     struct upload_job *job,
+                                     char **upload_key)
+{
+    int             retval;
+    char           *temp;
+
+    // pass a copy because basename may modify its argument
+    temp = strdup(job->path);
+    retval = filecache_upload_patch(job->quickkey, job->revision,
+                                    basename(temp),
+                                    job->has_source_hash ?
+                                    job->source_hash : NULL,
+                                    job->has_hash ? job->hash : NULL,
+                                    job->dirty, queue->filecache, conn,
+                                    job->hash, upload_key);
+    free(temp);
+    if (retval == 1) {
+        // the content did not change, so there is nothing to keep
+        job->has_hash = false;
+        return 0;
+    }
+    if (retval != 0) {
+        fprintf(stderr, "filecache_upload_patch failed\n");
+        return -1;
+    }
+    job->has_hash = true;
+
+    return 0;
+}
+
+/*
+ * moves the uploaded content into the file cache as the revision that the
+ * upload created, so that it does not have to be downloaded again
+ *
+ * the tree has to be updated already
+ */
+static void uploadqueue_adopt(uploadqueue * queue, struct upload_job *job)
+{
+    char           *datafile;
+
+    datafile = uploadqueue_job_datafile(queue, job);
+    if (folder_tree_adopt_file(queue->tree, queue->conn, job->path, datafile,
+                               job->hash) != 0) {
+        fprintf(stderr, "keeping the uploaded content of %s failed\n",
+                job->path);
+    }
+    free(datafile);
+}
+
+/*
+ * must be called with the mutex held once the server processed the upload
+ * of job or the upload failed
+ */
+static void uploadqueue_finish(uploadqueue * queue, struct upload_job *job,
+                               int retval)
+{
+    time_t          backoff;
+
+    job->in_progress = false;
+
+    if (retval == 0) {
+        // make the result visible before the job disappears so that
+        // there is no moment in which the file seems to be missing
+        folder_tree_update(queue->tree, queue->conn, true);
+        if (job->has_hash)
+            uploadqueue_adopt(queue, job);
+        // whatever was not moved into the cache is outdated now
+        uploadqueue_discard(queue, job);
+    } else {
+        job->attempts++;
+        backoff = uploadqueue_backoff(job->attempts);
+        job->not_before = time(NULL) + backoff;
+        fprintf(stderr, "upload of %s failed (attempt %u), retrying in "
+                "%d seconds\n", job->path, job->attempts, (int)backoff);
+        uploadqueue_job_store(queue, job);
+    }
+
+    pthread_cond_broadcast(&(queue->cond));
+}
+
+/*
+ * called by the tracker once the server processed an upload
+ */
+static void uploadqueue_upload_done(const char *upload_key, int result,
+                                    void *user_ptr)
+{
+    struct upload_tracked *tracked;
+
+    (void)upload_key;
+
+    tracked = (struct upload_tracked *)user_ptr;
+
+    pthread_mutex_lock(tracked->queue->mutex);
+    uploadqueue_finish(tracked->queue, tracked->job, result);
+    pthread_mutex_unlock(tracked->queue->mutex);
+
+    free(tracked);
+}
+
+/*
+ * the delay before the next attempt doubles with every failed attempt
+ */
+static time_t uploadqueue_backoff(unsigned int attempts)
+{
+    time_t          backoff;
+    unsigned int    i;
+
+    backoff = 10;
+    for (i = 1; i < attempts && backoff < UPLOADQUEUE_MAX_BACKOFF; i++) {
+        backoff *= 2;
+    }
+    if (backoff > UPLOADQUEUE_MAX_BACKOFF)
+        backoff = UPLOADQUEUE_MAX_BACKOFF;
+
+    return backoff;
+}
+
+/*
+ * uploads are delayed to give further modifications the chance to be merged
+ * into them but a file that is modified continuously is uploaded eventually
+ */
+static time_t uploadqueue_due(uploadqueue * queue, time_t since)
+{
+    time_t          due;
+    time_t          latest;
+
+    due = time(NULL) + queue->delay;
+    latest = since + UPLOADQUEUE_MAX_DEFERRAL * queue->delay;
+    if (due > latest)
+        due = latest;
+
+    return due;
+}
+
+static void    *uploadqueue_worker(void *user_ptr)
+{
+    uploadqueue    *queue;
+    struct upload_job *job;
+    struct upload_tracked *tracked;
+    mfconn         *conn;
+    char           *upload_key;
+    time_t          now;
+    time_t          wakeup;
+    struct timespec deadline;
+    int             retval;
+
+    queue = (uploadqueue *) user_ptr;
+    conn = NULL;
+
+    pthread_mutex_lock(queue->mutex);
+
+    while (!queue->stop) {
+        now = time(NULL);
+        job = uploadqueue_next(queue, now, &wakeup);
+        if (job == NULL) {
+            if (wakeup == 0) {
+                pthread_cond_wait(&(queue->cond), queue->mutex);
+            } else {
+                deadline.tv_sec = wakeup;
+                deadline.tv_nsec = 0;
+                pthread_cond_timedwait(&(queue->cond), queue->mutex,
+                                       &deadline);
+            }
+            continue;
+        }
+
+        job->in_progress = true;
+        pthread_mutex_unlock(queue->mutex);
+
+        // every worker uses its own session so that uploads do not have to
+        // be serialized with the other api calls
+        if (conn == NULL) {
+            conn = mfconn_acquire(queue->conn);
+        }
+
+        upload_key = NULL;
+        if (conn == NULL) {
+            fprintf(stderr, "cannot establish connection\n");
+            retval = -1;
+        } else if (job->type == UPLOAD_JOB_NEW) {
+            fprintf(stderr, "uploading new file %s\n", job->path);
+            retval = uploadqueue_process_new(queue, conn, job, &upload_key);
+        } else {
+            fprintf(stderr, "uploading patch for %s\n", job->path);
+            retval = uploadqueue_process_patch(queue, conn, job,
+                                               &upload_key);
+        }
+
+        if (retval != 0) {
+            // a new session is established for the next attempt
+            if (conn != NULL) {
+                mfconn_destroy(conn);
+                conn = NULL;
+            }
+        } else if (upload_key != NULL) {
+            // the job stays in progress until the server processed it
+            tracked = (struct upload_tracked *)
+                malloc(sizeof(struct upload_tracked));
+            tracked->queue = queue;
+            tracked->job = job;
+            if (uploadtracker_add(queue->tracker, upload_key,
+                                  uploadqueue_upload_done, tracked) == 0) {
+                free(upload_key);
+                pthread_mutex_lock(queue->mutex);
+                continue;
+            }
+            fprintf(stderr, "cannot track upload of %s\n", job->path);
+            free(tracked);
+            retval = -1;
+        }
+        free(upload_key);
+
+        pthread_mutex_lock(queue->mutex);
+        uploadqueue_finish(queue, job, retval);
+    }
+
+    pthread_mutex_unlock(queue->mutex);
+
+    mfconn_release(conn);
+
+    return NULL;
+}
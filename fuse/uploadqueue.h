@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __FUSE_UPLOADQUEUE_H__
+#define __FUSE_UPLOADQUEUE_H__
+
+#include <fuse/fuse.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "../mfapi/mfconn.h"
+#include "../utils/extents.h"
+#include "hashtbl.h"
+
+/*
+ * uploads of new and modified files are done in the background by a pool of
+ * workers
+ *
+ * every job is stored in the queue directory so that pending uploads are
+ * resumed when the filesystem is mounted the next time. New files are kept
+ * there as well until they are uploaded while for modified files the
+ * <key>_<rev>_new file of the file cache is used.
+ *
+ * uploads are delayed so that a file which is saved repeatedly within a short
+ * time is only uploaded once: reopening it for writing takes its job back
+ * from the queue.
+ *
+ * the queue shares the mutex of the filesystem context: all functions except
+ * uploadqueue_create, uploadqueue_start and uploadqueue_destroy must be called
+ * with the mutex held. The mutex is only held by the workers while they access
+ * the directory tree, the uploads themselves run with separate connections.
+ */
+typedef struct uploadqueue uploadqueue;
+
+struct uploadqueue_reclaimed {
+    bool            is_new;
+    char           *tmpfile;
+    char           *folderkey;
+    extents        *dirty;
+    time_t          since;
+};
+
+uploadqueue    *uploadqueue_create(const char *queuedir,
+                                   const char *filecache, folder_tree * tree,
+                                   mfconn * conn, pthread_mutex_t * mutex,
+                                   int num_workers, uint64_t max_dirty_bytes,
+                                   time_t delay, int parallel_units);
+
+int             uploadqueue_start(uploadqueue * queue);
+
+void            uploadqueue_destroy(uploadqueue * queue);
+
+int             uploadqueue_tmp_open(uploadqueue * queue, char **tmpfile);
+
+int             uploadqueue_add_new(uploadqueue * queue, const char *path,
+                                    const char *folderkey,
+                                    const char *tmpfile,
+                                    const unsigned char *hash, time_t since);
+
+int             uploadqueue_add_patch(uploadqueue * queue, const char *path,
+                                      const char *quickkey,
+                                      uint64_t revision,
+                                      const unsigned char *source_hash,
+                                      const unsigned char *target_hash,
+                                      extents * dirty, time_t since);
+
+bool            uploadqueue_getattr(uploadqueue * queue, const char *path,
+                                    struct stat *stbuf, bool in_tree);
+
+void            uploadqueue_readdir(uploadqueue * queue, const char *path,
+                                    void *buf, fuse_fill_dir_t filldir);
+
+int             uploadqueue_wait(uploadqueue * queue, const char *path);
+
+int             uploadqueue_reclaim(uploadqueue * queue, const char *path,
+                                    struct uploadqueue_reclaimed *reclaimed);
+
+bool            uploadqueue_rename(uploadqueue * queue, const char *oldpath,
+                                   const char *newpath,
+                                   const char *newfolderkey);
+
+int             uploadqueue_cancel(uploadqueue * queue, const char *path);
+
+void            uploadqueue_dirty_wait(uploadqueue * queue, uint64_t bytes);
+
+void            uploadqueue_dirty_add(uploadqueue * queue, uint64_t bytes);
+
+void            uploadqueue_dirty_sub(uploadqueue * queue, uint64_t bytes);
+
+#endif
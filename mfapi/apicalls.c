@@ -16,11 +16,19 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
 #include <jansson.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "../utils/http.h"
+#include "../utils/json_stream.h"
+#include "apicalls.h"
 
 const char     *mfconn_file_link_types[] = {
     "normal_download",
@@ -76,6 +84,77 @@ int mfapi_check_response(json_t * response, const char *apicall)
     return 0;
 }
 
+/*
+ * records the members of response that mfapi_check_stream_status() needs
+ *
+ * to be called with every event of a response that is parsed with
+ * json_stream. The status must have been zeroed before.
+ */
+void mfapi_stream_status(json_stream * stream, enum json_stream_event event,
+                         const char *value,
+                         struct mfapi_stream_status *status)
+{
+    const char     *key;
+
+    if (json_stream_depth(stream) != 2 || value == NULL)
+        return;
+    if (!json_stream_key_is(stream, 0, "response"))
+        return;
+
+    key = json_stream_key(stream, 1);
+    if (key == NULL) {
+        return;
+    } else if (strcmp(key, "error") == 0) {
+        // usually a number but strings have been seen as well
+        status->error = atoi(value);
+    } else if (event != JSON_STREAM_STRING) {
+        return;
+    } else if (strcmp(key, "result") == 0) {
+        snprintf(status->result, sizeof(status->result), "%s", value);
+    } else if (strcmp(key, "action") == 0) {
+        snprintf(status->action, sizeof(status->action), "%s", value);
+    } else if (strcmp(key, "message") == 0) {
+        snprintf(status->message, sizeof(status->message), "%s", value);
+    }
+}
+
+/*
+ * the same as mfapi_check_response() for a response that was parsed with
+ * json_stream
+ */
+int mfapi_check_stream_status(struct mfapi_stream_status *status,
+                              const char *apicall)
+{
+    int             error_code;
+
+    if (strcmp(status->result, "Success") != 0) {
+        // an error occurred
+        if (status->message[0] == '\0') {
+            fprintf(stderr, "no error message\n");
+        } else {
+            fprintf(stderr, "error message: %s\n", status->message);
+        }
+        fprintf(stderr, "error code: %d\n", status->error);
+        error_code = status->error;
+        if (error_code == 0)
+            error_code = -1;
+        return error_code;
+    }
+
+    if (status->action[0] == '\0') {
+        fprintf(stderr, "no value for action\n");
+        return -1;
+    }
+
+    if (strcmp(status->action, apicall) != 0) {
+        fprintf(stderr, "expected action %s but got %s", apicall,
+                status->action);
+        return -1;
+    }
+
+    return 0;
+}
+
 int mfapi_decode_common(mfhttp * conn, void *user_ptr)
 {
     json_t         *root;
@@ -112,3 +191,140 @@ int mfapi_decode_common(mfhttp * conn, void *user_ptr)
 
     return 0;
 }
+
+/*
+ * fills resumable from the response/resumable_upload node of upload/check and
+ * upload/resumable
+ *
+ * resumable must have been cleared before or filled by an earlier call
+ */
+int mfapi_decode_upload_resumable(json_t * node,
+                                  struct mfconn_upload_resumable *resumable)
+{
+    json_t         *j_obj;
+    json_t         *words;
+    size_t          i;
+
+    mfapi_upload_resumable_clear(resumable);
+
+    if (node == NULL || !json_is_object(node)) {
+        fprintf(stderr, "no resumable_upload content\n");
+        return -1;
+    }
+
+    j_obj = json_object_get(node, "all_units_ready");
+    if (j_obj != NULL && json_is_string(j_obj)
+        && strcmp(json_string_value(j_obj), "yes") == 0) {
+        resumable->all_units_ready = true;
+    }
+
+    j_obj = json_object_get(node, "number_of_units");
+    if (j_obj == NULL || !json_is_string(j_obj)) {
+        fprintf(stderr, "json: no /number_of_units content\n");
+        return -1;
+    }
+    resumable->number_of_units = strtoull(json_string_value(j_obj), NULL, 10);
+
+    j_obj = json_object_get(node, "unit_size");
+    if (j_obj == NULL || !json_is_string(j_obj)) {
+        fprintf(stderr, "json: no /unit_size content\n");
+        return -1;
+    }
+    resumable->unit_size = strtoull(json_string_value(j_obj), NULL, 10);
+
+    if (resumable->number_of_units > 0 && resumable->unit_size == 0) {
+        fprintf(stderr, "unit_size must not be zero\n");
+        return -1;
+    }
+
+    j_obj = json_object_get(node, "bitmap");
+    words = json_object_get(j_obj, "words");
+    if (words != NULL && json_is_array(words) && json_array_size(words) > 0) {
+        resumable->bitmap_count = json_array_size(words);
+        resumable->bitmap = (uint16_t *) calloc(resumable->bitmap_count,
+                                                sizeof(uint16_t));
+        for (i = 0; i < resumable->bitmap_count; i++) {
+            j_obj = json_array_get(words, i);
+            if (json_is_string(j_obj)) {
+                resumable->bitmap[i] = atoi(json_string_value(j_obj));
+            } else if (json_is_integer(j_obj)) {
+                resumable->bitmap[i] = json_integer_value(j_obj);
+            }
+        }
+    }
+
+    j_obj = json_object_get(node, "upload_key");
+    if (j_obj != NULL && json_is_string(j_obj)
+        && strcmp(json_string_value(j_obj), "") != 0) {
+        resumable->upload_key = strdup(json_string_value(j_obj));
+    }
+
+    return 0;
+}
+
+void mfapi_upload_resumable_clear(struct mfconn_upload_resumable *resumable)
+{
+    free(resumable->bitmap);
+    free(resumable->upload_key);
+    memset(resumable, 0, sizeof(struct mfconn_upload_resumable));
+}
+
+bool mfapi_upload_resumable_unit_ready(struct mfconn_upload_resumable
+                                       *resumable, uint64_t unit_id)
+{
+    if (resumable->all_units_ready)
+        return true;
+
+    if (unit_id / 16 >= resumable->bitmap_count)
+        return false;
+
+    return (resumable->bitmap[unit_id / 16] & (1 << (unit_id % 16))) != 0;
+}
+
+/*
+ * joins keys with commas for the api calls that accept several keys at once
+ */
+char           *mfapi_join_keys(const char **keys, int num_keys)
+{
+    char           *joined;
+    size_t          len;
+    int             i;
+
+    len = 1;
+    for (i = 0; i < num_keys; i++) {
+        len += strlen(keys[i]) + 1;
+    }
+
+    joined = (char *)malloc(len);
+    if (joined == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return NULL;
+    }
+
+    joined[0] = '\0';
+    for (i = 0; i < num_keys; i++) {
+        if (i > 0)
+            strcat(joined, ",");
+        strcat(joined, keys[i]);
+    }
+
+    return joined;
+}
+
+/*
+ * returns the position of key in keys or -1 if it is not among them
+ */
+int mfapi_find_key(const char **keys, int num_keys, const char *key)
+{
+    int             i;
+
+    if (key == NULL)
+        return -1;
+
+    for (i = 0; i < num_keys; i++) {
+        if (strcmp(keys[i], key) == 0)
+            return i;
+    }
+
+    return -1;
+}
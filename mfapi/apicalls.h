@@ -31,12 +31,29 @@
 #include "patch.h"
 #include "mfconn.h"
 #include "../utils/http.h"
+#include "../utils/json_stream.h"
 
 #define MFAPI_MAX_LEN_KEY 15
 #define MFAPI_MAX_LEN_NAME 255
 
 #define MFAPI_VERSION "1.2"
 
+// how many keys are sent in one call to an api that accepts several
+#define MFAPI_MAX_BATCH_KEYS 100
+
+// the largest page that folder/get_content hands out and how many pages of a
+// folder are requested at the same time
+#define MFAPI_FOLDER_CONTENT_CHUNK_SIZE 1000
+#define MFAPI_FOLDER_CONTENT_PARALLEL 4
+
+// the range of the intervals (in milliseconds) between polls of an upload
+#define MFAPI_UPLOAD_POLL_FIRST_INTERVAL 250
+#define MFAPI_UPLOAD_POLL_MAX_INTERVAL 16000
+
+// content types for mfconn_api_folder_get_content_stream()
+#define MFCONN_FOLDER_CONTENT_FOLDERS 1
+#define MFCONN_FOLDER_CONTENT_FILES 2
+
 enum mfconn_device_change_type {
     MFCONN_DEVICE_CHANGE_DELETED_FOLDER,
     MFCONN_DEVICE_CHANGE_DELETED_FILE,
@@ -56,6 +73,13 @@ enum mfconn_file_link_type {
     MFCONN_FILE_LINK_TYPE_ONE_TIME_DOWNLOAD
 };
 
+/*
+ * receives one entry of a folder: either folder or file is set and is only
+ * valid during the call
+ */
+typedef int     (*mfconn_folder_content_cb) (mffolder * folder, mffile * file,
+                                             void *user_ptr);
+
 extern const char *mfconn_file_link_types[];    // declared in apicalls.c
 
 struct mfconn_device_change {
@@ -65,26 +89,92 @@ struct mfconn_device_change {
     char            parent[16];
 };
 
+/*
+ * the state of a resumable upload as reported by upload/check and
+ * upload/resumable
+ *
+ * the file is sent in number_of_units units of unit_size bytes (the last one
+ * may be shorter). The server remembers the units it received by the hash of
+ * the file, so an interrupted upload can be continued later.
+ */
+struct mfconn_upload_resumable {
+    bool            all_units_ready;
+    uint64_t        number_of_units;
+    uint64_t        unit_size;
+    /* one bit per received unit, sixteen units per word */
+    uint64_t        bitmap_count;
+    uint16_t       *bitmap;
+    char           *upload_key;
+};
+
 struct mfconn_upload_check_result {
     bool            hash_exists;
     bool            in_account;
     bool            file_exists;
     bool            different_hash;
-    /* TODO: add resumable_upload */
+    /* only filled if a resumable upload was asked for */
+    struct mfconn_upload_resumable resumable;
+};
+
+/*
+ * the members of the response that tell whether an api call succeeded, as
+ * collected by mfapi_stream_status() from a response that is parsed while it
+ * arrives
+ */
+struct mfapi_stream_status {
+    char            result[16];
+    char            action[64];
+    char            message[256];
+    int             error;
 };
 
 int             mfapi_check_response(json_t * response, const char *apicall);
 
+void            mfapi_stream_status(json_stream * stream,
+                                    enum json_stream_event event,
+                                    const char *value,
+                                    struct mfapi_stream_status *status);
+
+int             mfapi_check_stream_status(struct mfapi_stream_status *status,
+                                          const char *apicall);
+
 int             mfapi_decode_common(mfhttp * conn, void *user_ptr);
 
+char           *mfapi_join_keys(const char **keys, int num_keys);
+
+int             mfapi_find_key(const char **keys, int num_keys,
+                               const char *key);
+
+int             mfapi_decode_upload_resumable(json_t * node,
+                                              struct mfconn_upload_resumable
+                                              *resumable);
+
+void            mfapi_upload_resumable_clear(struct mfconn_upload_resumable
+                                             *resumable);
+
+bool            mfapi_upload_resumable_unit_ready(struct
+                                                  mfconn_upload_resumable
+                                                  *resumable,
+                                                  uint64_t unit_id);
+
 int             mfconn_api_file_get_info(mfconn * conn, mffile * file,
                                          const char *quickkey);
 
+int             mfconn_api_file_get_info_batch(mfconn * conn,
+                                               const char **quickkeys,
+                                               int num_keys, mffile ** files);
+
 int             mfconn_api_file_get_links(mfconn * conn, mffile * file,
                                           const char *quickkey,
                                           enum mfconn_file_link_type
                                           link_mask);
 
+int             mfconn_api_file_get_links_batch(mfconn * conn,
+                                                const char **quickkeys,
+                                                int num_keys,
+                                                enum mfconn_file_link_type
+                                                link_mask, mffile ** files);
+
 int             mfconn_api_file_move(mfconn * conn, const char *quickkey,
                                      const char *folderkey);
 
@@ -100,9 +190,20 @@ long            mfconn_api_folder_get_content(mfconn * conn, const int mode,
                                               mffolder *** folder_result,
                                               mffile *** file_result);
 
+int             mfconn_api_folder_get_content_stream(mfconn * conn,
+                                                     const char *folderkey,
+                                                     int content_mask,
+                                                     mfconn_folder_content_cb
+                                                     cb, void *user_ptr);
+
 int             mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
                                            const char *folderkey);
 
+int             mfconn_api_folder_get_info_batch(mfconn * conn,
+                                                 const char **folderkeys,
+                                                 int num_keys,
+                                                 mffolder ** folders);
+
 int             mfconn_api_folder_move(mfconn * conn,
                                        const char *folder_key_src,
                                        const char *folder_key_dst);
@@ -148,6 +249,7 @@ int             mfconn_api_device_get_patch(mfconn * conn, mfpatch * patch,
 int             mfconn_api_upload_check(mfconn * conn, const char *filename,
                                         const char *hash,
                                         uint64_t size, const char *folder_key,
+                                        bool resumable,
                                         struct mfconn_upload_check_result
                                         *result);
 
@@ -157,9 +259,22 @@ int             mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
                                           const char *folder_key);
 
 int             mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
-                                         FILE * fh, const char *file_name,
+                                         const char *quickkey, FILE * fh,
+                                         const char *file_name,
                                          char **upload_key);
 
+int             mfconn_api_upload_resumable(mfconn * conn,
+                                            const char *folderkey,
+                                            const char *file_name,
+                                            uint64_t file_size,
+                                            const char *file_hash,
+                                            uint64_t unit_id,
+                                            const unsigned char *unit_data,
+                                            uint64_t unit_size,
+                                            const char *unit_hash,
+                                            struct mfconn_upload_resumable
+                                            *resumable, char **upload_key);
+
 int             mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
                                         const char *source_hash,
                                         const char *target_hash,
@@ -171,4 +286,11 @@ int             mfconn_api_upload_poll_upload(mfconn * conn,
                                               const char *upload_key,
                                               int *status, int *fileerror);
 
+int             mfconn_api_upload_poll_uploads(mfconn * conn,
+                                               const char **upload_keys,
+                                               int num_keys, int *status,
+                                               int *fileerror);
+
+int             mfapi_upload_poll_interval(unsigned int polls);
+
 #endif
@@ -17,19 +17,44 @@
  *
  */
 
-#include <jansson.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #include "../../utils/http.h"
+#include "../../utils/json_stream.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
-static int      _decode_device_get_changes(mfhttp * conn, void *data);
+/*
+ * the changes are collected while the response is parsed
+ */
+struct device_changes {
+    struct mfapi_stream_status status;
+    struct mfconn_device_change *changes;
+    size_t          len_changes;
+    size_t          size_changes;
+    // the change that is being parsed
+    struct mfconn_device_change change;
+    bool            have_key;
+    bool            have_parent;
+    bool            have_revision;
+    bool            have_device_revision;
+    uint64_t        device_revision;
+};
+
+static int      _decode_device_get_changes(json_stream * stream,
+                                           enum json_stream_event event,
+                                           const char *value, size_t len,
+                                           void *user_ptr);
+
+static int      device_changes_finish(struct device_changes *result,
+                                      struct mfconn_device_change **changes);
 
 /*
  * the mfconn_device_change array will be realloc'ed so it must either point
@@ -42,75 +67,53 @@ int mfconn_api_device_get_changes(mfconn * conn, uint64_t revision,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
+    json_stream    *json;
+    struct device_changes result;
 
     if (conn == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    memset(&result, 0, sizeof(struct device_changes));
+    json = json_stream_create(_decode_device_get_changes, &result);
+    if (json == NULL)
+        return -1;
+
+    mfapi_request_init(&request, conn, "device/get_changes");
+    while (mfapi_request_next(&request, &retval)) {
         if (*changes != NULL) {
             free(*changes);
             *changes = NULL;
         }
+        free(result.changes);
+        memset(&result, 0, sizeof(struct device_changes));
 
         api_call = mfconn_create_signed_get(conn, 0, "device/get_changes.php",
                                             "?revision=%" PRIu64
                                             "&response_format=json", revision);
         if (api_call == NULL) {
             fprintf(stderr, "mfconn_create_signed_get failed\n");
-            return -1;
+            retval = -1;
+            break;
         }
 
         http = http_create();
-        retval =
-            http_get_buf(http, api_call, _decode_device_get_changes,
-                         (void *)changes);
+        retval = http_get_json(http, api_call, json);
         http_destroy(http);
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
+        if (retval == 0)
+            retval = device_changes_finish(&result, changes);
     }
 
-    return retval;
-}
+    // on success, the array was handed over to changes
+    free(result.changes);
+    json_stream_destroy(json);
 
-static void aux(json_t * key, json_t * parent, json_t * revision,
-                enum mfconn_device_change_type change,
-                struct mfconn_device_change **changes, size_t * len_changes)
-{
-    struct mfconn_device_change *tmp_change;
-
-    if (key == NULL || revision == NULL || parent == NULL) {
-        fprintf(stderr, "change without either key, revision or parent");
-        return;
-    }
-    (*len_changes)++;
-    *changes = (struct mfconn_device_change *)
-        realloc(*changes,
-                (*len_changes) * sizeof(struct mfconn_device_change));
-    tmp_change = *changes + (*len_changes) - 1;
-    tmp_change->change = change;
-    strncpy(tmp_change->key, json_string_value(key), sizeof(tmp_change->key));
-    strncpy(tmp_change->parent, json_string_value(parent),
-            sizeof(tmp_change->parent));
-    tmp_change->revision = atoll(json_string_value(revision));
+    return retval;
 }
 
 static int change_compare(const void *a, const void *b)
@@ -119,136 +122,141 @@ static int change_compare(const void *a, const void *b)
         - ((struct mfconn_device_change *)b)->revision;
 }
 
-static int _decode_device_get_changes(mfhttp * conn, void *user_ptr)
+/*
+ * changes are listed in response/updated/files, response/updated/folders,
+ * response/deleted/files and response/deleted/folders
+ */
+static int _decode_device_get_changes(json_stream * stream,
+                                      enum json_stream_event event,
+                                      const char *value, size_t len,
+                                      void *user_ptr)
 {
-    json_error_t    error;
-    json_t         *root;
-    json_t         *node;
-    json_t         *response;
-    json_t         *data;
-
-    json_t         *obj_array;
-    json_t         *key;
-    json_t         *parent;
-    json_t         *revision;
-    json_t         *device_revision;
-    int             retval;
+    struct device_changes *result;
+    bool            deleted;
+    bool            files;
+    const char     *key;
+    int             depth;
 
-    int             array_sz;
-    int             i = 0;
+    (void)len;
 
-    struct mfconn_device_change **changes;
-    size_t          len_changes;
+    result = (struct device_changes *)user_ptr;
 
-    changes = (struct mfconn_device_change **)user_ptr;
-    if (changes == NULL)
-        return -1;
+    mfapi_stream_status(stream, event, value, &(result->status));
 
-    root = http_parse_buf_json(conn, 0, &error);
+    depth = json_stream_depth(stream);
+    if (depth < 2 || !json_stream_key_is(stream, 0, "response"))
+        return 0;
 
-    if (root == NULL) {
-        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
-        fprintf(stderr, "error message: %s\n", error.text);
-        return -1;
+    if (depth == 2) {
+        if (value != NULL
+            && json_stream_key_is(stream, 1, "device_revision")) {
+            result->device_revision = atoll(value);
+            result->have_device_revision = true;
+        }
+        return 0;
     }
 
-    response = json_object_get(root, "response");
+    if (json_stream_key_is(stream, 1, "updated"))
+        deleted = false;
+    else if (json_stream_key_is(stream, 1, "deleted"))
+        deleted = true;
+    else
+        return 0;
+
+    if (json_stream_key_is(stream, 2, "files"))
+        files = true;
+    else if (json_stream_key_is(stream, 2, "folders"))
+        files = false;
+    else
+        return 0;
+
+    if (depth == 4 && event == JSON_STREAM_OBJECT_BEGIN) {
+        memset(&(result->change), 0, sizeof(struct mfconn_device_change));
+        result->have_key = false;
+        result->have_parent = false;
+        result->have_revision = false;
+    } else if (depth == 4 && event == JSON_STREAM_OBJECT_END) {
+        if (!result->have_key || !result->have_parent
+            || !result->have_revision) {
+            fprintf(stderr, "change without either key, revision or parent\n");
+            return 0;
+        }
+        if (deleted && files)
+            result->change.change = MFCONN_DEVICE_CHANGE_DELETED_FILE;
+        else if (deleted)
+            result->change.change = MFCONN_DEVICE_CHANGE_DELETED_FOLDER;
+        else if (files)
+            result->change.change = MFCONN_DEVICE_CHANGE_UPDATED_FILE;
+        else
+            result->change.change = MFCONN_DEVICE_CHANGE_UPDATED_FOLDER;
+
+        // leave room for the terminating entry
+        if (result->len_changes + 2 > result->size_changes) {
+            result->size_changes = result->size_changes * 2 + 16;
+            result->changes = (struct mfconn_device_change *)
+                realloc(result->changes, result->size_changes *
+                        sizeof(struct mfconn_device_change));
+        }
+        result->changes[result->len_changes++] = result->change;
+    } else if (depth == 5 && value != NULL) {
+        key = json_stream_key(stream, 4);
+        if (key == NULL) {
+            return 0;
+        } else if (strcmp(key, files ? "quickkey" : "folderkey") == 0) {
+            strncpy(result->change.key, value,
+                    sizeof(result->change.key) - 1);
+            result->have_key = true;
+        } else if (strcmp(key, "parent_folderkey") == 0) {
+            strncpy(result->change.parent, value,
+                    sizeof(result->change.parent) - 1);
+            result->have_parent = true;
+        } else if (strcmp(key, "revision") == 0) {
+            result->change.revision = atoll(value);
+            result->have_revision = true;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * sorts the changes by revision and hands them to changes
+ */
+static int device_changes_finish(struct device_changes *result,
+                                 struct mfconn_device_change **changes)
+{
+    int             retval;
 
-    retval = mfapi_check_response(response, "device/get_changes");
+    retval = mfapi_check_stream_status(&(result->status),
+                                       "device/get_changes");
     if (retval != 0) {
         fprintf(stderr, "invalid response\n");
-        json_decref(root);
         return retval;
     }
 
-    device_revision = json_object_get(response, "device_revision");
-    if (device_revision == NULL) {
+    if (!result->have_device_revision) {
         fprintf(stderr,
                 "response/device_revision is not part of the result\n");
-        json_decref(root);
         return -1;
     }
 
-    len_changes = 0;
-
-    node = json_object_get(response, "updated");
-
-    obj_array = json_object_get(node, "files");
-    if (json_is_array(obj_array)) {
-        array_sz = json_array_size(obj_array);
-        for (i = 0; i < array_sz; i++) {
-            data = json_array_get(obj_array, i);
-            if (!json_is_object(data))
-                continue;
-            key = json_object_get(data, "quickkey");
-            parent = json_object_get(data, "parent_folderkey");
-            revision = json_object_get(data, "revision");
-            aux(key, parent, revision, MFCONN_DEVICE_CHANGE_UPDATED_FILE,
-                changes, &len_changes);
-        }
-    }
-
-    obj_array = json_object_get(node, "folders");
-    if (json_is_array(obj_array)) {
-        array_sz = json_array_size(obj_array);
-        for (i = 0; i < array_sz; i++) {
-            data = json_array_get(obj_array, i);
-            if (!json_is_object(data))
-                continue;
-            key = json_object_get(data, "folderkey");
-            parent = json_object_get(data, "parent_folderkey");
-            revision = json_object_get(data, "revision");
-            aux(key, parent, revision, MFCONN_DEVICE_CHANGE_UPDATED_FOLDER,
-                changes, &len_changes);
-        }
-    }
-
-    node = json_object_get(response, "deleted");
-
-    obj_array = json_object_get(node, "files");
-    if (json_is_array(obj_array)) {
-        array_sz = json_array_size(obj_array);
-        for (i = 0; i < array_sz; i++) {
-            data = json_array_get(obj_array, i);
-            if (!json_is_object(data))
-                continue;
-            key = json_object_get(data, "quickkey");
-            parent = json_object_get(data, "parent_folderkey");
-            revision = json_object_get(data, "revision");
-            aux(key, parent, revision, MFCONN_DEVICE_CHANGE_DELETED_FILE,
-                changes, &len_changes);
-        }
-    }
-
-    obj_array = json_object_get(node, "folders");
-    if (json_is_array(obj_array)) {
-        array_sz = json_array_size(obj_array);
-        for (i = 0; i < array_sz; i++) {
-            data = json_array_get(obj_array, i);
-            if (!json_is_object(data))
-                continue;
-            key = json_object_get(data, "folderkey");
-            parent = json_object_get(data, "parent_folderkey");
-            revision = json_object_get(data, "revision");
-            aux(key, parent, revision, MFCONN_DEVICE_CHANGE_DELETED_FOLDER,
-                changes, &len_changes);
-        }
+    if (result->changes == NULL) {
+        result->changes = (struct mfconn_device_change *)
+            malloc(sizeof(struct mfconn_device_change));
     }
     // sort
-    qsort(*changes, len_changes, sizeof(struct mfconn_device_change),
-          change_compare);
+    qsort(result->changes, result->len_changes,
+          sizeof(struct mfconn_device_change), change_compare);
 
     // put an entry with change type MFCONN_DEVICE_CHANGE_END at the end
     // encode the current device revision as its revision
-    len_changes++;
-    *changes = (struct mfconn_device_change *)
-        realloc(*changes, len_changes * sizeof(struct mfconn_device_change));
-    memset(*changes + len_changes - 1, 0, sizeof(struct mfconn_device_change));
-    (*changes)[len_changes - 1].change = MFCONN_DEVICE_CHANGE_END;
-    (*changes)[len_changes - 1].revision =
-        atoll(json_string_value(device_revision));
-
-    json_decref(root);
+    memset(result->changes + result->len_changes, 0,
+           sizeof(struct mfconn_device_change));
+    result->changes[result->len_changes].change = MFCONN_DEVICE_CHANGE_END;
+    result->changes[result->len_changes].revision = result->device_revision;
+
+    *changes = result->changes;
+    result->changes = NULL;
 
     return 0;
 }
@@ -26,6 +26,7 @@
 #include "../../utils/http.h"
 #include "../mfconn.h"
 #include "../patch.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_device_get_patch(mfhttp * conn, void *data);
@@ -38,7 +39,7 @@ int mfconn_api_device_get_patch(mfconn * conn, mfpatch * patch,
     int             len;
     mfhttp         *http;
     int             retval;
-    int             i;
+    struct mfapi_request request;
 
     if (conn == NULL)
         return -1;
@@ -54,7 +55,8 @@ int mfconn_api_device_get_patch(mfconn * conn, mfpatch * patch,
     if (len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "device/get_patch");
+    while (mfapi_request_next(&request, &retval)) {
         api_call = mfconn_create_signed_get(conn, 0, "device/get_patch.php",
                                             "?quick_key=%s"
                                             "&source_revision=%" PRIu64
@@ -73,22 +75,6 @@ int mfconn_api_device_get_patch(mfconn * conn, mfpatch * patch,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
@@ -24,6 +24,7 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_device_get_status(mfhttp * conn, void *data);
@@ -32,13 +33,14 @@ int mfconn_api_device_get_status(mfconn * conn, uint64_t * revision)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
 
     if (conn == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "device/get_status");
+    while (mfapi_request_next(&request, &retval)) {
         api_call = mfconn_create_signed_get(conn, 0, "device/get_status.php",
                                             "?response_format=json");
         if (api_call == NULL) {
@@ -54,22 +56,6 @@ int mfconn_api_device_get_status(mfconn * conn, uint64_t * revision)
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
@@ -27,6 +27,7 @@
 #include "../../utils/http.h"
 #include "../patch.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_device_get_updates(mfhttp * conn, void *data);
@@ -39,8 +40,8 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
     int             len;
     mfhttp         *http;
     int             retval;
-    int             i,
-                    j;
+    struct mfapi_request request;
+    int             j;
 
     if (conn == NULL)
         return -1;
@@ -56,7 +57,8 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
     if (len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "device/get_updates");
+    while (mfapi_request_next(&request, &retval)) {
         if (*patches != NULL) {
             for (j = 0; (*patches)[j] != NULL; j++) {
                 patch_free((*patches)[j]);
@@ -94,22 +96,6 @@ int mfconn_api_device_get_updates(mfconn * conn, const char *quickkey,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
@@ -128,6 +114,8 @@ static int _decode_device_get_updates(mfhttp * conn, void *user_ptr)
     json_t         *source_hash;
     json_t         *target_hash;
     json_t         *patch_hash;
+    json_t         *patch_size;
+    json_t         *target_size;
 
     int             array_sz;
     int             i;
@@ -172,6 +160,10 @@ static int _decode_device_get_updates(mfhttp * conn, void *user_ptr)
             source_hash = json_object_get(data, "source_hash");
             target_hash = json_object_get(data, "target_hash");
             patch_hash = json_object_get(data, "patch_hash");
+            // the sizes are optional and only used to estimate the cost of
+            // the update
+            patch_size = json_object_get(data, "patch_size");
+            target_size = json_object_get(data, "target_size");
             if (source_revision == NULL || target_revision == NULL
                 || source_hash == NULL || target_hash == NULL
                 || patch_hash == NULL) {
@@ -187,6 +179,12 @@ static int _decode_device_get_updates(mfhttp * conn, void *user_ptr)
             patch_set_source_hash(tmp_patch, json_string_value(source_hash));
             patch_set_target_hash(tmp_patch, json_string_value(target_hash));
             patch_set_hash(tmp_patch, json_string_value(patch_hash));
+            if (json_is_string(patch_size))
+                patch_set_size(tmp_patch,
+                               atoll(json_string_value(patch_size)));
+            if (json_is_string(target_size))
+                patch_set_target_size(tmp_patch,
+                                      atoll(json_string_value(target_size)));
             len_patches++;
             *patches = (mfpatch **) realloc(*patches,
                                             len_patches * sizeof(mfpatch *));
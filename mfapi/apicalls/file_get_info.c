@@ -17,10 +17,6 @@
  *
  */
 
-#ifndef __OpenBSD__
-#define _XOPEN_SOURCE           // for strptime
-#endif
-
 #include <jansson.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,20 +24,30 @@
 #include <time.h>
 
 #include "../../utils/http.h"
+#include "../../utils/strings.h"
 #include "../mfconn.h"
 #include "../file.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_file_get_info(mfhttp * conn, void *data);
+static int      _decode_file_get_info_batch(mfhttp * conn, void *data);
+static int      _decode_file_info(json_t * node, mffile * file);
+
+struct file_info_batch {
+    const char    **quickkeys;
+    int             num_keys;
+    mffile        **files;
+};
 
 int mfconn_api_file_get_info(mfconn * conn, mffile * file,
                              const char *quickkey)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     int             len;
     mfhttp         *http;
-    int             i;
 
     if (conn == NULL)
         return -1;
@@ -57,7 +63,8 @@ int mfconn_api_file_get_info(mfconn * conn, mffile * file,
     if (len != 11 && len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "file/get_info");
+    while (mfapi_request_next(&request, &retval)) {
         api_call = mfconn_create_signed_get(conn, 0, "file/get_info.php",
                                             "?quick_key=%s"
                                             "&response_format=json", quickkey);
@@ -72,38 +79,151 @@ int mfconn_api_file_get_info(mfconn * conn, mffile * file,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
+    }
 
-        if (retval != 127 && retval != 28)
-            break;
+    return retval;
+}
 
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+/*
+ * retrieves the information of num_keys files with as few calls as possible
+ *
+ * files must have room for num_keys pointers. A new mffile is stored at the
+ * position of every key that the server returned information for, the
+ * others are set to NULL. On error, the files that were already retrieved
+ * are kept and have to be freed by the caller as well.
+ */
+int mfconn_api_file_get_info_batch(mfconn * conn, const char **quickkeys,
+                                   int num_keys, mffile ** files)
+{
+    struct file_info_batch batch;
+    const char     *api_call;
+    char           *joined;
+    int             retval;
+    struct mfapi_request request;
+    int             len;
+    mfhttp         *http;
+    int             offset;
+    int             i;
+
+    if (conn == NULL)
+        return -1;
+
+    if (quickkeys == NULL || files == NULL)
+        return -1;
+
+    for (i = 0; i < num_keys; i++) {
+        files[i] = NULL;
+        len = strlen(quickkeys[i]);
+        // key must either be 11 or 15 chars
+        if (len != 11 && len != 15)
+            return -1;
+    }
+
+    retval = 0;
+    for (offset = 0; offset < num_keys; offset += MFAPI_MAX_BATCH_KEYS) {
+        batch.quickkeys = quickkeys + offset;
+        batch.num_keys = num_keys - offset;
+        if (batch.num_keys > MFAPI_MAX_BATCH_KEYS)
+            batch.num_keys = MFAPI_MAX_BATCH_KEYS;
+        batch.files = files + offset;
+
+        joined = mfapi_join_keys(batch.quickkeys, batch.num_keys);
+        if (joined == NULL)
+            return -1;
+
+        mfapi_request_init(&request, conn, "file/get_info");
+        while (mfapi_request_next(&request, &retval)) {
+            api_call = mfconn_create_signed_get(conn, 0, "file/get_info.php",
+                                                "?quick_key=%s"
+                                                "&response_format=json",
+                                                joined);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(joined);
+                return -1;
+            }
+
+            http = http_create();
+            retval = http_get_buf(http, api_call,
+                                  _decode_file_get_info_batch, &batch);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
         }
+        free(joined);
+
+        if (retval != 0)
+            break;
     }
 
     return retval;
 }
 
-static int _decode_file_get_info(mfhttp * conn, void *data)
+static int _decode_file_get_info_batch(mfhttp * conn, void *data)
 {
     json_error_t    error;
     json_t         *root;
     json_t         *node;
-    json_t         *obj;
+    json_t         *infos;
     json_t         *quickkey;
+    struct file_info_batch *batch;
+    size_t          i;
+    int             pos;
+    int             retval;
+
+    if (data == NULL)
+        return -1;
+
+    batch = (struct file_info_batch *)data;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "file/get_info");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    // several keys are answered with an array, a single one is not
+    infos = json_object_get(node, "file_infos");
+    if (!json_is_array(infos))
+        infos = NULL;
+    node = json_object_get(node, "file_info");
+
+    for (i = 0; infos != NULL ? i < json_array_size(infos) : i < 1; i++) {
+        if (infos != NULL)
+            node = json_array_get(infos, i);
+        quickkey = json_object_get(node, "quickkey");
+        pos = mfapi_find_key(batch->quickkeys, batch->num_keys,
+                             json_string_value(quickkey));
+        if (pos < 0 || batch->files[pos] != NULL)
+            continue;
+        batch->files[pos] = file_alloc();
+        _decode_file_info(node, batch->files[pos]);
+    }
+
+    json_decref(root);
+
+    return 0;
+}
+
+static int _decode_file_get_info(mfhttp * conn, void *data)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
     int             retval = 0;
     mffile         *file;
-    char           *ret;
-    struct tm       tm;
 
     if (data == NULL)
         return -1;
@@ -129,6 +249,22 @@ static int _decode_file_get_info(mfhttp * conn, void *data)
 
     node = json_object_get(node, "file_info");
 
+    retval = _decode_file_info(node, file);
+
+    json_decref(root);
+
+    return retval;
+}
+
+/*
+ * returns -1 if the node does not name the file
+ */
+static int _decode_file_info(json_t * node, mffile * file)
+{
+    json_t         *obj;
+    json_t         *quickkey;
+    time_t          created_time;
+
     quickkey = json_object_get(node, "quickkey");
     if (quickkey != NULL)
         file_set_key(file, json_string_value(quickkey));
@@ -152,12 +288,10 @@ static int _decode_file_get_info(mfhttp * conn, void *data)
 
     obj = json_object_get(node, "created");
     if (obj != NULL) {
-        memset(&tm, 0, sizeof(struct tm));
-        ret = (char *)strptime(json_string_value(obj), "%F %T", &tm);
-        if (ret[0] != '\0') {
+        if (string_to_time(json_string_value(obj), &created_time) != 0) {
             fprintf(stderr, "cannot parse time\n");
         } else {
-            file_set_created(file, mktime(&tm));
+            file_set_created(file, created_time);
         }
     }
 
@@ -171,10 +305,5 @@ static int _decode_file_get_info(mfhttp * conn, void *data)
         file_set_size(file, atoll(json_string_value(obj)));
     }
 
-    if (quickkey == NULL)
-        retval = -1;
-
-    json_decref(root);
-
-    return retval;
+    return quickkey == NULL ? -1 : 0;
 }
@@ -25,9 +25,18 @@
 #include "../../utils/http.h"
 #include "../mfconn.h"
 #include "../file.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_file_get_links(mfhttp * conn, void *data);
+static int      _decode_file_get_links_batch(mfhttp * conn, void *data);
+static void     _decode_file_links(json_t * node, mffile * file);
+
+struct file_links_batch {
+    const char    **quickkeys;
+    int             num_keys;
+    mffile        **files;
+};
 
 int mfconn_api_file_get_links(mfconn * conn, mffile * file,
                               const char *quickkey,
@@ -35,9 +44,9 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     int             len;
     mfhttp         *http;
-    int             i;
 
     if (conn == NULL)
         return -1;
@@ -53,7 +62,8 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
     if (len != 11 && len != 15)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "file/get_links");
+    while (mfapi_request_next(&request, &retval)) {
         api_call = mfconn_create_signed_get(conn, 0, "file/get_links.php",
                                             "?quick_key=%s"
                                             "&link_type=%s"
@@ -71,36 +81,153 @@ int mfconn_api_file_get_links(mfconn * conn, mffile * file,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
+    }
 
-        if (retval != 127 && retval != 28)
-            break;
+    return retval;
+}
 
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+/*
+ * retrieves the links of num_keys files with as few calls as possible
+ *
+ * files must have room for num_keys pointers. A new mffile is stored at the
+ * position of every key that the server returned links for, the others are
+ * set to NULL. On error, the files that were already retrieved are kept and
+ * have to be freed by the caller as well.
+ */
+int mfconn_api_file_get_links_batch(mfconn * conn, const char **quickkeys,
+                                    int num_keys,
+                                    enum mfconn_file_link_type link_mask,
+                                    mffile ** files)
+{
+    struct file_links_batch batch;
+    const char     *api_call;
+    char           *joined;
+    int             retval;
+    struct mfapi_request request;
+    int             len;
+    mfhttp         *http;
+    int             offset;
+    int             i;
+
+    if (conn == NULL)
+        return -1;
+
+    if (quickkeys == NULL || files == NULL)
+        return -1;
+
+    for (i = 0; i < num_keys; i++) {
+        files[i] = NULL;
+        len = strlen(quickkeys[i]);
+        // key must either be 11 or 15 chars
+        if (len != 11 && len != 15)
+            return -1;
+    }
+
+    retval = 0;
+    for (offset = 0; offset < num_keys; offset += MFAPI_MAX_BATCH_KEYS) {
+        batch.quickkeys = quickkeys + offset;
+        batch.num_keys = num_keys - offset;
+        if (batch.num_keys > MFAPI_MAX_BATCH_KEYS)
+            batch.num_keys = MFAPI_MAX_BATCH_KEYS;
+        batch.files = files + offset;
+
+        joined = mfapi_join_keys(batch.quickkeys, batch.num_keys);
+        if (joined == NULL)
+            return -1;
+
+        mfapi_request_init(&request, conn, "file/get_links");
+        while (mfapi_request_next(&request, &retval)) {
+            api_call = mfconn_create_signed_get(conn, 0, "file/get_links.php",
+                                                "?quick_key=%s"
+                                                "&link_type=%s"
+                                                "&response_format=json",
+                                                joined,
+                                                mfconn_file_link_types
+                                                [link_mask]);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(joined);
+                return -1;
+            }
+
+            http = http_create();
+            retval = http_get_buf(http, api_call,
+                                  _decode_file_get_links_batch, &batch);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
         }
+        free(joined);
+
+        if (retval != 0)
+            break;
     }
 
     return retval;
 }
 
-static int _decode_file_get_links(mfhttp * conn, void *data)
+static int _decode_file_get_links_batch(mfhttp * conn, void *data)
 {
     json_error_t    error;
     json_t         *root;
     json_t         *node;
+    json_t         *links_array;
     json_t         *quickkey;
-    json_t         *share_link;
-    json_t         *direct_link;
-    json_t         *onetime_link;
+    struct file_links_batch *batch;
+    size_t          i;
+    int             pos;
+    int             retval;
+
+    if (data == NULL)
+        return -1;
+
+    batch = (struct file_links_batch *)data;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "file/get_links");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    links_array = json_object_get(node, "links");
+    if (!json_is_array(links_array)) {
+        json_decref(root);
+        return -1;
+    }
+
+    for (i = 0; i < json_array_size(links_array); i++) {
+        node = json_array_get(links_array, i);
+        quickkey = json_object_get(node, "quickkey");
+        pos = mfapi_find_key(batch->quickkeys, batch->num_keys,
+                             json_string_value(quickkey));
+        if (pos < 0 || batch->files[pos] != NULL)
+            continue;
+        batch->files[pos] = file_alloc();
+        _decode_file_links(node, batch->files[pos]);
+    }
+
+    json_decref(root);
+
+    return 0;
+}
+
+static int _decode_file_get_links(mfhttp * conn, void *data)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
     json_t         *links_array;
     int             retval = 0;
     mffile         *file;
@@ -132,9 +259,24 @@ static int _decode_file_get_links(mfhttp * conn, void *data)
         json_decref(root);
         return -1;
     }
-    // just get the first one.  maybe later support multi-quickkey
+    // just get the first one, mfconn_api_file_get_links_batch() asks for
+    // several
     node = json_array_get(links_array, 0);
 
+    _decode_file_links(node, file);
+
+    json_decref(root);
+
+    return retval;
+}
+
+static void _decode_file_links(json_t * node, mffile * file)
+{
+    json_t         *quickkey;
+    json_t         *share_link;
+    json_t         *direct_link;
+    json_t         *onetime_link;
+
     quickkey = json_object_get(node, "quickkey");
     if (quickkey != NULL)
         file_set_key(file, json_string_value(quickkey));
@@ -155,8 +297,4 @@ static int _decode_file_get_links(mfhttp * conn, void *data)
     // if this is false something went horribly wrong
     // if (share_link == NULL)
     //    retval = -1;
-
-    json_decref(root);
-
-    return retval;
 }
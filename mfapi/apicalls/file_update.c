@@ -23,6 +23,7 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 int mfconn_api_file_update(mfconn * conn, const char *quickkey,
@@ -30,8 +31,8 @@ int mfconn_api_file_update(mfconn * conn, const char *quickkey,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
     char           *filename_urlenc = NULL;
 
     if (conn == NULL)
@@ -51,7 +52,8 @@ int mfconn_api_file_update(mfconn * conn, const char *quickkey,
             return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "file/update");
+    while (mfapi_request_next(&request, &retval)) {
 
         if (filename != NULL) {
             filename_urlenc = urlencode(filename);
@@ -102,22 +104,6 @@ int mfconn_api_file_update(mfconn * conn, const char *quickkey,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
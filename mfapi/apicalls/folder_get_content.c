@@ -16,367 +16,608 @@
  * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
  */
-#ifndef __OpenBSD__
-#define _XOPEN_SOURCE           // for strptime
-#endif
-
 #include <time.h>
-#include <jansson.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include "../../utils/http.h"
+#include "../../utils/json_stream.h"
+#include "../../utils/strings.h"
 #include "../folder.h"
 #include "../file.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
-static int      _decode_folder_get_content_folders(mfhttp * conn, void *data);
+/*
+ * the pages of one content type
+ *
+ * only the first chunk is known to exist in the beginning. Every page that
+ * reports more_chunks makes the next one known. Once any page was answered,
+ * up to MFAPI_FOLDER_CONTENT_PARALLEL chunks behind the known ones are
+ * fetched speculatively. A page that reports no more_chunks marks the end and
+ * failures of speculative chunks behind it do not count.
+ */
+struct folder_content_type {
+    const char     *name;
+    bool            wanted;
+    uint32_t        next_chunk;
+    uint32_t        known_chunks;
+    uint32_t        last_chunk;
+    uint32_t        failed_chunk;
+    int             in_flight;
+    bool            answered;
+};
+
+struct folder_content {
+    mfconn         *conn;
+    const char     *folderkey;
+    mfconn_folder_content_cb cb;
+    void           *user_ptr;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    struct folder_content_type types[2];
+    bool            aborted;
+};
 
-static int      _decode_folder_get_content_files(mfhttp * conn, void *data);
+/*
+ * the state of the page that is being transferred
+ *
+ * entries are parsed into a single folder or file that is handed out as soon
+ * as the entry is complete and then filled again with the next one
+ */
+struct folder_content_page {
+    struct folder_content *content;
+    int             type;
+    struct mfapi_stream_status status;
+    mffolder       *folder;
+    mffile         *file;
+    bool            have_key;
+    bool            have_name;
+    size_t          num_entries;
+    // entries that were handed out before the request had to be repeated
+    size_t          num_handed_out;
+    bool            more_chunks;
+};
+
+static void    *folder_content_worker(void *user_ptr);
+
+static void     folder_content_fetch(struct folder_content *content,
+                                     mfconn * conn, bool own_session);
+
+static int      folder_content_claim(struct folder_content *content,
+                                     int *type, uint32_t * chunk);
+
+static int      folder_content_get_page(mfconn * conn, json_stream * json,
+                                        const char *folderkey,
+                                        const char *content_type,
+                                        uint32_t chunk,
+                                        struct folder_content_page *page);
+
+static int      folder_content_hand_out(struct folder_content_page *page);
+
+static int      _decode_folder_get_content(json_stream * stream,
+                                           enum json_stream_event event,
+                                           const char *value, size_t len,
+                                           void *user_ptr);
+
+static void     _decode_content_folder(mffolder * folder, const char *key,
+                                       const char *value);
+
+static void     _decode_content_file(mffile * file, const char *key,
+                                     const char *value);
 
 /*
- * the helper functions will do a realloc on the values pointed to by
- * mffolder_result and mffile_result so make sure that those are either NULL
- * or values of already malloc'ed regions. They must not be uninitialized
- * values.
+ * retrieves all folders and/or files (depending on content_mask) of the
+ * folder with the given key and hands every single one to cb
  *
- * results are triple pointers because we cannot create an array of mffolder
- * or mffile as we do not know their sizes. We can only create an array of
- * pointers to them.
+ * the pages are requested with the largest chunk size and, together with the
+ * two content types, are fetched by up to MFAPI_FOLDER_CONTENT_PARALLEL
+ * threads at the same time. All but the calling thread use sessions from the
+ * pool of conn. The entries are handed out while the remaining pages are
+ * still being transferred, so they do not arrive in the order of the remote.
+ *
+ * the pages are parsed while they arrive and the entries are handed out one
+ * by one without building the whole response first.
+ *
+ * cb is called from any of the threads but never twice at the same time. It
+ * receives either a folder or a file (the other one is NULL) which is only
+ * valid during the call. If it returns non-zero, no further entries are
+ * handed out and the call fails.
  */
-long
-mfconn_api_folder_get_content(mfconn * conn, const int mode,
-                              const char *folderkey,
-                              mffolder *** mffolder_result,
-                              mffile *** mffile_result)
+int
+mfconn_api_folder_get_content_stream(mfconn * conn, const char *folderkey,
+                                     int content_mask,
+                                     mfconn_folder_content_cb cb,
+                                     void *user_ptr)
 {
-    const char     *api_call;
+    struct folder_content content;
+    pthread_t       threads[MFAPI_FOLDER_CONTENT_PARALLEL - 1];
+    int             num_threads;
     int             retval;
-    char           *content_type;
-    mfhttp         *http;
-    int             i,
-                    j;
+    int             i;
 
-    if (conn == NULL)
+    if (conn == NULL || cb == NULL)
         return -1;
 
-    if (mode == 0)
-        content_type = "folders";
-    else
-        content_type = "files";
-
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
-        if (mode == 0) {
-            if (*mffolder_result != NULL) {
-                for (j = 0; (*mffolder_result)[j] != NULL; j++) {
-                    folder_free((*mffolder_result)[j]);
-                }
-                free(*mffolder_result);
-                *mffolder_result = NULL;
+    if (folderkey == NULL)
+        folderkey = "myfiles";
+
+    memset(&content, 0, sizeof(struct folder_content));
+    content.conn = conn;
+    content.folderkey = folderkey;
+    content.cb = cb;
+    content.user_ptr = user_ptr;
+    pthread_mutex_init(&(content.mutex), NULL);
+    pthread_cond_init(&(content.cond), NULL);
+    content.types[0].name = "folders";
+    content.types[0].wanted = content_mask & MFCONN_FOLDER_CONTENT_FOLDERS;
+    content.types[1].name = "files";
+    content.types[1].wanted = content_mask & MFCONN_FOLDER_CONTENT_FILES;
+    for (i = 0; i < 2; i++) {
+        content.types[i].next_chunk = 1;
+        content.types[i].known_chunks = 1;
+    }
+
+    num_threads = 0;
+    for (i = 0; i < MFAPI_FOLDER_CONTENT_PARALLEL - 1; i++) {
+        if (pthread_create(&(threads[num_threads]), NULL,
+                           folder_content_worker, &content) != 0) {
+            fprintf(stderr, "cannot start folder/get_content thread\n");
+            break;
+        }
+        num_threads++;
+    }
+
+    // the calling thread fetches pages as well and uses conn itself
+    folder_content_fetch(&content, conn, false);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&(content.cond));
+    pthread_mutex_destroy(&(content.mutex));
+
+    retval = content.aborted ? -1 : 0;
+    for (i = 0; i < 2; i++) {
+        if (!content.types[i].wanted)
+            continue;
+        // a failed chunk only counts if it is not behind the last one
+        if (content.types[i].failed_chunk != 0
+            && (content.types[i].last_chunk == 0
+                || content.types[i].failed_chunk <=
+                content.types[i].last_chunk))
+            retval = -1;
+    }
+
+    return retval;
+}
+
+static void    *folder_content_worker(void *user_ptr)
+{
+    folder_content_fetch((struct folder_content *)user_ptr, NULL, true);
+
+    return NULL;
+}
+
+/*
+ * fetches pages until there are none left
+ *
+ * if own_session is set, a session is only taken from the pool once there is
+ * a page to fetch, so that small folders do not need more than one session
+ * per content type. A session that failed a page is destroyed instead of
+ * being returned to the pool.
+ */
+static void folder_content_fetch(struct folder_content *content,
+                                 mfconn * conn, bool own_session)
+{
+    struct folder_content_page page;
+    struct folder_content_type *type;
+    json_stream    *json;
+    int             type_id;
+    uint32_t        chunk;
+    int             retval;
+
+    memset(&page, 0, sizeof(struct folder_content_page));
+    page.content = content;
+    page.folder = folder_alloc();
+    page.file = file_alloc();
+    json = json_stream_create(_decode_folder_get_content, &page);
+
+    for (;;) {
+        pthread_mutex_lock(&(content->mutex));
+        retval = folder_content_claim(content, &type_id, &chunk);
+        pthread_mutex_unlock(&(content->mutex));
+        if (retval != 0)
+            break;
+
+        type = &(content->types[type_id]);
+
+        if (conn == NULL) {
+            conn = mfconn_acquire(content->conn);
+            if (conn == NULL)
+                fprintf(stderr, "cannot create session\n");
+        }
+
+        page.type = type_id;
+        page.num_handed_out = 0;
+        retval = -1;
+        if (conn != NULL && json != NULL)
+            retval = folder_content_get_page(conn, json, content->folderkey,
+                                             type->name, chunk, &page);
+
+        pthread_mutex_lock(&(content->mutex));
+        type->in_flight--;
+        if (retval != 0) {
+            if (chunk <= type->known_chunks) {
+                content->aborted = true;
+            } else if (type->failed_chunk == 0 || chunk < type->failed_chunk) {
+                type->failed_chunk = chunk;
             }
         } else {
-            if (*mffile_result != NULL) {
-                for (j = 0; (*mffile_result)[j] != NULL; j++) {
-                    file_free((*mffile_result)[j]);
-                }
-                free(*mffile_result);
-                *mffile_result = NULL;
+            type->answered = true;
+            if (!page.more_chunks) {
+                if (type->last_chunk == 0 || chunk < type->last_chunk)
+                    type->last_chunk = chunk;
+            } else if (chunk + 1 > type->known_chunks) {
+                type->known_chunks = chunk + 1;
             }
         }
+        pthread_cond_broadcast(&(content->cond));
+        pthread_mutex_unlock(&(content->mutex));
+
+        // without a session this thread cannot help anymore
+        if (conn == NULL || json == NULL)
+            break;
+
+        // even a speculative chunk that failed may have left the key chain
+        // of the session out of step, so it is not used again
+        if (retval != 0 && own_session) {
+            mfconn_destroy(conn);
+            conn = NULL;
+        }
+    }
+
+    if (json != NULL)
+        json_stream_destroy(json);
+    folder_free(page.folder);
+    file_free(page.file);
+
+    if (own_session && conn != NULL)
+        mfconn_release(conn);
+}
 
-        if (folderkey == NULL)
-            folderkey = "myfiles";
+/*
+ * must be called with the mutex held
+ *
+ * waits until a chunk can be fetched and returns 0 with its content type and
+ * number or returns -1 once all pages are done
+ */
+static int folder_content_claim(struct folder_content *content,
+                                int *type_id, uint32_t * chunk)
+{
+    struct folder_content_type *type;
+    uint32_t        limit;
+    bool            busy;
+    int             i;
+
+    for (;;) {
+        if (content->aborted)
+            return -1;
+
+        busy = false;
+        for (i = 0; i < 2; i++) {
+            type = &(content->types[i]);
+            if (!type->wanted)
+                continue;
+
+            limit = type->known_chunks;
+            if (type->answered)
+                limit += MFAPI_FOLDER_CONTENT_PARALLEL;
+            if (type->last_chunk != 0 && limit > type->last_chunk)
+                limit = type->last_chunk;
+            if (type->failed_chunk != 0 && limit >= type->failed_chunk)
+                limit = type->failed_chunk - 1;
+
+            if (type->next_chunk <= limit) {
+                *type_id = i;
+                *chunk = type->next_chunk++;
+                type->in_flight++;
+                return 0;
+            }
+            if (type->in_flight > 0)
+                busy = true;
+        }
 
-        /*
-           TODO:   there is a temporary hard limit of 400 items on this
-           call for two reasons:
+        // pages in flight may reveal more chunks
+        if (!busy)
+            return -1;
+        pthread_cond_wait(&(content->cond), &(content->mutex));
+    }
+}
 
-           1)  the REST API will be changed to improve performance
-           of > 400 items.  the official documentation says
-           that 1000 items is supported but theres a server-side
-           fix up that needs to take place first.
+static int folder_content_get_page(mfconn * conn, json_stream * json,
+                                   const char *folderkey,
+                                   const char *content_type, uint32_t chunk,
+                                   struct folder_content_page *page)
+{
+    const char     *api_call;
+    int             retval;
+    mfhttp         *http;
+    struct mfapi_request request;
 
-           2)  the 'more_chunks' property needs to be honored in
-           order to fetch multiples of chunk_size.  the servers
-           support this but it's not implmented here yet.
-         */
+    mfapi_request_init(&request, conn, "folder/get_content");
+    while (mfapi_request_next(&request, &retval)) {
+        memset(&(page->status), 0, sizeof(struct mfapi_stream_status));
+        page->num_entries = 0;
+        page->more_chunks = false;
 
         api_call = mfconn_create_signed_get(conn, 0,
                                             "folder/get_content.php",
                                             "?folder_key=%s"
                                             "&content_type=%s"
-                                            "&chunk_size=400"
+                                            "&chunk=%" PRIu32
+                                            "&chunk_size=%d"
                                             "&response_format=json",
-                                            folderkey, content_type);
+                                            folderkey, content_type, chunk,
+                                            MFAPI_FOLDER_CONTENT_CHUNK_SIZE);
         if (api_call == NULL) {
             fprintf(stderr, "mfconn_create_signed_get failed\n");
             return -1;
         }
 
         http = http_create();
-        if (mode == 0)
-            retval = http_get_buf(http, api_call,
-                                  _decode_folder_get_content_folders,
-                                  (void *)mffolder_result);
-        else
-            retval = http_get_buf(http, api_call,
-                                  _decode_folder_get_content_files,
-                                  (void *)mffile_result);
+        retval = http_get_json(http, api_call, json);
         http_destroy(http);
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
 
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+        if (retval == 0) {
+            retval = mfapi_check_stream_status(&(page->status),
+                                               "folder/get_content");
+            if (retval != 0)
+                fprintf(stderr, "invalid response\n");
         }
     }
 
     return retval;
 }
 
-static int _decode_folder_get_content_folders(mfhttp * conn, void *user_ptr)
+/*
+ * passes the entry that was just parsed to the callback
+ *
+ * a page that is requested again after a timeout starts from the beginning,
+ * so the entries that were already handed out are skipped
+ */
+static int folder_content_hand_out(struct folder_content_page *page)
 {
-    json_error_t    error;
-    json_t         *root;
-    json_t         *node;
-    json_t         *data;
-
-    json_t         *folders_array;
-    json_t         *folderkey;
-    json_t         *folder_name;
-    json_t         *j_obj;
-
-    char           *ret;
-    struct tm       tm;
+    struct folder_content *content;
     int             retval;
 
-    int             array_sz;
-    int             i = 0;
-
-    mffolder     ***mffolder_result;
-    mffolder       *tmp_folder;
-    size_t          len_mffolder_result;
+    if (!page->have_key || !page->have_name)
+        return 0;
+
+    page->num_entries++;
+    if (page->num_entries <= page->num_handed_out)
+        return 0;
+    page->num_handed_out++;
+
+    content = page->content;
+    pthread_mutex_lock(&(content->mutex));
+    if (content->aborted) {
+        retval = -1;
+    } else if (page->type == 0) {
+        retval = content->cb(page->folder, NULL, content->user_ptr);
+    } else {
+        retval = content->cb(NULL, page->file, content->user_ptr);
+    }
+    if (retval != 0)
+        content->aborted = true;
+    pthread_mutex_unlock(&(content->mutex));
 
-    mffolder_result = (mffolder ***) user_ptr;
-    if (mffolder_result == NULL)
-        return -1;
+    return retval != 0 ? -1 : 0;
+}
 
-    root = http_parse_buf_json(conn, 0, &error);
+struct folder_content_collect {
+    mffolder      **folders;
+    mffile        **files;
+    size_t          num_entries;
+};
 
-    if (root == NULL) {
-        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
-        fprintf(stderr, "error message: %s\n", error.text);
-        return -1;
+static int folder_content_collect_cb(mffolder * folder, mffile * file,
+                                     void *user_ptr)
+{
+    struct folder_content_collect *collect;
+
+    collect = (struct folder_content_collect *)user_ptr;
+
+    collect->num_entries++;
+    if (folder != NULL) {
+        collect->folders = (mffolder **) realloc(collect->folders,
+                                                 (collect->num_entries + 1) *
+                                                 sizeof(mffolder *));
+        collect->folders[collect->num_entries - 1] = folder_copy(folder);
+        collect->folders[collect->num_entries] = NULL;
+    } else {
+        collect->files = (mffile **) realloc(collect->files,
+                                             (collect->num_entries + 1) *
+                                             sizeof(mffile *));
+        collect->files[collect->num_entries - 1] = file_copy(file);
+        collect->files[collect->num_entries] = NULL;
     }
 
-    node = json_object_get(root, "response");
-
-    retval = mfapi_check_response(node, "folder/get_content");
-    if (retval != 0) {
-        fprintf(stderr, "invalid response\n");
-        json_decref(root);
-        return retval;
-    }
+    return 0;
+}
 
-    node = json_object_get(node, "folder_content");
+/*
+ * retrieves either the folders (mode 0) or the files (mode 1) of a folder as
+ * a NULL terminated array
+ *
+ * the values pointed to by mffolder_result and mffile_result are freed and
+ * replaced so make sure that those are either NULL or values of already
+ * malloc'ed regions. They must not be uninitialized values.
+ *
+ * results are triple pointers because we cannot create an array of mffolder
+ * or mffile as we do not know their sizes. We can only create an array of
+ * pointers to them.
+ */
+long
+mfconn_api_folder_get_content(mfconn * conn, const int mode,
+                              const char *folderkey,
+                              mffolder *** mffolder_result,
+                              mffile *** mffile_result)
+{
+    struct folder_content_collect collect;
+    int             content_mask;
+    int             retval;
+    int             j;
 
-    folders_array = json_object_get(node, "folders");
-    if (!json_is_array(folders_array)) {
-        fprintf(stderr, "is not an array: folders");
-        json_decref(root);
+    if (conn == NULL)
         return -1;
-    }
 
-    len_mffolder_result = 0;
-    array_sz = json_array_size(folders_array);
-    for (i = 0; i < array_sz; i++) {
-        data = json_array_get(folders_array, i);
-
-        if (json_is_object(data)) {
-            folderkey = json_object_get(data, "folderkey");
-
-            folder_name = json_object_get(data, "name");
-
-            if (folderkey != NULL && folder_name != NULL) {
-                tmp_folder = folder_alloc();
-
-                folder_set_key(tmp_folder, json_string_value(folderkey));
-                folder_set_name(tmp_folder, json_string_value(folder_name));
-
-                j_obj = json_object_get(data, "revision");
-                if (j_obj != NULL) {
-                    folder_set_revision(tmp_folder,
-                                        atoll(json_string_value(j_obj)));
-                }
-
-                j_obj = json_object_get(data, "parent");
-                if (j_obj != NULL) {
-                    folder_set_parent(tmp_folder, json_string_value(j_obj));
-                }
-
-                j_obj = json_object_get(data, "created");
-                if (j_obj != NULL) {
-                    memset(&tm, 0, sizeof(struct tm));
-                    ret =
-                        (char *)strptime(json_string_value(j_obj), "%F %T",
-                                         &tm);
-                    if (ret[0] == '\0') {
-                        folder_set_created(tmp_folder, mktime(&tm));
-                    }
-                }
-
-                len_mffolder_result++;
-                *mffolder_result =
-                    (mffolder **) realloc(*mffolder_result,
-                                          len_mffolder_result *
-                                          sizeof(mffolder *));
-                (*mffolder_result)[len_mffolder_result - 1] = tmp_folder;
+    memset(&collect, 0, sizeof(struct folder_content_collect));
+
+    if (mode == 0) {
+        if (*mffolder_result != NULL) {
+            for (j = 0; (*mffolder_result)[j] != NULL; j++) {
+                folder_free((*mffolder_result)[j]);
+            }
+            free(*mffolder_result);
+        }
+        collect.folders = (mffolder **) calloc(1, sizeof(mffolder *));
+        content_mask = MFCONN_FOLDER_CONTENT_FOLDERS;
+    } else {
+        if (*mffile_result != NULL) {
+            for (j = 0; (*mffile_result)[j] != NULL; j++) {
+                file_free((*mffile_result)[j]);
             }
+            free(*mffile_result);
         }
+        collect.files = (mffile **) calloc(1, sizeof(mffile *));
+        content_mask = MFCONN_FOLDER_CONTENT_FILES;
     }
 
-    // append an terminating empty mffolder
-    len_mffolder_result++;
-    *mffolder_result =
-        (mffolder **) realloc(*mffolder_result,
-                              len_mffolder_result * sizeof(mffolder *));
-    // write an empty last element
-    (*mffolder_result)[len_mffolder_result - 1] = NULL;
+    retval = mfconn_api_folder_get_content_stream(conn, folderkey,
+                                                  content_mask,
+                                                  folder_content_collect_cb,
+                                                  &collect);
 
-    if (root != NULL)
-        json_decref(root);
+    if (mode == 0)
+        *mffolder_result = collect.folders;
+    else
+        *mffile_result = collect.files;
 
-    return 0;
+    return retval;
 }
 
-static int _decode_folder_get_content_files(mfhttp * conn, void *user_ptr)
+/*
+ * the entries are in response/folder_content/folders or
+ * response/folder_content/files
+ */
+static int _decode_folder_get_content(json_stream * stream,
+                                      enum json_stream_event event,
+                                      const char *value, size_t len,
+                                      void *user_ptr)
 {
-    json_error_t    error;
-    json_t         *root;
-    json_t         *node;
-    json_t         *data;
-
-    json_t         *files_array;
-    json_t         *quickkey;
-    json_t         *file_name;
-    json_t         *j_obj;
-    int             retval;
-
-    char           *ret;
-    struct tm       tm;
+    struct folder_content_page *page;
+    const char     *type_name;
+    int             depth;
 
-    int             array_sz;
-    int             i = 0;
+    (void)len;
 
-    mffile       ***mffile_result;
-    mffile         *tmp_file;
-    size_t          len_mffile_result;
+    page = (struct folder_content_page *)user_ptr;
 
-    mffile_result = (mffile ***) user_ptr;
-    if (mffile_result == NULL)
-        return -1;
+    mfapi_stream_status(stream, event, value, &(page->status));
 
-    root = http_parse_buf_json(conn, 0, &error);
+    depth = json_stream_depth(stream);
+    if (depth < 3 || !json_stream_key_is(stream, 0, "response")
+        || !json_stream_key_is(stream, 1, "folder_content"))
+        return 0;
 
-    if (root == NULL) {
-        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
-        fprintf(stderr, "error message: %s\n", error.text);
-        return -1;
+    if (depth == 3) {
+        if (event == JSON_STREAM_STRING
+            && json_stream_key_is(stream, 2, "more_chunks"))
+            page->more_chunks = strcmp(value, "yes") == 0;
+        return 0;
     }
 
-    node = json_object_get(root, "response");
-
-    retval = mfapi_check_response(node, "folder/get_content");
-    if (retval != 0) {
-        fprintf(stderr, "invalid response\n");
-        json_decref(root);
-        return retval;
+    type_name = page->type == 0 ? "folders" : "files";
+    if (!json_stream_key_is(stream, 2, type_name))
+        return 0;
+
+    if (depth == 4 && event == JSON_STREAM_OBJECT_BEGIN) {
+        folder_clear(page->folder);
+        file_clear(page->file);
+        page->have_key = false;
+        page->have_name = false;
+    } else if (depth == 4 && event == JSON_STREAM_OBJECT_END) {
+        return folder_content_hand_out(page);
+    } else if (depth == 5 && value != NULL
+               && json_stream_key(stream, 4) != NULL) {
+        if (page->type == 0) {
+            _decode_content_folder(page->folder, json_stream_key(stream, 4),
+                                   value);
+            if (json_stream_key_is(stream, 4, "folderkey"))
+                page->have_key = true;
+            else if (json_stream_key_is(stream, 4, "name"))
+                page->have_name = true;
+        } else {
+            _decode_content_file(page->file, json_stream_key(stream, 4),
+                                 value);
+            if (json_stream_key_is(stream, 4, "quickkey"))
+                page->have_key = true;
+            else if (json_stream_key_is(stream, 4, "filename"))
+                page->have_name = true;
+        }
     }
 
-    node = json_object_get(node, "folder_content");
+    return 0;
+}
 
-    files_array = json_object_get(node, "files");
-    if (!json_is_array(files_array)) {
-        fprintf(stderr, "is not an array: files");
-        json_decref(root);
-        return -1;
+static void _decode_content_folder(mffolder * folder, const char *key,
+                                   const char *value)
+{
+    time_t          created;
+
+    if (strcmp(key, "folderkey") == 0) {
+        folder_set_key(folder, value);
+    } else if (strcmp(key, "name") == 0) {
+        folder_set_name(folder, value);
+    } else if (strcmp(key, "revision") == 0) {
+        folder_set_revision(folder, atoll(value));
+    } else if (strcmp(key, "parent") == 0) {
+        folder_set_parent(folder, value);
+    } else if (strcmp(key, "created") == 0) {
+        if (string_to_time(value, &created) == 0)
+            folder_set_created(folder, created);
     }
+}
 
-    len_mffile_result = 0;
-    array_sz = json_array_size(files_array);
-    for (i = 0; i < array_sz; i++) {
-        data = json_array_get(files_array, i);
-
-        if (json_is_object(data)) {
-            quickkey = json_object_get(data, "quickkey");
-
-            file_name = json_object_get(data, "filename");
-
-            if (quickkey != NULL && file_name != NULL) {
-                tmp_file = file_alloc();
-
-                file_set_key(tmp_file, json_string_value(quickkey));
-                file_set_name(tmp_file, json_string_value(file_name));
-
-                j_obj = json_object_get(data, "size");
-                if (j_obj != NULL) {
-                    file_set_size(tmp_file, atoll(json_string_value(j_obj)));
-                }
-
-                j_obj = json_object_get(data, "created");
-                if (j_obj != NULL) {
-                    memset(&tm, 0, sizeof(struct tm));
-                    ret = strptime(json_string_value(j_obj), "%F %T", &tm);
-                    if (ret[0] == '\0') {
-                        file_set_created(tmp_file, mktime(&tm));
-                    }
-                }
-
-                j_obj = json_object_get(data, "revision");
-                if (j_obj != NULL) {
-                    file_set_revision(tmp_file,
-                                      atoll(json_string_value(j_obj)));
-                }
-
-                j_obj = json_object_get(data, "hash");
-                if (j_obj != NULL) {
-                    file_set_hash(tmp_file, json_string_value(j_obj));
-                }
-
-                len_mffile_result++;
-                *mffile_result =
-                    (mffile **) realloc(*mffile_result,
-                                        len_mffile_result * sizeof(mffile *));
-                (*mffile_result)[len_mffile_result - 1] = tmp_file;
-            }
-        }
+static void _decode_content_file(mffile * file, const char *key,
+                                 const char *value)
+{
+    time_t          created;
+
+    if (strcmp(key, "quickkey") == 0) {
+        file_set_key(file, value);
+    } else if (strcmp(key, "filename") == 0) {
+        file_set_name(file, value);
+    } else if (strcmp(key, "size") == 0) {
+        file_set_size(file, atoll(value));
+    } else if (strcmp(key, "created") == 0) {
+        if (string_to_time(value, &created) == 0)
+            file_set_created(file, created);
+    } else if (strcmp(key, "revision") == 0) {
+        file_set_revision(file, atoll(value));
+    } else if (strcmp(key, "hash") == 0) {
+        file_set_hash(file, value);
     }
-
-    // append a terminating empty file
-    len_mffile_result++;
-    *mffile_result =
-        (mffile **) realloc(*mffile_result,
-                            len_mffile_result * sizeof(mffile *));
-    // write an empty last element
-    (*mffile_result)[len_mffile_result - 1] = NULL;
-
-    json_decref(root);
-
-    return 0;
 }
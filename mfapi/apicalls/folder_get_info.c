@@ -16,10 +16,6 @@
  * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  *
  */
-#ifndef __OpenBSD__
-#define _XOPEN_SOURCE           // for strptime
-#endif
-
 #include <jansson.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,11 +23,21 @@
 #include <time.h>
 
 #include "../../utils/http.h"
+#include "../../utils/strings.h"
 #include "../folder.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_folder_get_info(mfhttp * conn, void *data);
+static int      _decode_folder_get_info_batch(mfhttp * conn, void *data);
+static int      _decode_folder_info(json_t * node, mffolder * folder);
+
+struct folder_info_batch {
+    const char    **folderkeys;
+    int             num_keys;
+    mffolder      **folders;
+};
 
 int
 mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
@@ -39,8 +45,8 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
 
     if (conn == NULL)
         return -1;
@@ -53,7 +59,8 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "folder/get_info");
+    while (mfapi_request_next(&request, &retval)) {
         if (folderkey == NULL) {
             api_call = mfconn_create_signed_get(conn, 0, "folder/get_info.php",
                                                 "?response_format=json");
@@ -74,41 +81,151 @@ mfconn_api_folder_get_info(mfconn * conn, mffolder * folder,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
+    }
 
-        if (retval != 127 && retval != 28)
-            break;
+    return retval;
+}
 
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
+/*
+ * retrieves the information of num_keys folders with as few calls as
+ * possible
+ *
+ * folders must have room for num_keys pointers. A new mffolder is stored at
+ * the position of every key that the server returned information for, the
+ * others are set to NULL. On error, the folders that were already retrieved
+ * are kept and have to be freed by the caller as well.
+ */
+int mfconn_api_folder_get_info_batch(mfconn * conn, const char **folderkeys,
+                                     int num_keys, mffolder ** folders)
+{
+    struct folder_info_batch batch;
+    const char     *api_call;
+    char           *joined;
+    int             retval;
+    struct mfapi_request request;
+    mfhttp         *http;
+    int             offset;
+    int             i;
+
+    if (conn == NULL)
+        return -1;
+
+    if (folderkeys == NULL || folders == NULL)
+        return -1;
+
+    for (i = 0; i < num_keys; i++) {
+        folders[i] = NULL;
+        // the root cannot be asked for together with other folders
+        if (folderkeys[i] == NULL || strlen(folderkeys[i]) != 13)
+            return -1;
+    }
+
+    retval = 0;
+    for (offset = 0; offset < num_keys; offset += MFAPI_MAX_BATCH_KEYS) {
+        batch.folderkeys = folderkeys + offset;
+        batch.num_keys = num_keys - offset;
+        if (batch.num_keys > MFAPI_MAX_BATCH_KEYS)
+            batch.num_keys = MFAPI_MAX_BATCH_KEYS;
+        batch.folders = folders + offset;
+
+        joined = mfapi_join_keys(batch.folderkeys, batch.num_keys);
+        if (joined == NULL)
+            return -1;
+
+        mfapi_request_init(&request, conn, "folder/get_info");
+        while (mfapi_request_next(&request, &retval)) {
+            api_call = mfconn_create_signed_get(conn, 0,
+                                                "folder/get_info.php",
+                                                "?folder_key=%s"
+                                                "&response_format=json",
+                                                joined);
+            if (api_call == NULL) {
+                fprintf(stderr, "mfconn_create_signed_get failed\n");
+                free(joined);
+                return -1;
+            }
+
+            http = http_create();
+            retval = http_get_buf(http, api_call,
+                                  _decode_folder_get_info_batch, &batch);
+            http_destroy(http);
+            mfconn_update_secret_key(conn);
+
+            free((void *)api_call);
         }
+        free(joined);
+
+        if (retval != 0)
+            break;
     }
 
     return retval;
 }
 
-static int _decode_folder_get_info(mfhttp * conn, void *data)
+static int _decode_folder_get_info_batch(mfhttp * conn, void *data)
 {
     json_error_t    error;
     json_t         *root;
     json_t         *node;
+    json_t         *infos;
     json_t         *folderkey;
-    json_t         *folder_name;
-    json_t         *revision;
-    json_t         *created;
-    json_t         *parent_folder;
+    struct folder_info_batch *batch;
+    size_t          i;
+    int             pos;
+    int             retval;
+
+    if (data == NULL)
+        return -1;
+
+    batch = (struct folder_info_batch *)data;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "folder/get_info");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    // several keys are answered with an array, a single one is not
+    infos = json_object_get(node, "folder_infos");
+    if (!json_is_array(infos))
+        infos = NULL;
+    node = json_object_get(node, "folder_info");
+
+    for (i = 0; infos != NULL ? i < json_array_size(infos) : i < 1; i++) {
+        if (infos != NULL)
+            node = json_array_get(infos, i);
+        folderkey = json_object_get(node, "folderkey");
+        pos = mfapi_find_key(batch->folderkeys, batch->num_keys,
+                             json_string_value(folderkey));
+        if (pos < 0 || batch->folders[pos] != NULL)
+            continue;
+        batch->folders[pos] = folder_alloc();
+        _decode_folder_info(node, batch->folders[pos]);
+    }
+
+    json_decref(root);
+
+    return 0;
+}
+
+static int _decode_folder_get_info(mfhttp * conn, void *data)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
     int             retval = 0;
     mffolder       *folder;
-    char           *ret;
-    struct tm       tm;
 
     if (data == NULL)
         return -1;
@@ -134,6 +251,25 @@ static int _decode_folder_get_info(mfhttp * conn, void *data)
 
     node = json_object_get(node, "folder_info");
 
+    retval = _decode_folder_info(node, folder);
+
+    json_decref(root);
+
+    return retval;
+}
+
+/*
+ * returns -1 if the node does not name the folder
+ */
+static int _decode_folder_info(json_t * node, mffolder * folder)
+{
+    json_t         *folderkey;
+    json_t         *folder_name;
+    json_t         *revision;
+    json_t         *created;
+    json_t         *parent_folder;
+    time_t          created_time;
+
     folderkey = json_object_get(node, "folderkey");
     if (folderkey != NULL)
         folder_set_key(folder, json_string_value(folderkey));
@@ -157,21 +293,14 @@ static int _decode_folder_get_info(mfhttp * conn, void *data)
 
     created = json_object_get(node, "created");
     if (created != NULL) {
-        memset(&tm, 0, sizeof(struct tm));
-        ret = (char *)strptime(json_string_value(created), "%F %T", &tm);
-        if (ret[0] != '\0') {
+        if (string_to_time(json_string_value(created), &created_time) != 0) {
             fprintf(stderr, "cannot parse time\n");
         } else {
-            folder_set_created(folder, mktime(&tm));
+            folder_set_created(folder, created_time);
         }
     }
 
-    if (folderkey == NULL)
-        retval = -1;
-
-    json_decref(root);
-
-    return retval;
+    return folderkey == NULL ? -1 : 0;
 }
 
 // sample user callback
@@ -23,6 +23,7 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 int mfconn_api_folder_move(mfconn * conn, const char *folder_key_src,
@@ -30,8 +31,8 @@ int mfconn_api_folder_move(mfconn * conn, const char *folder_key_src,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
 
     if (conn == NULL)
         return -1;
@@ -42,7 +43,8 @@ int mfconn_api_folder_move(mfconn * conn, const char *folder_key_src,
     if (strlen(folder_key_src) != 13)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "folder/move");
+    while (mfapi_request_next(&request, &retval)) {
         if (folder_key_src == NULL) {
             api_call = mfconn_create_signed_get(conn, 0, "folder/move.php",
                                                 "?folder_key_src=%s"
@@ -68,22 +70,6 @@ int mfconn_api_folder_move(mfconn * conn, const char *folder_key_src,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
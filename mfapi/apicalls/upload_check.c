@@ -26,21 +26,25 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_upload_check(mfhttp * conn, void *data);
 
 int mfconn_api_upload_check(mfconn * conn, const char *filename,
                             const char *hash, uint64_t size,
-                            const char *folder_key,
+                            const char *folder_key, bool resumable,
                             struct mfconn_upload_check_result *result)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
     char           *filename_urlenc;
 
+    // the decoder only fills the resumable information if it was asked for
+    memset(&(result->resumable), 0, sizeof(struct mfconn_upload_resumable));
+
     if (conn == NULL)
         return -1;
 
@@ -59,7 +63,8 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "upload/check");
+    while (mfapi_request_next(&request, &retval)) {
         filename_urlenc = urlencode(filename);
         if (filename_urlenc == NULL) {
             fprintf(stderr, "urlencode failed\n");
@@ -70,8 +75,11 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
                                             "&filename=%s"
                                             "&size=%" PRIu64
                                             "&hash=%s"
-                                            "&folder_key=%s", filename_urlenc,
-                                            size, hash, folder_key);
+                                            "&folder_key=%s"
+                                            "%s", filename_urlenc,
+                                            size, hash, folder_key,
+                                            resumable ? "&resumable=yes" :
+                                            "");
         free(filename_urlenc);
         if (api_call == NULL) {
             fprintf(stderr, "mfconn_create_signed_get failed\n");
@@ -85,22 +93,6 @@ int mfconn_api_upload_check(mfconn * conn, const char *filename,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
@@ -231,6 +223,17 @@ static int _decode_upload_check(mfhttp * conn, void *data)
         }
     }
 
+    /* retrieve response/resumable_upload */
+    obj = json_object_get(node, "resumable_upload");
+    if (obj != NULL) {
+        retval = mfapi_decode_upload_resumable(obj, &(result->resumable));
+        if (retval != 0) {
+            fprintf(stderr, "cannot decode response/resumable_upload\n");
+            json_decref(root);
+            return -1;
+        }
+    }
+
     json_decref(root);
 
     return 0;
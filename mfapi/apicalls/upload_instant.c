@@ -23,6 +23,7 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
@@ -31,8 +32,8 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
     char           *filename_urlenc;
 
     if (conn == NULL)
@@ -43,7 +44,8 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
         return -1;
     }
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "upload/instant");
+    while (mfapi_request_next(&request, &retval)) {
         if (quick_key != NULL && quick_key[0] != '\0') {
             // update an existing file
             api_call = mfconn_create_signed_get(conn, 0, "upload/instant.php",
@@ -87,22 +89,6 @@ int mfconn_api_upload_instant(mfconn * conn, const char *quick_key,
         mfconn_update_secret_key(conn);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
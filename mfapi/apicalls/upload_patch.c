@@ -33,6 +33,7 @@
 #include "../../utils/http.h"
 #include "../../utils/strings.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_upload_patch(mfhttp * conn, void *data);
@@ -45,8 +46,8 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
-    int             i;
     FILE           *patch_fh;
     struct curl_slist *custom_headers = NULL;
     char           *tmpheader;
@@ -65,7 +66,8 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
 
     patch_size = file_info.st_size;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "upload/patch");
+    while (mfapi_request_next(&request, &retval)) {
         if (*upload_key != NULL) {
             free(*upload_key);
             *upload_key = NULL;
@@ -109,22 +111,6 @@ mfconn_api_upload_patch(mfconn * conn, const char *quickkey,
 
         fclose(patch_fh);
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
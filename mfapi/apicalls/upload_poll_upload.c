@@ -25,24 +25,29 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 struct upload_poll_upload_response {
     int             status;
     int             fileerror;
+    // every poll of a batch is admitted and accounted for on its own
+    struct mfapi_request request;
 };
 
 static int      _decode_upload_poll_upload(mfhttp * conn, void *data);
 
+static void     upload_poll_done(mfhttp * conn, int result, void *user_ptr);
+
 int
 mfconn_api_upload_poll_upload(mfconn * conn, const char *upload_key,
                               int *status, int *fileerror)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
     struct upload_poll_upload_response response;
-    int             i;
 
     if (conn == NULL)
         return -1;
@@ -50,7 +55,8 @@ mfconn_api_upload_poll_upload(mfconn * conn, const char *upload_key,
     if (upload_key == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    mfapi_request_init(&request, conn, "upload/poll_upload");
+    while (mfapi_request_next(&request, &retval)) {
         // make an UNSIGNED get
         api_call = mfconn_create_unsigned_get(conn, 0,
                                               "upload/poll_upload.php",
@@ -67,22 +73,6 @@ mfconn_api_upload_poll_upload(mfconn * conn, const char *upload_key,
         http_destroy(http);
 
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     *status = response.status;
@@ -91,6 +81,110 @@ mfconn_api_upload_poll_upload(mfconn * conn, const char *upload_key,
     return retval;
 }
 
+/*
+ * polls several uploads at the same time through the multi engine of http
+ *
+ * status and fileerror receive one value per key. The status of every key
+ * that could not be polled is set to -1. Polls are not repeated here, but
+ * each of them waits for the rate limit and counts for the circuit of the
+ * endpoint like any other call.
+ */
+int
+mfconn_api_upload_poll_uploads(mfconn * conn, const char **upload_keys,
+                               int num_keys, int *status, int *fileerror)
+{
+    struct upload_poll_upload_response *responses;
+    mfhttp_multi   *multi;
+    const char     *api_call;
+    int             i;
+
+    if (conn == NULL)
+        return -1;
+
+    multi = http_multi_create(num_keys);
+    if (multi == NULL)
+        return -1;
+
+    responses = (struct upload_poll_upload_response *)
+        calloc(num_keys, sizeof(struct upload_poll_upload_response));
+    if (responses == NULL) {
+        http_multi_destroy(multi);
+        return -1;
+    }
+
+    for (i = 0; i < num_keys; i++) {
+        responses[i].status = -1;
+
+        mfapi_request_init(&(responses[i].request), conn,
+                           "upload/poll_upload");
+        if (!mfapi_request_begin(&(responses[i].request)))
+            continue;
+
+        api_call = mfconn_create_unsigned_get(conn, 0,
+                                              "upload/poll_upload.php",
+                                              "?response_format=json"
+                                              "&key=%s", upload_keys[i]);
+        if (api_call == NULL) {
+            fprintf(stderr, "mfconn_create_unsigned_get failed\n");
+            continue;
+        }
+
+        if (http_multi_get_buf(multi, api_call, 0, upload_poll_done,
+                               &(responses[i])) != 0)
+            fprintf(stderr, "cannot queue poll of %s\n", upload_keys[i]);
+
+        free((void *)api_call);
+    }
+
+    http_multi_run(multi);
+    http_multi_destroy(multi);
+
+    for (i = 0; i < num_keys; i++) {
+        status[i] = responses[i].status;
+        fileerror[i] = responses[i].fileerror;
+    }
+    free(responses);
+
+    return 0;
+}
+
+static void upload_poll_done(mfhttp * conn, int result, void *user_ptr)
+{
+    struct upload_poll_upload_response *response;
+
+    response = (struct upload_poll_upload_response *)user_ptr;
+
+    if (result == 0)
+        result = _decode_upload_poll_upload(conn, response);
+    mfapi_request_end(&(response->request), result);
+
+    if (result != 0)
+        response->status = -1;
+}
+
+/*
+ * how many milliseconds to wait before the next poll of an upload that was
+ * polled that many times already
+ *
+ * small files are often done right away, so the first polls come quickly.
+ * After that the interval doubles so that large files, which take the
+ * server a while, are not polled needlessly often.
+ */
+int mfapi_upload_poll_interval(unsigned int polls)
+{
+    int             interval;
+    unsigned int    i;
+
+    interval = MFAPI_UPLOAD_POLL_FIRST_INTERVAL;
+    for (i = 0; i < polls && interval < MFAPI_UPLOAD_POLL_MAX_INTERVAL; i++) {
+        interval *= 2;
+    }
+    if (interval > MFAPI_UPLOAD_POLL_MAX_INTERVAL)
+        interval = MFAPI_UPLOAD_POLL_MAX_INTERVAL;
+
+    return interval;
+}
+
 static int _decode_upload_poll_upload(mfhttp * conn, void *user_ptr)
 {
     json_error_t    error;
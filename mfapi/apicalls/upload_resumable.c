@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2015 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup
+#define _DEFAULT_SOURCE         // for strdup on old systems
+
+#include <jansson.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <curl/curl.h>
+
+#include "../../utils/http.h"
+#include "../../utils/strings.h"
+#include "../mfconn.h"
+#include "../request.h"
+#include "../apicalls.h"        // IWYU pragma: keep
+
+struct upload_resumable_response {
+    struct mfconn_upload_resumable *resumable;
+    char          **upload_key;
+};
+
+static int      _decode_upload_resumable(mfhttp * conn, void *data);
+
+/*
+ * sends the unit_size bytes at unit_data as a single unit of a resumable
+ * upload
+ *
+ * resumable is updated with the units the server has received so far and
+ * upload_key is set once the last unit arrived
+ */
+int
+mfconn_api_upload_resumable(mfconn * conn, const char *folderkey,
+                            const char *file_name, uint64_t file_size,
+                            const char *file_hash, uint64_t unit_id,
+                            const unsigned char *unit_data,
+                            uint64_t unit_size,
+                            const char *unit_hash,
+                            struct mfconn_upload_resumable *resumable,
+                            char **upload_key)
+{
+    const char     *api_call;
+    int             retval;
+    struct mfapi_request request;
+    mfhttp         *http;
+    struct curl_slist *custom_headers = NULL;
+    char           *tmpheader;
+    struct upload_resumable_response response;
+
+    if (conn == NULL)
+        return -1;
+
+    if (unit_data == NULL)
+        return -1;
+
+    if (file_hash == NULL || unit_hash == NULL)
+        return -1;
+
+    response.resumable = resumable;
+    response.upload_key = upload_key;
+
+    mfapi_request_init(&request, conn, "upload/resumable");
+    while (mfapi_request_next(&request, &retval)) {
+        if (*upload_key != NULL) {
+            free(*upload_key);
+            *upload_key = NULL;
+        }
+        if (custom_headers != NULL) {
+            curl_slist_free_all(custom_headers);
+            custom_headers = NULL;
+        }
+
+        if (folderkey == NULL) {
+            api_call = mfconn_create_signed_get(conn, 0,
+                                                "upload/resumable.php",
+                                                "?response_format=json");
+        } else {
+            api_call = mfconn_create_signed_get(conn, 0,
+                                                "upload/resumable.php",
+                                                "?response_format=json"
+                                                "&folder_key=%s", folderkey);
+        }
+        if (api_call == NULL) {
+            fprintf(stderr, "mfconn_create_signed_get failed\n");
+            return -1;
+        }
+
+        // the following pseudo headers are interpreted by the mediafire
+        // server
+        tmpheader = strdup_printf("x-filename: %s", file_name);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+        tmpheader = strdup_printf("x-filesize: %" PRIu64, file_size);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+        tmpheader = strdup_printf("x-filehash: %s", file_hash);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+        tmpheader = strdup_printf("x-unit-id: %" PRIu64, unit_id);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+        tmpheader = strdup_printf("x-unit-size: %" PRIu64, unit_size);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+        tmpheader = strdup_printf("x-unit-hash: %s", unit_hash);
+        custom_headers = curl_slist_append(custom_headers, tmpheader);
+        free(tmpheader);
+
+        http = http_create();
+        retval = http_post_mem(http, api_call, unit_data, unit_size,
+                               &custom_headers, _decode_upload_resumable,
+                               &response);
+        http_destroy(http);
+        mfconn_update_secret_key(conn);
+
+        if (custom_headers != NULL) {
+            curl_slist_free_all(custom_headers);
+            custom_headers = NULL;
+        }
+        free((void *)api_call);
+    }
+
+    return retval;
+}
+
+static int _decode_upload_resumable(mfhttp * conn, void *user_ptr)
+{
+    json_error_t    error;
+    json_t         *root;
+    json_t         *node;
+    json_t         *j_obj;
+    int             retval;
+    struct upload_resumable_response *response;
+    struct mfconn_upload_resumable resumable;
+
+    response = (struct upload_resumable_response *)user_ptr;
+    if (response == NULL)
+        return -1;
+
+    root = http_parse_buf_json(conn, 0, &error);
+
+    if (root == NULL) {
+        fprintf(stderr, "http_parse_buf_json failed at line %d\n", error.line);
+        fprintf(stderr, "error message: %s\n", error.text);
+        return -1;
+    }
+
+    node = json_object_get(root, "response");
+
+    retval = mfapi_check_response(node, "upload/resumable");
+    if (retval != 0) {
+        fprintf(stderr, "invalid response\n");
+        json_decref(root);
+        return retval;
+    }
+
+    // only replace the known state if the new one is complete
+    memset(&resumable, 0, sizeof(struct mfconn_upload_resumable));
+    retval = mfapi_decode_upload_resumable(json_object_get(node,
+                                                           "resumable_upload"),
+                                           &resumable);
+    if (retval != 0) {
+        fprintf(stderr, "cannot decode response/resumable_upload\n");
+        mfapi_upload_resumable_clear(&resumable);
+        json_decref(root);
+        return -1;
+    }
+    mfapi_upload_resumable_clear(response->resumable);
+    *(response->resumable) = resumable;
+
+    node = json_object_get(node, "doupload");
+
+    // a non-zero result means that the server rejected the unit
+    j_obj = json_object_get(node, "result");
+    if (j_obj != NULL && json_is_string(j_obj)
+        && strcmp(json_string_value(j_obj), "0") != 0) {
+        fprintf(stderr, "unit rejected with result %s\n",
+                json_string_value(j_obj));
+        json_decref(root);
+        return -1;
+    }
+
+    j_obj = json_object_get(node, "key");
+    if (j_obj != NULL && json_is_string(j_obj)
+        && strcmp(json_string_value(j_obj), "") != 0) {
+        *(response->upload_key) = strdup(json_string_value(j_obj));
+    } else {
+        *(response->upload_key) = NULL;
+    }
+
+    json_decref(root);
+
+    return 0;
+}
@@ -32,20 +32,26 @@
 #include "../../utils/http.h"
 #include "../../utils/strings.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_upload_simple(mfhttp * conn, void *data);
 
+/*
+ * if quickkey is given, the upload replaces the content of that file
+ * instead of creating a new one in folderkey
+ */
 int
 mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
-                         FILE * fh, const char *file_name, char **upload_key)
+                         const char *quickkey, FILE * fh,
+                         const char *file_name, char **upload_key)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
     long            l_file_size;
     uint64_t        file_size;
-    int             i;
     struct curl_slist *custom_headers = NULL;
     char           *tmpheader;
 
@@ -68,10 +74,12 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
     }
     file_size = l_file_size;
 
-    // make sure that we are at the beginning of the file
-    rewind(fh);
+    mfapi_request_init(&request, conn, "upload/simple");
+    while (mfapi_request_next(&request, &retval)) {
+        // make sure that we are at the beginning of the file, a failed
+        // attempt might have sent part of it
+        rewind(fh);
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
         if (*upload_key != NULL) {
             free(*upload_key);
             *upload_key = NULL;
@@ -81,7 +89,12 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
             custom_headers = NULL;
         }
 
-        if (folderkey == NULL) {
+        if (quickkey != NULL) {
+            api_call = mfconn_create_signed_get(conn, 0,
+                                                "upload/simple.php",
+                                                "?response_format=json"
+                                                "&quick_key=%s", quickkey);
+        } else if (folderkey == NULL) {
             api_call = mfconn_create_signed_get(conn, 0,
                                                 "upload/simple.php",
                                                 "?response_format=json");
@@ -118,22 +131,6 @@ mfconn_api_upload_simple(mfconn * conn, const char *folderkey,
             custom_headers = NULL;
         }
         free((void *)api_call);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     return retval;
@@ -23,6 +23,7 @@
 
 #include "../../utils/http.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../user.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
@@ -32,6 +33,7 @@ int mfconn_api_user_get_info(mfconn * conn, mfuser_t * user)
 {
     const char     *api_call;
     int             retval;
+    struct mfapi_request request;
     mfhttp         *http;
 
     // char        *rx_buffer;
@@ -39,20 +41,24 @@ int mfconn_api_user_get_info(mfconn * conn, mfuser_t * user)
     if (conn == NULL)
         return -1;
 
-    api_call = mfconn_create_signed_get(conn, 0, "user/get_info.php",
-                                        "?response_format=json");
-    if (api_call == NULL) {
-        fprintf(stderr, "mfconn_create_signed_get failed\n");
-        return -1;
+    mfapi_request_init(&request, conn, "user/get_info");
+    while (mfapi_request_next(&request, &retval)) {
+        api_call = mfconn_create_signed_get(conn, 0, "user/get_info.php",
+                                            "?response_format=json");
+        if (api_call == NULL) {
+            fprintf(stderr, "mfconn_create_signed_get failed\n");
+            return -1;
+        }
+
+        http = http_create();
+        retval = http_get_buf(http, api_call, _decode_user_get_info,
+                              (void *)user);
+        http_destroy(http);
+        mfconn_update_secret_key(conn);
+
+        free((void *)api_call);
     }
 
-    http = http_create();
-    retval = http_get_buf(http, api_call, _decode_user_get_info, (void *)user);
-    http_destroy(http);
-    mfconn_update_secret_key(conn);
-
-    free((void *)api_call);
-
     return retval;
 }
 
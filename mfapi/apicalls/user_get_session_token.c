@@ -29,6 +29,7 @@
 #include "../../utils/http.h"
 #include "../../utils/strings.h"
 #include "../mfconn.h"
+#include "../request.h"
 #include "../apicalls.h"        // IWYU pragma: keep
 
 static int      _decode_get_session_token(mfhttp * conn, void *data);
@@ -49,19 +50,25 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
                                   char **ekey)
 {
     char           *login_url;
+    char           *server_url;
     char           *post_args;
     const char     *user_signature;
     int             retval;
+    struct mfapi_request request;
     struct user_get_session_token_response response;
     mfhttp         *http;
-    int             i;
     char           *username_urlenc;
     char           *password_urlenc;
 
     if (conn == NULL)
         return -1;
 
-    for (i = 0; i < mfconn_get_max_num_retries(conn); i++) {
+    memset(&response, 0, sizeof(response));
+
+    mfapi_request_init(&request, conn, "user/get_session_token");
+    // a failed attempt must not ask for another token itself
+    request.refresh_token = false;
+    while (mfapi_request_next(&request, &retval)) {
         if (*secret_time != NULL) {
             free(*secret_time);
             *secret_time = NULL;
@@ -75,8 +82,10 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
             *ekey = NULL;
         }
         // configure url for operation
-        login_url = strdup_printf("https://%s/api/user/get_session_token.php",
-                                  server);
+        server_url = mfconn_server_url(server, 1);
+        login_url = strdup_printf("%s/api/user/get_session_token.php",
+                                  server_url);
+        free(server_url);
 
         // create user signature
         user_signature =
@@ -113,22 +122,6 @@ mfconn_api_user_get_session_token(mfconn * conn, const char *server,
 
         free(login_url);
         free(post_args);
-
-        if (retval != 127 && retval != 28)
-            break;
-
-        // if there was either a curl timeout or a token error, get a new
-        // token and try again
-        //
-        // on a curl timeout we get a new token because it is likely that we
-        // lost signature synchronization (we don't know whether the server
-        // accepted or rejected the last call)
-        fprintf(stderr, "got error %d - negotiate a new token\n", retval);
-        retval = mfconn_refresh_token(conn);
-        if (retval != 0) {
-            fprintf(stderr, "failed to get a new token\n");
-            break;
-        }
     }
 
     *secret_key = response.secret_key;
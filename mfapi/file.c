@@ -73,6 +73,36 @@ void file_free(mffile * file)
     return;
 }
 
+/*
+ * empties file so that it can be filled again without another allocation
+ */
+void file_clear(mffile * file)
+{
+    free(file->share_link);
+    free(file->direct_link);
+    free(file->onetime_link);
+    memset(file, 0, sizeof(mffile));
+}
+
+mffile         *file_copy(mffile * file)
+{
+    mffile         *copy;
+
+    copy = file_alloc();
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, file, sizeof(mffile));
+    if (file->share_link != NULL)
+        copy->share_link = strdup(file->share_link);
+    if (file->direct_link != NULL)
+        copy->direct_link = strdup(file->direct_link);
+    if (file->onetime_link != NULL)
+        copy->onetime_link = strdup(file->onetime_link);
+
+    return copy;
+}
+
 int file_set_key(mffile * file, const char *key)
 {
     int             len;
@@ -29,6 +29,10 @@ mffile         *file_alloc(void);
 
 void            file_free(mffile * file);
 
+void            file_clear(mffile * file);
+
+mffile         *file_copy(mffile * file);
+
 int             file_set_key(mffile * file, const char *quickkey);
 
 const char     *file_get_key(mffile * file);
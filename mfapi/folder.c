@@ -53,6 +53,27 @@ void folder_free(mffolder * folder)
     return;
 }
 
+/*
+ * empties folder so that it can be filled again without another allocation
+ */
+void folder_clear(mffolder * folder)
+{
+    memset(folder, 0, sizeof(mffolder));
+}
+
+mffolder       *folder_copy(mffolder * folder)
+{
+    mffolder       *copy;
+
+    copy = folder_alloc();
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, folder, sizeof(mffolder));
+
+    return copy;
+}
+
 int folder_set_key(mffolder * folder, const char *key)
 {
     if (folder == NULL) {
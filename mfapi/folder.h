@@ -29,6 +29,10 @@ mffolder       *folder_alloc(void);
 
 void            folder_free(mffolder * folder);
 
+void            folder_clear(mffolder * folder);
+
+mffolder       *folder_copy(mffolder * folder);
+
 int             folder_set_key(mffolder * folder, const char *folderkey);
 
 const char     *folder_get_key(mffolder * folder);
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apicalls.h"
+#include "file.h"
+#include "linkcache.h"
+#include "mfconn.h"
+
+struct mfapi_link {
+    // quickkeys are either 11 or 15 characters long
+    char            quickkey[16];
+    uint64_t        revision;
+    // NULL if the slot is free
+    char           *url;
+    time_t          expires;
+};
+
+static pthread_mutex_t mfapi_linkcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mfapi_link mfapi_links[MFAPI_LINKCACHE_SIZE];
+
+static char    *mfapi_linkcache_lookup(const char *quickkey,
+                                       uint64_t revision);
+static void     mfapi_linkcache_store(const char *quickkey, uint64_t revision,
+                                      const char *url);
+static struct mfapi_link *mfapi_linkcache_find(const char *quickkey);
+
+/*
+ * returns the direct download link of the given revision of a file, which
+ * has to be freed by the caller, or NULL if it cannot be retrieved
+ */
+char           *mfapi_linkcache_get(mfconn * conn, const char *quickkey,
+                                    uint64_t revision)
+{
+    mffile         *file;
+    const char     *url;
+    char           *cached;
+    int             retval;
+
+    if (quickkey == NULL)
+        return NULL;
+
+    cached = mfapi_linkcache_lookup(quickkey, revision);
+    if (cached != NULL)
+        return cached;
+
+    file = file_alloc();
+    retval = mfconn_api_file_get_links(conn, file, quickkey,
+                                       MFCONN_FILE_LINK_TYPE_DIRECT_DOWNLOAD);
+    if (retval != 0) {
+        fprintf(stderr, "mfconn_api_file_get_links failed\n");
+        file_free(file);
+        return NULL;
+    }
+
+    url = file_get_direct_link(file);
+    if (url == NULL) {
+        fprintf(stderr, "file_get_direct_link failed\n");
+        file_free(file);
+        return NULL;
+    }
+
+    mfapi_linkcache_store(quickkey, revision, url);
+    cached = strdup(url);
+    file_free(file);
+
+    return cached;
+}
+
+/*
+ * retrieves the links of all files that are not cached yet with as few
+ * calls as possible, so that their downloads can start right away
+ *
+ * revisions holds the revision of every file in quickkeys
+ */
+int mfapi_linkcache_resolve(mfconn * conn, const char **quickkeys,
+                            const uint64_t * revisions, int num_keys)
+{
+    const char    **missing_keys;
+    uint64_t       *missing_revisions;
+    mffile        **files;
+    const char     *url;
+    char           *cached;
+    enum mfconn_file_link_type link_mask;
+    int             num_missing;
+    int             retval;
+    int             i;
+
+    if (quickkeys == NULL || revisions == NULL || num_keys <= 0)
+        return -1;
+
+    missing_keys = (const char **)calloc(num_keys, sizeof(char *));
+    missing_revisions = (uint64_t *) calloc(num_keys, sizeof(uint64_t));
+    files = (mffile **) calloc(num_keys, sizeof(mffile *));
+    if (missing_keys == NULL || missing_revisions == NULL || files == NULL) {
+        free(missing_keys);
+        free(missing_revisions);
+        free(files);
+        return -1;
+    }
+
+    num_missing = 0;
+    for (i = 0; i < num_keys; i++) {
+        cached = mfapi_linkcache_lookup(quickkeys[i], revisions[i]);
+        if (cached != NULL) {
+            free(cached);
+            continue;
+        }
+        missing_keys[num_missing] = quickkeys[i];
+        missing_revisions[num_missing] = revisions[i];
+        num_missing++;
+    }
+
+    retval = 0;
+    if (num_missing > 0) {
+        link_mask = MFCONN_FILE_LINK_TYPE_DIRECT_DOWNLOAD;
+        retval = mfconn_api_file_get_links_batch(conn, missing_keys,
+                                                 num_missing, link_mask,
+                                                 files);
+        if (retval != 0)
+            fprintf(stderr, "file/get_links for %d files failed\n",
+                    num_missing);
+    }
+
+    // keep what arrived even if a later part of the batch failed
+    for (i = 0; i < num_missing; i++) {
+        if (files[i] == NULL)
+            continue;
+        url = file_get_direct_link(files[i]);
+        if (url != NULL)
+            mfapi_linkcache_store(missing_keys[i], missing_revisions[i], url);
+        file_free(files[i]);
+    }
+
+    free(missing_keys);
+    free(missing_revisions);
+    free(files);
+
+    return retval;
+}
+
+/*
+ * forgets the link of a file, for example because the server refused it
+ */
+void mfapi_linkcache_invalidate(const char *quickkey)
+{
+    struct mfapi_link *link;
+
+    if (quickkey == NULL)
+        return;
+
+    pthread_mutex_lock(&mfapi_linkcache_mutex);
+    link = mfapi_linkcache_find(quickkey);
+    if (link != NULL) {
+        free(link->url);
+        link->url = NULL;
+    }
+    pthread_mutex_unlock(&mfapi_linkcache_mutex);
+}
+
+/*
+ * returns a copy of the cached link or NULL if there is none that is still
+ * valid for this revision
+ */
+static char    *mfapi_linkcache_lookup(const char *quickkey,
+                                       uint64_t revision)
+{
+    struct mfapi_link *link;
+    char           *url;
+
+    url = NULL;
+
+    pthread_mutex_lock(&mfapi_linkcache_mutex);
+    link = mfapi_linkcache_find(quickkey);
+    if (link != NULL) {
+        if (link->revision == revision && link->expires > time(NULL)) {
+            url = strdup(link->url);
+        } else {
+            // the file changed or the link is too old to be trusted
+            free(link->url);
+            link->url = NULL;
+        }
+    }
+    pthread_mutex_unlock(&mfapi_linkcache_mutex);
+
+    return url;
+}
+
+/*
+ * once the cache is full, the link that expires first makes room
+ */
+static void mfapi_linkcache_store(const char *quickkey, uint64_t revision,
+                                  const char *url)
+{
+    struct mfapi_link *link;
+    int             i;
+
+    if (strlen(quickkey) >= sizeof(link->quickkey))
+        return;
+
+    pthread_mutex_lock(&mfapi_linkcache_mutex);
+    link = mfapi_linkcache_find(quickkey);
+    for (i = 0; link == NULL && i < MFAPI_LINKCACHE_SIZE; i++) {
+        if (mfapi_links[i].url == NULL)
+            link = &(mfapi_links[i]);
+    }
+    if (link == NULL) {
+        link = &(mfapi_links[0]);
+        for (i = 1; i < MFAPI_LINKCACHE_SIZE; i++) {
+            if (mfapi_links[i].expires < link->expires)
+                link = &(mfapi_links[i]);
+        }
+    }
+
+    free(link->url);
+    strcpy(link->quickkey, quickkey);
+    link->revision = revision;
+    link->url = strdup(url);
+    link->expires = time(NULL) + MFAPI_LINKCACHE_TTL;
+    pthread_mutex_unlock(&mfapi_linkcache_mutex);
+}
+
+/*
+ * must be called with the mutex held
+ */
+static struct mfapi_link *mfapi_linkcache_find(const char *quickkey)
+{
+    int             i;
+
+    for (i = 0; i < MFAPI_LINKCACHE_SIZE; i++) {
+        if (mfapi_links[i].url != NULL
+            && strcmp(mfapi_links[i].quickkey, quickkey) == 0)
+            return &(mfapi_links[i]);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __MFAPI_LINKCACHE_H__
+#define __MFAPI_LINKCACHE_H__
+
+#include <stdint.h>
+
+#include "mfconn.h"
+
+/*
+ * remembers the direct download links of files so that downloading a file
+ * again does not need another file/get_links call first
+ *
+ * a link belongs to one revision of a file and is only used for
+ * MFAPI_LINKCACHE_TTL seconds. A link that the server refused has to be
+ * dropped with mfapi_linkcache_invalidate(). The links of a set of files
+ * that are about to be downloaded are retrieved together by
+ * mfapi_linkcache_resolve().
+ */
+
+// how long (in seconds) a direct link is used after it was retrieved
+#define MFAPI_LINKCACHE_TTL 600
+
+// how many links are remembered at most
+#define MFAPI_LINKCACHE_SIZE 256
+
+char           *mfapi_linkcache_get(mfconn * conn, const char *quickkey,
+                                    uint64_t revision);
+
+int             mfapi_linkcache_resolve(mfconn * conn, const char **quickkeys,
+                                        const uint64_t * revisions,
+                                        int num_keys);
+
+void            mfapi_linkcache_invalidate(const char *quickkey);
+
+#endif
@@ -22,16 +22,37 @@
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../utils/hash.h"
 #include "../utils/strings.h"
 #include "apicalls.h"
 #include "mfconn.h"
 
+// a session token together with the state of its secret key chain
+struct mfconn_token {
+    uint32_t        secret_key;
+    char           *secret_time;
+    char           *session_token;
+    char           *ekey;
+    time_t          token_time;
+};
+
 struct mfconn {
     char           *server;
     uint32_t        secret_key;
@@ -43,8 +64,35 @@ struct mfconn {
     int             app_id;
     char           *app_key;
     int             max_num_retries;
+    // sessions that were handed out by mfconn_acquire() go back to the pool
+    // of this connection
+    mfconn         *parent;
+    pthread_mutex_t pool_mutex;
+    mfconn        **pool;
+    int             pool_len;
+    // when the server handed out the session token
+    time_t          token_time;
+    // where the session is kept between runs or NULL
+    char           *session_file;
+    // protects token_time and the token that the renewal thread obtained in
+    // advance, which is taken over before the next call
+    pthread_mutex_t token_mutex;
+    pthread_cond_t  token_cond;
+    struct mfconn_token *pending;
+    pthread_t       renewer;
+    bool            renewing;
+    bool            stop_renewing;
 };
 
+static mfconn  *mfconn_alloc(const char *server, const char *username,
+                             const char *password, int app_id,
+                             const char *app_key, int max_num_retries);
+static int      mfconn_load_session(mfconn * conn, const char *path);
+static int      mfconn_save_session(mfconn * conn);
+static void    *mfconn_renewer(void *user_ptr);
+static void     mfconn_adopt_token(mfconn * conn);
+static void     mfconn_token_free(struct mfconn_token *token);
+
 mfconn         *mfconn_create(const char *server, const char *username,
                               const char *password, int app_id,
                               const char *app_key, int max_num_retries)
@@ -52,6 +100,75 @@ mfconn         *mfconn_create(const char *server, const char *username,
     mfconn         *conn;
     int             retval;
 
+    conn = mfconn_alloc(server, username, password, app_id, app_key,
+                        max_num_retries);
+    if (conn == NULL)
+        return NULL;
+
+    retval = mfconn_api_user_get_session_token(conn, conn->server,
+                                               conn->username, conn->password,
+                                               conn->app_id, conn->app_key,
+                                               &(conn->secret_key),
+                                               &(conn->secret_time),
+                                               &(conn->session_token),
+                                               &(conn->ekey));
+
+    if (retval != 0) {
+        fprintf(stderr, "error: mfconn_api_user_get_session_token\n");
+        mfconn_destroy(conn);
+        return NULL;
+    }
+    conn->token_time = time(NULL);
+
+    return conn;
+}
+
+/*
+ * like mfconn_create() but continues the session that was stored in
+ * session_file by the previous run, if it is still valid, instead of logging
+ * in
+ *
+ * the session is stored there again by mfconn_destroy(). While a session is
+ * in use, it is taken out of the file so that no other process continues it
+ * at the same time. session_file may be NULL.
+ */
+mfconn         *mfconn_resume(const char *server, const char *username,
+                              const char *password, int app_id,
+                              const char *app_key, int max_num_retries,
+                              const char *session_file)
+{
+    mfconn         *conn;
+
+    if (session_file == NULL)
+        return mfconn_create(server, username, password, app_id, app_key,
+                             max_num_retries);
+
+    conn = mfconn_alloc(server, username, password, app_id, app_key,
+                        max_num_retries);
+    if (conn == NULL)
+        return NULL;
+
+    if (mfconn_load_session(conn, session_file) != 0) {
+        mfconn_destroy(conn);
+        conn = mfconn_create(server, username, password, app_id, app_key,
+                             max_num_retries);
+        if (conn == NULL)
+            return NULL;
+    } else {
+        fprintf(stderr, "continuing the previous session\n");
+    }
+
+    conn->session_file = strdup(session_file);
+
+    return conn;
+}
+
+static mfconn  *mfconn_alloc(const char *server, const char *username,
+                             const char *password, int app_id,
+                             const char *app_key, int max_num_retries)
+{
+    mfconn         *conn;
+
     if (server == NULL)
         return NULL;
 
@@ -78,20 +195,114 @@ mfconn         *mfconn_create(const char *server, const char *username,
     conn->secret_time = NULL;
     conn->session_token = NULL;
     conn->ekey = NULL;
-    retval = mfconn_api_user_get_session_token(conn, conn->server,
-                                               conn->username, conn->password,
-                                               conn->app_id, conn->app_key,
-                                               &(conn->secret_key),
-                                               &(conn->secret_time),
-                                               &(conn->session_token),
-                                               &(conn->ekey));
+    conn->parent = NULL;
+    pthread_mutex_init(&(conn->pool_mutex), NULL);
+    conn->pool = NULL;
+    conn->pool_len = 0;
+    conn->token_time = 0;
+    conn->session_file = NULL;
+    pthread_mutex_init(&(conn->token_mutex), NULL);
+    pthread_cond_init(&(conn->token_cond), NULL);
+    conn->pending = NULL;
+    conn->renewing = false;
+    conn->stop_renewing = false;
 
-    if (retval != 0) {
-        fprintf(stderr, "error: mfconn_api_user_get_session_token\n");
+    return conn;
+}
+
+/*
+ * creates a new connection with the same credentials as conn but with its
+ * own session token
+ *
+ * since every signed call advances the secret key of a session, concurrent
+ * calls from multiple threads have to use separate sessions
+ */
+mfconn         *mfconn_clone(mfconn * conn)
+{
+    if (conn == NULL)
+        return NULL;
+
+    return mfconn_create(conn->server, conn->username, conn->password,
+                         conn->app_id, conn->app_key, conn->max_num_retries);
+}
+
+/*
+ * hands out a session of its own for requests that run at the same time as
+ * those of other threads
+ *
+ * every session has its own secret key chain and refreshes its token on its
+ * own when a call fails. Sessions that were given back with
+ * mfconn_release() are reused, a new one is only created if none of them is
+ * idle. conn may be a session itself, in which case the session comes from
+ * the pool of the connection it was taken from.
+ *
+ * the parent connection must outlive all of its sessions
+ */
+mfconn         *mfconn_acquire(mfconn * conn)
+{
+    mfconn         *root;
+    mfconn         *session;
+
+    if (conn == NULL)
         return NULL;
+
+    root = conn->parent != NULL ? conn->parent : conn;
+
+    session = NULL;
+    pthread_mutex_lock(&(root->pool_mutex));
+    if (root->pool_len > 0) {
+        root->pool_len--;
+        session = root->pool[root->pool_len];
     }
+    pthread_mutex_unlock(&(root->pool_mutex));
 
-    return conn;
+    if (session != NULL)
+        return session;
+
+    session = mfconn_clone(root);
+    if (session == NULL)
+        return NULL;
+    session->parent = root;
+
+    return session;
+}
+
+/*
+ * gives back a session that was handed out by mfconn_acquire()
+ *
+ * up to MFCONN_POOL_SIZE idle sessions are kept, further ones are closed.
+ * A session whose secret key chain is in an unknown state should be
+ * destroyed with mfconn_destroy() instead.
+ */
+void mfconn_release(mfconn * session)
+{
+    mfconn         *root;
+
+    if (session == NULL)
+        return;
+
+    root = session->parent;
+    if (root == NULL) {
+        fprintf(stderr, "connection was not taken from a pool\n");
+        return;
+    }
+
+    pthread_mutex_lock(&(root->pool_mutex));
+    if (root->pool_len < MFCONN_POOL_SIZE) {
+        if (root->pool == NULL) {
+            root->pool = (mfconn **) calloc(MFCONN_POOL_SIZE,
+                                            sizeof(mfconn *));
+        }
+        if (root->pool != NULL) {
+            root->pool[root->pool_len] = session;
+            root->pool_len++;
+            session = NULL;
+        }
+    }
+    pthread_mutex_unlock(&(root->pool_mutex));
+
+    if (session != NULL)
+        mfconn_destroy(session);
 }
 
 int mfconn_refresh_token(mfconn * conn)
@@ -115,11 +326,370 @@ int mfconn_refresh_token(mfconn * conn)
         fprintf(stderr, "user/get_session_token failed\n");
         return -1;
     }
+
+    // a token that was obtained in advance is older than this one
+    pthread_mutex_lock(&(conn->token_mutex));
+    conn->token_time = time(NULL);
+    mfconn_token_free(conn->pending);
+    conn->pending = NULL;
+    pthread_mutex_unlock(&(conn->token_mutex));
+
+    return 0;
+}
+
+/*
+ * must be called before every call by the thread that uses conn
+ *
+ * takes over the token that the renewal thread obtained in advance. Without
+ * one, a token that is about to expire is renewed right away so that the call
+ * is not rejected.
+ */
+int mfconn_check_token(mfconn * conn)
+{
+    bool            expiring;
+
+    if (conn == NULL)
+        return -1;
+
+    pthread_mutex_lock(&(conn->token_mutex));
+    mfconn_adopt_token(conn);
+    expiring = time(NULL) - conn->token_time
+        >= MFCONN_TOKEN_LIFETIME - MFCONN_TOKEN_MARGIN;
+    pthread_mutex_unlock(&(conn->token_mutex));
+
+    if (!expiring)
+        return 0;
+
+    fprintf(stderr, "session token is about to expire, renewing it\n");
+    return mfconn_refresh_token(conn);
+}
+
+/*
+ * must be called with the token mutex held
+ */
+static void mfconn_adopt_token(mfconn * conn)
+{
+    struct mfconn_token *pending;
+
+    pending = conn->pending;
+    if (pending == NULL)
+        return;
+    conn->pending = NULL;
+
+    free(conn->secret_time);
+    free(conn->session_token);
+    free(conn->ekey);
+    conn->secret_key = pending->secret_key;
+    conn->secret_time = pending->secret_time;
+    conn->session_token = pending->session_token;
+    conn->ekey = pending->ekey;
+    conn->token_time = pending->token_time;
+    free(pending);
+}
+
+/*
+ * starts a thread that obtains a new token shortly before the current one
+ * expires so that this does not delay any call
+ *
+ * threads do not survive a fork, so this has to be called afterwards
+ */
+int mfconn_start_renewal(mfconn * conn)
+{
+    if (conn == NULL || conn->renewing)
+        return -1;
+
+    if (pthread_create(&(conn->renewer), NULL, mfconn_renewer, conn) != 0) {
+        fprintf(stderr, "cannot start token renewal\n");
+        return -1;
+    }
+    conn->renewing = true;
+
     return 0;
 }
 
+static void    *mfconn_renewer(void *user_ptr)
+{
+    mfconn         *conn;
+    struct mfconn_token *token;
+    struct timespec deadline;
+    time_t          due;
+    time_t          not_before;
+    int             retval;
+
+    conn = (mfconn *) user_ptr;
+    not_before = 0;
+
+    pthread_mutex_lock(&(conn->token_mutex));
+    while (!conn->stop_renewing) {
+        // renew early enough that mfconn_check_token() never has to
+        due = conn->pending != NULL ? conn->pending->token_time
+            : conn->token_time;
+        due += MFCONN_TOKEN_LIFETIME - 2 * MFCONN_TOKEN_MARGIN;
+        if (due < not_before)
+            due = not_before;
+        if (due > time(NULL)) {
+            deadline.tv_sec = due;
+            deadline.tv_nsec = 0;
+            pthread_cond_timedwait(&(conn->token_cond), &(conn->token_mutex),
+                                   &deadline);
+            continue;
+        }
+        pthread_mutex_unlock(&(conn->token_mutex));
+
+        // only the immutable credentials of conn are used for this
+        token = (struct mfconn_token *)calloc(1, sizeof(struct mfconn_token));
+        retval = mfconn_api_user_get_session_token(conn, conn->server,
+                                                   conn->username,
+                                                   conn->password,
+                                                   conn->app_id,
+                                                   conn->app_key,
+                                                   &(token->secret_key),
+                                                   &(token->secret_time),
+                                                   &(token->session_token),
+                                                   &(token->ekey));
+        token->token_time = time(NULL);
+
+        pthread_mutex_lock(&(conn->token_mutex));
+        if (retval != 0) {
+            fprintf(stderr, "renewing the session token failed\n");
+            mfconn_token_free(token);
+            not_before = time(NULL) + MFCONN_TOKEN_MARGIN / 2;
+            continue;
+        }
+        mfconn_token_free(conn->pending);
+        conn->pending = token;
+    }
+    pthread_mutex_unlock(&(conn->token_mutex));
+
+    return NULL;
+}
+
+static void mfconn_token_free(struct mfconn_token *token)
+{
+    if (token == NULL)
+        return;
+
+    free(token->secret_time);
+    free(token->session_token);
+    free(token->ekey);
+    free(token);
+}
+
+/*
+ * returns where the session of an account is kept between runs, which is
+ * $XDG_CACHE_HOME/mediafire-tools or ~/.cache/mediafire-tools
+ */
+char           *mfconn_session_file(const char *server, const char *username,
+                                    int app_id)
+{
+    struct passwd  *pw;
+    const char     *homedir;
+    char           *cachedir;
+    char           *toolsdir;
+    char           *account;
+    char           *account_hex;
+    char           *path;
+    unsigned char   account_hash[SHA256_DIGEST_LENGTH];
+
+    if (getenv("XDG_CACHE_HOME") != NULL) {
+        cachedir = strdup(getenv("XDG_CACHE_HOME"));
+    } else {
+        homedir = getenv("HOME");
+        if (homedir == NULL) {
+            pw = getpwuid(getuid());
+            if (pw == NULL) {
+                fprintf(stderr, "cannot find the home directory\n");
+                return NULL;
+            }
+            homedir = pw->pw_dir;
+        }
+        cachedir = strdup_printf("%s/.cache", homedir);
+    }
+    toolsdir = strdup_printf("%s/mediafire-tools", cachedir);
+
+    /* EEXIST is okay, so only fail if it is something else */
+    if ((mkdir(cachedir, 0755) != 0 && errno != EEXIST)
+        || (mkdir(toolsdir, 0755) != 0 && errno != EEXIST)) {
+        fprintf(stderr, "cannot create %s\n", toolsdir);
+        free(cachedir);
+        free(toolsdir);
+        return NULL;
+    }
+
+    // the user name does not appear in the file name
+    account = strdup_printf("%s\n%s\n%d", server, username, app_id);
+    SHA256((const unsigned char *)account, strlen(account), account_hash);
+    account_hex = binary2hex(account_hash, SHA256_DIGEST_LENGTH);
+
+    path = strdup_printf("%s/session_%s", toolsdir, account_hex);
+
+    free(account_hex);
+    free(account);
+    free(toolsdir);
+    free(cachedir);
+
+    return path;
+}
+
+/*
+ * the file holds one value per line: server, user name, app id, the time the
+ * token was obtained, secret key, secret time, session token and ekey
+ *
+ * the file is removed so that no other process continues the session
+ *
+ * returns -1 if there is no session or if it belongs to another account or
+ * expired
+ */
+static int mfconn_load_session(mfconn * conn, const char *path)
+{
+    FILE           *fh;
+    char           *claimed;
+    char           *lines[8];
+    size_t          len;
+    ssize_t         read;
+    char           *app_id;
+    long long       token_time;
+    unsigned long   secret_key;
+    int             retval;
+    int             i;
+
+    // renaming is atomic, so only one process gets hold of the file
+    claimed = strdup_printf("%s.%ld", path, (long)getpid());
+    if (rename(path, claimed) != 0) {
+        free(claimed);
+        return -1;
+    }
+
+    fh = fopen(claimed, "r");
+    unlink(claimed);
+    free(claimed);
+    if (fh == NULL)
+        return -1;
+
+    retval = 0;
+    for (i = 0; i < 8; i++) {
+        lines[i] = NULL;
+        len = 0;
+        read = getline(&(lines[i]), &len, fh);
+        if (read <= 1) {
+            retval = -1;
+            continue;
+        }
+        if (lines[i][read - 1] == '\n')
+            lines[i][read - 1] = '\0';
+    }
+    fclose(fh);
+
+    if (retval == 0) {
+        app_id = strdup_printf("%d", conn->app_id);
+        if (strcmp(lines[0], conn->server) != 0
+            || strcmp(lines[1], conn->username) != 0
+            || strcmp(lines[2], app_id) != 0
+            || sscanf(lines[3], "%lld", &token_time) != 1
+            || sscanf(lines[4], "%lu", &secret_key) != 1) {
+            retval = -1;
+        } else if (time(NULL) - (time_t) token_time
+                   >= MFCONN_TOKEN_LIFETIME - MFCONN_TOKEN_MARGIN) {
+            fprintf(stderr, "the stored session expired\n");
+            retval = -1;
+        }
+        free(app_id);
+    }
+
+    if (retval == 0) {
+        conn->token_time = (time_t) token_time;
+        conn->secret_key = (uint32_t) secret_key;
+        conn->secret_time = lines[5];
+        conn->session_token = lines[6];
+        conn->ekey = lines[7];
+        lines[5] = lines[6] = lines[7] = NULL;
+    }
+
+    for (i = 0; i < 8; i++) {
+        free(lines[i]);
+    }
+
+    return retval;
+}
+
+/*
+ * the file contains the session token, so only the user can read it
+ */
+static int mfconn_save_session(mfconn * conn)
+{
+    FILE           *fh;
+    char           *tmpfile;
+    int             fd;
+    int             retval;
+
+    if (conn->session_token == NULL || conn->secret_time == NULL
+        || conn->ekey == NULL)
+        return -1;
+
+    tmpfile = strdup_printf("%s.%ld.tmp", conn->session_file,
+                            (long)getpid());
+    fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create %s\n", tmpfile);
+        free(tmpfile);
+        return -1;
+    }
+    fh = fdopen(fd, "w");
+    if (fh == NULL) {
+        close(fd);
+        unlink(tmpfile);
+        free(tmpfile);
+        return -1;
+    }
+
+    fprintf(fh, "%s\n%s\n%d\n%lld\n%lu\n%s\n%s\n%s\n", conn->server,
+            conn->username, conn->app_id, (long long)conn->token_time,
+            (unsigned long)conn->secret_key, conn->secret_time,
+            conn->session_token, conn->ekey);
+
+    retval = 0;
+    if (fclose(fh) != 0 || rename(tmpfile, conn->session_file) != 0) {
+        fprintf(stderr, "cannot store the session in %s\n",
+                conn->session_file);
+        unlink(tmpfile);
+        retval = -1;
+    }
+    free(tmpfile);
+
+    return retval;
+}
+
+/*
+ * a connection that was created by mfconn_resume() stores its session for
+ * the next run
+ */
 void mfconn_destroy(mfconn * conn)
 {
+    int             i;
+
+    if (conn->renewing) {
+        pthread_mutex_lock(&(conn->token_mutex));
+        conn->stop_renewing = true;
+        pthread_cond_signal(&(conn->token_cond));
+        pthread_mutex_unlock(&(conn->token_mutex));
+        pthread_join(conn->renewer, NULL);
+    }
+
+    if (conn->session_file != NULL) {
+        // a token that was obtained in advance lasts longer
+        mfconn_adopt_token(conn);
+        mfconn_save_session(conn);
+        free(conn->session_file);
+    }
+    mfconn_token_free(conn->pending);
+    pthread_cond_destroy(&(conn->token_cond));
+    pthread_mutex_destroy(&(conn->token_mutex));
+
+    for (i = 0; i < conn->pool_len; i++) {
+        mfconn_destroy(conn->pool[i]);
+    }
+    free(conn->pool);
+    pthread_mutex_destroy(&(conn->pool_mutex));
     free(conn->server);
     free(conn->username);
     free(conn->password);
@@ -146,6 +716,18 @@ void mfconn_update_secret_key(mfconn * conn)
     return;
 }
 
+/*
+ * goes back to an earlier key of the chain when the server did not process
+ * the call that advanced it
+ */
+void mfconn_set_secret_key(mfconn * conn, uint32_t secret_key)
+{
+    if (conn == NULL)
+        return;
+
+    conn->secret_key = secret_key;
+}
+
 const char     *mfconn_create_user_signature(mfconn * conn,
                                              const char *username,
                                              const char *password, int app_id,
@@ -223,12 +805,26 @@ const char     *mfconn_create_call_signature(mfconn * conn, const char *url,
     return strdup((const char *)signature_hex);
 }
 
+/*
+ * the server is usually given as a domain name. To test against a local
+ * stand-in server it can also be given as http://host:port, in which case
+ * TLS is never used
+ */
+char           *mfconn_server_url(const char *server, int ssl)
+{
+    if (strncmp(server, "http://", strlen("http://")) == 0)
+        return strdup(server);
+
+    return strdup_printf("%s://%s", (ssl ? "https" : "http"), server);
+}
+
 const char     *mfconn_create_unsigned_get(mfconn * conn, int ssl,
                                            const char *api, const char *fmt,
                                            ...)
 {
     char           *api_request = NULL;
     char           *api_args = NULL;
+    char           *server_url;
     int             bytes_to_alloc;
     int             api_args_len;
     int             api_len;
@@ -272,9 +868,10 @@ const char     *mfconn_create_unsigned_get(mfconn * conn, int ssl,
         return NULL;
     }
 
-    api_request = strdup_printf("%s//%s/api/%s/%s",
-                                (ssl ? "https:" : "http:"),
-                                conn->server, MFAPI_VERSION, api);
+    server_url = mfconn_server_url(conn->server, ssl);
+    api_request = strdup_printf("%s/api/%s/%s", server_url, MFAPI_VERSION,
+                                api);
+    free(server_url);
 
     // compute the amount of space requred to realloc() the request
     bytes_to_alloc = api_args_len;
@@ -301,6 +898,7 @@ const char     *mfconn_create_signed_get(mfconn * conn, int ssl,
     char           *api_request = NULL;
     char           *api_args = NULL;
     char           *signature;
+    char           *server_url;
     const char     *call_hash;
     char           *session_token;
     int             bytes_to_alloc;
@@ -361,9 +959,10 @@ const char     *mfconn_create_signed_get(mfconn * conn, int ssl,
         return NULL;
     }
 
-    api_request = strdup_printf("%s//%s/api/%s/%s",
-                                (ssl ? "https:" : "http:"),
-                                conn->server, MFAPI_VERSION, api);
+    server_url = mfconn_server_url(conn->server, ssl);
+    api_request = strdup_printf("%s/api/%s/%s", server_url, MFAPI_VERSION,
+                                api);
+    free(server_url);
 
     call_hash = mfconn_create_call_signature(conn, api_request, api_args);
     signature = strdup_printf("&signature=%s", call_hash);
@@ -418,11 +1017,20 @@ const char     *mfconn_get_ekey(mfconn * conn)
 
 int mfconn_upload_poll_for_completion(mfconn * conn, const char *upload_key)
 {
+    struct timespec delay;
+    unsigned int    polls;
+    int             interval;
     int             status;
     int             fileerror;
     int             retval;
 
-    for (;;) {
+    for (polls = 0;; polls++) {
+        // poll quickly at first and less often the longer it takes
+        interval = mfapi_upload_poll_interval(polls);
+        delay.tv_sec = interval / 1000;
+        delay.tv_nsec = (interval % 1000) * 1000000L;
+        nanosleep(&delay, NULL);
+
         // no need to update the secret key after this
         retval = mfconn_api_upload_poll_upload(conn, upload_key, &status,
                                                &fileerror);
@@ -434,10 +1042,231 @@ int mfconn_upload_poll_for_completion(mfconn * conn, const char *upload_key)
 
         // values 98 and 99 are terminal states for a completed upload
         if (status == 99 || status == 98) {
+            if (fileerror != 0) {
+                fprintf(stderr, "upload failed\n");
+                return -1;
+            }
             fprintf(stderr, "done\n");
             break;
         }
-        sleep(1);
     }
     return 0;
 }
+
+struct mfconn_upload_units {
+    mfconn         *conn;
+    const char     *folderkey;
+    const char     *file_name;
+    const char     *file_hash;
+    uint64_t        file_size;
+    const unsigned char *data;
+    struct mfconn_upload_resumable *resumable;
+    pthread_mutex_t mutex;
+    uint64_t        next_unit;
+    bool            failed;
+    char           *upload_key;
+};
+
+static void    *mfconn_upload_units_worker(void *user_ptr);
+static int      mfconn_upload_units_send(struct mfconn_upload_units *units,
+                                         mfconn * conn);
+
+/*
+ * sends fh in the units that upload/check asked for when it was called with
+ * resumable set
+ *
+ * units that the server already has, also from an earlier attempt of the
+ * same upload that was interrupted, are skipped. Every unit is retried on its
+ * own, so a failure never causes the whole file to be sent again.
+ *
+ * up to max_parallel units are sent at the same time. Every additional one
+ * uses a session from the pool of conn because signed calls of the same
+ * session cannot overlap. The units are sent directly from a memory mapping
+ * of the file.
+ *
+ * on success, upload_key is set to the key to poll for completion
+ */
+int mfconn_upload_resumable(mfconn * conn, const char *folderkey, FILE * fh,
+                            const char *file_name, uint64_t file_size,
+                            const char *file_hash,
+                            struct mfconn_upload_resumable *resumable,
+                            int max_parallel, char **upload_key)
+{
+    struct mfconn_upload_units units;
+    pthread_t      *threads;
+    void           *data;
+    int             num_threads;
+    int             i;
+
+    *upload_key = NULL;
+
+    if (resumable->number_of_units == 0 || resumable->unit_size == 0) {
+        fprintf(stderr, "no resumable upload information\n");
+        return -1;
+    }
+
+    if (file_size == 0
+        || resumable->number_of_units * resumable->unit_size < file_size) {
+        fprintf(stderr, "units do not cover the file\n");
+        return -1;
+    }
+
+    data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mmap failed\n");
+        return -1;
+    }
+
+    units.conn = conn;
+    units.folderkey = folderkey;
+    units.file_name = file_name;
+    units.file_hash = file_hash;
+    units.file_size = file_size;
+    units.data = (const unsigned char *)data;
+    units.resumable = resumable;
+    pthread_mutex_init(&(units.mutex), NULL);
+    units.next_unit = 0;
+    units.failed = false;
+    units.upload_key = NULL;
+
+    if (max_parallel < 1)
+        max_parallel = 1;
+    if ((uint64_t) max_parallel > resumable->number_of_units)
+        max_parallel = resumable->number_of_units;
+
+    // the calling thread is one of the senders and uses conn itself
+    threads = (pthread_t *) calloc(max_parallel, sizeof(pthread_t));
+    num_threads = 0;
+    for (i = 1; i < max_parallel; i++) {
+        if (pthread_create(&(threads[num_threads]), NULL,
+                           mfconn_upload_units_worker, &units) != 0) {
+            fprintf(stderr, "cannot start upload thread\n");
+            break;
+        }
+        num_threads++;
+    }
+
+    mfconn_upload_units_send(&units, conn);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    munmap(data, file_size);
+    pthread_mutex_destroy(&(units.mutex));
+
+    if (units.failed) {
+        free(units.upload_key);
+        return -1;
+    }
+    // if all units had already been sent before, the key comes from
+    // upload/check
+    if (units.upload_key == NULL && resumable->upload_key != NULL)
+        units.upload_key = strdup(resumable->upload_key);
+
+    if (units.upload_key == NULL) {
+        fprintf(stderr, "server did not return an upload key\n");
+        return -1;
+    }
+
+    *upload_key = units.upload_key;
+
+    return 0;
+}
+
+static void    *mfconn_upload_units_worker(void *user_ptr)
+{
+    struct mfconn_upload_units *units;
+    mfconn         *conn;
+
+    units = (struct mfconn_upload_units *)user_ptr;
+
+    conn = mfconn_acquire(units->conn);
+    if (conn == NULL) {
+        // the other senders carry on without this one
+        fprintf(stderr, "cannot create session for upload thread\n");
+        return NULL;
+    }
+
+    // after a failure the key chain of the session may be out of step with
+    // the server, so it must not be handed to anybody else
+    if (mfconn_upload_units_send(units, conn) != 0) {
+        mfconn_destroy(conn);
+    } else {
+        mfconn_release(conn);
+    }
+
+    return NULL;
+}
+
+/*
+ * sends units until there are none left or one of them failed
+ *
+ * returns -1 if a unit sent with conn failed and 0 otherwise
+ */
+static int mfconn_upload_units_send(struct mfconn_upload_units *units,
+                                    mfconn * conn)
+{
+    struct mfconn_upload_resumable resumable;
+    unsigned char   bhash[SHA256_DIGEST_LENGTH];
+    char           *unit_hash;
+    char           *upload_key;
+    uint64_t        unit_id;
+    uint64_t        unit_size;
+    uint64_t        offset;
+    int             retval;
+
+    for (;;) {
+        pthread_mutex_lock(&(units->mutex));
+        while (units->next_unit < units->resumable->number_of_units
+               && mfapi_upload_resumable_unit_ready(units->resumable,
+                                                    units->next_unit))
+            units->next_unit++;
+        unit_id = units->next_unit++;
+        offset = unit_id * units->resumable->unit_size;
+        if (units->failed || unit_id >= units->resumable->number_of_units
+            || offset >= units->file_size) {
+            pthread_mutex_unlock(&(units->mutex));
+            return 0;
+        }
+        pthread_mutex_unlock(&(units->mutex));
+
+        unit_size = units->file_size - offset;
+        if (unit_size > units->resumable->unit_size)
+            unit_size = units->resumable->unit_size;
+
+        SHA256(units->data + offset, unit_size, bhash);
+        unit_hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
+
+        memset(&resumable, 0, sizeof(struct mfconn_upload_resumable));
+        upload_key = NULL;
+        // the call retries on its own and renews the token where needed
+        retval = mfconn_api_upload_resumable(conn, units->folderkey,
+                                             units->file_name,
+                                             units->file_size,
+                                             units->file_hash, unit_id,
+                                             units->data + offset, unit_size,
+                                             unit_hash, &resumable,
+                                             &upload_key);
+        if (retval != 0)
+            fprintf(stderr, "upload of unit %" PRIu64 " failed\n", unit_id);
+        free(unit_hash);
+        mfapi_upload_resumable_clear(&resumable);
+
+        pthread_mutex_lock(&(units->mutex));
+        if (retval != 0) {
+            units->failed = true;
+        } else if (upload_key != NULL && units->upload_key == NULL) {
+            // only the response to the unit that completed the file
+            // carries the key
+            units->upload_key = upload_key;
+            upload_key = NULL;
+        }
+        pthread_mutex_unlock(&(units->mutex));
+        free(upload_key);
+
+        if (retval != 0)
+            return -1;
+    }
+}
@@ -20,22 +20,56 @@
 #define __MFAPI_MFCONN_H__
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #include "file.h"
 
 typedef struct mfconn mfconn;
 
+// how many units of a resumable upload are sent at the same time by default
+#define MFCONN_UPLOAD_PARALLEL_UNITS 4
+
+// how many idle sessions a connection keeps for mfconn_acquire()
+#define MFCONN_POOL_SIZE 8
+
+// how long (in seconds) the server accepts a session token and how long
+// before that it is renewed
+#define MFCONN_TOKEN_LIFETIME 600
+#define MFCONN_TOKEN_MARGIN 60
+
+struct mfconn_upload_resumable;
+
 mfconn         *mfconn_create(const char *server, const char *username,
                               const char *password, int app_id,
                               const char *app_key, int max_num_retries);
 
+mfconn         *mfconn_resume(const char *server, const char *username,
+                              const char *password, int app_id,
+                              const char *app_key, int max_num_retries,
+                              const char *session_file);
+
+char           *mfconn_session_file(const char *server, const char *username,
+                                    int app_id);
+
+mfconn         *mfconn_clone(mfconn * conn);
+
+mfconn         *mfconn_acquire(mfconn * conn);
+
+void            mfconn_release(mfconn * session);
+
 int             mfconn_refresh_token(mfconn * conn);
 
+int             mfconn_check_token(mfconn * conn);
+
+int             mfconn_start_renewal(mfconn * conn);
+
 void            mfconn_destroy(mfconn * conn);
 
 ssize_t         mfconn_download_direct(mffile * file, const char *local_dir);
 
+char           *mfconn_server_url(const char *server, int ssl);
+
 const char     *mfconn_create_unsigned_get(mfconn * conn, int ssl,
                                            const char *api, const char *fmt,
                                            ...);
@@ -51,6 +85,8 @@ const char     *mfconn_create_user_signature(mfconn * conn,
 
 void            mfconn_update_secret_key(mfconn * conn);
 
+void            mfconn_set_secret_key(mfconn * conn, uint32_t secret_key);
+
 const char     *mfconn_get_session_token(mfconn * conn);
 
 const char     *mfconn_get_secret_time(mfconn * conn);
@@ -64,4 +100,12 @@ int             mfconn_get_max_num_retries(mfconn * conn);
 int             mfconn_upload_poll_for_completion(mfconn * conn,
                                                   const char *upload_key);
 
+int             mfconn_upload_resumable(mfconn * conn, const char *folderkey,
+                                        FILE * fh, const char *file_name,
+                                        uint64_t file_size,
+                                        const char *file_hash,
+                                        struct mfconn_upload_resumable
+                                        *resumable, int max_parallel,
+                                        char **upload_key);
+
 #endif
@@ -40,6 +40,8 @@ struct mfpatch {
     char            target_hash[SHA256_DIGEST_LENGTH * 2 + 1];
     /* expected size of the patched file */
     uint64_t        target_size;
+    /* size of the patch itself or zero if unknown */
+    uint64_t        size;
     char           *link;
 };
 
@@ -228,6 +230,28 @@ int patch_set_target_size(mfpatch * patch, uint64_t size)
     return 0;
 }
 
+uint64_t patch_get_size(mfpatch * patch)
+{
+    if (patch == NULL) {
+        fprintf(stderr, "patch must not be NULL\n");
+        return -1;
+    }
+
+    return patch->size;
+}
+
+int patch_set_size(mfpatch * patch, uint64_t size)
+{
+    if (patch == NULL) {
+        fprintf(stderr, "patch must not be NULL\n");
+        return -1;
+    }
+
+    patch->size = size;
+
+    return 0;
+}
+
 const char     *patch_get_link(mfpatch * patch)
 {
     if (patch == NULL) {
@@ -49,6 +49,10 @@ uint64_t        patch_get_target_size(mfpatch * patch);
 
 int             patch_set_target_size(mfpatch * patch, uint64_t size);
 
+uint64_t        patch_get_size(mfpatch * patch);
+
+int             patch_set_size(mfpatch * patch, uint64_t size);
+
 const char     *patch_get_link(mfpatch * patch);
 
 int             patch_set_link(mfpatch * patch, const char *link);
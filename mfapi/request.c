@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, nanosleep and rand_r
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../utils/http.h"
+#include "mfconn.h"
+#include "request.h"
+
+// the number of endpoints whose failures are counted separately
+#define MFAPI_REQUEST_MAX_CIRCUITS 48
+
+struct mfapi_circuit {
+    char            endpoint[64];
+    unsigned int    failures;
+    // in milliseconds
+    int64_t         open_until;
+};
+
+static pthread_mutex_t mfapi_request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mfapi_circuit mfapi_circuits[MFAPI_REQUEST_MAX_CIRCUITS];
+static int      mfapi_num_circuits = 0;
+// the token bucket of the rate limit which is disabled if the rate is zero
+static double   mfapi_rate = 0;
+static double   mfapi_tokens = 0;
+static int64_t  mfapi_tokens_time = 0;
+// nobody sends anything before this time after the server was overloaded
+static int64_t  mfapi_busy_until = 0;
+static unsigned int mfapi_seed = 0;
+
+static struct mfapi_circuit *mfapi_request_circuit(const char *endpoint);
+static bool     mfapi_request_admit(struct mfapi_request *request);
+static bool     mfapi_request_record(struct mfapi_request *request,
+                                     enum mfapi_result result);
+static int      mfapi_request_backoff(int attempts);
+static void     mfapi_request_hold_back(int64_t milliseconds);
+static void     mfapi_request_sleep(int64_t milliseconds);
+static int64_t  mfapi_request_now(void);
+
+void mfapi_request_init(struct mfapi_request *request, mfconn * conn,
+                        const char *endpoint)
+{
+    request->conn = conn;
+    request->endpoint = endpoint;
+    request->attempts = 0;
+    request->refresh_token = true;
+}
+
+/*
+ * decides whether another attempt is to be made and waits until it may
+ *
+ * retval is the result of the previous attempt. If no further attempt is
+ * made, it is what the api call has to return.
+ */
+bool mfapi_request_next(struct mfapi_request *request, int *retval)
+{
+    enum mfapi_result result;
+    int64_t         backoff;
+
+    if (request->attempts > 0) {
+        result = mfapi_request_classify(*retval);
+        // a failure that took the endpoint out ends the retries right away
+        if (!mfapi_request_record(request, result))
+            return false;
+
+        if (result == MFAPI_RESULT_SUCCESS
+            || result == MFAPI_RESULT_PERMANENT)
+            return false;
+
+        if (request->attempts >= mfconn_get_max_num_retries(request->conn))
+            return false;
+
+        backoff = 0;
+        if (result == MFAPI_RESULT_TRANSIENT
+            || result == MFAPI_RESULT_UNREACHED
+            || result == MFAPI_RESULT_BUSY)
+            backoff = mfapi_request_backoff(request->attempts);
+
+        if (result == MFAPI_RESULT_BUSY) {
+            mfapi_request_hold_back(backoff);
+        } else if (backoff > 0) {
+            mfapi_request_sleep(backoff);
+        }
+
+        // if there was either a token error or a transfer that broke off,
+        // get a new token and try again
+        //
+        // on a transfer that broke off we get a new token because it is
+        // likely that we lost signature synchronization (we don't know
+        // whether the server accepted or rejected the last call). If the
+        // server never processed the call, it still expects the old key.
+        if (request->refresh_token && (result == MFAPI_RESULT_TOKEN
+                                       || result == MFAPI_RESULT_TRANSIENT)) {
+            fprintf(stderr, "got error %d - negotiate a new token\n",
+                    *retval);
+            if (mfconn_refresh_token(request->conn) != 0) {
+                fprintf(stderr, "failed to get a new token\n");
+                *retval = -1;
+                return false;
+            }
+        } else if (request->refresh_token) {
+            mfconn_set_secret_key(request->conn, request->secret_key);
+        }
+    } else if (request->refresh_token) {
+        // take over a token that was renewed in the background or renew one
+        // that is about to expire
+        if (mfconn_check_token(request->conn) != 0) {
+            fprintf(stderr, "failed to renew the token\n");
+            *retval = -1;
+            return false;
+        }
+    }
+
+    if (!mfapi_request_admit(request)) {
+        *retval = -1;
+        return false;
+    }
+
+    // the request that obtains the token does not use the key of conn
+    if (request->refresh_token)
+        request->secret_key = mfconn_get_secret_key(request->conn);
+    request->attempts++;
+
+    return true;
+}
+
+/*
+ * admits a single attempt of a call that is not repeated by the policy, for
+ * example one of many that run at the same time in the multi engine
+ *
+ * like the attempts of other calls, it waits for the rate limit and for an
+ * overloaded server. Its outcome has to be handed to mfapi_request_end().
+ */
+bool mfapi_request_begin(struct mfapi_request *request)
+{
+    if (!mfapi_request_admit(request))
+        return false;
+
+    request->attempts++;
+
+    return true;
+}
+
+void mfapi_request_end(struct mfapi_request *request, int retval)
+{
+    enum mfapi_result result;
+
+    result = mfapi_request_classify(retval);
+    mfapi_request_record(request, result);
+    if (result == MFAPI_RESULT_BUSY)
+        mfapi_request_hold_back(mfapi_request_backoff(request->attempts));
+}
+
+/*
+ * retval is either a curl error, an error code of the api or -1
+ */
+enum mfapi_result mfapi_request_classify(int retval)
+{
+    switch (retval) {
+        case 0:
+            return MFAPI_RESULT_SUCCESS;
+        case 127:
+            return MFAPI_RESULT_TOKEN;
+        case HTTP_SERVER_BUSY:
+            return MFAPI_RESULT_BUSY;
+        case CURLE_COULDNT_RESOLVE_PROXY:
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_SSL_CONNECT_ERROR:
+            return MFAPI_RESULT_UNREACHED;
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+            return MFAPI_RESULT_TRANSIENT;
+        default:
+            return MFAPI_RESULT_PERMANENT;
+    }
+}
+
+/*
+ * limits how many attempts are made per second by all threads together
+ *
+ * a rate of zero removes the limit
+ */
+void mfapi_request_set_rate_limit(double requests_per_second)
+{
+    pthread_mutex_lock(&mfapi_request_mutex);
+    mfapi_rate = requests_per_second > 0 ? requests_per_second : 0;
+    // start with a full bucket
+    mfapi_tokens = mfapi_rate < 1 ? 1 : mfapi_rate;
+    mfapi_tokens_time = mfapi_request_now();
+    pthread_mutex_unlock(&mfapi_request_mutex);
+}
+
+/*
+ * must be called with the mutex held
+ *
+ * returns NULL if there are too many endpoints, which are then not guarded
+ */
+static struct mfapi_circuit *mfapi_request_circuit(const char *endpoint)
+{
+    struct mfapi_circuit *circuit;
+    int             i;
+
+    for (i = 0; i < mfapi_num_circuits; i++) {
+        if (strcmp(mfapi_circuits[i].endpoint, endpoint) == 0)
+            return &(mfapi_circuits[i]);
+    }
+
+    if (mfapi_num_circuits >= MFAPI_REQUEST_MAX_CIRCUITS)
+        return NULL;
+
+    circuit = &(mfapi_circuits[mfapi_num_circuits]);
+    mfapi_num_circuits++;
+    snprintf(circuit->endpoint, sizeof(circuit->endpoint), "%s", endpoint);
+    circuit->failures = 0;
+    circuit->open_until = 0;
+
+    return circuit;
+}
+
+/*
+ * refuses the attempt if the endpoint is failing and otherwise waits until
+ * the rate limit allows it
+ */
+static bool mfapi_request_admit(struct mfapi_request *request)
+{
+    struct mfapi_circuit *circuit;
+    double          burst;
+    int64_t         now;
+    int64_t         wait_until;
+
+    now = mfapi_request_now();
+
+    pthread_mutex_lock(&mfapi_request_mutex);
+
+    circuit = mfapi_request_circuit(request->endpoint);
+    if (circuit != NULL && circuit->open_until > now) {
+        pthread_mutex_unlock(&mfapi_request_mutex);
+        fprintf(stderr, "not trying %s, it failed too often\n",
+                request->endpoint);
+        return false;
+    }
+
+    wait_until = mfapi_busy_until;
+
+    if (mfapi_rate > 0) {
+        // the attempt takes its token right away, even if that means that
+        // the bucket is in debt and it has to wait for it
+        burst = mfapi_rate < 1 ? 1 : mfapi_rate;
+        mfapi_tokens += (now - mfapi_tokens_time) * mfapi_rate / 1000;
+        if (mfapi_tokens > burst)
+            mfapi_tokens = burst;
+        mfapi_tokens_time = now;
+        mfapi_tokens -= 1;
+        if (mfapi_tokens < 0
+            && now - mfapi_tokens * 1000 / mfapi_rate > wait_until)
+            wait_until = now - mfapi_tokens * 1000 / mfapi_rate;
+    }
+
+    pthread_mutex_unlock(&mfapi_request_mutex);
+
+    if (wait_until > now)
+        mfapi_request_sleep(wait_until - now);
+
+    return true;
+}
+
+/*
+ * counts the transient failures of the endpoint in a row
+ *
+ * once the endpoint is tried again after the cooldown, a single further
+ * failure is enough to take it out again
+ *
+ * returns false if the endpoint is taken out
+ */
+static bool mfapi_request_record(struct mfapi_request *request,
+                                 enum mfapi_result result)
+{
+    struct mfapi_circuit *circuit;
+    bool            closed;
+
+    closed = true;
+
+    pthread_mutex_lock(&mfapi_request_mutex);
+
+    circuit = mfapi_request_circuit(request->endpoint);
+    if (circuit != NULL) {
+        if (result == MFAPI_RESULT_TRANSIENT
+            || result == MFAPI_RESULT_UNREACHED
+            || result == MFAPI_RESULT_BUSY) {
+            circuit->failures++;
+            if (circuit->failures >= MFAPI_REQUEST_CIRCUIT_FAILURES) {
+                if (circuit->failures == MFAPI_REQUEST_CIRCUIT_FAILURES)
+                    fprintf(stderr, "%s failed %u times in a row, not "
+                            "trying it for %d seconds\n", request->endpoint,
+                            circuit->failures,
+                            MFAPI_REQUEST_CIRCUIT_COOLDOWN);
+                circuit->open_until = mfapi_request_now()
+                    + MFAPI_REQUEST_CIRCUIT_COOLDOWN * 1000;
+                closed = false;
+            }
+        } else if (result != MFAPI_RESULT_TOKEN) {
+            // the server answered, so the endpoint works
+            circuit->failures = 0;
+            circuit->open_until = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&mfapi_request_mutex);
+
+    return closed;
+}
+
+/*
+ * the delay before the next attempt doubles with every failed attempt
+ *
+ * only the first half of it is fixed, the rest is random so that the
+ * attempts of threads which failed together are spread out
+ */
+static int mfapi_request_backoff(int attempts)
+{
+    int             backoff;
+    int             jitter;
+    int             i;
+
+    backoff = MFAPI_REQUEST_FIRST_BACKOFF;
+    for (i = 1; i < attempts && backoff < MFAPI_REQUEST_MAX_BACKOFF; i++) {
+        backoff *= 2;
+    }
+    if (backoff > MFAPI_REQUEST_MAX_BACKOFF)
+        backoff = MFAPI_REQUEST_MAX_BACKOFF;
+
+    pthread_mutex_lock(&mfapi_request_mutex);
+    if (mfapi_seed == 0)
+        mfapi_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    jitter = rand_r(&mfapi_seed) % (backoff / 2 + 1);
+    pthread_mutex_unlock(&mfapi_request_mutex);
+
+    return backoff / 2 + jitter;
+}
+
+/*
+ * holds back all requests, not just the one that found the server
+ * overloaded
+ */
+static void mfapi_request_hold_back(int64_t milliseconds)
+{
+    int64_t         until;
+
+    until = mfapi_request_now() + milliseconds;
+
+    pthread_mutex_lock(&mfapi_request_mutex);
+    if (mfapi_busy_until < until)
+        mfapi_busy_until = until;
+    pthread_mutex_unlock(&mfapi_request_mutex);
+}
+
+static void mfapi_request_sleep(int64_t milliseconds)
+{
+    struct timespec delay;
+
+    delay.tv_sec = milliseconds / 1000;
+    delay.tv_nsec = (milliseconds % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+}
+
+static int64_t mfapi_request_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
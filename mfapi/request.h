@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __MFAPI_REQUEST_H__
+#define __MFAPI_REQUEST_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mfconn.h"
+
+/*
+ * decides for all api calls whether, when and how often they are attempted
+ *
+ * an api call runs its attempts in a loop like
+ *
+ *     mfapi_request_init(&request, conn, "file/delete");
+ *     while (mfapi_request_next(&request, &retval)) {
+ *         ...
+ *         retval = http_get_buf(...);
+ *         ...
+ *     }
+ *
+ * failed attempts are repeated after a growing delay with some randomness so
+ * that threads which failed at the same time do not all come back at the
+ * same time. A new token is only negotiated if the server rejected the token
+ * or if it is unknown whether the server processed the last attempt, which
+ * advanced the secret key. Otherwise the same token is used again with the
+ * secret key from before the attempt.
+ *
+ * all requests share a rate limit and when the server signals that it is
+ * overloaded, everybody backs off. An endpoint that keeps failing is not
+ * tried anymore for a while so that callers fail fast instead of waiting for
+ * all their retries.
+ */
+
+enum mfapi_result {
+    MFAPI_RESULT_SUCCESS,
+    // the server answered with an error that another attempt won't fix
+    MFAPI_RESULT_PERMANENT,
+    // the session token was rejected
+    MFAPI_RESULT_TOKEN,
+    // the request failed on the way, so the server might have processed it
+    MFAPI_RESULT_TRANSIENT,
+    // the request never reached the server
+    MFAPI_RESULT_UNREACHED,
+    // the server asked to slow down without processing the request
+    MFAPI_RESULT_BUSY,
+};
+
+struct mfapi_request {
+    mfconn         *conn;
+    const char     *endpoint;
+    int             attempts;
+    // false for the request that obtains the token itself
+    bool            refresh_token;
+    // the secret key before the last attempt, which is restored if the
+    // server did not process it
+    uint32_t        secret_key;
+};
+
+// the delay (in milliseconds) before the second attempt, it doubles with
+// every further one
+#define MFAPI_REQUEST_FIRST_BACKOFF 500
+#define MFAPI_REQUEST_MAX_BACKOFF 8000
+
+// after this many transient failures in a row, an endpoint is not tried for
+// MFAPI_REQUEST_CIRCUIT_COOLDOWN seconds
+#define MFAPI_REQUEST_CIRCUIT_FAILURES 5
+#define MFAPI_REQUEST_CIRCUIT_COOLDOWN 30
+
+void            mfapi_request_init(struct mfapi_request *request,
+                                   mfconn * conn, const char *endpoint);
+
+bool            mfapi_request_next(struct mfapi_request *request,
+                                   int *retval);
+
+bool            mfapi_request_begin(struct mfapi_request *request);
+
+void            mfapi_request_end(struct mfapi_request *request, int retval);
+
+enum mfapi_result mfapi_request_classify(int retval);
+
+void            mfapi_request_set_rate_limit(double requests_per_second);
+
+#endif
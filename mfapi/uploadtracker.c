@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strdup and clock_gettime
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apicalls.h"
+#include "mfconn.h"
+#include "uploadtracker.h"
+
+struct tracked_upload {
+    char           *upload_key;
+    uploadtracker_cb cb;
+    void           *user_ptr;
+    unsigned int    polls;
+    unsigned int    errors;
+    // in milliseconds
+    int64_t         next_poll;
+    int             result;
+    struct tracked_upload *next;
+};
+
+struct uploadtracker {
+    mfconn         *conn;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    // signalled whenever an upload was added
+    pthread_cond_t  cond;
+    struct tracked_upload *uploads;
+    bool            stop;
+};
+
+static void    *uploadtracker_thread(void *user_ptr);
+static void     uploadtracker_poll(uploadtracker * tracker, mfconn * conn,
+                                   struct tracked_upload **done);
+static int64_t  uploadtracker_now(void);
+
+uploadtracker  *uploadtracker_create(mfconn * conn)
+{
+    uploadtracker  *tracker;
+
+    tracker = (uploadtracker *) calloc(1, sizeof(uploadtracker));
+    if (tracker == NULL)
+        return NULL;
+
+    tracker->conn = conn;
+    pthread_mutex_init(&(tracker->mutex), NULL);
+    pthread_cond_init(&(tracker->cond), NULL);
+
+    if (pthread_create(&(tracker->thread), NULL, uploadtracker_thread,
+                       tracker) != 0) {
+        fprintf(stderr, "cannot start upload tracker\n");
+        pthread_cond_destroy(&(tracker->cond));
+        pthread_mutex_destroy(&(tracker->mutex));
+        free(tracker);
+        return NULL;
+    }
+
+    return tracker;
+}
+
+/*
+ * starts polling upload_key
+ *
+ * cb is called exactly once unless this function fails
+ */
+int uploadtracker_add(uploadtracker * tracker, const char *upload_key,
+                      uploadtracker_cb cb, void *user_ptr)
+{
+    struct tracked_upload *upload;
+
+    upload = (struct tracked_upload *)calloc(1,
+                                             sizeof(struct tracked_upload));
+    if (upload == NULL)
+        return -1;
+
+    upload->upload_key = strdup(upload_key);
+    upload->cb = cb;
+    upload->user_ptr = user_ptr;
+    upload->next_poll = uploadtracker_now()
+        + mfapi_upload_poll_interval(0);
+
+    pthread_mutex_lock(&(tracker->mutex));
+    if (tracker->stop) {
+        pthread_mutex_unlock(&(tracker->mutex));
+        free(upload->upload_key);
+        free(upload);
+        return -1;
+    }
+    upload->next = tracker->uploads;
+    tracker->uploads = upload;
+    pthread_cond_signal(&(tracker->cond));
+    pthread_mutex_unlock(&(tracker->mutex));
+
+    return 0;
+}
+
+/*
+ * waits until all uploads that are tracked finished
+ */
+void uploadtracker_destroy(uploadtracker * tracker)
+{
+    pthread_mutex_lock(&(tracker->mutex));
+    tracker->stop = true;
+    pthread_cond_signal(&(tracker->cond));
+    pthread_mutex_unlock(&(tracker->mutex));
+
+    pthread_join(tracker->thread, NULL);
+
+    pthread_cond_destroy(&(tracker->cond));
+    pthread_mutex_destroy(&(tracker->mutex));
+    free(tracker);
+}
+
+static void    *uploadtracker_thread(void *user_ptr)
+{
+    uploadtracker  *tracker;
+    struct tracked_upload *upload;
+    struct tracked_upload *done;
+    struct timespec deadline;
+    mfconn         *conn;
+    int64_t         wakeup;
+
+    tracker = (uploadtracker *) user_ptr;
+    // the polls run with a session of their own which is only taken once
+    // there is something to poll
+    conn = NULL;
+
+    pthread_mutex_lock(&(tracker->mutex));
+    for (;;) {
+        if (tracker->uploads == NULL) {
+            if (tracker->stop)
+                break;
+            pthread_cond_wait(&(tracker->cond), &(tracker->mutex));
+            continue;
+        }
+
+        wakeup = 0;
+        for (upload = tracker->uploads; upload != NULL;
+             upload = upload->next) {
+            if (wakeup == 0 || upload->next_poll < wakeup)
+                wakeup = upload->next_poll;
+        }
+        if (wakeup > uploadtracker_now()) {
+            deadline.tv_sec = wakeup / 1000;
+            deadline.tv_nsec = (wakeup % 1000) * 1000000L;
+            pthread_cond_timedwait(&(tracker->cond), &(tracker->mutex),
+                                   &deadline);
+            continue;
+        }
+
+        if (conn == NULL) {
+            pthread_mutex_unlock(&(tracker->mutex));
+            conn = mfconn_acquire(tracker->conn);
+            pthread_mutex_lock(&(tracker->mutex));
+        }
+
+        done = NULL;
+        uploadtracker_poll(tracker, conn, &done);
+
+        // the callbacks may add further uploads
+        pthread_mutex_unlock(&(tracker->mutex));
+        while (done != NULL) {
+            upload = done;
+            done = upload->next;
+            upload->cb(upload->upload_key, upload->result, upload->user_ptr);
+            free(upload->upload_key);
+            free(upload);
+        }
+        pthread_mutex_lock(&(tracker->mutex));
+    }
+    pthread_mutex_unlock(&(tracker->mutex));
+
+    mfconn_release(conn);
+
+    return NULL;
+}
+
+/*
+ * must be called with the mutex held, which is released while the uploads
+ * are polled
+ *
+ * polls all uploads that are due and moves those that finished to done.
+ * Uploads are only added to the front of the list, so the others stay where
+ * they are while the mutex is released.
+ */
+static void uploadtracker_poll(uploadtracker * tracker, mfconn * conn,
+                              struct tracked_upload **done)
+{
+    struct tracked_upload *batch[UPLOADTRACKER_MAX_BATCH];
+    const char     *upload_keys[UPLOADTRACKER_MAX_BATCH];
+    int             status[UPLOADTRACKER_MAX_BATCH];
+    int             fileerror[UPLOADTRACKER_MAX_BATCH];
+    struct tracked_upload *upload;
+    struct tracked_upload **next;
+    int64_t         now;
+    int             num_polled;
+    int             i;
+
+    now = uploadtracker_now();
+    num_polled = 0;
+    for (upload = tracker->uploads;
+         upload != NULL && num_polled < UPLOADTRACKER_MAX_BATCH;
+         upload = upload->next) {
+        if (upload->next_poll > now)
+            continue;
+        batch[num_polled] = upload;
+        upload_keys[num_polled] = upload->upload_key;
+        num_polled++;
+    }
+
+    pthread_mutex_unlock(&(tracker->mutex));
+    if (conn == NULL
+        || mfconn_api_upload_poll_uploads(conn, upload_keys, num_polled,
+                                          status, fileerror) != 0) {
+        for (i = 0; i < num_polled; i++) {
+            status[i] = -1;
+        }
+    }
+    pthread_mutex_lock(&(tracker->mutex));
+
+    now = uploadtracker_now();
+    for (i = 0; i < num_polled; i++) {
+        upload = batch[i];
+        upload->polls++;
+        if (status[i] == -1) {
+            upload->errors++;
+            if (upload->errors >= UPLOADTRACKER_MAX_ERRORS) {
+                fprintf(stderr, "cannot poll upload %s\n",
+                        upload->upload_key);
+                upload->result = -1;
+                upload->next_poll = -1;
+                continue;
+            }
+        } else {
+            upload->errors = 0;
+            // values 98 and 99 are terminal states for a completed upload
+            if (status[i] == 99 || status[i] == 98) {
+                if (fileerror[i] != 0)
+                    fprintf(stderr, "upload %s failed with error %d\n",
+                            upload->upload_key, fileerror[i]);
+                upload->result = fileerror[i] == 0 ? 0 : -1;
+                upload->next_poll = -1;
+                continue;
+            }
+        }
+        upload->next_poll = now + mfapi_upload_poll_interval(upload->polls);
+    }
+
+    // hand the finished ones out
+    next = &(tracker->uploads);
+    while (*next != NULL) {
+        upload = *next;
+        if (upload->next_poll == -1) {
+            *next = upload->next;
+            upload->next = *done;
+            *done = upload;
+        } else {
+            next = &(upload->next);
+        }
+    }
+}
+
+static int64_t uploadtracker_now(void)
+{
+    struct timespec now;
+
+    // the same clock as the one of pthread_cond_timedwait
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef __MFAPI_UPLOADTRACKER_H__
+#define __MFAPI_UPLOADTRACKER_H__
+
+#include "mfconn.h"
+
+/*
+ * waits for the server to finish processing uploads
+ *
+ * a single thread polls all uploads that are due at the same time. Every
+ * upload is polled quickly at first and then less and less often (see
+ * mfapi_upload_poll_interval()). Once an upload is done or failed, its
+ * callback is called from that thread.
+ */
+typedef struct uploadtracker uploadtracker;
+
+// result is 0 if the upload completed and -1 if it failed
+typedef void    (*uploadtracker_cb) (const char *upload_key, int result,
+                                     void *user_ptr);
+
+// an upload that could not be polled this many times in a row failed
+#define UPLOADTRACKER_MAX_ERRORS 5
+
+// how many uploads are polled at the same time at most
+#define UPLOADTRACKER_MAX_BATCH 16
+
+uploadtracker  *uploadtracker_create(mfconn * conn);
+
+int             uploadtracker_add(uploadtracker * tracker,
+                                  const char *upload_key,
+                                  uploadtracker_cb cb, void *user_ptr);
+
+void            uploadtracker_destroy(uploadtracker * tracker);
+
+#endif
@@ -19,6 +19,7 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 
 #include "../mfshell.h"
@@ -30,6 +31,7 @@ int mfshell_cmd_auth(mfshell * mfshell, int argc, char *const argv[])
 {
     char           *username;
     char           *password;
+    char           *session_file;
 
     if (mfshell == NULL)
         return -1;
@@ -60,13 +62,19 @@ int mfshell_cmd_auth(mfshell * mfshell, int argc, char *const argv[])
     if (username == NULL || password == NULL)
         return -1;
 
-    mfshell->conn = mfconn_create(mfshell->server, username, password,
-                                  mfshell->app_id, mfshell->app_key, 3);
+    session_file = mfconn_session_file(mfshell->server, username,
+                                       mfshell->app_id);
+    mfshell->conn = mfconn_resume(mfshell->server, username, password,
+                                  mfshell->app_id, mfshell->app_key, 3,
+                                  session_file);
+    free(session_file);
 
-    if (mfshell->conn != NULL)
+    if (mfshell->conn != NULL) {
+        mfconn_start_renewal(mfshell->conn);
         printf("\n\rAuthentication SUCCESS\n\r");
-    else
+    } else {
         printf("\n\rAuthentication FAILURE\n\r");
+    }
 
     return (mfshell->conn != NULL);
 }
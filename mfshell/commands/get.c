@@ -19,7 +19,9 @@
 
 #define _POSIX_C_SOURCE 200809L // for PATH_MAX
 
+#include <inttypes.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,24 +29,31 @@
 #include <sys/stat.h>
 
 #include "../../mfapi/apicalls.h"
+#include "../../mfapi/linkcache.h"
 #include "../mfshell.h"
 #include "../../mfapi/file.h"
 #include "../commands.h"        // IWYU pragma: keep
 #include "../../utils/strings.h"
 #include "../../utils/http.h"
 
+static int      mfshell_get_file(mfshell * mfshell, const char *quickkey,
+                                 mffile * file);
+
+/*
+ * the links of all files are retrieved together before the first download
+ * starts
+ */
 int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
 {
-    mffile         *file;
+    mffile        **files;
+    const char    **quickkeys;
+    const char    **found_keys;
+    uint64_t       *revisions;
+    int             num_keys;
+    int             num_found;
     int             len;
     int             retval;
-    ssize_t         bytes_read;
-    const char     *quickkey;
-    const char     *file_path;
-    const char     *file_name;
-    const char     *url;
-    struct stat     file_info;
-    mfhttp         *http;
+    int             i;
 
     if (mfshell == NULL)
         return -1;
@@ -54,38 +63,19 @@ int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
         return -1;
     }
 
-    if (argc != 2) {
+    if (argc < 2) {
         fprintf(stderr, "Invalid number of arguments\n");
         return -1;
     }
 
-    quickkey = argv[1];
-    if (quickkey == NULL)
-        return -1;
-
-    len = strlen(quickkey);
-
-    if (len != 11 && len != 15)
-        return -1;
-
-    file = file_alloc();
-
-    // get file name
-    retval = mfconn_api_file_get_info(mfshell->conn, file, (char *)quickkey);
-
-    if (retval != 0) {
-        file_free(file);
-        return -1;
+    num_keys = argc - 1;
+    quickkeys = (const char **)(argv + 1);
+    for (i = 0; i < num_keys; i++) {
+        len = strlen(quickkeys[i]);
+        if (len != 11 && len != 15)
+            return -1;
     }
-    // request a direct download (streaming) link
-    retval = mfconn_api_file_get_links(mfshell->conn, file,
-                                       (char *)quickkey,
-                                       MFCONN_FILE_LINK_TYPE_DIRECT_DOWNLOAD);
 
-    if (retval != 0) {
-        file_free(file);
-        return -1;
-    }
     // make sure we have a valid working directory to download to
     if (mfshell->local_working_dir == NULL) {
         mfshell->local_working_dir =
@@ -93,6 +83,71 @@ int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
         getcwd(mfshell->local_working_dir, PATH_MAX);
     }
 
+    files = (mffile **) calloc(num_keys, sizeof(mffile *));
+    found_keys = (const char **)calloc(num_keys, sizeof(char *));
+    revisions = (uint64_t *) calloc(num_keys, sizeof(uint64_t));
+
+    // get file names and revisions
+    if (num_keys > 1) {
+        retval = mfconn_api_file_get_info_batch(mfshell->conn, quickkeys,
+                                                num_keys, files);
+        if (retval != 0)
+            fprintf(stderr, "file/get_info for %d files failed\n",
+                    num_keys);
+    }
+
+    num_found = 0;
+    for (i = 0; i < num_keys; i++) {
+        if (files[i] == NULL) {
+            files[i] = file_alloc();
+            retval = mfconn_api_file_get_info(mfshell->conn, files[i],
+                                              quickkeys[i]);
+            if (retval != 0) {
+                fprintf(stderr, "cannot get information about %s\n",
+                        quickkeys[i]);
+                file_free(files[i]);
+                files[i] = NULL;
+                continue;
+            }
+        }
+        found_keys[num_found] = quickkeys[i];
+        revisions[num_found] = file_get_revision(files[i]);
+        num_found++;
+    }
+
+    // request the direct download (streaming) links
+    if (num_found > 1)
+        mfapi_linkcache_resolve(mfshell->conn, found_keys, revisions,
+                                num_found);
+
+    retval = num_found == num_keys ? 0 : -1;
+    for (i = 0; i < num_keys; i++) {
+        if (files[i] == NULL)
+            continue;
+        if (mfshell_get_file(mfshell, quickkeys[i], files[i]) != 0)
+            retval = -1;
+        file_free(files[i]);
+    }
+
+    free(files);
+    free(found_keys);
+    free(revisions);
+
+    return retval;
+}
+
+static int mfshell_get_file(mfshell * mfshell, const char *quickkey,
+                            mffile * file)
+{
+    int             retval;
+    int             attempt;
+    ssize_t         bytes_read;
+    char           *file_path;
+    const char     *file_name;
+    char           *url;
+    struct stat     file_info;
+    mfhttp         *http;
+
     file_name = file_get_name(file);
     if (file_name == NULL)
         return -1;
@@ -101,33 +156,50 @@ int mfshell_cmd_get(mfshell * mfshell, int argc, char *const argv[])
 
     file_path = strdup_printf("%s/%s", mfshell->local_working_dir, file_name);
 
-    url = file_get_direct_link(file);
-    if (url == NULL)
-        return -1;
-
-    http = http_create();
-    retval = http_get_file(http, url, file_path);
-    http_destroy(http);
+    // a cached link that the server refuses is replaced by a fresh one
+    retval = -1;
+    for (attempt = 0; attempt < 2; attempt++) {
+        url = mfapi_linkcache_get(mfshell->conn, quickkey,
+                                  file_get_revision(file));
+        if (url == NULL)
+            break;
+
+        http = http_create();
+        retval = http_get_file(http, url, file_path);
+        http_destroy(http);
+        free(url);
+
+        if (retval != HTTP_FORBIDDEN)
+            break;
+        mfapi_linkcache_invalidate(quickkey);
+    }
 
-    if (retval != 0)
+    if (retval != 0) {
+        printf("\r\n   Download FAILED!\n\r");
+        mfapi_linkcache_invalidate(quickkey);
+        free(file_path);
         return -1;
+    }
 
     memset(&file_info, 0, sizeof(file_info));
     retval = stat(file_path, &file_info);
 
-    free((void *)file_path);
+    free(file_path);
 
     if (retval != 0)
         return -1;
 
     bytes_read = file_info.st_size;
 
-    if (bytes_read != -1)
-        printf("\r   Downloaded %zd bytes OK!\n\r", bytes_read);
-    else
-        printf("\r\n   Download FAILED!\n\r");
+    // a link that went stale might deliver an error page instead
+    if ((uint64_t) bytes_read != file_get_size(file)) {
+        printf("\r\n   Download FAILED! Got %zd of %" PRIu64 " bytes\n\r",
+               bytes_read, file_get_size(file));
+        mfapi_linkcache_invalidate(quickkey);
+        return -1;
+    }
 
-    file_free(file);
+    printf("\r   Downloaded %zd bytes OK!\n\r", bytes_read);
 
     return 0;
 }
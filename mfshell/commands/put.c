@@ -22,8 +22,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <libgen.h>
+#include <openssl/sha.h>
 
+#include "../../utils/hash.h"
 #include "../../mfapi/apicalls.h"
 #include "../../mfapi/mfconn.h"
 #include "../mfshell.h"
@@ -37,7 +41,12 @@ int mfshell_cmd_put(mfshell * mfshell, int argc, char *const argv[])
     char           *temp;
     char           *file_name;
     char           *upload_key = NULL;
+    const char     *folder_key;
+    char           *hash;
+    unsigned char   bhash[SHA256_DIGEST_LENGTH];
+    uint64_t        size;
     FILE           *fh;
+    struct mfconn_upload_check_result check_result;
 
     if (mfshell == NULL)
         return -1;
@@ -63,19 +72,68 @@ int mfshell_cmd_put(mfshell * mfshell, int argc, char *const argv[])
         fprintf(stderr, "cannot open %s\n", file_path);
         return -1;
     }
+    retval = calc_sha256(fh, bhash, &size);
+    if (retval != 0) {
+        fprintf(stderr, "failed to calculate hash\n");
+        fclose(fh);
+        return -1;
+    }
+    hash = binary2hex(bhash, SHA256_DIGEST_LENGTH);
+
     // create copies because basename modifies it
     temp = strdup(argv[1]);
     file_name = basename(temp);
 
-    retval = mfconn_api_upload_simple(mfshell->conn,
-                                      folder_get_key(mfshell->folder_curr),
-                                      fh, file_name, &upload_key);
+    folder_key = folder_get_key(mfshell->folder_curr);
+    if (folder_key == NULL)
+        folder_key = "myfiles";
+
+    // an interrupted upload of the same file continues where it stopped
+    retval = mfconn_api_upload_check(mfshell->conn, file_name, hash, size,
+                                     folder_key, true, &check_result);
+    if (retval != 0) {
+        fprintf(stderr, "mfconn_api_upload_check failed\n");
+        mfapi_upload_resumable_clear(&(check_result.resumable));
+        fclose(fh);
+        free(temp);
+        free(hash);
+        return -1;
+    }
+
+    if (check_result.hash_exists) {
+        retval = mfconn_api_upload_instant(mfshell->conn, NULL, file_name,
+                                           hash, size, folder_key);
+        mfapi_upload_resumable_clear(&(check_result.resumable));
+        fclose(fh);
+        free(temp);
+        free(hash);
+
+        if (retval != 0) {
+            fprintf(stderr, "mfconn_api_upload_instant failed\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (size > 0 && check_result.resumable.number_of_units > 0) {
+        retval = mfconn_upload_resumable(mfshell->conn, folder_key, fh,
+                                         file_name, size, hash,
+                                         &(check_result.resumable),
+                                         MFCONN_UPLOAD_PARALLEL_UNITS,
+                                         &upload_key);
+    } else {
+        retval = mfconn_api_upload_simple(mfshell->conn, folder_key, NULL,
+                                          fh, file_name, &upload_key);
+    }
+    mfapi_upload_resumable_clear(&(check_result.resumable));
 
     fclose(fh);
     free(temp);
+    free(hash);
 
     if (retval != 0 || upload_key == NULL) {
-        fprintf(stderr, "mfconn_api_upload_simple failed\n");
+        fprintf(stderr, "upload of %s failed\n", file_path);
+        free(upload_key);
         return -1;
     }
 
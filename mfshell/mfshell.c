@@ -33,6 +33,7 @@
 #include "commands.h"
 #include "mfshell.h"
 #include "../mfapi/folder.h"
+#include "../utils/http.h"
 
 struct mfcmd    commands[] = {
     {"help", "", "show this help", mfshell_cmd_help},
@@ -56,7 +57,7 @@ struct mfcmd    commands[] = {
      mfshell_cmd_folder},
     {"links", "[quickkey]", "show access urls for the file",
      mfshell_cmd_links},
-    {"get", "[quickkey]", "download a file", mfshell_cmd_get},
+    {"get", "[quickkey...]", "download files", mfshell_cmd_get},
     {"put", "[local filename]", "upload a file", mfshell_cmd_put},
     {"rmdir", "[folderkey]", "remove directory", mfshell_cmd_rmdir},
     {"rm", "[quickkey]", "remove file", mfshell_cmd_rm},
@@ -80,10 +81,15 @@ mfshell        *mfshell_create(int app_id, char *app_key, char *server)
     /*
        check to see if the server contains a forward-slash.  if so,
        the caller did not understand the API and passed in the wrong
-       type of server resource.
+       type of server resource. The only exception is an explicit
+       http:// prefix which is used to talk to local test servers.
      */
-    if (strchr(server, '/') != NULL)
+    if (strncmp(server, "http://", strlen("http://")) == 0) {
+        if (strchr(server + strlen("http://"), '/') != NULL)
+            return NULL;
+    } else if (strchr(server, '/') != NULL) {
         return NULL;
+    }
 
     shell = (mfshell *) calloc(1, sizeof(mfshell));
 
@@ -255,4 +261,5 @@ void mfshell_destroy(mfshell * shell)
     if (shell->conn != NULL)
         mfconn_destroy(shell->conn);
     free(shell);
+    http_cleanup();
 }
@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+
+# runs "mediafire-shell put" against a local stand-in for the parts of the
+# MediaFire API that a resumable upload needs
+#
+# the connection of one unit of the first upload is dropped before the server
+# answers (the unit has to be retried on its own) and further units are
+# rejected after a few, so that the upload fails. The second upload must only
+# send the units that are still missing. Units are sent in parallel, so the
+# server handles every connection in its own thread.
+#
+# finally, a shell that is started again must continue the session that the
+# previous one stored instead of logging in.
+
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse, parse_qs
+
+UNIT_SIZE = 64 * 1024
+NUM_UNITS = 6
+FILE_SIZE = NUM_UNITS * UNIT_SIZE - UNIT_SIZE // 2
+
+
+class Upload:
+    def __init__(self, size):
+        self.size = size
+        self.units = {}
+
+    def number_of_units(self):
+        return (self.size + UNIT_SIZE - 1) // UNIT_SIZE
+
+    def complete(self):
+        return len(self.units) == self.number_of_units()
+
+    def state(self):
+        words = []
+        for unit_id in self.units:
+            while len(words) <= unit_id // 16:
+                words.append(0)
+            words[unit_id // 16] |= 1 << (unit_id % 16)
+        return {
+            "all_units_ready": "yes" if self.complete() else "no",
+            "number_of_units": str(self.number_of_units()),
+            "unit_size": str(UNIT_SIZE),
+            "bitmap": {"count": str(len(words)),
+                       "words": [str(w) for w in words]},
+            "upload_key": "upkey" if self.complete() else "",
+        }
+
+
+class Server(ThreadingHTTPServer):
+    def __init__(self):
+        super().__init__(("127.0.0.1", 0), Handler)
+        self.lock = threading.Lock()
+        self.uploads = {}
+        # how often every unit was received completely
+        self.received = {}
+        # units whose first transfer is not answered
+        self.interrupt = set()
+        # reject all units after this many were accepted
+        self.accept_limit = None
+        self.tokens = 0
+
+
+class Handler(BaseHTTPRequestHandler):
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, action, response):
+        response["action"] = action
+        response.setdefault("result", "Success")
+        body = json.dumps({"response": response}).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        with self.server.lock:
+            self.get()
+
+    def do_POST(self):
+        length = int(self.headers["Content-Length"])
+        data = self.rfile.read(length)
+        with self.server.lock:
+            self.post(data)
+
+    def get(self):
+        url = urlparse(self.path)
+        args = {k: v[0] for k, v in parse_qs(url.query).items()}
+        if url.path.endswith("/upload/check.php"):
+            upload = self.server.uploads.setdefault(
+                args["hash"], Upload(int(args["size"])))
+            response = {"hash_exists": "no", "file_exists": "no"}
+            if args.get("resumable") == "yes":
+                response["resumable_upload"] = upload.state()
+            self.reply("upload/check", response)
+        elif url.path.endswith("/upload/poll_upload.php"):
+            self.reply("upload/poll_upload",
+                       {"doupload": {"result": "0", "status": "99",
+                                     "fileerror": ""}})
+        else:
+            self.send_error(404)
+
+    def post(self, data):
+        url = urlparse(self.path)
+        if url.path.endswith("/user/get_session_token.php"):
+            self.server.tokens += 1
+            self.reply("user/get_session_token",
+                       {"session_token": "token%d" % self.server.tokens,
+                        "secret_key": "1234", "time": "1.0",
+                        "ekey": "ekey"})
+        elif url.path.endswith("/upload/resumable.php"):
+            self.resumable(data)
+        else:
+            self.send_error(404)
+
+    def resumable(self, data):
+        server = self.server
+        upload = server.uploads[self.headers["x-filehash"]]
+        unit_id = int(self.headers["x-unit-id"])
+        if unit_id in server.interrupt:
+            # drop the connection without an answer
+            server.interrupt.discard(unit_id)
+            self.close_connection = True
+            self.connection.shutdown(2)
+            return
+        if hashlib.sha256(data).hexdigest() != self.headers["x-unit-hash"] \
+                or len(data) != int(self.headers["x-unit-size"]):
+            self.reply("upload/resumable",
+                       {"result": "Error", "error": 160,
+                        "message": "unit hash mismatch"})
+            return
+        if server.accept_limit is not None:
+            if server.accept_limit == 0:
+                self.reply("upload/resumable",
+                           {"result": "Error", "error": 110,
+                            "message": "temporarily unavailable"})
+                return
+            server.accept_limit -= 1
+        upload.units[unit_id] = data
+        server.received[unit_id] = server.received.get(unit_id, 0) + 1
+        self.reply("upload/resumable",
+                   {"doupload": {"result": "0",
+                                 "key": "upkey" if upload.complete() else ""},
+                    "resumable_upload": upload.state()})
+
+
+def shell(binary_dir, port, workdir, cachedir, command):
+    cmd = [os.path.join(binary_dir, "mediafire-shell"),
+           "--server", "http://127.0.0.1:%d" % port,
+           "-u", "user", "-p", "password", "-c", command]
+    # run in an empty directory so that no configuration file is picked up
+    # and keep the stored session out of the cache of the user
+    subprocess.run(cmd, cwd=workdir, stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL,
+                   env=dict(os.environ, XDG_CACHE_HOME=cachedir))
+
+
+def put(binary_dir, port, workdir, path):
+    # every upload starts with a session of its own
+    cachedir = tempfile.mkdtemp(dir=workdir)
+    shell(binary_dir, port, workdir, cachedir, "put %s" % path)
+
+
+def resume(binary_dir, server, workdir):
+    cachedir = tempfile.mkdtemp(dir=workdir)
+    tokens = server.tokens
+    shell(binary_dir, server.server_port, workdir, cachedir, "lpwd")
+    if server.tokens != tokens + 1:
+        print("the first shell did not log in")
+        return 1
+    sessions = os.listdir(os.path.join(cachedir, "mediafire-tools"))
+    if len(sessions) != 1 or not sessions[0].startswith("session_"):
+        print("the session was not stored: %s" % sessions)
+        return 1
+    shell(binary_dir, server.server_port, workdir, cachedir, "lpwd")
+    if server.tokens != tokens + 1:
+        print("the second shell logged in instead of continuing the session")
+        return 1
+    return 0
+
+
+def main():
+    binary_dir = sys.argv[1] if len(sys.argv) > 1 else "."
+
+    server = Server()
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+    with tempfile.TemporaryDirectory() as workdir:
+        path = os.path.join(workdir, "data")
+        content = os.urandom(FILE_SIZE)
+        with open(path, "wb") as f:
+            f.write(content)
+        upload = Upload(FILE_SIZE)
+        server.uploads[hashlib.sha256(content).hexdigest()] = upload
+
+        server.interrupt = {1}
+        server.accept_limit = 3
+        put(binary_dir, server.server_port, workdir, path)
+        if len(upload.units) != 3:
+            print("first upload sent units %s" % sorted(upload.units))
+            return 1
+
+        server.accept_limit = None
+        put(binary_dir, server.server_port, workdir, path)
+        if not upload.complete():
+            print("second upload did not send units %s" %
+                  sorted(set(range(upload.number_of_units())) -
+                         set(upload.units)))
+            return 1
+
+        if resume(binary_dir, server, workdir) != 0:
+            return 1
+
+    server.shutdown()
+
+    if b"".join(upload.units[i] for i in sorted(upload.units)) != content:
+        print("uploaded content differs")
+        return 1
+    if any(count != 1 for count in server.received.values()):
+        print("units were sent more than once: %s" % server.received)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
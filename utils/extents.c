@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "extents.h"
+
+struct extent {
+    uint64_t        start;
+    uint64_t        end;        // exclusive
+};
+
+struct extents {
+    size_t          len;
+    size_t          size;
+    struct extent  *array;
+};
+
+extents        *extents_alloc(void)
+{
+    extents        *ext;
+
+    ext = (extents *) calloc(1, sizeof(extents));
+    if (ext == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        return NULL;
+    }
+    ext->len = 0;
+    ext->size = 0;
+    ext->array = NULL;
+    return ext;
+}
+
+void extents_free(extents * ext)
+{
+    free(ext->array);
+    free(ext);
+}
+
+/*
+ * returns the index of the first extent that ends at or after the given
+ * offset (or len if there is none)
+ */
+static size_t extents_search(extents * ext, uint64_t offset)
+{
+    size_t          lo;
+    size_t          hi;
+    size_t          mid;
+
+    lo = 0;
+    hi = ext->len;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ext->array[mid].end < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int extents_add(extents * ext, uint64_t offset, uint64_t length)
+{
+    size_t          first;
+    size_t          last;
+    uint64_t        end;
+    struct extent  *tmp;
+    size_t          size;
+
+    if (length == 0)
+        return 0;
+
+    end = offset + length;
+
+    // all extents in [first, last) touch the new range and are merged into it
+    first = extents_search(ext, offset);
+    last = first;
+    while (last < ext->len && ext->array[last].start <= end) {
+        last++;
+    }
+
+    if (first == last) {
+        // nothing to merge with, so insert a new extent at position first
+        if (ext->len == ext->size) {
+            size = ext->size == 0 ? 16 : ext->size * 2;
+            tmp = realloc(ext->array, sizeof(struct extent) * size);
+            if (tmp == NULL) {
+                fprintf(stderr, "failed to realloc\n");
+                return -1;
+            }
+            ext->array = tmp;
+            ext->size = size;
+        }
+        memmove(ext->array + first + 1, ext->array + first,
+                sizeof(struct extent) * (ext->len - first));
+        ext->array[first].start = offset;
+        ext->array[first].end = end;
+        ext->len++;
+        return 0;
+    }
+
+    if (ext->array[first].start < offset)
+        offset = ext->array[first].start;
+    if (ext->array[last - 1].end > end)
+        end = ext->array[last - 1].end;
+
+    ext->array[first].start = offset;
+    ext->array[first].end = end;
+
+    // shift the remaining entries to the left over the merged ones
+    memmove(ext->array + first + 1, ext->array + last,
+            sizeof(struct extent) * (ext->len - last));
+    ext->len -= last - first - 1;
+
+    return 0;
+}
+
+/*
+ * adds all ranges of other to ext
+ */
+int extents_merge(extents * ext, extents * other)
+{
+    size_t          i;
+
+    for (i = 0; i < other->len; i++) {
+        if (extents_add(ext, other->array[i].start,
+                        other->array[i].end - other->array[i].start) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void extents_clear(extents * ext)
+{
+    ext->len = 0;
+}
+
+bool extents_is_empty(extents * ext)
+{
+    return ext->len == 0;
+}
+
+size_t extents_count(extents * ext)
+{
+    return ext->len;
+}
+
+int extents_get(extents * ext, size_t i, uint64_t * offset, uint64_t * length)
+{
+    if (i >= ext->len) {
+        fprintf(stderr, "index out of bounds\n");
+        return -1;
+    }
+    *offset = ext->array[i].start;
+    *length = ext->array[i].end - ext->array[i].start;
+    return 0;
+}
+
+uint64_t extents_total(extents * ext)
+{
+    size_t          i;
+    uint64_t        total;
+
+    total = 0;
+    for (i = 0; i < ext->len; i++) {
+        total += ext->array[i].end - ext->array[i].start;
+    }
+    return total;
+}
+
+/*
+ * returns how many bytes of the given range are not covered by any extent
+ */
+uint64_t extents_uncovered(extents * ext, uint64_t offset, uint64_t length)
+{
+    size_t          i;
+    uint64_t        end;
+    uint64_t        start;
+    uint64_t        stop;
+
+    end = offset + length;
+    for (i = extents_search(ext, offset);
+         i < ext->len && ext->array[i].start < end; i++) {
+        start = ext->array[i].start > offset ? ext->array[i].start : offset;
+        stop = ext->array[i].end < end ? ext->array[i].end : end;
+        if (stop > start)
+            length -= stop - start;
+    }
+    return length;
+}
+
+/*
+ * returns whether offset lies within one of the extents
+ *
+ * boundary is set to the end of that extent or, if offset is not covered, to
+ * the start of the next extent (UINT64_MAX if there is none)
+ */
+bool extents_find(extents * ext, uint64_t offset, uint64_t * boundary)
+{
+    size_t          i;
+
+    // the found extent may end exactly at offset in which case it doesn't
+    // cover it
+    i = extents_search(ext, offset);
+    if (i < ext->len && ext->array[i].end == offset)
+        i++;
+
+    if (i == ext->len) {
+        *boundary = UINT64_MAX;
+        return false;
+    }
+
+    if (ext->array[i].start <= offset) {
+        *boundary = ext->array[i].end;
+        return true;
+    }
+
+    *boundary = ext->array[i].start;
+    return false;
+}
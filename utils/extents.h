@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _EXTENTS_H_
+#define _EXTENTS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * a sorted list of non-overlapping byte ranges
+ *
+ * overlapping or adjacent ranges are merged when they are added
+ */
+typedef struct extents extents;
+
+extents        *extents_alloc(void);
+
+void            extents_free(extents * ext);
+
+int             extents_add(extents * ext, uint64_t offset, uint64_t length);
+
+int             extents_merge(extents * ext, extents * other);
+
+void            extents_clear(extents * ext);
+
+bool            extents_is_empty(extents * ext);
+
+size_t          extents_count(extents * ext);
+
+int             extents_get(extents * ext, size_t i, uint64_t * offset,
+                            uint64_t * length);
+
+uint64_t        extents_total(extents * ext);
+
+uint64_t        extents_uncovered(extents * ext, uint64_t offset,
+                                  uint64_t length);
+
+bool            extents_find(extents * ext, uint64_t offset,
+                             uint64_t * boundary);
+
+#endif
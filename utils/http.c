@@ -16,14 +16,20 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime and nanosleep
+
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "http.h"
+#include "json_stream.h"
 
 static int      http_progress_cb(void *user_ptr, double dltotal, double dlnow,
                                  double ultotal, double ulnow);
@@ -40,6 +46,9 @@ struct mfhttp {
     CURL           *curl_handle;
     char           *write_buf;
     size_t          write_buf_len;
+    size_t          write_buf_size;
+    // if set, responses are parsed as they arrive instead of buffered
+    json_stream    *json;
     double          ul_len;
     double          ul_now;
     double          dl_len;
@@ -47,15 +56,107 @@ struct mfhttp {
     bool            show_progress;
     char            error_buf[CURL_ERROR_SIZE];
     FILE           *stream;
+    // whether the transfer is an upload that counts against the limit and
+    // how much of it was counted already
+    bool            ul_limited;
+    double          ul_counted;
 };
 
+/*
+ * all uploads that run at the same time draw from one bucket which is
+ * refilled at the upload bandwidth limit. An upload that overdraws it is
+ * paused in the progress callback until the debt is paid back, so the
+ * total stays within the limit however many uploads start or end.
+ */
+static uint64_t http_upload_limit = 0;
+static double   http_upload_tokens = 0;
+static struct timespec http_upload_refilled;
+static pthread_mutex_t http_upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void     http_upload_begin(mfhttp * conn);
+static void     http_upload_end(mfhttp * conn);
+static void     http_upload_throttle(double bytes);
+
+/*
+ * moving averages over the file downloads so far, zero until the first one
+ * finished. The latency is the time until the first byte arrived and the
+ * rate is measured over the rest of the transfer.
+ */
+#define HTTP_DOWNLOAD_WEIGHT 0.25
+#define HTTP_DOWNLOAD_MIN_SAMPLE (64 * 1024)
+static double   http_download_rate = 0;
+static double   http_download_latency = 0;
+static pthread_mutex_t http_download_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void     http_download_measure(mfhttp * conn);
+
 /*
  * This set of functions is made such that the mfhttp struct and the curl
  * handle it stores can be reused for multiple operations
  *
- * We do not use a single global instance because mediafire does not support
- * keep-alive anyways.
+ * http_destroy() keeps up to HTTP_POOL_SIZE handles which http_create() hands
+ * out again. A curl handle keeps its connections open, so a call that gets a
+ * handle from the pool can skip the TCP and TLS handshakes if the server
+ * kept the connection alive. All handles share the DNS cache, the TLS
+ * sessions and, if curl supports it, the open connections.
  */
+#define HTTP_POOL_SIZE 16
+static mfhttp  *http_pool[HTTP_POOL_SIZE];
+static int      http_pool_len = 0;
+static struct http_stats http_pool_stats;
+static pthread_mutex_t http_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static CURLSH  *http_share = NULL;
+static pthread_mutex_t http_share_mutex[CURL_LOCK_DATA_LAST];
+static pthread_once_t http_share_once = PTHREAD_ONCE_INIT;
+
+static void     http_share_init(void);
+static CURLcode http_perform(mfhttp * conn);
+static void     http_count(mfhttp * conn);
+static bool     http_server_busy(mfhttp * conn);
+
+static void http_share_lock(CURL * handle, curl_lock_data data,
+                            curl_lock_access access, void *user_ptr)
+{
+    (void)handle;
+    (void)access;
+    (void)user_ptr;
+
+    pthread_mutex_lock(&(http_share_mutex[data]));
+}
+
+static void http_share_unlock(CURL * handle, curl_lock_data data,
+                              void *user_ptr)
+{
+    (void)handle;
+    (void)user_ptr;
+
+    pthread_mutex_unlock(&(http_share_mutex[data]));
+}
+
+static void http_share_init(void)
+{
+    int             i;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&(http_share_mutex[i]), NULL);
+    }
+
+    http_share = curl_share_init();
+    if (http_share == NULL) {
+        fprintf(stderr, "curl_share_init failed\n");
+        return;
+    }
+    curl_share_setopt(http_share, CURLSHOPT_LOCKFUNC, http_share_lock);
+    curl_share_setopt(http_share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    // sharing the connection cache works since curl 7.57.0
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
 
 static void http_curl_reset(mfhttp * conn)
 {
@@ -70,6 +171,8 @@ static void http_curl_reset(mfhttp * conn)
     curl_easy_setopt(conn->curl_handle, CURLOPT_ERRORBUFFER, conn->error_buf);
     curl_easy_setopt(conn->curl_handle, CURLOPT_PROXY, getenv("http_proxy"));
     curl_easy_setopt(conn->curl_handle, CURLOPT_VERBOSE, 0L);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_SHARE, http_share);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
 
     // it should never take 5 seconds to establish a connection to the server
     curl_easy_setopt(conn->curl_handle, CURLOPT_CONNECTTIMEOUT, 5);
@@ -82,6 +185,25 @@ mfhttp         *http_create(void)
     mfhttp         *conn;
     CURL           *curl_handle;
 
+    pthread_once(&http_share_once, http_share_init);
+
+    conn = NULL;
+    pthread_mutex_lock(&http_pool_mutex);
+    if (http_pool_len > 0) {
+        http_pool_len--;
+        conn = http_pool[http_pool_len];
+        http_pool_stats.handles_reused++;
+    } else {
+        http_pool_stats.handles_created++;
+    }
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (conn != NULL) {
+        conn->write_buf_len = 0;
+        conn->show_progress = false;
+        return conn;
+    }
+
     curl_handle = curl_easy_init();
     if (curl_handle == NULL)
         return NULL;
@@ -99,13 +221,105 @@ json_t         *http_parse_buf_json(mfhttp * conn, size_t flags,
     return json_loadb(conn->write_buf, conn->write_buf_len, flags, error);
 }
 
+/*
+ * gives the handle back to the pool or closes it if the pool is full
+ */
 void http_destroy(mfhttp * conn)
 {
+    pthread_mutex_lock(&http_pool_mutex);
+    if (http_pool_len < HTTP_POOL_SIZE) {
+        http_pool[http_pool_len] = conn;
+        http_pool_len++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (conn == NULL)
+        return;
+
     curl_easy_cleanup(conn->curl_handle);
     free(conn->write_buf);
     free(conn);
 }
 
+/*
+ * closes all pooled handles and their connections before the program exits
+ *
+ * no handle must be in use anymore and none must be created afterwards
+ */
+void http_cleanup(void)
+{
+    mfhttp         *conn;
+
+    pthread_mutex_lock(&http_pool_mutex);
+    while (http_pool_len > 0) {
+        http_pool_len--;
+        conn = http_pool[http_pool_len];
+        curl_easy_cleanup(conn->curl_handle);
+        free(conn->write_buf);
+        free(conn);
+    }
+    pthread_mutex_unlock(&http_pool_mutex);
+
+    if (http_share != NULL) {
+        curl_share_cleanup(http_share);
+        http_share = NULL;
+    }
+}
+
+void http_get_stats(struct http_stats *stats)
+{
+    pthread_mutex_lock(&http_pool_mutex);
+    *stats = http_pool_stats;
+    pthread_mutex_unlock(&http_pool_mutex);
+}
+
+/*
+ * performs the request of conn and counts it and the connections it had to
+ * open
+ */
+static CURLcode http_perform(mfhttp * conn)
+{
+    CURLcode        retval;
+
+    retval = curl_easy_perform(conn->curl_handle);
+    http_count(conn);
+
+    return retval;
+}
+
+static void http_count(mfhttp * conn)
+{
+    long            num_connects;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_NUM_CONNECTS,
+                          &num_connects) != CURLE_OK)
+        num_connects = 0;
+
+    pthread_mutex_lock(&http_pool_mutex);
+    http_pool_stats.requests++;
+    http_pool_stats.connections += num_connects;
+    pthread_mutex_unlock(&http_pool_mutex);
+}
+
+/*
+ * the body of such an answer is not what the data handler expects
+ */
+static bool http_server_busy(mfhttp * conn)
+{
+    long            status;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE,
+                          &status) != CURLE_OK)
+        return false;
+
+    if (status != 429 && status < 500)
+        return false;
+
+    fprintf(stderr, "server answered with status %ld\n", status);
+    return true;
+}
+
 static int
 http_progress_cb(void *user_ptr, double dltotal, double dlnow,
                  double ultotal, double ulnow)
@@ -120,18 +334,19 @@ http_progress_cb(void *user_ptr, double dltotal, double dlnow,
     conn->ul_len = ultotal;
     conn->ul_now = ulnow;
 
+    if (conn->ul_limited && ulnow > conn->ul_counted) {
+        http_upload_throttle(ulnow - conn->ul_counted);
+        conn->ul_counted = ulnow;
+    }
+
     conn->dl_len = dltotal;
     conn->dl_now = dlnow;
 
     return 0;
 }
 
-int
-http_get_buf(mfhttp * conn, const char *url,
-             int (*data_handler) (mfhttp * conn, void *data), void *data)
+static void http_prepare_get_buf(mfhttp * conn, const char *url)
 {
-    int             retval;
-
     http_curl_reset(conn);
     conn->write_buf_len = 0;
     curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
@@ -141,17 +356,59 @@ http_get_buf(mfhttp * conn, const char *url,
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
                      http_write_buf_cb);
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
+}
+
+int
+http_get_buf(mfhttp * conn, const char *url,
+             int (*data_handler) (mfhttp * conn, void *data), void *data)
+{
+    int             retval;
+
+    http_prepare_get_buf(conn, url);
     fprintf(stderr, "GET: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
+    retval = http_perform(conn);
     if (retval != CURLE_OK) {
         fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
         return retval;
     }
+    if (http_server_busy(conn))
+        return HTTP_SERVER_BUSY;
     if (data_handler != NULL)
         retval = data_handler(conn, data);
     return retval;
 }
 
+/*
+ * like http_get_buf() but hands the response to the incremental parser while
+ * it arrives
+ *
+ * returns the curl error, HTTP_SERVER_BUSY, -1 if the response is not a
+ * complete json document or 0
+ */
+int http_get_json(mfhttp * conn, const char *url, json_stream * stream)
+{
+    int             retval;
+
+    http_prepare_get_buf(conn, url);
+    json_stream_reset(stream);
+    conn->json = stream;
+    fprintf(stderr, "GET: %s\n", url);
+    retval = http_perform(conn);
+    conn->json = NULL;
+    // the body of an error page aborts the transfer as it is no json
+    if (http_server_busy(conn))
+        return HTTP_SERVER_BUSY;
+    if (retval != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
+        return retval;
+    }
+    if (json_stream_finish(stream) != 0) {
+        fprintf(stderr, "incomplete json response\n");
+        return -1;
+    }
+    return 0;
+}
+
 static          size_t
 http_read_buf_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
 {
@@ -183,10 +440,22 @@ http_write_buf_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
     conn = (mfhttp *) user_ptr;
     data_len = size * nmemb;
 
+    if (conn->json != NULL) {
+        // a short count makes curl abort the transfer
+        if (json_stream_feed(conn->json, data, data_len) != 0)
+            return 0;
+        return data_len;
+    }
+
     if (data_len > 0) {
-        fwrite(data, size, nmemb, stderr);
-        conn->write_buf = (char *)realloc(conn->write_buf,
-                                          conn->write_buf_len + data_len);
+        if (conn->write_buf_len + data_len > conn->write_buf_size) {
+            if (conn->write_buf_size == 0)
+                conn->write_buf_size = 16384;
+            while (conn->write_buf_len + data_len > conn->write_buf_size)
+                conn->write_buf_size *= 2;
+            conn->write_buf = (char *)realloc(conn->write_buf,
+                                              conn->write_buf_size);
+        }
         memcpy(conn->write_buf + conn->write_buf_len, data, data_len);
         conn->write_buf_len += data_len;
     }
@@ -211,21 +480,21 @@ http_post_buf(mfhttp * conn, const char *url, const char *post_args,
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
     curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDS, post_args);
     fprintf(stderr, "POST: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
+    retval = http_perform(conn);
     if (retval != CURLE_OK) {
         fprintf(stderr, "error curl_easy_perform \"%s\" \"%s\"\n\r",
                 curl_easy_strerror(retval), conn->error_buf);
         return retval;
     }
+    if (http_server_busy(conn))
+        return HTTP_SERVER_BUSY;
     if (data_handler != NULL)
         retval = data_handler(conn, data);
     return retval;
 }
 
-int http_get_file(mfhttp * conn, const char *url, const char *path)
+static void http_prepare_get_file(mfhttp * conn, const char *url)
 {
-    int             retval;
-
     http_curl_reset(conn);
     curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(conn->curl_handle, CURLOPT_READFUNCTION,
@@ -234,18 +503,77 @@ int http_get_file(mfhttp * conn, const char *url, const char *path)
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
                      http_write_file_cb);
     curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
+}
+
+int http_get_file(mfhttp * conn, const char *url, const char *path)
+{
+    int             retval;
+    long            status;
+
+    http_prepare_get_file(conn, url);
     // FIXME: handle fopen() return value
     conn->stream = fopen(path, "w+");
     fprintf(stderr, "GET: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
+    retval = http_perform(conn);
     fclose(conn->stream);
     if (retval != CURLE_OK) {
         fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
         return retval;
     }
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_RESPONSE_CODE,
+                          &status) == CURLE_OK && status == 403) {
+        fprintf(stderr, "server refused %s\n", url);
+        return HTTP_FORBIDDEN;
+    }
+    http_download_measure(conn);
     return retval;
 }
 
+static void http_download_measure(mfhttp * conn)
+{
+    double          size;
+    double          total_time;
+    double          start_time;
+    double          rate;
+
+    if (curl_easy_getinfo(conn->curl_handle, CURLINFO_SIZE_DOWNLOAD,
+                          &size) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_TOTAL_TIME,
+                             &total_time) != CURLE_OK
+        || curl_easy_getinfo(conn->curl_handle, CURLINFO_STARTTRANSFER_TIME,
+                             &start_time) != CURLE_OK)
+        return;
+
+    pthread_mutex_lock(&http_download_mutex);
+    if (http_download_latency == 0)
+        http_download_latency = start_time;
+    else
+        http_download_latency += HTTP_DOWNLOAD_WEIGHT
+            * (start_time - http_download_latency);
+    // small files say nothing about the bandwidth
+    if (size >= HTTP_DOWNLOAD_MIN_SAMPLE && total_time > start_time) {
+        rate = size / (total_time - start_time);
+        if (http_download_rate == 0)
+            http_download_rate = rate;
+        else
+            http_download_rate += HTTP_DOWNLOAD_WEIGHT
+                * (rate - http_download_rate);
+    }
+    pthread_mutex_unlock(&http_download_mutex);
+}
+
+/*
+ * returns the measured download rate and the latency until a download
+ * starts, each of them is zero as long as it is unknown
+ */
+void http_get_download_estimate(double *bytes_per_second, double *latency)
+{
+    pthread_mutex_lock(&http_download_mutex);
+    *bytes_per_second = http_download_rate;
+    *latency = http_download_latency;
+    pthread_mutex_unlock(&http_download_mutex);
+}
+
 static          size_t
 http_write_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
 {
@@ -280,6 +608,120 @@ http_read_file_cb(char *data, size_t size, size_t nmemb, void *user_ptr)
     return size * ret;
 }
 
+/*
+ * limits the bandwidth of all uploads together to bytes_per_second or lifts
+ * the limit if it is zero
+ */
+void http_set_upload_limit(uint64_t bytes_per_second)
+{
+    pthread_mutex_lock(&http_upload_mutex);
+    http_upload_limit = bytes_per_second;
+    http_upload_tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &http_upload_refilled);
+    pthread_mutex_unlock(&http_upload_mutex);
+}
+
+static void http_upload_begin(mfhttp * conn)
+{
+    conn->ul_limited = true;
+    conn->ul_counted = 0;
+}
+
+static void http_upload_end(mfhttp * conn)
+{
+    conn->ul_limited = false;
+}
+
+/*
+ * takes bytes that were just sent out of the bucket and sleeps until the
+ * bucket is no longer overdrawn
+ */
+static void http_upload_throttle(double bytes)
+{
+    struct timespec now;
+    struct timespec delay;
+    double          elapsed;
+    double          wait;
+
+    pthread_mutex_lock(&http_upload_mutex);
+    if (http_upload_limit == 0) {
+        pthread_mutex_unlock(&http_upload_mutex);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - http_upload_refilled.tv_sec)
+        + (now.tv_nsec - http_upload_refilled.tv_nsec) / 1e9;
+    http_upload_refilled = now;
+
+    // at most one second worth of data can be sent in a burst
+    http_upload_tokens += elapsed * http_upload_limit;
+    if (http_upload_tokens > http_upload_limit)
+        http_upload_tokens = http_upload_limit;
+    http_upload_tokens -= bytes;
+
+    wait = 0;
+    if (http_upload_tokens < 0)
+        wait = -http_upload_tokens / http_upload_limit;
+    pthread_mutex_unlock(&http_upload_mutex);
+
+    if (wait > 0) {
+        delay.tv_sec = (time_t) wait;
+        delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+        nanosleep(&delay, NULL);
+    }
+}
+
+/*
+ * like http_post_file but sends len bytes from buf without copying them, so
+ * buf can be a memory mapping of the file to upload
+ */
+int
+http_post_mem(mfhttp * conn, const char *url, const void *buf, uint64_t len,
+              struct curl_slist **custom_headers,
+              int (*data_handler) (mfhttp * conn, void *data), void *data)
+{
+    int             retval;
+    struct curl_slist *fallback_headers;
+
+    http_curl_reset(conn);
+    conn->write_buf_len = 0;
+
+    if (custom_headers == NULL) {
+        custom_headers = &fallback_headers;
+        *custom_headers = NULL;
+    }
+    *custom_headers =
+        curl_slist_append(*custom_headers,
+                          "Content-Type: application/octet-stream");
+    *custom_headers = curl_slist_append(*custom_headers, "Expect:");
+    curl_easy_setopt(conn->curl_handle, CURLOPT_POST, 1);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_HTTPHEADER, *custom_headers);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEFUNCTION,
+                     http_write_buf_cb);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_WRITEDATA, (void *)conn);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t) len);
+    curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDS, buf);
+
+    http_upload_begin(conn);
+    fprintf(stderr, "POST: %s\n", url);
+    retval = http_perform(conn);
+    http_upload_end(conn);
+    curl_slist_free_all(*custom_headers);
+    *custom_headers = NULL;
+    if (retval != CURLE_OK) {
+        fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
+        return retval;
+    }
+    if (http_server_busy(conn))
+        return HTTP_SERVER_BUSY;
+    if (data_handler != NULL)
+        retval = data_handler(conn, data);
+    return retval;
+}
+
 int
 http_post_file(mfhttp * conn, const char *url, FILE * fh,
                struct curl_slist **custom_headers, uint64_t filesize,
@@ -316,19 +758,337 @@ http_post_file(mfhttp * conn, const char *url, FILE * fh,
     curl_easy_setopt(conn->curl_handle, CURLOPT_POSTFIELDSIZE, filesize);
 
     conn->stream = fh;
+    http_upload_begin(conn);
     fprintf(stderr, "POST: %s\n", url);
-    retval = curl_easy_perform(conn->curl_handle);
+    retval = http_perform(conn);
+    http_upload_end(conn);
     curl_slist_free_all(*custom_headers);
     *custom_headers = NULL;
     if (retval != CURLE_OK) {
         fprintf(stderr, "error curl_easy_perform %s\n\r", conn->error_buf);
         return retval;
     }
+    if (http_server_busy(conn))
+        return HTTP_SERVER_BUSY;
     if (data_handler != NULL)
         retval = data_handler(conn, data);
     return retval;
 }
 
+/*
+ * The multi engine runs many requests from a single thread. Requests are
+ * queued with a priority, and up to max_transfers of them are handed to
+ * curl at the same time, those with the highest priority first. Over
+ * HTTP/2 they are multiplexed on one connection to the host. Every request
+ * takes a handle from the pool. Once it finished, its callback is called
+ * with the handle and the curl result, and the handle goes back to the
+ * pool.
+ *
+ * An engine must only be used by one thread at a time.
+ */
+struct http_request {
+    mfhttp         *conn;
+    int             priority;
+    bool            to_file;
+    http_done_cb    done;
+    void           *user_ptr;
+    struct http_request *next;
+};
+
+struct mfhttp_multi {
+    CURLM          *multi_handle;
+    int             max_transfers;
+    int             num_transfers;
+    // sorted by priority, requests of the same priority in the order in
+    // which they were added
+    struct http_request *pending;
+    int             num_pending;
+    // the requests that curl is working on
+    struct http_request *active;
+};
+
+mfhttp_multi   *http_multi_create(int max_transfers)
+{
+    mfhttp_multi   *multi;
+
+    pthread_once(&http_share_once, http_share_init);
+
+    multi = (mfhttp_multi *) calloc(1, sizeof(mfhttp_multi));
+    if (multi == NULL)
+        return NULL;
+
+    multi->multi_handle = curl_multi_init();
+    if (multi->multi_handle == NULL) {
+        fprintf(stderr, "curl_multi_init failed\n");
+        free(multi);
+        return NULL;
+    }
+    curl_multi_setopt(multi->multi_handle, CURLMOPT_PIPELINING,
+                      CURLPIPE_MULTIPLEX);
+
+    multi->max_transfers = max_transfers < 1 ? 1 : max_transfers;
+    multi->num_transfers = 0;
+    multi->pending = NULL;
+    multi->num_pending = 0;
+    multi->active = NULL;
+
+    return multi;
+}
+
+static void http_multi_finish(struct http_request *request, int result)
+{
+    if (request->to_file) {
+        fclose(request->conn->stream);
+        request->conn->stream = NULL;
+        if (result == CURLE_OK)
+            http_download_measure(request->conn);
+    }
+    if (result != CURLE_OK) {
+        fprintf(stderr, "error curl_multi_perform %s\n",
+                curl_easy_strerror(result));
+    } else if (http_server_busy(request->conn)) {
+        result = HTTP_SERVER_BUSY;
+    }
+    if (request->done != NULL)
+        request->done(request->conn, result, request->user_ptr);
+    http_destroy(request->conn);
+    free(request);
+}
+
+/*
+ * requests that did not finish yet are aborted without calling their
+ * callbacks
+ */
+void http_multi_destroy(mfhttp_multi * multi)
+{
+    struct http_request *request;
+
+    while (multi->pending != NULL) {
+        request = multi->pending;
+        multi->pending = request->next;
+        request->done = NULL;
+        http_multi_finish(request, CURLE_ABORTED_BY_CALLBACK);
+    }
+
+    while (multi->active != NULL) {
+        request = multi->active;
+        multi->active = request->next;
+        curl_multi_remove_handle(multi->multi_handle,
+                                 request->conn->curl_handle);
+        request->done = NULL;
+        http_multi_finish(request, CURLE_ABORTED_BY_CALLBACK);
+    }
+
+    curl_multi_cleanup(multi->multi_handle);
+    free(multi);
+}
+
+static void http_multi_queue(mfhttp_multi * multi,
+                             struct http_request *request)
+{
+    struct http_request **next;
+
+    next = &(multi->pending);
+    while (*next != NULL && (*next)->priority >= request->priority)
+        next = &((*next)->next);
+    request->next = *next;
+    *next = request;
+    multi->num_pending++;
+}
+
+static struct http_request *http_multi_request(int priority, bool to_file,
+                                               http_done_cb done,
+                                               void *user_ptr)
+{
+    struct http_request *request;
+
+    request = (struct http_request *)calloc(1, sizeof(struct http_request));
+    if (request == NULL)
+        return NULL;
+
+    request->conn = http_create();
+    if (request->conn == NULL) {
+        free(request);
+        return NULL;
+    }
+    request->priority = priority;
+    request->to_file = to_file;
+    request->done = done;
+    request->user_ptr = user_ptr;
+
+    return request;
+}
+
+/*
+ * sets the options that only requests of the engine use, after the request
+ * was prepared
+ */
+static void http_multi_request_init(struct http_request *request)
+{
+    curl_easy_setopt(request->conn->curl_handle, CURLOPT_PRIVATE, request);
+    curl_easy_setopt(request->conn->curl_handle, CURLOPT_HTTP_VERSION,
+                     CURL_HTTP_VERSION_2TLS);
+    // rather wait for a connection that can be multiplexed than open
+    // another one
+    curl_easy_setopt(request->conn->curl_handle, CURLOPT_PIPEWAIT, 1L);
+}
+
+/*
+ * queues the retrieval of url into a buffer which done can read with
+ * http_parse_buf_json()
+ */
+int http_multi_get_buf(mfhttp_multi * multi, const char *url, int priority,
+                       http_done_cb done, void *user_ptr)
+{
+    struct http_request *request;
+
+    request = http_multi_request(priority, false, done, user_ptr);
+    if (request == NULL)
+        return -1;
+
+    http_prepare_get_buf(request->conn, url);
+    http_multi_request_init(request);
+    http_multi_queue(multi, request);
+
+    return 0;
+}
+
+/*
+ * queues the download of url to path
+ */
+int http_multi_get_file(mfhttp_multi * multi, const char *url,
+                        const char *path, int priority, http_done_cb done,
+                        void *user_ptr)
+{
+    struct http_request *request;
+
+    request = http_multi_request(priority, true, done, user_ptr);
+    if (request == NULL)
+        return -1;
+
+    request->conn->stream = fopen(path, "w+");
+    if (request->conn->stream == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        http_destroy(request->conn);
+        free(request);
+        return -1;
+    }
+
+    http_prepare_get_file(request->conn, url);
+    http_multi_request_init(request);
+    http_multi_queue(multi, request);
+
+    return 0;
+}
+
+/*
+ * hands the queued requests with the highest priority to curl as long as
+ * there are free transfer slots
+ */
+static void http_multi_start(mfhttp_multi * multi)
+{
+    struct http_request *request;
+
+    while (multi->pending != NULL
+           && multi->num_transfers < multi->max_transfers) {
+        request = multi->pending;
+        multi->pending = request->next;
+        multi->num_pending--;
+        request->next = NULL;
+
+        if (curl_multi_add_handle(multi->multi_handle,
+                                  request->conn->curl_handle) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_add_handle failed\n");
+            http_multi_finish(request, CURLE_FAILED_INIT);
+            continue;
+        }
+        request->next = multi->active;
+        multi->active = request;
+        multi->num_transfers++;
+    }
+}
+
+static void http_multi_complete(mfhttp_multi * multi)
+{
+    struct http_request *request;
+    struct http_request **next;
+    CURLMsg        *msg;
+    CURL           *handle;
+    CURLcode        result;
+    int             num_msgs;
+
+    while ((msg = curl_multi_info_read(multi->multi_handle, &num_msgs))
+           != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        handle = msg->easy_handle;
+        result = msg->data.result;
+        request = NULL;
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&request);
+        curl_multi_remove_handle(multi->multi_handle, handle);
+        for (next = &(multi->active); *next != NULL;
+             next = &((*next)->next)) {
+            if (*next == request) {
+                *next = request->next;
+                break;
+            }
+        }
+        multi->num_transfers--;
+        http_count(request->conn);
+        http_multi_finish(request, result);
+    }
+}
+
+/*
+ * drives all requests for up to timeout_ms milliseconds and calls the
+ * callbacks of those that finished. Callbacks may queue further requests.
+ *
+ * returns the number of requests that did not finish yet or -1 on error
+ */
+int http_multi_perform(mfhttp_multi * multi, int timeout_ms)
+{
+    CURLMcode       retval;
+    int             running;
+
+    http_multi_start(multi);
+
+    if (multi->num_transfers > 0) {
+        retval = curl_multi_wait(multi->multi_handle, NULL, 0, timeout_ms,
+                                 NULL);
+        if (retval != CURLM_OK) {
+            fprintf(stderr, "curl_multi_wait failed: %s\n",
+                    curl_multi_strerror(retval));
+            return -1;
+        }
+    }
+
+    retval = curl_multi_perform(multi->multi_handle, &running);
+    if (retval != CURLM_OK) {
+        fprintf(stderr, "curl_multi_perform failed: %s\n",
+                curl_multi_strerror(retval));
+        return -1;
+    }
+
+    http_multi_complete(multi);
+    http_multi_start(multi);
+
+    return multi->num_transfers + multi->num_pending;
+}
+
+/*
+ * runs until all requests finished, including those that callbacks queued
+ */
+int http_multi_run(mfhttp_multi * multi)
+{
+    int             retval;
+
+    do {
+        retval = http_multi_perform(multi, 1000);
+    } while (retval > 0);
+
+    return retval;
+}
+
 // we roll our own urlencode function because curl_easy_escape requires a curl
 // handle
 char           *urlencode(const char *inp)
@@ -25,13 +25,39 @@
 #include <stdio.h>
 #include <curl/curl.h>
 
+#include "json_stream.h"
+
+// returned by the requests instead of the result of the data handler if the
+// server answered that it is overloaded or failed (HTTP status 429 or 5xx)
+#define HTTP_SERVER_BUSY -2
+
+// returned by http_get_file() if the server refused to hand out the file
+// (HTTP status 403), for example because the link expired
+#define HTTP_FORBIDDEN -3
+
 typedef struct mfhttp mfhttp;
+typedef struct mfhttp_multi mfhttp_multi;
+
+// called when a request of the multi engine finished with the curl result
+typedef void    (*http_done_cb) (mfhttp * conn, int result, void *user_ptr);
+
+struct http_stats {
+    uint64_t        requests;
+    // connections that had to be opened for the requests
+    uint64_t        connections;
+    uint64_t        handles_created;
+    uint64_t        handles_reused;
+};
 
 mfhttp         *http_create(void);
 void            http_destroy(mfhttp * conn);
+void            http_cleanup(void);
+void            http_get_stats(struct http_stats *stats);
 int             http_get_buf(mfhttp * conn, const char *url,
                              int (*data_handler) (mfhttp * conn, void *data),
                              void *data);
+int             http_get_json(mfhttp * conn, const char *url,
+                              json_stream * stream);
 int             http_post_buf(mfhttp * conn, const char *url,
                               const char *post_args,
                               int (*data_handler) (mfhttp * conn, void *data),
@@ -45,6 +71,25 @@ int             http_post_file(mfhttp * conn, const char *url, FILE * fh,
                                uint64_t filesize,
                                int (*data_handler) (mfhttp * conn, void *data),
                                void *data);
+int             http_post_mem(mfhttp * conn, const char *url,
+                              const void *buf, uint64_t len,
+                              struct curl_slist **custom_headers,
+                              int (*data_handler) (mfhttp * conn, void *data),
+                              void *data);
+void            http_set_upload_limit(uint64_t bytes_per_second);
+void            http_get_download_estimate(double *bytes_per_second,
+                                           double *latency);
+
+mfhttp_multi   *http_multi_create(int max_transfers);
+void            http_multi_destroy(mfhttp_multi * multi);
+int             http_multi_get_buf(mfhttp_multi * multi, const char *url,
+                                   int priority, http_done_cb done,
+                                   void *user_ptr);
+int             http_multi_get_file(mfhttp_multi * multi, const char *url,
+                                    const char *path, int priority,
+                                    http_done_cb done, void *user_ptr);
+int             http_multi_perform(mfhttp_multi * multi, int timeout_ms);
+int             http_multi_run(mfhttp_multi * multi);
 
 char           *urlencode(const char *input);
 
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+enum json_stream_state {
+    JSON_STATE_VALUE,
+    // after '[', a value or the end of the array
+    JSON_STATE_VALUE_OR_END,
+    // after '{', a member name or the end of the object
+    JSON_STATE_KEY_OR_END,
+    // after ',' in an object
+    JSON_STATE_KEY,
+    JSON_STATE_COLON,
+    JSON_STATE_AFTER_VALUE,
+    JSON_STATE_STRING,
+    JSON_STATE_ESCAPE,
+    JSON_STATE_UNICODE,
+    JSON_STATE_NUMBER,
+    JSON_STATE_LITERAL,
+    JSON_STATE_DONE,
+    JSON_STATE_FAILED
+};
+
+struct json_stream_frame {
+    bool            is_object;
+    char            key[JSON_STREAM_MAX_KEY + 1];
+};
+
+struct json_stream {
+    json_stream_cb  cb;
+    void           *user_ptr;
+    enum json_stream_state state;
+    struct json_stream_frame frames[JSON_STREAM_MAX_DEPTH];
+    int             depth;
+
+    // strings and numbers may be split over several pieces
+    char           *token;
+    size_t          token_len;
+    size_t          token_size;
+    bool            token_is_key;
+
+    uint32_t        unicode;
+    int             unicode_digits;
+    uint32_t        high_surrogate;
+
+    const char     *literal;
+    size_t          literal_pos;
+    enum json_stream_event literal_event;
+};
+
+static int      json_stream_value(json_stream * stream, char c);
+static int      json_stream_emit(json_stream * stream,
+                                 enum json_stream_event event,
+                                 const char *value, size_t len);
+static int      json_stream_close(json_stream * stream, bool is_object);
+static int      json_stream_string_end(json_stream * stream);
+static void     json_stream_append(json_stream * stream, const char *data,
+                                   size_t len);
+static void     json_stream_append_utf8(json_stream * stream, uint32_t cp);
+
+json_stream    *json_stream_create(json_stream_cb cb, void *user_ptr)
+{
+    json_stream    *stream;
+
+    stream = (json_stream *) calloc(1, sizeof(json_stream));
+    if (stream == NULL)
+        return NULL;
+
+    stream->cb = cb;
+    stream->user_ptr = user_ptr;
+    stream->state = JSON_STATE_VALUE;
+
+    return stream;
+}
+
+void json_stream_destroy(json_stream * stream)
+{
+    free(stream->token);
+    free(stream);
+}
+
+/*
+ * prepares the parser for a new document, for example when a request has to
+ * be sent again
+ */
+void json_stream_reset(json_stream * stream)
+{
+    stream->state = JSON_STATE_VALUE;
+    stream->depth = 0;
+    stream->token_len = 0;
+    stream->high_surrogate = 0;
+}
+
+int json_stream_depth(json_stream * stream)
+{
+    return stream->depth;
+}
+
+/*
+ * returns the name of the member of the object at the given level (0 is the
+ * outermost one) that contains the current value or NULL if that level is an
+ * array
+ */
+const char     *json_stream_key(json_stream * stream, int level)
+{
+    if (level < 0 || level >= stream->depth)
+        return NULL;
+
+    if (!stream->frames[level].is_object)
+        return NULL;
+
+    return stream->frames[level].key;
+}
+
+bool json_stream_key_is(json_stream * stream, int level, const char *key)
+{
+    const char     *name;
+
+    name = json_stream_key(stream, level);
+
+    return name != NULL && strcmp(name, key) == 0;
+}
+
+/*
+ * parses the next piece of the document
+ *
+ * returns -1 if the document is invalid or the callback stopped the parser
+ */
+int json_stream_feed(json_stream * stream, const char *data, size_t len)
+{
+    const char     *end;
+    const char     *run;
+    char            c;
+    int             digit;
+
+    end = data + len;
+    while (data < end) {
+        c = *data;
+        switch (stream->state) {
+            case JSON_STATE_VALUE:
+            case JSON_STATE_VALUE_OR_END:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                    break;
+                if (c == ']' && stream->state == JSON_STATE_VALUE_OR_END) {
+                    if (json_stream_close(stream, false) != 0)
+                        return -1;
+                    break;
+                }
+                if (json_stream_value(stream, c) != 0)
+                    return -1;
+                break;
+            case JSON_STATE_KEY_OR_END:
+            case JSON_STATE_KEY:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                    break;
+                if (c == '}' && stream->state == JSON_STATE_KEY_OR_END) {
+                    if (json_stream_close(stream, true) != 0)
+                        return -1;
+                    break;
+                }
+                if (c != '"') {
+                    stream->state = JSON_STATE_FAILED;
+                    return -1;
+                }
+                stream->token_len = 0;
+                stream->token_is_key = true;
+                stream->state = JSON_STATE_STRING;
+                break;
+            case JSON_STATE_COLON:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                    break;
+                if (c != ':') {
+                    stream->state = JSON_STATE_FAILED;
+                    return -1;
+                }
+                stream->state = JSON_STATE_VALUE;
+                break;
+            case JSON_STATE_AFTER_VALUE:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                    break;
+                if (c == ',') {
+                    if (stream->frames[stream->depth - 1].is_object)
+                        stream->state = JSON_STATE_KEY;
+                    else
+                        stream->state = JSON_STATE_VALUE;
+                    break;
+                }
+                if (c == '}' || c == ']') {
+                    if (json_stream_close(stream, c == '}') != 0)
+                        return -1;
+                    break;
+                }
+                stream->state = JSON_STATE_FAILED;
+                return -1;
+            case JSON_STATE_STRING:
+                // copy everything up to the next quote or escape at once
+                run = data;
+                while (data < end && *data != '"' && *data != '\\'
+                       && (unsigned char)*data >= 0x20)
+                    data++;
+                if (data > run) {
+                    json_stream_append(stream, run, data - run);
+                    continue;
+                }
+                if (c == '\\') {
+                    stream->state = JSON_STATE_ESCAPE;
+                    break;
+                }
+                if (c != '"') {
+                    stream->state = JSON_STATE_FAILED;
+                    return -1;
+                }
+                if (json_stream_string_end(stream) != 0)
+                    return -1;
+                break;
+            case JSON_STATE_ESCAPE:
+                stream->state = JSON_STATE_STRING;
+                switch (c) {
+                    case '"':
+                    case '\\':
+                    case '/':
+                        json_stream_append(stream, &c, 1);
+                        break;
+                    case 'b':
+                        json_stream_append(stream, "\b", 1);
+                        break;
+                    case 'f':
+                        json_stream_append(stream, "\f", 1);
+                        break;
+                    case 'n':
+                        json_stream_append(stream, "\n", 1);
+                        break;
+                    case 'r':
+                        json_stream_append(stream, "\r", 1);
+                        break;
+                    case 't':
+                        json_stream_append(stream, "\t", 1);
+                        break;
+                    case 'u':
+                        stream->unicode = 0;
+                        stream->unicode_digits = 0;
+                        stream->state = JSON_STATE_UNICODE;
+                        break;
+                    default:
+                        stream->state = JSON_STATE_FAILED;
+                        return -1;
+                }
+                break;
+            case JSON_STATE_UNICODE:
+                if (c >= '0' && c <= '9')
+                    digit = c - '0';
+                else if (c >= 'a' && c <= 'f')
+                    digit = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F')
+                    digit = c - 'A' + 10;
+                else {
+                    stream->state = JSON_STATE_FAILED;
+                    return -1;
+                }
+                stream->unicode = (stream->unicode << 4) | digit;
+                stream->unicode_digits++;
+                if (stream->unicode_digits == 4) {
+                    json_stream_append_utf8(stream, stream->unicode);
+                    stream->state = JSON_STATE_STRING;
+                }
+                break;
+            case JSON_STATE_NUMBER:
+                if ((c >= '0' && c <= '9') || c == '-' || c == '+'
+                    || c == '.' || c == 'e' || c == 'E') {
+                    json_stream_append(stream, &c, 1);
+                    break;
+                }
+                stream->token[stream->token_len] = '\0';
+                if (json_stream_emit(stream, JSON_STREAM_NUMBER,
+                                     stream->token, stream->token_len) != 0)
+                    return -1;
+                // the character that ended the number is looked at again
+                continue;
+            case JSON_STATE_LITERAL:
+                if (c != stream->literal[stream->literal_pos]) {
+                    stream->state = JSON_STATE_FAILED;
+                    return -1;
+                }
+                stream->literal_pos++;
+                if (stream->literal[stream->literal_pos] == '\0') {
+                    if (json_stream_emit(stream, stream->literal_event, NULL,
+                                         0) != 0)
+                        return -1;
+                }
+                break;
+            case JSON_STATE_DONE:
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                    break;
+                stream->state = JSON_STATE_FAILED;
+                return -1;
+            case JSON_STATE_FAILED:
+                return -1;
+        }
+        data++;
+    }
+
+    return 0;
+}
+
+/*
+ * returns 0 if the document was complete
+ */
+int json_stream_finish(json_stream * stream)
+{
+    // a number at the top level only ends with the document
+    if (stream->state == JSON_STATE_NUMBER && stream->depth == 0) {
+        stream->token[stream->token_len] = '\0';
+        if (json_stream_emit(stream, JSON_STREAM_NUMBER, stream->token,
+                             stream->token_len) != 0)
+            return -1;
+    }
+
+    if (stream->state != JSON_STATE_DONE)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * starts the value that begins with c
+ */
+static int json_stream_value(json_stream * stream, char c)
+{
+    switch (c) {
+        case '{':
+        case '[':
+            if (stream->depth == JSON_STREAM_MAX_DEPTH) {
+                stream->state = JSON_STATE_FAILED;
+                return -1;
+            }
+            if (stream->cb(stream, c == '{' ? JSON_STREAM_OBJECT_BEGIN
+                           : JSON_STREAM_ARRAY_BEGIN, NULL, 0,
+                           stream->user_ptr) != 0) {
+                stream->state = JSON_STATE_FAILED;
+                return -1;
+            }
+            stream->frames[stream->depth].is_object = (c == '{');
+            stream->frames[stream->depth].key[0] = '\0';
+            stream->depth++;
+            if (c == '{')
+                stream->state = JSON_STATE_KEY_OR_END;
+            else
+                stream->state = JSON_STATE_VALUE_OR_END;
+            return 0;
+        case '"':
+            stream->token_len = 0;
+            stream->token_is_key = false;
+            stream->state = JSON_STATE_STRING;
+            return 0;
+        case 't':
+            stream->literal = "true";
+            stream->literal_event = JSON_STREAM_TRUE;
+            break;
+        case 'f':
+            stream->literal = "false";
+            stream->literal_event = JSON_STREAM_FALSE;
+            break;
+        case 'n':
+            stream->literal = "null";
+            stream->literal_event = JSON_STREAM_NULL;
+            break;
+        default:
+            if (c != '-' && (c < '0' || c > '9')) {
+                stream->state = JSON_STATE_FAILED;
+                return -1;
+            }
+            stream->token_len = 0;
+            json_stream_append(stream, &c, 1);
+            stream->state = JSON_STATE_NUMBER;
+            return 0;
+    }
+
+    stream->literal_pos = 1;
+    stream->state = JSON_STATE_LITERAL;
+
+    return 0;
+}
+
+/*
+ * reports a complete scalar value
+ */
+static int json_stream_emit(json_stream * stream,
+                            enum json_stream_event event, const char *value,
+                            size_t len)
+{
+    if (stream->cb(stream, event, value, len, stream->user_ptr) != 0) {
+        stream->state = JSON_STATE_FAILED;
+        return -1;
+    }
+
+    if (stream->depth == 0)
+        stream->state = JSON_STATE_DONE;
+    else
+        stream->state = JSON_STATE_AFTER_VALUE;
+
+    return 0;
+}
+
+static int json_stream_close(json_stream * stream, bool is_object)
+{
+    if (stream->depth == 0
+        || stream->frames[stream->depth - 1].is_object != is_object) {
+        stream->state = JSON_STATE_FAILED;
+        return -1;
+    }
+
+    stream->depth--;
+
+    return json_stream_emit(stream, is_object ? JSON_STREAM_OBJECT_END
+                            : JSON_STREAM_ARRAY_END, NULL, 0);
+}
+
+static int json_stream_string_end(json_stream * stream)
+{
+    struct json_stream_frame *frame;
+    size_t          len;
+
+    // a high surrogate without its low half
+    if (stream->high_surrogate != 0) {
+        stream->high_surrogate = 0;
+        json_stream_append(stream, "\xEF\xBF\xBD", 3);
+    }
+    // allocates the token for empty strings
+    json_stream_append(stream, "", 0);
+
+    stream->token[stream->token_len] = '\0';
+
+    if (!stream->token_is_key)
+        return json_stream_emit(stream, JSON_STREAM_STRING, stream->token,
+                                stream->token_len);
+
+    frame = &(stream->frames[stream->depth - 1]);
+    len = stream->token_len;
+    if (len > JSON_STREAM_MAX_KEY)
+        len = JSON_STREAM_MAX_KEY;
+    memcpy(frame->key, stream->token, len);
+    frame->key[len] = '\0';
+    stream->state = JSON_STATE_COLON;
+
+    return 0;
+}
+
+/*
+ * the token always keeps one byte for the terminating zero
+ */
+static void json_stream_append(json_stream * stream, const char *data,
+                               size_t len)
+{
+    if (stream->high_surrogate != 0) {
+        stream->high_surrogate = 0;
+        json_stream_append(stream, "\xEF\xBF\xBD", 3);
+    }
+
+    if (stream->token_len + len + 1 > stream->token_size) {
+        if (stream->token_size == 0)
+            stream->token_size = 256;
+        while (stream->token_len + len + 1 > stream->token_size)
+            stream->token_size *= 2;
+        stream->token = (char *)realloc(stream->token, stream->token_size);
+    }
+
+    memcpy(stream->token + stream->token_len, data, len);
+    stream->token_len += len;
+}
+
+static void json_stream_append_utf8(json_stream * stream, uint32_t cp)
+{
+    char            buf[4];
+
+    if (cp >= 0xD800 && cp < 0xDC00) {
+        if (stream->high_surrogate != 0) {
+            stream->high_surrogate = 0;
+            json_stream_append(stream, "\xEF\xBF\xBD", 3);
+        }
+        stream->high_surrogate = cp;
+        return;
+    }
+
+    if (cp >= 0xDC00 && cp < 0xE000) {
+        if (stream->high_surrogate == 0) {
+            cp = 0xFFFD;
+        } else {
+            cp = 0x10000 + ((stream->high_surrogate - 0xD800) << 10)
+                + (cp - 0xDC00);
+            stream->high_surrogate = 0;
+        }
+    }
+
+    if (cp < 0x80) {
+        buf[0] = cp;
+        json_stream_append(stream, buf, 1);
+    } else if (cp < 0x800) {
+        buf[0] = 0xC0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3F);
+        json_stream_append(stream, buf, 2);
+    } else if (cp < 0x10000) {
+        buf[0] = 0xE0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[2] = 0x80 | (cp & 0x3F);
+        json_stream_append(stream, buf, 3);
+    } else {
+        buf[0] = 0xF0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3F);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[3] = 0x80 | (cp & 0x3F);
+        json_stream_append(stream, buf, 4);
+    }
+}
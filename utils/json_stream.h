@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2014 Johannes Schauer <j.schauer@email.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _JSON_STREAM_H_
+#define _JSON_STREAM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * an incremental json parser
+ *
+ * the document is fed in pieces of any size as it arrives and every value is
+ * reported to a callback as soon as it is complete, so no tree of the whole
+ * document is ever built.
+ *
+ * the depth of a value is the number of arrays and objects that enclose it.
+ * While a value is reported, json_stream_key() returns the names of the
+ * members that lead to it.
+ */
+
+// nesting deeper than this is rejected
+#define JSON_STREAM_MAX_DEPTH 32
+// longer member names are cut off
+#define JSON_STREAM_MAX_KEY 63
+
+typedef struct json_stream json_stream;
+
+enum json_stream_event {
+    JSON_STREAM_OBJECT_BEGIN,
+    JSON_STREAM_OBJECT_END,
+    JSON_STREAM_ARRAY_BEGIN,
+    JSON_STREAM_ARRAY_END,
+    JSON_STREAM_STRING,
+    JSON_STREAM_NUMBER,
+    JSON_STREAM_TRUE,
+    JSON_STREAM_FALSE,
+    JSON_STREAM_NULL
+};
+
+/*
+ * value is the zero terminated text of strings (unescaped) and numbers and
+ * NULL for all other events
+ *
+ * returning non-zero stops the parser
+ */
+typedef int     (*json_stream_cb) (json_stream * stream,
+                                   enum json_stream_event event,
+                                   const char *value, size_t len,
+                                   void *user_ptr);
+
+json_stream    *json_stream_create(json_stream_cb cb, void *user_ptr);
+
+void            json_stream_destroy(json_stream * stream);
+
+void            json_stream_reset(json_stream * stream);
+
+int             json_stream_feed(json_stream * stream, const char *data,
+                                 size_t len);
+
+int             json_stream_finish(json_stream * stream);
+
+int             json_stream_depth(json_stream * stream);
+
+const char     *json_stream_key(json_stream * stream, int level);
+
+bool            json_stream_key_is(json_stream * stream, int level,
+                                   const char *key);
+
+#endif
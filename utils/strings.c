@@ -28,6 +28,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "strings.h"
 #include "stringv.h"
@@ -60,6 +62,91 @@ char           *strdup_printf(char *fmt, ...)
     return ret_str;
 }
 
+/*
+ * remembers the result of mktime() for the beginning of recently seen hours,
+ * keyed by year, month, day and hour
+ */
+#define STRING_TIME_CACHE_SIZE 64
+
+struct string_time_hour {
+    long            key;
+    time_t          time;
+};
+
+static struct string_time_hour string_time_cache[STRING_TIME_CACHE_SIZE];
+static pthread_mutex_t string_time_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int string_digits(const char *str, int num)
+{
+    int             value;
+    int             i;
+
+    value = 0;
+    for (i = 0; i < num; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return -1;
+        value = value * 10 + (str[i] - '0');
+    }
+
+    return value;
+}
+
+/*
+ * converts a local time of the form "YYYY-MM-DD HH:MM:SS" like strptime()
+ * with "%F %T" followed by mktime() would
+ *
+ * timestamps come in masses with folder listings and mktime() is slow, so it
+ * only runs once per hour that is seen. Minutes and seconds are added to its
+ * result.
+ *
+ * returns -1 if str does not have this form
+ */
+int string_to_time(const char *str, time_t * result)
+{
+    struct string_time_hour *entry;
+    struct tm       tm;
+    int             year,
+                    month,
+                    day,
+                    hour,
+                    minute,
+                    second;
+    long            key;
+
+    if (strlen(str) != 19 || str[4] != '-' || str[7] != '-' || str[10] != ' '
+        || str[13] != ':' || str[16] != ':')
+        return -1;
+
+    year = string_digits(str, 4);
+    month = string_digits(str + 5, 2);
+    day = string_digits(str + 8, 2);
+    hour = string_digits(str + 11, 2);
+    minute = string_digits(str + 14, 2);
+    second = string_digits(str + 17, 2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31
+        || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0
+        || second > 60)
+        return -1;
+
+    key = ((year * 100L + month) * 100 + day) * 100 + hour;
+    entry = &(string_time_cache[key % STRING_TIME_CACHE_SIZE]);
+
+    pthread_mutex_lock(&string_time_mutex);
+    if (entry->key != key) {
+        memset(&tm, 0, sizeof(struct tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        entry->key = key;
+        entry->time = mktime(&tm);
+    }
+    *result = entry->time + minute * 60 + second;
+    pthread_mutex_unlock(&string_time_mutex);
+
+    return 0;
+}
+
 char           *string_line_from_stdin(bool hide)
 {
     char           *line = NULL;
@@ -21,9 +21,14 @@
 #define _STR_TOOLS_H_
 
 #include <stdbool.h>
+#include <time.h>
 
-char           *strdup_printf(char *fmt, ...);
+// the format is checked like the one of printf
+char           *strdup_printf(char *fmt, ...)
+    __attribute__ ((format(printf, 1, 2)));
 
 char           *string_line_from_stdin(bool hide);
 
+int             string_to_time(const char *str, time_t * result);
+
 #endif
@@ -18,16 +18,78 @@
 #define _POSIX_SOURCE
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <openssl/sha.h>
 #undef _POSIX_SOURCE
+// the huffman coders are vendored, lzma needs liblzma (HAVE_LZMA_H)
+#define SECONDARY_DJW 1
+#define SECONDARY_FGK 1
+// the huffman coders do not build cleanly with -Wextra
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
 #include "../3rdparty/xdelta3-3.0.8/xdelta3.h"
 #include "../3rdparty/xdelta3-3.0.8/xdelta3.c"
 #include "../3rdparty/xdelta3-3.0.8/xdelta3-decode.h"
+#pragma GCC diagnostic pop
+
+#include "xdelta3.h"
+
+static int      xdelta3_secondary_flags = 0;
+
+/*
+ * the smallest power of two that holds size bytes, within min and max
+ */
+static usize_t xdelta3_scale(uint64_t size, usize_t min, usize_t max)
+{
+    usize_t         scaled;
+
+    for (scaled = min; scaled < max && scaled < size; scaled <<= 1) ;
+
+    return scaled;
+}
+
+/*
+ * selects the secondary compression of the patches that xdelta3_diff
+ * creates. Patches always tell how to decode them.
+ *
+ * returns -1 if the compressor was not built in
+ */
+int xdelta3_set_secondary(enum xdelta3_secondary secondary)
+{
+    switch (secondary) {
+        case XDELTA3_SECONDARY_NONE:
+            xdelta3_secondary_flags = 0;
+            return 0;
+        case XDELTA3_SECONDARY_DJW:
+            xdelta3_secondary_flags = XD3_SEC_DJW;
+            return 0;
+        case XDELTA3_SECONDARY_FGK:
+            xdelta3_secondary_flags = XD3_SEC_FGK;
+            return 0;
+        case XDELTA3_SECONDARY_LZMA:
+#if SECONDARY_LZMA
+            xdelta3_secondary_flags = XD3_SEC_LZMA;
+            return 0;
+#else
+            fprintf(stderr, "xdelta3 was built without lzma\n");
+            return -1;
+#endif
+    }
+    return -1;
+}
 
 //---------------------------------------------------------------------------
+// InHash and OutHash may be NULL, otherwise they receive the sha256 of
+// everything that was read from InFile and written to OutFile
+//
+// the encoder window grows with the size of InFile. SrcFile is mapped into
+// memory, so that source blocks are handed to xdelta3 without copying them
+// and the source size is known up front.
 static int code(int encode, FILE * InFile, FILE * SrcFile, FILE * OutFile,
-                unsigned int BufSize)
+                unsigned char *InHash, unsigned char *OutHash)
 {
     int             r,
                     ret;
@@ -38,34 +100,68 @@ static int code(int encode, FILE * InFile, FILE * SrcFile, FILE * OutFile,
     xd3_source      source;
     void           *Input_Buf;
     unsigned int    Input_Buf_Read;
+    unsigned int    BufSize;
+    uint8_t        *SrcMap;
+    uint64_t        SrcSize;
+    xoff_t          SrcOffset;
+    SHA256_CTX      InHashCtx;
+    SHA256_CTX      OutHashCtx;
+
+    r = fstat(fileno(InFile), &statbuf);
+    if (r)
+        return r;
+    BufSize = xdelta3_scale(statbuf.st_size, XD3_ALLOCSIZE,
+                            XD3_DEFAULT_WINSIZE);
+
+    r = fstat(fileno(SrcFile), &statbuf);
+    if (r)
+        return r;
+    SrcSize = statbuf.st_size;
+    SrcMap = NULL;
+    if (SrcSize > 0) {
+        SrcMap = mmap(NULL, SrcSize, PROT_READ, MAP_PRIVATE,
+                      fileno(SrcFile), 0);
+        if (SrcMap == MAP_FAILED) {
+            fprintf(stderr, "cannot map the source\n");
+            return -1;
+        }
+    }
 
-    if (BufSize < XD3_ALLOCSIZE)
-        BufSize = XD3_ALLOCSIZE;
     memset(&stream, 0, sizeof(stream));
     memset(&source, 0, sizeof(source));
     xd3_init_config(&config, XD3_ADLER32);
     config.winsize = BufSize;
-    xd3_config_stream(&stream, &config);
-    r = fstat(fileno(SrcFile), &statbuf);
-    if (r)
+    if (encode)
+        config.flags |= xdelta3_secondary_flags;
+    r = xd3_config_stream(&stream, &config);
+    if (r) {
+        fprintf(stderr, "!!! INVALID %s %d !!!\n", stream.msg, r);
+        if (SrcMap != NULL)
+            munmap(SrcMap, SrcSize);
         return r;
-    source.blksize = BufSize;
-    source.curblk = malloc(source.blksize);
+    }
 
-    /* Load 1st block of stream. */
-    r = fseek(SrcFile, 0, SEEK_SET);
-    if (r)
-        return r;
-    source.onblk = fread((void *)source.curblk, 1, source.blksize, SrcFile);
+    // blocks are only pointers into the mapping, so they can be as large as
+    // the source window
+    source.blksize = xdelta3_scale(SrcSize, XD3_ALLOCSIZE,
+                                   XD3_DEFAULT_SRCWINSZ);
+    source.max_winsize = source.blksize;
+    source.curblk = SrcMap;
+    source.onblk = SrcSize < source.blksize ? SrcSize : source.blksize;
     source.curblkno = 0;
 
     /* Set the stream. */
-    xd3_set_source(&stream, &source);
+    xd3_set_source_and_size(&stream, &source, SrcSize);
     Input_Buf = malloc(BufSize);
     fseek(InFile, 0, SEEK_SET);
+    SHA256_Init(&InHashCtx);
+    SHA256_Init(&OutHashCtx);
 
+    ret = 0;
     do {
         Input_Buf_Read = fread(Input_Buf, 1, BufSize, InFile);
+        if (InHash != NULL)
+            SHA256_Update(&InHashCtx, Input_Buf, Input_Buf_Read);
         if (Input_Buf_Read < BufSize) {
             xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
         }
@@ -76,40 +172,65 @@ static int code(int encode, FILE * InFile, FILE * SrcFile, FILE * OutFile,
             else
                 ret = xd3_decode_input(&stream);
             if (ret == XD3_INPUT) {
+                ret = 0;
                 break;
             } else if (ret == XD3_OUTPUT) {
                 r = fwrite(stream.next_out, 1, stream.avail_out, OutFile);
-                if (r != (int)stream.avail_out)
-                    return r;
+                if (r != (int)stream.avail_out) {
+                    ret = -1;
+                    break;
+                }
+                if (OutHash != NULL)
+                    SHA256_Update(&OutHashCtx, stream.next_out,
+                                  stream.avail_out);
                 xd3_consume_output(&stream);
             } else if (ret == XD3_GETSRCBLK) {
-                r = fseek(SrcFile, source.blksize * source.getblkno, SEEK_SET);
-                if (r)
-                    return r;
-                source.onblk =
-                    fread((void *)source.curblk, 1, source.blksize, SrcFile);
+                SrcOffset = (xoff_t) source.blksize * source.getblkno;
+                if (SrcOffset < SrcSize) {
+                    source.curblk = SrcMap + SrcOffset;
+                    source.onblk = SrcSize - SrcOffset < source.blksize
+                        ? SrcSize - SrcOffset : source.blksize;
+                } else {
+                    source.onblk = 0;
+                }
                 source.curblkno = source.getblkno;
             } else if (ret == XD3_GOTHEADER || ret == XD3_WINSTART
                        || ret == XD3_WINFINISH) {
             } else {
                 fprintf(stderr, "!!! INVALID %s %d !!!\n", stream.msg, ret);
-                return ret;
+                break;
             }
         }
-    } while (Input_Buf_Read == BufSize);
+    } while (ret == 0 && Input_Buf_Read == BufSize);
+    if (InHash != NULL)
+        SHA256_Final(InHash, &InHashCtx);
+    if (OutHash != NULL)
+        SHA256_Final(OutHash, &OutHashCtx);
     free(Input_Buf);
-    free((void *)source.curblk);
+    if (SrcMap != NULL)
+        munmap(SrcMap, SrcSize);
     xd3_close_stream(&stream);
     xd3_free_stream(&stream);
-    return 0;
+    return ret;
 }
 
 int xdelta3_diff(FILE * old, FILE * new, FILE * diff)
 {
-    return code(1, new, old, diff, 0x1000);
+    return code(1, new, old, diff, NULL, NULL);
 }
 
 int xdelta3_patch(FILE * old, FILE * diff, FILE * new)
 {
-    return code(0, diff, old, new, 0x1000);
+    return code(0, diff, old, new, NULL, NULL);
+}
+
+/*
+ * like xdelta3_patch but also computes the sha256 of the patch and of the
+ * patched file while they pass through, so that they don't have to be read
+ * again to be verified
+ */
+int xdelta3_patch_hash(FILE * old, FILE * diff, FILE * new,
+                       unsigned char *diff_hash, unsigned char *new_hash)
+{
+    return code(0, diff, old, new, diff_hash, new_hash);
 }
@@ -21,7 +21,19 @@
 
 #include <stdio.h>
 
+enum xdelta3_secondary {
+    XDELTA3_SECONDARY_NONE,
+    XDELTA3_SECONDARY_DJW,
+    XDELTA3_SECONDARY_FGK,
+    XDELTA3_SECONDARY_LZMA
+};
+
+int             xdelta3_set_secondary(enum xdelta3_secondary secondary);
+
 int             xdelta3_diff(FILE * old, FILE * new, FILE * diff);
 int             xdelta3_patch(FILE * old, FILE * diff, FILE * new);
+int             xdelta3_patch_hash(FILE * old, FILE * diff, FILE * new,
+                                   unsigned char *diff_hash,
+                                   unsigned char *new_hash);
 
 #endif